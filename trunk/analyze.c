@@ -38,6 +38,8 @@
 #include "analyze.h"
 #include "global.h"
 #include "xfuncs.h"
+#include "latency.h"
+#include "hash.h"
 
 extern struct net_stat net_stat;
 extern struct conf_map_t memadvice_map[];
@@ -84,6 +86,28 @@ struct statistic_map_t
 	{ "voluntary cs:", "Voluntary context switches:    " },
 #define	STAT_NICECS 14
 	{ "nice cs:     ", "Nice context switches:         " },
+#define	STAT_RTT 15
+	{ "rtt:         ", "Round trip time (application): " },
+#define	STAT_RTT_KERNEL 16
+	{ "rtt-kernel:  ", "Round trip time (kernel):      " },
+#define	STAT_BDP 17
+	{ "bdp:         ", "Bandwidth delay product:       " },
+#define	STAT_CAPACITY 18
+	{ "capacity:    ", "Bottleneck capacity:           " },
+#define	STAT_PERF 19
+	{ "perf:        ", "Performance counters:          " },
+#define	STAT_SOFTIRQ 20
+	{ "softirq:     ", "Softirq time (all cpus):       " },
+#define	STAT_NET_CPUS 21
+	{ "net-cpus:    ", "CPUs with network work:        " },
+#define	STAT_PEER 22
+	{ "peer:        ", "Peer counters:                 " },
+#define	STAT_GOODPUT 23
+	{ "goodput:     ", "End to end goodput:            " },
+#define	STAT_CPU_BYTE 24
+	{ "cpu/byte:    ", "CPU time per byte (both ends): " },
+#define	STAT_PHASES 25
+	{ "phases:      ", "Setup and transfer phases:     " },
 };
 
 
@@ -182,6 +206,213 @@ tsc_diff(unsigned long long end, unsigned long long start)
 #endif
 
 
+static double
+tv_diff_sec(struct timeval *end, struct timeval *start)
+{
+	struct timeval tv_tmp;
+
+	subtime(end, start, &tv_tmp);
+	return tv_tmp.tv_sec + ((double) tv_tmp.tv_usec) / 1000000;
+}
+
+
+/* From the setup code, every phase is taken once: the first
+** call counts. Not in the io loops but for the first byte. */
+void
+phase_mark(enum phase phase)
+{
+	struct timespec ts;
+
+	if (net_stat.phase_ns[phase])
+		return;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return;
+	net_stat.phase_ns[phase] = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* milliseconds of a phase after the start, < 0 if not reached */
+static double
+phase_ms(enum phase phase)
+{
+	if (!net_stat.phase_ns[PHASE_START] || !net_stat.phase_ns[phase])
+		return -1;
+	return (net_stat.phase_ns[phase] - net_stat.phase_ns[PHASE_START]) / 1E6;
+}
+
+
+/* phases:      dns 0.412 ms, connect 0.093 ms, headers 0.210 ms, first-byte
+**              0.017 ms, transfer 12.304 ms (first byte 0.732 ms, total 13.036 ms)
+** Every phase counts from the one reached before it, the
+** receiver waits in accept for its peer. */
+static int
+phases_human(char *buf, unsigned int max_buf_len)
+{
+	static const char *names[PHASE_MAX][2] = {
+		[PHASE_RESOLVED] = { "dns", "listen" },
+		[PHASE_CONNECTED] = { "connect", "accept" },
+		[PHASE_HEADERS] = { "headers", "headers" },
+		[PHASE_PROBED] = { "probes", "probes" },
+		[PHASE_FIRST_BYTE] = { "first-byte", "first-byte" },
+		[PHASE_LAST_BYTE] = { "transfer", "transfer" },
+	};
+	int len, phase, rx = opts.workmode == MODE_TRANSMIT ? 0 : 1;
+	const char *sep = " ";
+	double prev = 0, at;
+
+	if (phase_ms(PHASE_LAST_BYTE) < 0)
+		return 0;
+
+	len = xsnprintf(buf, max_buf_len, "%s", T2S(STAT_PHASES));
+	for (phase = PHASE_START + 1; phase < PHASE_MAX; phase++) {
+		if ((at = phase_ms(phase)) < 0)
+			continue;
+		len += xsnprintf(buf + len, max_buf_len - len, "%s%s %.3f ms",
+				sep, names[phase][rx], at - prev);
+		sep = ", ";
+		prev = at;
+	}
+	if (phase_ms(PHASE_FIRST_BYTE) >= 0)
+		len += xsnprintf(buf + len, max_buf_len - len, " (first byte %.3f ms,",
+				phase_ms(PHASE_FIRST_BYTE));
+	else
+		len += xsnprintf(buf + len, max_buf_len - len, "%s", " (");
+	len += xsnprintf(buf + len, max_buf_len - len, " total %.3f ms)\n", prev);
+
+	return len;
+}
+
+
+/* The io call that moved the data, the counters per byte are
+** what sets the engines apart */
+const char *
+engine_str(void)
+{
+	return opts.workmode == MODE_TRANSMIT ? io_call_to_str(opts.io_call) : "read";
+}
+
+
+static unsigned long long
+engine_bytes(void)
+{
+	return opts.workmode == MODE_TRANSMIT ?
+		net_stat.total_tx_bytes : net_stat.total_rx_bytes;
+}
+
+
+/* perf:         cycles 1234 (user 100, kernel 1134) 0.024/byte (sendfile)
+** A "-" marks the mode the counter could not count. */
+static int
+perf_human(char *buf, unsigned int max_buf_len)
+{
+	const struct perf_stat *ps = &net_stat.perf;
+	unsigned long long bytes = engine_bytes();
+	char user[32], kernel[32];
+	unsigned int i, bit;
+	int len = 0;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		bit = 1 << i;
+		if (!((ps->user_valid | ps->kernel_valid) & bit))
+			continue;
+
+		if (ps->user_valid & bit)
+			xsnprintf(user, sizeof(user), "%llu", ps->user[i]);
+		else
+			strcpy(user, "-");
+		if (ps->kernel_valid & bit)
+			xsnprintf(kernel, sizeof(kernel), "%llu", ps->kernel[i]);
+		else
+			strcpy(kernel, "-");
+
+		len += xsnprintf(buf + len, max_buf_len - len, "%s %s %llu (user %s, kernel %s)",
+				T2S(STAT_PERF), perf_counter_name(i), ps->user[i] + ps->kernel[i],
+				user, kernel);
+		if ((i == PERF_CYCLES || i == PERF_INSTRUCTIONS) && bytes)
+			len += xsnprintf(buf + len, max_buf_len - len, " %.4f/byte (%s)",
+					(double) (ps->user[i] + ps->kernel[i]) / bytes, engine_str());
+		len += xsnprintf(buf + len, max_buf_len - len, "%s", "\n");
+	}
+
+	return len;
+}
+
+
+/* both ends after the statistics exchange: the bytes the
+** receiver got over the longer of both real times - the two
+** clocks are not comparable, the durations are - and the cpu
+** time (user + system) each side spent per byte */
+struct end_to_end {
+	const struct peer_stat *peer;
+	unsigned long long bytes;
+	double goodput; /* bytes/s */
+	double tx_cpu_ns, rx_cpu_ns; /* per byte */
+};
+
+static bool
+end_to_end(struct end_to_end *e2e)
+{
+	const struct peer_stat *ps = &net_stat.peer;
+	struct use_stat *start = &net_stat.use_stat_start, *end = &net_stat.use_stat_end;
+	double real, cpu, tx_cpu, rx_cpu;
+
+	if (!ps->valid)
+		return false;
+
+	real = max(tv_diff_sec(&end->time, &start->time), ps->real_sec);
+	cpu = tv_diff_sec(&end->ru.ru_utime, &start->ru.ru_utime) +
+		tv_diff_sec(&end->ru.ru_stime, &start->ru.ru_stime);
+
+	e2e->peer = ps;
+	if (opts.workmode == MODE_TRANSMIT) {
+		e2e->bytes = ps->bytes;
+		tx_cpu = cpu;
+		rx_cpu = ps->utime_sec + ps->stime_sec;
+	} else {
+		e2e->bytes = net_stat.total_rx_bytes;
+		tx_cpu = ps->utime_sec + ps->stime_sec;
+		rx_cpu = cpu;
+	}
+
+	e2e->goodput = real > 0 ? e2e->bytes / real : 0;
+	e2e->tx_cpu_ns = e2e->bytes ? tx_cpu * 1E9 / e2e->bytes : 0;
+	e2e->rx_cpu_ns = e2e->bytes ? rx_cpu * 1E9 / e2e->bytes : 0;
+
+	return true;
+}
+
+
+/* peer:        rx 5242928 bytes, 161 calls (read), real 0.0123 sec, ...
+** goodput:     415.12345 MiB/sec (5242928 bytes end to end)
+** cpu/byte:    tx 0.812 ns, rx 1.936 ns */
+static int
+end_to_end_human(char *buf, unsigned int max_buf_len)
+{
+	struct end_to_end e2e;
+	const struct peer_stat *ps;
+	int len;
+
+	if (!end_to_end(&e2e))
+		return 0;
+	ps = e2e.peer;
+
+	len = xsnprintf(buf, max_buf_len, "%s %s %llu bytes, %u calls (%s), real %.4f sec, "
+			"utime %.4f sec, stime %.4f sec", T2S(STAT_PEER), ps->transmit ? "tx" : "rx",
+			ps->bytes, ps->calls, ps->transmit ? io_call_to_str(ps->io_call) : "read",
+			ps->real_sec, ps->utime_sec, ps->stime_sec);
+	if (ps->rtt_us > 0)
+		len += xsnprintf(buf + len, max_buf_len - len, ", rtt %.3f us", ps->rtt_us);
+	len += xsnprintf(buf + len, max_buf_len - len, "%s", "\n");
+
+	len += xsnprintf(buf + len, max_buf_len - len, "%s %.5f %s/sec (%llu bytes end to end)\n",
+			T2S(STAT_GOODPUT), e2e.goodput / UNIT_N2F(M_UNIT), UNIT_N2S(M_UNIT), e2e.bytes);
+	len += xsnprintf(buf + len, max_buf_len - len, "%s tx %.3f ns, rx %.3f ns\n",
+			T2S(STAT_CPU_BYTE), e2e.tx_cpu_ns, e2e.rx_cpu_ns);
+
+	return len;
+}
+
+
 void
 gen_human_analyse(char *buf, unsigned int max_buf_len)
 {
@@ -321,6 +552,66 @@ gen_human_analyse(char *buf, unsigned int max_buf_len)
 
 	}
 
+	/* rtt probes (-r), the kernel timestamps exclude our syscalls */
+	if (net_stat.rtt_probe.app_avg_us > 0) {
+		const struct rtt_probe *rp = &net_stat.rtt_probe;
+
+		len += xsnprintf(buf + len, max_buf_len - len,
+				"%s %.3f us (min %.3f, p50 %.3f, p99 %.3f, max %.3f us, %u of %u lost)\n",
+				T2S(STAT_RTT), rp->app_avg_us, rp->app_min_us, rp->app_p50_us,
+				rp->app_p99_us, rp->app_max_us, rp->lost, rp->sent);
+		if (rp->kernel_avg_us > 0)
+			len += xsnprintf(buf + len, max_buf_len - len,
+					"%s %.3f us (min %.3f, p50 %.3f, p99 %.3f, max %.3f us)\n",
+					T2S(STAT_RTT_KERNEL), rp->kernel_avg_us, rp->kernel_min_us,
+					rp->kernel_p50_us, rp->kernel_p99_us, rp->kernel_max_us);
+	}
+
+	/* buffer sizing (-B) */
+	if (net_stat.bdp.rate > 0)
+		len += xsnprintf(buf + len, max_buf_len - len,
+				"%s %llu bytes (%.0f bytes/s, sndbuf %d, peer rcvbuf %d, clamp %d bytes)\n",
+				T2S(STAT_BDP), net_stat.bdp.bdp, net_stat.bdp.rate, net_stat.bdp.sndbuf,
+				net_stat.bdp.rcvbuf, net_stat.bdp.clamp);
+
+	/* packet pairs and trains (-c) */
+	if (net_stat.pprobe.pairs + net_stat.pprobe.trains > 0)
+		len += xsnprintf(buf + len, max_buf_len - len,
+				"%s %.0f bit/s (%u pairs, dispersion rate %.0f bit/s of %u trains)\n",
+				T2S(STAT_CAPACITY), net_stat.pprobe.capacity, net_stat.pprobe.pairs,
+				net_stat.pprobe.adr, net_stat.pprobe.trains);
+
+	/* per call latency and size (-L) */
+	if (opts.latency_hist)
+		len += lat_report(buf + len, max_buf_len - len);
+
+	/* hardware and software counters (-E) */
+	if (net_stat.perf.user_valid | net_stat.perf.kernel_valid)
+		len += perf_human(buf + len, max_buf_len - len);
+
+	/* the network work of all cpus (-K), our cpu time misses it */
+	if (net_stat.cpu_stat.ok) {
+		const struct cpu_delta *cd = &net_stat.cpu_stat;
+		unsigned int i;
+
+		len += xsnprintf(buf + len, max_buf_len - len,
+				"%s %.4f sec (irq %.4f sec, NET_RX %llu, NET_TX %llu, cpu+softirq %.4f sec)\n",
+				T2S(STAT_SOFTIRQ), cd->softirq_sec, cd->irq_sec, cd->net_rx, cd->net_tx,
+				total_cpu + cd->softirq_sec);
+		if (cd->cpus_no) {
+			len += xsnprintf(buf + len, max_buf_len - len, "%s", T2S(STAT_NET_CPUS));
+			for (i = 0; i < min(cd->cpus_no, (unsigned int) CPU_NET_MAX); i++)
+				len += xsnprintf(buf + len, max_buf_len - len,
+						"%s cpu%d %.3f sec (NET_RX %llu, NET_TX %llu)", i ? "," : "",
+						cd->cpus[i].cpu, cd->cpus[i].softirq_sec, cd->cpus[i].net_rx,
+						cd->cpus[i].net_tx);
+			if (cd->cpus_no > CPU_NET_MAX)
+				len += xsnprintf(buf + len, max_buf_len - len, " and %u more",
+						cd->cpus_no - CPU_NET_MAX);
+			len += xsnprintf(buf + len, max_buf_len - len, "%s", "\n");
+		}
+	}
+
 	/* throughput (bytes/s)*/
 	throughput = opts.workmode == MODE_TRANSMIT ?
 		((double)net_stat.total_tx_bytes) / total_real :
@@ -341,6 +632,12 @@ gen_human_analyse(char *buf, unsigned int max_buf_len)
 		len += xsnprintf(buf + len, max_buf_len - len, "%s", ")"); /* newline */
 	}
 	len += xsnprintf(buf + len, max_buf_len - len, "%s", "\n");
+
+	/* the other side, exchanged after the data (tcp) */
+	len += end_to_end_human(buf + len, max_buf_len - len);
+
+	/* where the time before the data went */
+	len += phases_human(buf + len, max_buf_len - len);
 }
 
 #undef T2S
@@ -451,6 +748,310 @@ gen_machine_analyse(char *buf, unsigned int max_buf_len)
 }
 
 
+/* JSON report (-T json) - unlike the machine line fields may be
+** added at any place, a consumer looks them up by name. Bump
+** JSON_SCHEMA_VERSION only if a field changes its meaning or
+** goes away.
+*/
+#define	JSON_SCHEMA_VERSION 1
+
+static void
+json_str(FILE *out, const char *str)
+{
+	const unsigned char *p = (const unsigned char *) str;
+
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+
+	fputc('"', out);
+	for (; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf(out, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(out, "\\u%04x", *p);
+		else
+			fputc(*p, out);
+	}
+	fputc('"', out);
+}
+
+
+/* a counter the mode could not count is null */
+static void
+json_perf(FILE *out)
+{
+	const struct perf_stat *ps = &net_stat.perf;
+	unsigned long long bytes = engine_bytes();
+	unsigned int i, bit;
+
+	if (!(ps->user_valid | ps->kernel_valid)) {
+		fputs("null", out);
+		return;
+	}
+
+	fprintf(out, "{\"engine\": \"%s\", \"bytes\": %llu", engine_str(), bytes);
+	for (i = 0; i < PERF_MAX; i++) {
+		bit = 1 << i;
+		fprintf(out, ", \"%s\": {\"user\": ", perf_counter_name(i));
+		if (ps->user_valid & bit)
+			fprintf(out, "%llu", ps->user[i]);
+		else
+			fputs("null", out);
+		fputs(", \"kernel\": ", out);
+		if (ps->kernel_valid & bit)
+			fprintf(out, "%llu", ps->kernel[i]);
+		else
+			fputs("null", out);
+		fputc('}', out);
+	}
+	fputs(", \"cycles_per_byte\": ", out);
+	if ((ps->user_valid | ps->kernel_valid) & (1 << PERF_CYCLES) && bytes)
+		fprintf(out, "%.6f", (double) (ps->user[PERF_CYCLES] + ps->kernel[PERF_CYCLES]) / bytes);
+	else
+		fputs("null", out);
+	fputs(", \"instructions_per_byte\": ", out);
+	if ((ps->user_valid | ps->kernel_valid) & (1 << PERF_INSTRUCTIONS) && bytes)
+		fprintf(out, "%.6f", (double) (ps->user[PERF_INSTRUCTIONS] +
+					ps->kernel[PERF_INSTRUCTIONS]) / bytes);
+	else
+		fputs("null", out);
+	fputc('}', out);
+}
+
+
+static void
+json_cpu_delta(FILE *out, const struct cpu_delta *cd)
+{
+	unsigned int i;
+
+	if (!cd->ok) {
+		fputs("null", out);
+		return;
+	}
+
+	fprintf(out, "{\"softirq_sec\": %.3f, \"irq_sec\": %.3f, \"system_sec\": %.3f, "
+			"\"net_rx\": %llu, \"net_tx\": %llu, \"net_cpus_no\": %u, \"net_cpus\": [",
+			cd->softirq_sec, cd->irq_sec, cd->system_sec, cd->net_rx, cd->net_tx, cd->cpus_no);
+	for (i = 0; i < min(cd->cpus_no, (unsigned int) CPU_NET_MAX); i++)
+		fprintf(out, "%s{\"cpu\": %d, \"softirq_sec\": %.3f, \"system_sec\": %.3f, "
+				"\"net_rx\": %llu, \"net_tx\": %llu}", i ? ", " : "", cd->cpus[i].cpu,
+				cd->cpus[i].softirq_sec, cd->cpus[i].system_sec, cd->cpus[i].net_rx,
+				cd->cpus[i].net_tx);
+	fputs("]}", out);
+}
+
+
+static void
+json_end_to_end(FILE *out)
+{
+	struct end_to_end e2e;
+	const struct peer_stat *ps;
+
+	if (!end_to_end(&e2e)) {
+		fputs("null", out);
+		return;
+	}
+	ps = e2e.peer;
+
+	fprintf(out, "{\"peer\": {\"mode\": \"%s\", \"io_call\": \"%s\", \"bytes\": %llu, "
+			"\"calls\": %u, \"real_sec\": %.6f, \"utime_sec\": %.6f, \"stime_sec\": %.6f, "
+			"\"rtt_us\": %.3f},\n    \"bytes\": %llu, \"goodput\": %.0f, "
+			"\"tx_cpu_ns_per_byte\": %.3f, \"rx_cpu_ns_per_byte\": %.3f}",
+			ps->transmit ? "tx" : "rx", ps->transmit ? io_call_to_str(ps->io_call) : "read",
+			ps->bytes, ps->calls, ps->real_sec, ps->utime_sec, ps->stime_sec, ps->rtt_us,
+			e2e.bytes, e2e.goodput, e2e.tx_cpu_ns, e2e.rx_cpu_ns);
+}
+
+
+/* milliseconds since the start, null if not reached */
+static void
+json_phases(FILE *out)
+{
+	static const char *keys[PHASE_MAX] = {
+		[PHASE_START] = "start", [PHASE_RESOLVED] = "resolved",
+		[PHASE_CONNECTED] = "connected", [PHASE_HEADERS] = "headers",
+		[PHASE_PROBED] = "probed", [PHASE_FIRST_BYTE] = "first_byte",
+		[PHASE_LAST_BYTE] = "last_byte",
+	};
+	int phase;
+
+	for (phase = PHASE_START; phase < PHASE_MAX; phase++) {
+		fprintf(out, "%s\"%s\": ", phase ? ", " : "{", keys[phase]);
+		if (phase_ms(phase) < 0)
+			fputs("null", out);
+		else
+			fprintf(out, "%.6f", phase_ms(phase));
+	}
+	fputc('}', out);
+}
+
+
+static void
+json_tcp_sample(FILE *out, const struct tcp_sample *t)
+{
+	fprintf(out, "{\"cwnd\": %u, \"ssthresh\": %u, \"srtt_us\": %u, \"rttvar_us\": %u, "
+			"\"rto_us\": %u, \"snd_mss\": %u, \"rcv_mss\": %u, \"unacked\": %u, "
+			"\"retransmits\": %u, \"total_retrans\": %u, \"delivery_rate\": %llu, "
+			"\"pacing_rate\": %llu, \"busy_us\": %llu, \"rwnd_limited_us\": %llu, "
+			"\"sndbuf_limited_us\": %llu, \"notsent_bytes\": %u}",
+			t->cwnd, t->ssthresh, t->srtt_us, t->rttvar_us, t->rto_us, t->snd_mss,
+			t->rcv_mss, t->unacked, t->retransmits, t->total_retrans,
+			t->delivery_rate, t->pacing_rate, t->busy_us, t->rwnd_limited_us,
+			t->sndbuf_limited_us, t->notsent);
+}
+
+
+void
+gen_json_analyse(FILE *out)
+{
+	static const char *proto_str[] = {
+		[NS_PROTO_UNSPEC] = "unspec", [NS_PROTO_TCP] = "tcp", [NS_PROTO_UDP] = "udp",
+		[NS_PROTO_UDPLITE] = "udplite", [NS_PROTO_DCCP] = "dccp",
+		[NS_PROTO_TIPC] = "tipc", [NS_PROTO_SCTP] = "sctp"
+	};
+	struct use_stat *start = &net_stat.use_stat_start, *end = &net_stat.use_stat_end;
+	const struct rtt_probe *rp = &net_stat.rtt_probe;
+	const struct interval_sample *is;
+	struct utsname utsname;
+	unsigned int i, is_no;
+
+	if (uname(&utsname))
+		memset(&utsname, 0, sizeof(utsname));
+
+	fprintf(out, "{\n  \"schema_version\": %d,\n  \"version\": ", JSON_SCHEMA_VERSION);
+	json_str(out, VERSIONSTRING);
+	fprintf(out, ",\n  \"mode\": \"%s\",\n",
+			opts.workmode == MODE_TRANSMIT ? "tx" : "rx");
+
+	/* host */
+	fputs("  \"host\": {\"sysname\": ", out);
+	json_str(out, utsname.sysname);
+	fputs(", \"nodename\": ", out);
+	json_str(out, utsname.nodename);
+	fputs(", \"release\": ", out);
+	json_str(out, utsname.release);
+	fputs(", \"version\": ", out);
+	json_str(out, utsname.version);
+	fputs(", \"machine\": ", out);
+	json_str(out, utsname.machine);
+	fputs("},\n", out);
+
+	/* configuration */
+	fprintf(out, "  \"options\": {\"protocol\": \"%s\", \"family\": %d, \"socktype\": %d, "
+			"\"io_call\": \"%s\", \"buffer_size\": %d, \"multiple_barrier\": %d, "
+			"\"mem_advice\": ", proto_str[opts.ns_proto], opts.family, opts.socktype,
+			engine_str(), opts.buffer_size, opts.multiple_barrier);
+	json_str(out, opts.change_mem_advise ? memadvice_map[opts.mem_advice].conf_string : NULL);
+	fputs(", \"port\": ", out);
+	json_str(out, opts.port);
+	fputs(", \"hostname\": ", out);
+	json_str(out, opts.hostname);
+	fputs(", \"infile\": ", out);
+	json_str(out, opts.infile);
+	fputs(", \"outfile\": ", out);
+	json_str(out, opts.outfile);
+	fprintf(out, ", \"ext_hdr_mask\": %ld, \"digest\": ", opts.ext_hdr_mask);
+	json_str(out, opts.ext_hdr_mask & HDR_MSK_DIGEST ? hash_type_to_str(opts.digest_type) : NULL);
+	fprintf(out, ", \"compress_mode\": %d, \"nodelay\": %d, \"nice\": %ld, "
+			"\"sched_policy\": %d, \"priority\": %d, \"interval_ms\": %d, "
+			"\"latency_hist\": %s, \"perf_counters\": %s, \"cpu_stat\": %s, "
+			"\"tcp_fastopen\": %s,\n",
+			opts.ext_hdr_mask & HDR_MSK_COMPRESS ? opts.compress_mode : -1,
+			opts.nodelay, opts.nice == INT_MAX ? 0 : opts.nice,
+			opts.sched_user ? opts.sched_policy : -1, opts.priority,
+			opts.interval_ms, opts.latency_hist ? "true" : "false",
+			opts.perf_counters ? "true" : "false", opts.cpu_stat ? "true" : "false",
+			opts.tcp_fastopen ? "true" : "false");
+	fprintf(out, "    \"rtt_probe\": {\"iterations\": %d, \"data_size\": %d, "
+			"\"deviation_filter\": %d, \"force_ms\": %d, \"inflight\": %d, "
+			"\"timeout_ms\": %d},\n",
+			opts.rtt_probe_opt.iterations, opts.rtt_probe_opt.data_size,
+			opts.rtt_probe_opt.deviation_filter, opts.rtt_probe_opt.force_ms,
+			opts.rtt_probe_opt.inflight, opts.rtt_probe_opt.timeout_ms);
+	fprintf(out, "    \"pair_probe\": {\"pairs\": %d, \"trains\": %d, \"train_len\": %d, "
+			"\"size\": %d}},\n", opts.pprobe_opt.pairs, opts.pprobe_opt.trains,
+			opts.pprobe_opt.train_len, opts.pprobe_opt.size);
+
+	/* counters */
+	fprintf(out, "  \"net_stat\": {\"rx_calls\": %u, \"rx_bytes\": %llu, \"tx_calls\": %u, "
+			"\"tx_bytes\": %llu, \"io_bytes\": %llu,\n",
+			net_stat.total_rx_calls, net_stat.total_rx_bytes, net_stat.total_tx_calls,
+			net_stat.total_tx_bytes, net_stat.io_bytes);
+	fprintf(out, "    \"real_sec\": %.6f, \"utime_sec\": %.6f, \"stime_sec\": %.6f, "
+			"\"swaps\": %ld, \"voluntary_cs\": %ld, \"involuntary_cs\": %ld, "
+			"\"maxrss_kb\": %ld, ",
+			tv_diff_sec(&end->time, &start->time),
+			tv_diff_sec(&end->ru.ru_utime, &start->ru.ru_utime),
+			tv_diff_sec(&end->ru.ru_stime, &start->ru.ru_stime),
+			sublong(end->ru.ru_nswap, start->ru.ru_nswap),
+			sublong(end->ru.ru_nvcsw, start->ru.ru_nvcsw),
+			sublong(end->ru.ru_nivcsw, start->ru.ru_nivcsw), end->ru.ru_maxrss);
+#ifdef HAVE_RDTSCLL
+	fprintf(out, "\"cpu_cycles\": %llu, ", tsc_diff(end->tsc, start->tsc));
+#endif
+	fprintf(out, "\"mss\": %u, \"keep_alive\": %d,\n",
+			net_stat.sock_stat.mss, net_stat.sock_stat.keep_alive);
+
+	fprintf(out, "    \"rtt\": {\"sent\": %u, \"lost\": %u, \"usec\": %.3f, \"variance\": %.3f, "
+			"\"app_us\": {\"avg\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p99\": %.3f, "
+			"\"max\": %.3f}, \"kernel_us\": {\"avg\": %.3f, \"min\": %.3f, \"p50\": %.3f, "
+			"\"p99\": %.3f, \"max\": %.3f}, \"hist_log2_us\": [",
+			rp->sent, rp->lost, rp->usec, rp->variance, rp->app_avg_us, rp->app_min_us,
+			rp->app_p50_us, rp->app_p99_us, rp->app_max_us, rp->kernel_avg_us,
+			rp->kernel_min_us, rp->kernel_p50_us, rp->kernel_p99_us, rp->kernel_max_us);
+	for (i = 0; i < RTT_HIST_BUCKETS; i++)
+		fprintf(out, "%s%u", i ? ", " : "", rp->hist[i]);
+	fputs("]},\n", out);
+
+	fprintf(out, "    \"capacity\": {\"capacity_bps\": %.0f, \"adr_bps\": %.0f, \"pairs\": %u, "
+			"\"trains\": %u},\n", net_stat.pprobe.capacity, net_stat.pprobe.adr,
+			net_stat.pprobe.pairs, net_stat.pprobe.trains);
+	fprintf(out, "    \"bdp\": {\"rate\": %.0f, \"bdp\": %llu, \"sndbuf\": %d, \"rcvbuf\": %d, "
+			"\"clamp\": %d}},\n", net_stat.bdp.rate, net_stat.bdp.bdp, net_stat.bdp.sndbuf,
+			net_stat.bdp.rcvbuf, net_stat.bdp.clamp);
+
+	fputs("  \"perf\": ", out);
+	json_perf(out);
+	fputs(",\n  \"softirq\": ", out);
+	json_cpu_delta(out, &net_stat.cpu_stat);
+
+	/* both sides (tcp) */
+	fputs(",\n  \"end_to_end\": ", out);
+	json_end_to_end(out);
+
+	/* setup and transfer */
+	fputs(",\n  \"phases_ms\": ", out);
+	json_phases(out);
+
+	/* the connection at the end */
+	fputs(",\n  \"tcp_info\": ", out);
+	if (net_stat.tcp_end_ok)
+		json_tcp_sample(out, &net_stat.tcp_end);
+	else
+		fputs("null", out);
+
+	/* -i */
+	fputs(",\n  \"intervals\": [", out);
+	is = interval_samples(&is_no);
+	for (i = 0; i < is_no; i++) {
+		fprintf(out, "%s\n    {\"from\": %.6f, \"to\": %.6f, \"bytes\": %llu, \"calls\": %llu, "
+				"\"utime_sec\": %.6f, \"stime_sec\": %.6f, \"tcp_info\": ",
+				i ? "," : "", is[i].from, is[i].to, is[i].bytes, is[i].calls,
+				is[i].utime, is[i].stime);
+		if (is[i].tcp_ok)
+			json_tcp_sample(out, &is[i].tcp);
+		else
+			fputs("null", out);
+		fputs(", \"softirq\": ", out);
+		json_cpu_delta(out, &is[i].cpu);
+		fputc('}', out);
+	}
+	fputs(is_no ? "\n  ]\n}\n" : "]\n}\n", out);
+}
+
+
 int
 subtime(struct timeval *op1, struct timeval *op2, struct timeval *result)
 {
@@ -24,6 +24,8 @@
 
 void gen_human_analyse(char *, unsigned int);
 void gen_machine_analyse(char *, unsigned int);
+void gen_json_analyse(FILE *);
+const char *engine_str(void);
 long sublong(long, long);
 
 #define TIME_GT(x,y) (x->tv_sec > y->tv_sec || (x->tv_sec == y->tv_sec && x->tv_usec > y->tv_usec))
@@ -0,0 +1,241 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "ns_hdr.h"
+#include "xfuncs.h"
+#include "lz.h"
+#include "compress.h"
+
+/* Compressing a block pays off if compressing it and sending
+** the remainder is faster than sending it as it is:
+**
+**   1 / comp_rate + ratio / link_rate < 1 / link_rate
+**   <=> comp_rate * (1 - ratio) > link_rate
+**
+** ratio and comp_rate are decaying averages over the compressed
+** blocks. The link rate is the wall time the engine spends per
+** sent byte (minus the compressor), averaged over windows of
+** COMPRESS_LINK_WINDOW seconds - single writes are too bursty
+** as long as the socket buffer takes whole blocks at once.
+** If compression does not pay off the engine sends raw blocks
+** and probes now and then (exponential backoff) whether the
+** data compresses better. A block must shrink by at least 1/32,
+** lz_compress() gives up as soon as it can't reach that.
+*/
+#define	COMPRESS_DECAY       0.25
+#define	COMPRESS_LINK_WINDOW 0.1
+#define	COMPRESS_PROBE_MIN   16
+#define	COMPRESS_PROBE_MAX   1024
+#define	COMPRESS_MIN_SAVING  32
+
+extern struct opts opts;
+
+static struct {
+	int mode;
+	unsigned char *frame;
+	size_t frame_size;
+
+	bool active; /* compress the next block */
+	unsigned int skip, backoff;
+
+	/* decaying sums - ratios of them are the averages */
+	double cmpr_raw, cmpr_wire, cmpr_time;
+
+	double blk_cmpr_time; /* compressor time of the current block */
+	struct timespec last_sent;
+	double win_wire, win_time, link_rate;
+
+	unsigned long long raw_bytes, wire_bytes;
+	unsigned long long blocks, blocks_compressed, probes;
+} cmpr;
+
+
+static inline double ts_diff(const struct timespec *end, const struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static inline void decay_add(double *sum, double val)
+{
+	*sum = *sum * (1.0 - COMPRESS_DECAY) + val;
+}
+
+
+static void compress_decide(void)
+{
+	double ratio, comp_rate, link_rate;
+
+	if (cmpr.mode == COMPRESS_ALWAYS) {
+		cmpr.active = true;
+		return;
+	}
+
+	/* no full window yet: take what we have */
+	link_rate = cmpr.link_rate;
+	if (link_rate == 0 && cmpr.win_time > 0)
+		link_rate = cmpr.win_wire / cmpr.win_time;
+
+	if (cmpr.cmpr_raw > 0 && cmpr.cmpr_time > 0 && link_rate > 0) {
+		ratio = cmpr.cmpr_wire / cmpr.cmpr_raw;
+		comp_rate = cmpr.cmpr_raw / cmpr.cmpr_time;
+
+		if (comp_rate * (1.0 - ratio) > link_rate) {
+			cmpr.active = true;
+			cmpr.backoff = COMPRESS_PROBE_MIN;
+			return;
+		}
+	}
+
+	if (cmpr.active) {
+		cmpr.active = false;
+		cmpr.skip = cmpr.backoff;
+		cmpr.backoff = min(cmpr.backoff * 2, (unsigned int)COMPRESS_PROBE_MAX);
+	} else if (--cmpr.skip == 0) {
+		cmpr.active = true;
+		cmpr.probes++;
+	}
+}
+
+
+void compress_start(int mode, size_t block_size)
+{
+	memset(&cmpr, 0, sizeof(cmpr));
+
+	cmpr.mode = mode;
+	cmpr.frame_size = COMPRESS_BLK_HDR_LEN + block_size;
+	cmpr.frame = xmalloc(cmpr.frame_size);
+
+	/* the first block tells us how the data compresses */
+	cmpr.active = true;
+	cmpr.backoff = COMPRESS_PROBE_MIN;
+	clock_gettime(CLOCK_MONOTONIC, &cmpr.last_sent);
+
+	msg(STRESSFUL, "block compression %s (block size %zu)",
+			mode == COMPRESS_ALWAYS ? "always on" : "adaptive", block_size);
+}
+
+
+/* blk holds COMPRESS_BLK_HDR_LEN bytes of headroom followed
+** by len bytes of data, returns the frame length to send */
+size_t compress_block(unsigned char *blk, size_t len, unsigned char **frame)
+{
+	struct ns_blk_hdr *blk_hdr;
+	size_t clen = 0;
+
+	cmpr.blk_cmpr_time = 0;
+	if (cmpr.active) {
+		struct timespec start, end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		clen = lz_compress(blk + COMPRESS_BLK_HDR_LEN, len,
+				cmpr.frame + COMPRESS_BLK_HDR_LEN, len - len / COMPRESS_MIN_SAVING - 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		decay_add(&cmpr.cmpr_raw, len);
+		decay_add(&cmpr.cmpr_wire, clen ? clen : len);
+		cmpr.blk_cmpr_time = ts_diff(&end, &start);
+		decay_add(&cmpr.cmpr_time, cmpr.blk_cmpr_time);
+	}
+
+	cmpr.blocks++;
+	cmpr.raw_bytes += len;
+
+	if (clen) {
+		cmpr.blocks_compressed++;
+		blk_hdr = (struct ns_blk_hdr *) cmpr.frame;
+		blk_hdr->wire_len = htonl(clen | NS_BLK_COMPRESSED);
+		*frame = cmpr.frame;
+	} else {
+		clen = len;
+		blk_hdr = (struct ns_blk_hdr *) blk;
+		blk_hdr->wire_len = htonl(len);
+		*frame = blk;
+	}
+	blk_hdr->raw_len = htonl(len);
+
+	return COMPRESS_BLK_HDR_LEN + clen;
+}
+
+
+/* account a written frame and decide about the next block */
+void compress_sent(size_t wire_len)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	cmpr.wire_bytes += wire_len;
+	cmpr.win_wire += wire_len;
+	cmpr.win_time += ts_diff(&now, &cmpr.last_sent) - cmpr.blk_cmpr_time;
+	cmpr.last_sent = now;
+
+	if (cmpr.win_time >= COMPRESS_LINK_WINDOW) {
+		double rate = cmpr.win_wire / cmpr.win_time;
+
+		cmpr.link_rate = cmpr.link_rate == 0 ? rate :
+			cmpr.link_rate * (1.0 - COMPRESS_DECAY) + rate * COMPRESS_DECAY;
+		cmpr.win_wire = cmpr.win_time = 0;
+	}
+
+	compress_decide();
+}
+
+
+/* an empty frame terminates the data stream */
+size_t compress_end_marker(unsigned char *blk)
+{
+	struct ns_blk_hdr *blk_hdr = (struct ns_blk_hdr *) blk;
+
+	blk_hdr->wire_len = 0;
+	blk_hdr->raw_len = 0;
+
+	return COMPRESS_BLK_HDR_LEN;
+}
+
+
+unsigned long long compress_raw_bytes(void)
+{
+	return cmpr.raw_bytes;
+}
+
+
+void compress_finish(void)
+{
+	msg(LOUDISH, "compression: %llu of %llu blocks compressed (%llu probes), "
+			"%llu bytes sent for %llu bytes of data (%.1f%%)",
+			cmpr.blocks_compressed, cmpr.blocks, cmpr.probes,
+			cmpr.wire_bytes, cmpr.raw_bytes,
+			cmpr.raw_bytes ? 100.0 * cmpr.wire_bytes / cmpr.raw_bytes : 0.0);
+
+	free(cmpr.frame);
+	cmpr.frame = NULL;
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
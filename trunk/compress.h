@@ -0,0 +1,25 @@
+#ifndef NETSEND_COMPRESS_H_INCLUDE_
+#define NETSEND_COMPRESS_H_INCLUDE_
+
+#include <stddef.h>
+
+/* compress.c - adaptive block compression for the rw engine
+**
+** Every block is framed by a struct ns_blk_hdr (ns_hdr.h). The
+** engine reads into blk + COMPRESS_BLK_HDR_LEN and sends the
+** frame compress_block() hands back - either blk itself (raw)
+** or the compressed copy. Whether a block gets compressed is
+** decided from the measured compressor speed, ratio and the
+** rate the link drains the data at.
+*/
+
+#define	COMPRESS_BLK_HDR_LEN 8
+
+void compress_start(int mode, size_t block_size);
+size_t compress_block(unsigned char *blk, size_t len, unsigned char **frame);
+void compress_sent(size_t wire_len);
+size_t compress_end_marker(unsigned char *blk);
+unsigned long long compress_raw_bytes(void);
+void compress_finish(void);
+
+#endif /* NETSEND_COMPRESS_H_INCLUDE_ */
@@ -0,0 +1,279 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "xfuncs.h"
+
+extern struct opts opts;
+extern struct net_stat net_stat;
+
+/* getrusage(RUSAGE_SELF) misses the network stack work done in
+** softirq context: most of the receive path runs on the cpu the
+** NIC interrupt (or RPS) picked, not in our process. -K samples
+** the time of every cpu from /proc/stat and the NET_RX/NET_TX
+** softirq counts from /proc/softirqs around the transfer (and
+** every interval with -i). Both files are read with stdio, never
+** from the io loops. /proc/stat counts in USER_HZ ticks, so short
+** intervals are coarse.
+*/
+
+#define	PROC_STAT     "/proc/stat"
+#define	PROC_SOFTIRQS "/proc/softirqs"
+
+struct cpu_snap_cpu {
+	bool present;
+	unsigned long long system, irq, softirq; /* USER_HZ ticks */
+	unsigned long long net_rx, net_tx;
+};
+
+struct cpu_snap {
+	bool ok;
+	int cpus; /* entries of cpu[], indexed by cpu number */
+	struct cpu_snap_cpu *cpu;
+};
+
+/* the start of the whole transfer */
+static struct cpu_snap *start_snap;
+
+
+struct cpu_snap *
+cpu_snap_new(void)
+{
+	struct cpu_snap *snap = xzalloc(sizeof(*snap));
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	snap->cpus = cpus > 0 ? cpus : 1;
+	snap->cpu = xzalloc(snap->cpus * sizeof(*snap->cpu));
+
+	return snap;
+}
+
+
+void
+cpu_snap_free(struct cpu_snap *snap)
+{
+	if (!snap)
+		return;
+
+	free(snap->cpu);
+	free(snap);
+}
+
+
+/* cpuN user nice system idle iowait irq softirq ... */
+static bool
+proc_stat_read(struct cpu_snap *snap)
+{
+	FILE *fp;
+	char line[512];
+	unsigned long long user, nice, system, idle, iowait, irq, softirq;
+	int cpu, found = 0;
+
+	if ((fp = fopen(PROC_STAT, "r")) == NULL)
+		return false;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "cpu", 3) || line[3] < '0' || line[3] > '9')
+			continue;
+
+		if (sscanf(line + 3, "%d %llu %llu %llu %llu %llu %llu %llu", &cpu, &user,
+					&nice, &system, &idle, &iowait, &irq, &softirq) != 8)
+			continue;
+		if (cpu < 0 || cpu >= snap->cpus)
+			continue;
+
+		snap->cpu[cpu].present = true;
+		snap->cpu[cpu].system = system;
+		snap->cpu[cpu].irq = irq;
+		snap->cpu[cpu].softirq = softirq;
+		found++;
+	}
+	fclose(fp);
+
+	return found > 0;
+}
+
+
+/* The header names the cpu of each column ("CPU0 CPU2 ..."),
+** offline cpus have none. A line can be long on big machines. */
+static bool
+proc_softirqs_read(struct cpu_snap *snap)
+{
+	FILE *fp;
+	char *line = NULL, *p, *end;
+	size_t line_len = 0;
+	int *column = NULL, columns = 0, i;
+	unsigned long val;
+	bool rx, ret = false;
+
+	if ((fp = fopen(PROC_SOFTIRQS, "r")) == NULL)
+		return false;
+
+	if (getline(&line, &line_len, fp) < 0)
+		goto out;
+
+	column = xmalloc(snap->cpus * sizeof(*column));
+	for (p = line; (p = strstr(p, "CPU")) != NULL && columns < snap->cpus; ) {
+		p += 3;
+		column[columns++] = strtol(p, &p, 10);
+	}
+
+	while (getline(&line, &line_len, fp) >= 0) {
+		p = line + strspn(line, " ");
+		if (!strncmp(p, "NET_RX:", 7))
+			rx = true;
+		else if (!strncmp(p, "NET_TX:", 7))
+			rx = false;
+		else
+			continue;
+
+		p += 7;
+		for (i = 0; i < columns; i++) {
+			val = strtoul(p, &end, 10);
+			if (end == p)
+				break;
+			p = end;
+			if (column[i] < 0 || column[i] >= snap->cpus)
+				continue;
+			if (rx)
+				snap->cpu[column[i]].net_rx = val;
+			else
+				snap->cpu[column[i]].net_tx = val;
+		}
+		ret = true;
+	}
+
+out:
+	free(column);
+	free(line);
+	fclose(fp);
+
+	return ret;
+}
+
+
+bool
+cpu_snap_take(struct cpu_snap *snap)
+{
+	memset(snap->cpu, 0, snap->cpus * sizeof(*snap->cpu));
+
+	snap->ok = proc_stat_read(snap);
+	/* without /proc/softirqs the times are still worth it */
+	proc_softirqs_read(snap);
+
+	return snap->ok;
+}
+
+
+static int
+cpu_net_cmp(const void *a, const void *b)
+{
+	const struct cpu_net *x = a, *y = b;
+
+	if (x->softirq_sec != y->softirq_sec)
+		return x->softirq_sec < y->softirq_sec ? 1 : -1;
+	if (x->net_rx + x->net_tx != y->net_rx + y->net_tx)
+		return x->net_rx + x->net_tx < y->net_rx + y->net_tx ? 1 : -1;
+	return x->cpu - y->cpu;
+}
+
+
+/* the counters only grow, a cpu which went offline in between is left out */
+void
+cpu_snap_diff(const struct cpu_snap *prev, const struct cpu_snap *now,
+		struct cpu_delta *delta)
+{
+	const struct cpu_snap_cpu *p, *n;
+	struct cpu_net cn, *cpus;
+	double hz = sysconf(_SC_CLK_TCK);
+	int cpu;
+
+	memset(delta, 0, sizeof(*delta));
+	if (!prev->ok || !now->ok)
+		return;
+	if (hz <= 0)
+		hz = 100;
+
+	cpus = xmalloc(now->cpus * sizeof(*cpus));
+	for (cpu = 0; cpu < now->cpus && cpu < prev->cpus; cpu++) {
+		p = &prev->cpu[cpu];
+		n = &now->cpu[cpu];
+		if (!p->present || !n->present)
+			continue;
+
+		memset(&cn, 0, sizeof(cn));
+		cn.cpu = cpu;
+		cn.softirq_sec = n->softirq >= p->softirq ? (n->softirq - p->softirq) / hz : 0;
+		cn.system_sec = n->system >= p->system ? (n->system - p->system) / hz : 0;
+		cn.net_rx = n->net_rx >= p->net_rx ? n->net_rx - p->net_rx : 0;
+		cn.net_tx = n->net_tx >= p->net_tx ? n->net_tx - p->net_tx : 0;
+
+		delta->softirq_sec += cn.softirq_sec;
+		delta->system_sec += cn.system_sec;
+		delta->irq_sec += n->irq >= p->irq ? (n->irq - p->irq) / hz : 0;
+		delta->net_rx += cn.net_rx;
+		delta->net_tx += cn.net_tx;
+
+		if (cn.softirq_sec > 0 || cn.net_rx || cn.net_tx)
+			cpus[delta->cpus_no++] = cn;
+	}
+
+	qsort(cpus, delta->cpus_no, sizeof(*cpus), cpu_net_cmp);
+	memcpy(delta->cpus, cpus, min(delta->cpus_no, (unsigned int) CPU_NET_MAX) * sizeof(*cpus));
+	free(cpus);
+
+	delta->ok = true;
+}
+
+
+/* called from touch_use_stat() around the transfer */
+void
+cpu_stat_start(void)
+{
+	if (!opts.cpu_stat)
+		return;
+
+	if (!start_snap)
+		start_snap = cpu_snap_new();
+	if (!cpu_snap_take(start_snap))
+		err_sys("Can't read %s, no softirq statistic (-K)", PROC_STAT);
+}
+
+
+void
+cpu_stat_stop(void)
+{
+	struct cpu_snap *end_snap;
+
+	if (!start_snap || !start_snap->ok)
+		return;
+
+	end_snap = cpu_snap_new();
+	cpu_snap_take(end_snap);
+	cpu_snap_diff(start_snap, end_snap, &net_stat.cpu_stat);
+	cpu_snap_free(end_snap);
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,291 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "global.h"
+#include "xfuncs.h"
+#include "hash.h"
+#include "delta.h"
+
+#define	DELTA_NONE UINT32_MAX
+
+static struct {
+	struct delta_sig *sigs;
+	uint32_t n, n_full; /* n_full: blocks of full size */
+	size_t block, last_len;
+
+	uint32_t *head, *next;
+	unsigned int hash_bits;
+
+	uint32_t hint; /* the block following the last match */
+	unsigned long long literal_bytes, ref_bytes, refs;
+} dlt;
+
+
+/* about sqrt(size) like rsync, in 1k steps */
+size_t delta_block_size(unsigned long long size)
+{
+	size_t block = DELTA_BLOCK_MIN;
+
+	while (block < DELTA_BLOCK_MAX && (unsigned long long)block * block < size)
+		block += 1024;
+
+	return block;
+}
+
+
+/* a = sum of all bytes, b = sum of the running a values,
+** both mod 2^16 - cheap to roll by one byte */
+uint32_t delta_weak(const unsigned char *p, size_t len)
+{
+	uint32_t a = 0, b = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		a += p[i];
+		b += a;
+	}
+
+	return (a & 0xffff) | (b << 16);
+}
+
+
+void delta_strong(const unsigned char *p, size_t len, unsigned char *out)
+{
+	struct hash_ctx ctx;
+	unsigned char md[HASH_MAX_LEN];
+
+	hash_init(&ctx, HASH_SHA256);
+	hash_update(&ctx, p, len);
+	hash_final(&ctx, md);
+	memcpy(out, md, DELTA_STRONG_LEN);
+}
+
+
+static inline uint32_t delta_hash(uint32_t weak)
+{
+	return (weak * 2654435761U) >> (32 - dlt.hash_bits);
+}
+
+
+/* takes ownership of sigs, the last block may be short */
+void delta_index_build(struct delta_sig *sigs, uint32_t n, size_t block,
+		unsigned long long old_size)
+{
+	uint32_t i;
+
+	memset(&dlt, 0, sizeof(dlt));
+	dlt.sigs = sigs;
+	dlt.n = n;
+	dlt.block = block;
+	dlt.last_len = n ? old_size - (unsigned long long)(n - 1) * block : 0;
+	dlt.n_full = dlt.last_len == block ? n : n - (n > 0);
+
+	for (dlt.hash_bits = 4; dlt.hash_bits < 31 &&
+			(1U << dlt.hash_bits) < 2 * dlt.n_full; dlt.hash_bits++)
+		;
+
+	dlt.head = xmalloc(sizeof(uint32_t) << dlt.hash_bits);
+	memset(dlt.head, 0xff, sizeof(uint32_t) << dlt.hash_bits);
+	dlt.next = xmalloc(sizeof(uint32_t) * (dlt.n_full + 1));
+
+	/* insert backwards: chains are ordered by block number */
+	for (i = dlt.n_full; i-- > 0; ) {
+		uint32_t h = delta_hash(sigs[i].weak);
+
+		dlt.next[i] = dlt.head[h];
+		dlt.head[h] = i;
+	}
+}
+
+
+void delta_index_free(void)
+{
+	free(dlt.sigs);
+	free(dlt.head);
+	free(dlt.next);
+	dlt.sigs = NULL;
+	dlt.head = dlt.next = NULL;
+}
+
+
+static uint32_t delta_lookup(uint32_t weak, const unsigned char *p)
+{
+	unsigned char md[DELTA_STRONG_LEN];
+	bool have_md = false;
+	uint32_t i;
+
+	/* changes are rare: most likely the next block matches */
+	if (dlt.hint < dlt.n_full && dlt.sigs[dlt.hint].weak == weak) {
+		delta_strong(p, dlt.block, md);
+		have_md = true;
+		if (!memcmp(md, dlt.sigs[dlt.hint].strong, DELTA_STRONG_LEN))
+			return dlt.hint;
+	}
+
+	for (i = dlt.head[delta_hash(weak)]; i != DELTA_NONE; i = dlt.next[i]) {
+		if (dlt.sigs[i].weak != weak)
+			continue;
+		if (!have_md) {
+			delta_strong(p, dlt.block, md);
+			have_md = true;
+		}
+		if (!memcmp(md, dlt.sigs[i].strong, DELTA_STRONG_LEN))
+			return i;
+	}
+
+	return DELTA_NONE;
+}
+
+
+static int emit_literal(const unsigned char *p, size_t len, delta_emit_t emit, void *arg)
+{
+	struct delta_op op = { .type = DELTA_OP_LITERAL };
+
+	dlt.literal_bytes += len;
+
+	while (len > 0) {
+		op.ptr = p;
+		op.len = min(len, (size_t)DELTA_LITERAL_MAX);
+		if (emit(&op, arg))
+			return -1;
+		p += op.len;
+		len -= op.len;
+	}
+	return 0;
+}
+
+
+static int emit_ref(uint32_t block, uint32_t count, delta_emit_t emit, void *arg)
+{
+	struct delta_op op = { .type = DELTA_OP_REF, .block = block, .count = count };
+
+	if (count == 0)
+		return 0;
+
+	dlt.refs++;
+	return emit(&op, arg);
+}
+
+
+/* encode data against the index, returns -1 if emit failed */
+int delta_scan(const unsigned char *data, size_t len, delta_emit_t emit, void *arg)
+{
+	const size_t B = dlt.block;
+	size_t pos = 0, lit = 0;
+	uint32_t a = 0, b = 0, run_start = 0, run_count = 0;
+	struct delta_op op = { .type = DELTA_OP_END };
+
+	if (dlt.n_full && len >= B) {
+		uint32_t weak = delta_weak(data, B);
+		a = weak & 0xffff;
+		b = weak >> 16;
+	}
+
+	while (dlt.n_full && pos + B <= len) {
+		uint32_t idx = delta_lookup((a & 0xffff) | (b << 16), data + pos);
+
+		if (idx != DELTA_NONE) {
+			if (pos > lit) {
+				if (emit_ref(run_start, run_count, emit, arg) ||
+					emit_literal(data + lit, pos - lit, emit, arg))
+					return -1;
+				run_count = 0;
+			}
+			if (run_count && idx == run_start + run_count) {
+				run_count++;
+			} else {
+				if (emit_ref(run_start, run_count, emit, arg))
+					return -1;
+				run_start = idx;
+				run_count = 1;
+			}
+			dlt.ref_bytes += B;
+			dlt.hint = idx + 1;
+
+			pos += B;
+			lit = pos;
+			if (pos + B <= len) {
+				uint32_t weak = delta_weak(data + pos, B);
+				a = weak & 0xffff;
+				b = weak >> 16;
+			}
+			continue;
+		}
+
+		/* roll the window one byte further */
+		if (pos + B < len) {
+			a += data[pos + B] - data[pos];
+			b += a - B * data[pos];
+		}
+		pos++;
+
+		if (pos - lit >= DELTA_LITERAL_MAX) {
+			if (emit_ref(run_start, run_count, emit, arg) ||
+				emit_literal(data + lit, pos - lit, emit, arg))
+				return -1;
+			run_count = 0;
+			lit = pos;
+		}
+	}
+
+	/* the old file may end with a short block */
+	if (dlt.n > dlt.n_full && len - pos == dlt.last_len) {
+		const struct delta_sig *sig = &dlt.sigs[dlt.n - 1];
+		unsigned char md[DELTA_STRONG_LEN];
+
+		if (delta_weak(data + pos, dlt.last_len) == sig->weak) {
+			delta_strong(data + pos, dlt.last_len, md);
+			if (!memcmp(md, sig->strong, DELTA_STRONG_LEN)) {
+				if (pos > lit) {
+					if (emit_ref(run_start, run_count, emit, arg) ||
+						emit_literal(data + lit, pos - lit, emit, arg))
+						return -1;
+					run_count = 0;
+				}
+				if (run_count && dlt.n - 1 == run_start + run_count) {
+					run_count++;
+				} else {
+					if (emit_ref(run_start, run_count, emit, arg))
+						return -1;
+					run_start = dlt.n - 1;
+					run_count = 1;
+				}
+				dlt.ref_bytes += dlt.last_len;
+				pos = lit = len;
+			}
+		}
+	}
+
+	if (emit_ref(run_start, run_count, emit, arg) ||
+		emit_literal(data + lit, len - lit, emit, arg))
+		return -1;
+
+	msg(LOUDISH, "delta: %llu literal bytes, %llu bytes in %llu block references "
+			"(block size %zu)", dlt.literal_bytes, dlt.ref_bytes, dlt.refs, B);
+
+	return emit(&op, arg);
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,45 @@
+#ifndef NETSEND_DELTA_H_INCLUDE_
+#define NETSEND_DELTA_H_INCLUDE_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* delta.c - rsync like delta encoding
+**
+** The receiver cuts its old file into blocks and sends a weak
+** rolling and a strong checksum per block. The transmitter
+** slides a window over its file: where the weak checksum hits
+** and the strong one confirms, it references the old block,
+** everything else goes out as literal data.
+*/
+
+#define	DELTA_STRONG_LEN  16 /* leading octets of sha256 */
+#define	DELTA_BLOCK_MIN   2048
+#define	DELTA_BLOCK_MAX   (128 * 1024)
+#define	DELTA_LITERAL_MAX (256 * 1024)
+
+struct delta_sig {
+	uint32_t weak;
+	unsigned char strong[DELTA_STRONG_LEN];
+};
+
+enum delta_op_type { DELTA_OP_END = 0, DELTA_OP_LITERAL, DELTA_OP_REF };
+
+struct delta_op {
+	enum delta_op_type type;
+	const unsigned char *ptr; /* literal data */
+	size_t len;
+	uint32_t block, count; /* referenced block run */
+};
+
+typedef int (*delta_emit_t)(const struct delta_op *, void *);
+
+size_t delta_block_size(unsigned long long);
+uint32_t delta_weak(const unsigned char *, size_t);
+void delta_strong(const unsigned char *, size_t, unsigned char *);
+
+void delta_index_build(struct delta_sig *, uint32_t, size_t, unsigned long long);
+int delta_scan(const unsigned char *, size_t, delta_emit_t, void *);
+void delta_index_free(void);
+
+#endif /* NETSEND_DELTA_H_INCLUDE_ */
@@ -0,0 +1,315 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "global.h"
+#include "xfuncs.h"
+#include "digest.h"
+
+/* Number of rw buffers in flight between engine and hash
+** thread. If the hash is slower than the network the engine
+** blocks in digest_slot_get() - but only then.
+*/
+#define	DIGEST_SLOTS      8
+#define	DIGEST_QUEUE_LEN  64
+#define	DIGEST_FILE_BUF   (256 * 1024)
+#define	DIGEST_COPY_MAX   32
+
+enum digest_item_type {
+	DI_SLOT = 0,
+	DI_REF,
+	DI_FILE,
+	DI_COPY,
+	DI_STOP
+};
+
+struct digest_item {
+	enum digest_item_type type;
+	const unsigned char *ptr;
+	unsigned char *slot; /* DI_SLOT: back to the pool after hashing */
+	size_t len;
+	int fd;
+	off_t off;
+	unsigned char copy[DIGEST_COPY_MAX]; /* DI_COPY */
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* engine -> hash thread */
+	pthread_cond_t done; /* hash thread -> engine */
+
+	struct digest_item queue[DIGEST_QUEUE_LEN];
+	unsigned int q_head, q_len;
+	bool busy;
+
+	unsigned char *slots[DIGEST_SLOTS];
+	unsigned int free_slots;
+
+	struct hash_ctx ctx;
+	unsigned long long bytes;
+	bool running;
+} dgst = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+
+static void digest_file_range(unsigned char *buf, int fd, off_t off, size_t len)
+{
+	while (len > 0) {
+		ssize_t rc = pread(fd, buf, min(len, (size_t)DIGEST_FILE_BUF), off);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys_die(EXIT_FAILMISC, "digest: pread at offset %lld failed",
+					(long long)off);
+		}
+		if (rc == 0)
+			err_msg_die(EXIT_FAILMISC, "digest: input file shrunk while hashing");
+
+		hash_update(&dgst.ctx, buf, rc);
+		off += rc;
+		len -= rc;
+	}
+}
+
+
+static void *digest_thread(void *arg __attribute__((unused)))
+{
+	unsigned char *file_buf = NULL;
+	struct digest_item item;
+
+	for (;;) {
+		pthread_mutex_lock(&dgst.lock);
+		while (dgst.q_len == 0)
+			pthread_cond_wait(&dgst.work, &dgst.lock);
+		item = dgst.queue[dgst.q_head];
+		dgst.q_head = (dgst.q_head + 1) % DIGEST_QUEUE_LEN;
+		dgst.q_len--;
+		dgst.busy = true;
+		pthread_mutex_unlock(&dgst.lock);
+
+		switch (item.type) {
+		case DI_SLOT:
+		case DI_REF:
+			hash_update(&dgst.ctx, item.ptr, item.len);
+			break;
+		case DI_COPY:
+			hash_update(&dgst.ctx, item.copy, item.len);
+			break;
+		case DI_FILE:
+			if (!file_buf)
+				file_buf = xmalloc(DIGEST_FILE_BUF);
+			digest_file_range(file_buf, item.fd, item.off, item.len);
+			break;
+		case DI_STOP:
+			break;
+		}
+
+		pthread_mutex_lock(&dgst.lock);
+		dgst.bytes += item.len;
+		if (item.type == DI_SLOT)
+			dgst.slots[dgst.free_slots++] = item.slot;
+		dgst.busy = false;
+		pthread_cond_broadcast(&dgst.done);
+		pthread_mutex_unlock(&dgst.lock);
+
+		if (item.type == DI_STOP)
+			break;
+	}
+
+	free(file_buf);
+	return NULL;
+}
+
+
+static void digest_enqueue(enum digest_item_type type, const void *ptr,
+		unsigned char *slot, size_t len, int fd, off_t off)
+{
+	struct digest_item *item;
+
+	pthread_mutex_lock(&dgst.lock);
+	while (dgst.q_len == DIGEST_QUEUE_LEN)
+		pthread_cond_wait(&dgst.done, &dgst.lock);
+
+	item = &dgst.queue[(dgst.q_head + dgst.q_len) % DIGEST_QUEUE_LEN];
+	item->type = type;
+	item->ptr = ptr;
+	item->slot = slot;
+	item->len = len;
+	item->fd = fd;
+	item->off = off;
+	if (type == DI_COPY)
+		memcpy(item->copy, ptr, len);
+	dgst.q_len++;
+
+	pthread_cond_signal(&dgst.work);
+	pthread_mutex_unlock(&dgst.lock);
+}
+
+
+/* slot_size is the largest chunk a rw engine will put into
+** a slot; pass 0 if the engine never calls digest_slot_get()
+*/
+void digest_start(enum hash_type type, size_t slot_size)
+{
+	int ret;
+	unsigned i;
+
+	hash_init(&dgst.ctx, type);
+
+	dgst.free_slots = 0;
+	if (slot_size) {
+		for (i = 0; i < DIGEST_SLOTS; i++)
+			dgst.slots[dgst.free_slots++] = xmalloc(slot_size);
+	}
+
+	ret = pthread_create(&dgst.thread, NULL, digest_thread, NULL);
+	if (ret)
+		err_msg_die(EXIT_FAILMISC, "Can't create digest thread: %s", strerror(ret));
+	dgst.running = true;
+
+	msg(LOUDISH, "digest thread started (%s, %s implementation)",
+			hash_type_to_str(type), hash_impl_str(type));
+}
+
+
+unsigned char *digest_slot_get(void)
+{
+	unsigned char *slot;
+
+	pthread_mutex_lock(&dgst.lock);
+	while (dgst.free_slots == 0)
+		pthread_cond_wait(&dgst.done, &dgst.lock);
+	slot = dgst.slots[--dgst.free_slots];
+	pthread_mutex_unlock(&dgst.lock);
+
+	return slot;
+}
+
+
+/* a zero len returns the slot without hashing anything */
+void digest_slot_put(unsigned char *slot, size_t len)
+{
+	if (len == 0) {
+		pthread_mutex_lock(&dgst.lock);
+		dgst.slots[dgst.free_slots++] = slot;
+		pthread_cond_broadcast(&dgst.done);
+		pthread_mutex_unlock(&dgst.lock);
+		return;
+	}
+	digest_enqueue(DI_SLOT, slot, slot, len, -1, 0);
+}
+
+
+/* like digest_slot_put() but the data starts off bytes
+** into the slot (room for a block header) */
+void digest_slot_put_off(unsigned char *slot, size_t off, size_t len)
+{
+	if (len == 0) {
+		digest_slot_put(slot, 0);
+		return;
+	}
+	digest_enqueue(DI_SLOT, slot + off, slot, len, -1, 0);
+}
+
+
+/* the slot goes back to the pool after everything queued so
+** far is hashed - for slots whose data was fed in pieces with
+** digest_feed_ref() */
+void digest_slot_release(unsigned char *slot)
+{
+	digest_enqueue(DI_SLOT, slot, slot, 0, -1, 0);
+}
+
+
+void digest_feed_ref(const void *ptr, size_t len)
+{
+	if (len)
+		digest_enqueue(DI_REF, ptr, NULL, len, -1, 0);
+}
+
+
+/* a few bytes (framing headers) which don't live long enough
+** for a reference, copied into the queue */
+void digest_feed_copy(const void *ptr, size_t len)
+{
+	while (len) {
+		size_t chunk = min(len, (size_t)DIGEST_COPY_MAX);
+
+		digest_enqueue(DI_COPY, ptr, NULL, chunk, -1, 0);
+		ptr = (const unsigned char *) ptr + chunk;
+		len -= chunk;
+	}
+}
+
+
+void digest_feed_file(int fd, off_t off, size_t len)
+{
+	if (len)
+		digest_enqueue(DI_FILE, NULL, NULL, len, fd, off);
+}
+
+
+/* wait until the hash thread has consumed all queued data */
+void digest_drain(void)
+{
+	pthread_mutex_lock(&dgst.lock);
+	while (dgst.q_len || dgst.busy)
+		pthread_cond_wait(&dgst.done, &dgst.lock);
+	pthread_mutex_unlock(&dgst.lock);
+}
+
+
+/* stop the hash thread and store the digest in out
+** (HASH_MAX_LEN bytes), returns the digest length */
+size_t digest_finish(unsigned char *out)
+{
+	unsigned i;
+
+	if (!dgst.running)
+		return 0;
+
+	digest_enqueue(DI_STOP, NULL, NULL, 0, -1, 0);
+	pthread_join(dgst.thread, NULL);
+	dgst.running = false;
+
+	hash_final(&dgst.ctx, out);
+
+	for (i = 0; i < dgst.free_slots; i++)
+		free(dgst.slots[i]);
+	dgst.free_slots = 0;
+
+	msg(LOUDISH, "digest over %llu bytes (%s)", dgst.bytes,
+			hash_type_to_str(dgst.ctx.type));
+
+	return hash_len(dgst.ctx.type);
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
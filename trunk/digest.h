@@ -0,0 +1,37 @@
+#ifndef NETSEND_DIGEST_H_INCLUDE_
+#define NETSEND_DIGEST_H_INCLUDE_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+/* digest.c - overlapped end-to-end digest
+**
+** The transmit and receive engines hand their data (or a
+** reference to it) to a helper thread which runs the hash
+** while the engine continues with the next chunk.
+*/
+
+void digest_start(enum hash_type, size_t slot_size);
+
+/* rw engines: buffers are borrowed from the digest pool and
+** given back (with the valid length) once they are written */
+unsigned char *digest_slot_get(void);
+void digest_slot_put(unsigned char *, size_t);
+void digest_slot_put_off(unsigned char *, size_t, size_t);
+void digest_slot_release(unsigned char *);
+
+/* data stays valid until digest_drain() returns (mmap) */
+void digest_feed_ref(const void *, size_t);
+
+/* a few bytes on the stack, copied before it returns */
+void digest_feed_copy(const void *, size_t);
+
+/* data never showed up in userspace (sendfile, splice) */
+void digest_feed_file(int, off_t, size_t);
+
+void digest_drain(void);
+size_t digest_finish(unsigned char *);
+
+#endif /* NETSEND_DIGEST_H_INCLUDE_ */
@@ -49,6 +49,10 @@ open_input_file(void)
 	if (ret == -1)
 		err_sys_die(EXIT_FAILMISC, "Can't stat file %s", opts.infile);
 
+	/* a directory is sent as a tree, see trans_tree() */
+	if (S_ISDIR(stat_buf.st_mode))
+		opts.ext_hdr_mask |= HDR_MSK_TREE;
+
 #ifdef O_NOATIME
 	fd = open(opts.infile, O_RDONLY|O_NOATIME);
 #else
@@ -65,6 +69,7 @@ int
 open_output_file(void)
 {
 	int fd = 0;
+	struct stat s;
 
 	if (!opts.outfile)
 		return STDOUT_FILENO;
@@ -74,10 +79,26 @@ open_output_file(void)
 
 	umask(0);
 
+	/* an existing directory takes a tree, see cs_read_tree() */
+	if (stat(opts.outfile, &s) == 0 && S_ISDIR(s.st_mode)) {
+		fd = open(opts.outfile, O_RDONLY | O_DIRECTORY);
+		if (fd == -1)
+			err_sys_die(EXIT_FAILOPT, "Can't open output directory: %s", opts.outfile);
+		return fd;
+	}
+
+	/* resume and delta: keep existing data, the hash tree
+	** and the block signatures need read access */
+	if (opts.ext_hdr_mask & (HDR_MSK_RESUME | HDR_MSK_DELTA)) {
+		fd = open(opts.outfile, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+		if (fd == -1)
+			err_sys_die(EXIT_FAILOPT, "Can't open outputfile: %s", opts.outfile);
+		return fd;
+	}
+
 	fd = open(opts.outfile, O_WRONLY | O_CREAT | O_EXCL,
 			  S_IRUSR | S_IWUSR | S_IRGRP);
 	if (fd == -1) {
-		struct stat s;
 		if (errno != EEXIST)
 			err_sys_die(EXIT_FAILOPT, "Can't create outputfile: %s", opts.outfile);
 
@@ -96,4 +117,23 @@ open_output_file(void)
 }
 
 
+/* data continues at offset (a resumed transfer) - cut off
+** what follows in a regular output file */
+void
+truncate_output_file(int fd, off_t offset)
+{
+	struct stat s;
+
+	xfstat(fd, &s, opts.outfile ? opts.outfile : "stdout");
+	if (!S_ISREG(s.st_mode))
+		return;
+
+	if (ftruncate(fd, offset))
+		err_sys_die(EXIT_FAILMISC, "Can't truncate outputfile to %lld bytes",
+				(long long)offset);
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		err_sys_die(EXIT_FAILMISC, "Can't seek in outputfile");
+}
+
+
 /* vim:set ts=4 sw=4 tw=78 noet: */
@@ -33,6 +33,8 @@
 
 #include "global.h"
 #include "xfuncs.h"
+#include "hash.h"
+#include "trace.h"
 
 /* This is the overall parsing procedure:
  *
@@ -74,27 +76,35 @@ static const char const help_str[][4096] = {
 	" OPTIONS      := { -T FORMAT | -6 | -4 | -n | -d | -r RTTPROBE | -P SCHED-POLICY | -N level\n"
 	"                   -m MEM-ADVISORY | -V[version] | -v[erbose] LEVEL | -h[elp] | -a[ll-options] }\n"
 	"                   -p PORT -s SETSOCKOPT_OPTNAME _OPTVAL -b READWRITE_BUFSIZE -u SEND-ROUTINE\n"
+	"                   -D DIGEST -z COMPRESSION -R -X -S -Z -B -c PAIRPROBE -i SECONDS\n"
+	"                   -L -E -K -M METRICS -e TRACE -x\n"
 #if 0
 	"                   -P <processing-threads>\n" /* not implemented */
 #endif
 	" PROTOCOL     := { tcp | udp | dccp | tipc | sctp | udplite }\n"
 	" COMMAND      := { UDP-OPTIONS | UDPL-OPTIONS | SCTP-OPTIONS | DCCP-OPTIONS | TIPC-OPTIONS | TCP-OPTIONS }\n"
 	" MODE         := { receive | transmit }\n"
-	" FORMAT       := { human | machine }\n"
+	" FORMAT       := { human | machine | json }\n"
 	" SEND-ROUTINE := { mmap | sendfile | splice | rw }\n"
-	" RTTPROBE     := { 10n,10d,10m,10f }\n"
+	" RTTPROBE     := { 10n,10d,10m,10f,1k,1000t }\n"
+	" PAIRPROBE    := { 20p,5t,16l,1400s }\n"
+	" METRICS      := { PORT | HOST:PORT | *:PORT | unix:PATH }\n"
+	" TRACE        := FILE[,EVENTS]\n"
+	" DIGEST       := { crc32c | sha256 }\n"
+	" COMPRESSION  := { auto | always }\n"
 	" MEM-ADVISORY := { normal | sequential | random | willneed | dontneed | noreuse }\n"
 	" SCHED-POLICY := { sched_rr | sched_fifo | sched_batch | sched_other } priority\n"
 	" LEVEL        := { quitscent | gentle | loudish | stressful }",
 #define	HELP_STR_TCP 1
 	" CC-ALGORITHM := -s TCP_CONGESTION { bic | cubic | highspeed | htcp | hybla | scalable | vegas | westwood | reno }\n"
-	" TCP_MD5SIG := -C [ peer-IP-Address ] (receive mode only)",
+	" TCP_MD5SIG := -C [ peer-IP-Address ] (receive mode only)\n"
+	" FASTOPEN   := -F (header in the syn, both sides)",
 #define	HELP_STR_UDP 2
 	" UDP-OPTIONS  := [ FIXME ]",
 #define	HELP_STR_UDPLITE 3
 	" UDPL-OPTIONS := [ -C <checksum_coverage> ]",
 #define	HELP_STR_SCTP 4
-	" SCTP_DISABLE_FRAGMENTS "
+	" SCTP_DISABLE_FRAGMENTS ",
 #define	HELP_STR_DCCP 5
 	" DCCP-OPTIONS := { }",
 #define	HELP_STR_TIPC 6
@@ -115,7 +125,11 @@ static const char const help_str[][4096] = {
 #define	HELP_STR_MEM_ADVICE 9
 	" MEM-ADVISORY := { normal | sequential | random | willneed | dontneed | noreuse }",
 #define	HELP_STR_IO_ADVICE 10
-	" IO-CALL := { mmap | sendfile | splice | rw }"
+	" IO-CALL := { mmap | sendfile | splice | rw }",
+#define	HELP_STR_DIGEST 11
+	" DIGEST := { crc32c | sha256 }",
+#define	HELP_STR_COMPRESS 12
+	" COMPRESSION := { auto | always }"
 };
 
 
@@ -276,6 +290,14 @@ static int parse_tcp_opt(int ac, char *av[], struct opts *optsp)
 	optsp->socktype = SOCK_STREAM;
 
 	while (av[0] && av[0][0] == '-') {
+		/* -F tcp fast open, no argument */
+		if (av[0][1] == 'F') {
+			optsp->tcp_fastopen = true;
+			ac--;
+			av++;
+			continue;
+		}
+
 		if (av[0][1] == 'C')
 			optsp->tcp_use_md5sig = true;
 
@@ -293,6 +315,8 @@ static int parse_tcp_opt(int ac, char *av[], struct opts *optsp)
 
 	if (optsp->tcp_use_md5sig)
 		msg(GENTLE, "Enabled TCP_MD5SIG option");
+	if (optsp->tcp_fastopen)
+		msg(GENTLE, "Enabled TCP fast open");
 	/* Now parse all transmit | receive specific code, plus the most
 	 * important options: the file- and hostname
 	 */
@@ -357,6 +381,7 @@ static void dump_tcp_opt(struct opts *optsp)
 		fprintf(stdout, "# perform rtt probe: false\n");
 	}
 
+	fprintf(stdout, "# tcp fast open: %s\n", optsp->tcp_fastopen ? "true" : "false");
 
 }
 
@@ -725,19 +750,31 @@ static void print_complete_usage(void)
 		fprintf(stderr, "%s\n", help_str[i]);
 }
 
+static void set_rtt_defaults(void)
+{
+	opts.rtt_probe_opt.iterations = DEFAULT_RTT_ITERATIONS;
+	opts.rtt_probe_opt.data_size = DEFAULT_RTT_DATA_SIZE;
+	opts.rtt_probe_opt.deviation_filter = DEFAULT_RTT_FILTER;
+	opts.rtt_probe_opt.inflight = DEFAULT_RTT_INFLIGHT;
+	opts.rtt_probe_opt.timeout_ms = DEFAULT_RTT_TIMEOUT_MS;
+}
+
 static int parse_rtt_string(const char *rtt_cmd, struct opts *optsp __attribute__((unused)))
 {
 	const char *tok = rtt_cmd;
 	char *what;
 
+	set_rtt_defaults();
+
 	while (tok) {
 		long value = strtol(tok, &what, 10);
 		switch (*what) {
 		case 'n':
 			opts.rtt_probe_opt.iterations = value;
-			if (value <= 0 || value > 100) {
+			if (value <= 0 || value > MAX_RTT_ITERATIONS) {
 				fprintf(stderr, "You want %ld rtt probe iterations - that's not sensible! "
-						"Valid range is between 1 and 100 probe iterations\n", value);
+						"Valid range is between 1 and %d probe iterations\n",
+						value, MAX_RTT_ITERATIONS);
 				return FAILURE;
 			}
 			break;
@@ -764,6 +801,21 @@ static int parse_rtt_string(const char *rtt_cmd, struct opts *optsp __attribute_
 				return FAILURE;
 			}
 			break;
+		case 'k':
+			opts.rtt_probe_opt.inflight = value;
+			if (value <= 0 || value > UINT16_MAX) {
+				fprintf(stderr, "%ld rtt probes in flight are not possible "
+						"(1 to %d)\n", value, UINT16_MAX);
+				return FAILURE;
+			}
+			break;
+		case 't':
+			opts.rtt_probe_opt.timeout_ms = value;
+			if (value <= 0) {
+				fprintf(stderr, "%ldms are nonsensical for a rtt probe timeout\n", value);
+				return FAILURE;
+			}
+			break;
 		default:
 			fprintf(stderr, "short rtt option %s in %s not supported: %c not recognized\n",
 					tok, rtt_cmd, *what);
@@ -780,12 +832,139 @@ static int parse_rtt_string(const char *rtt_cmd, struct opts *optsp __attribute_
 	return SUCCESS;
 }
 
+static int parse_pprobe_string(const char *pp_cmd)
+{
+	const char *tok = pp_cmd;
+	char *what;
+
+	opts.pprobe_opt.pairs = DEFAULT_PPROBE_PAIRS;
+	opts.pprobe_opt.trains = DEFAULT_PPROBE_TRAINS;
+	opts.pprobe_opt.train_len = DEFAULT_PPROBE_TRAIN_LEN;
+	opts.pprobe_opt.size = DEFAULT_PPROBE_SIZE;
+
+	while (tok) {
+		long value = strtol(tok, &what, 10);
+		switch (*what) {
+		case 'p':
+			opts.pprobe_opt.pairs = value;
+			break;
+		case 't':
+			opts.pprobe_opt.trains = value;
+			break;
+		case 'l':
+			opts.pprobe_opt.train_len = value;
+			if (value < 3 || value > MAX_PPROBE_TRAIN_LEN) {
+				fprintf(stderr, "a train has 3 to %d datagrams, not %ld\n",
+						MAX_PPROBE_TRAIN_LEN, value);
+				return FAILURE;
+			}
+			break;
+		case 's':
+			opts.pprobe_opt.size = value;
+			if (value < MIN_PPROBE_SIZE || value > 65000 || value % 4) {
+				fprintf(stderr, "%ld is not a valid datagram size (a multiple of 4 "
+						"between %d and 65000)\n", value, MIN_PPROBE_SIZE);
+				return FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "short pair probe option %s in %s not supported: %c not recognized\n",
+					tok, pp_cmd, *what);
+			return FAILURE;
+		}
+		if (*what) what++;
+		if (*what && *what != ',') {
+			fprintf(stderr, "pair probe options must be comma separated, got %c: %s\n", *what, tok);
+			return FAILURE;
+		}
+		tok = strchr(tok, ',');
+		if (tok) tok++;
+	}
+
+	if (opts.pprobe_opt.pairs < 0 || opts.pprobe_opt.trains < 0 ||
+		opts.pprobe_opt.pairs + opts.pprobe_opt.trains == 0 ||
+		opts.pprobe_opt.pairs + opts.pprobe_opt.trains > MAX_PPROBE_GROUPS) {
+		fprintf(stderr, "send 1 to %d pairs and trains\n", MAX_PPROBE_GROUPS);
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+
 static void dump_opts(struct opts *optsp __attribute__((unused)))
 {
 
 }
 
 
+/* extension headers which rely on a reliable byte
+ * stream (e.g. the trailer digest) can't be used with
+ * datagram sockets - check this after the protocol parser
+ * set up socktype
+ */
+static void check_ext_hdr_opts(struct opts *optsp)
+{
+	/* the other engines never see the data in userspace */
+	if ((optsp->ext_hdr_mask & HDR_MSK_COMPRESS) && optsp->io_call != IO_RW)
+		err_msg_die(EXIT_FAILOPT, "-z works with the rw send routine only (-u rw)");
+
+	/* the delta engine has its own framing and replaces the send routine */
+	if ((optsp->ext_hdr_mask & HDR_MSK_DELTA) &&
+		(optsp->ext_hdr_mask & (HDR_MSK_COMPRESS | HDR_MSK_RESUME)))
+		err_msg_die(EXIT_FAILOPT, "-X can't be combined with -z or -R");
+
+	/* extents are framed by the sparse engine itself */
+	if ((optsp->ext_hdr_mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO)) &&
+		(optsp->ext_hdr_mask & (HDR_MSK_COMPRESS | HDR_MSK_DELTA)))
+		err_msg_die(EXIT_FAILOPT, "-S and -Z can't be combined with -z or -X");
+
+	/* sendfile and splice never see the data */
+	if ((optsp->ext_hdr_mask & HDR_MSK_ZERO) &&
+		optsp->io_call != IO_RW && optsp->io_call != IO_MMAP)
+		err_msg_die(EXIT_FAILOPT, "-Z works with the rw and mmap send routines only");
+
+	/* buffer sizing needs the rtt */
+	if (optsp->ext_hdr_mask & HDR_MSK_BDP) {
+		if (optsp->protocol != IPPROTO_TCP)
+			err_msg_die(EXIT_FAILOPT, "-B requires tcp");
+		if (optsp->rtt_probe_opt.iterations == 0)
+			set_rtt_defaults();
+	}
+
+	/* the trailer and the half close of the statistics exchange */
+	if ((optsp->ext_hdr_mask & HDR_MSK_STATS) && optsp->protocol != IPPROTO_TCP)
+		err_msg_die(EXIT_FAILOPT, "-x requires tcp");
+
+	/* a stream sends no back to back datagrams */
+	if (optsp->pprobe_opt.pairs + optsp->pprobe_opt.trains > 0 &&
+		optsp->protocol != IPPROTO_UDP && optsp->protocol != IPPROTO_UDPLITE)
+		err_msg_die(EXIT_FAILOPT, "-c requires a datagram protocol (udp or udplite)");
+
+	if (optsp->socktype == SOCK_STREAM)
+		return;
+
+	if (optsp->ext_hdr_mask & HDR_MSK_DIGEST)
+		err_msg_die(EXIT_FAILOPT, "-D requires a stream protocol (tcp, sctp "
+				"or tipc with SOCK_STREAM)");
+
+	if (optsp->ext_hdr_mask & HDR_MSK_COMPRESS)
+		err_msg_die(EXIT_FAILOPT, "-z requires a stream protocol (tcp, sctp "
+				"or tipc with SOCK_STREAM)");
+
+	if (optsp->ext_hdr_mask & HDR_MSK_RESUME)
+		err_msg_die(EXIT_FAILOPT, "-R requires a stream protocol (tcp, sctp "
+				"or tipc with SOCK_STREAM)");
+
+	if (optsp->ext_hdr_mask & HDR_MSK_DELTA)
+		err_msg_die(EXIT_FAILOPT, "-X requires a stream protocol (tcp, sctp "
+				"or tipc with SOCK_STREAM)");
+
+	if (optsp->ext_hdr_mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO))
+		err_msg_die(EXIT_FAILOPT, "-S and -Z require a stream protocol (tcp, sctp "
+				"or tipc with SOCK_STREAM)");
+}
+
+
 
 
 /* parse_opts will parse all command line
@@ -895,7 +1074,7 @@ parse_opts(int ac, char *av[], struct opts *optsp)
 		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "d")))
 			++dump_defaults;
 
-		 /* -T { human | machine } */
+		 /* -T { human | machine | json } */
 		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "T"))) {
 			if (!av[2]) {
 				print_usage(NULL, HELP_STR_GLOBAL, 1);
@@ -908,6 +1087,10 @@ parse_opts(int ac, char *av[], struct opts *optsp)
 				optsp->machine_parseable++;
 				av += 2; ac -= 2;
 				continue;
+			} else if (!strcmp(&av[FIRST_ARG_INDEX + 1][0], "json")) {
+				optsp->json_report++;
+				av += 2; ac -= 2;
+				continue;
 			} else {
 				print_usage(NULL, HELP_STR_GLOBAL, 1);
 				exit(1);
@@ -946,6 +1129,82 @@ parse_opts(int ac, char *av[], struct opts *optsp)
 			continue;
 		}
 
+		/* -L latency and size histograms of the io calls */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "L")) ) {
+			optsp->latency_hist = true;
+			av++; ac--;
+			continue;
+		}
+
+		/* -E hardware and software counters of the transfer */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "E")) ) {
+			optsp->perf_counters = true;
+			av++; ac--;
+			continue;
+		}
+
+		/* -e FILE[,EVENTS] binary trace of the io calls */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "e")) ) {
+			char *slots;
+
+			if (!av[FIRST_ARG_INDEX + 1])
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+
+			optsp->trace_file = xstrdup(av[FIRST_ARG_INDEX + 1]);
+			optsp->trace_slots = DEFAULT_TRACE_SLOTS;
+			if ((slots = strrchr(optsp->trace_file, ',')) != NULL) {
+				char *end;
+
+				*slots++ = '\0';
+				optsp->trace_slots = strtoull(slots, &end, 10);
+				if (*end || optsp->trace_slots < MIN_TRACE_SLOTS)
+					err_msg_die(EXIT_FAILOPT, "-e: need at least %d events", MIN_TRACE_SLOTS);
+			}
+			if (!*optsp->trace_file)
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+
+			av += 2; ac -= 2;
+			continue;
+		}
+
+		/* -M address of the metrics endpoint */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "M")) ) {
+			if (!av[FIRST_ARG_INDEX + 1])
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+
+			optsp->metrics_addr = xstrdup(av[FIRST_ARG_INDEX + 1]);
+			av += 2; ac -= 2;
+			continue;
+		}
+
+		/* -K softirq and cpu time of all cpus */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "K")) ) {
+			optsp->cpu_stat = true;
+			av++; ac--;
+			continue;
+		}
+
+		/* -i seconds: interval reports during the transfer */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "i")) ) {
+			double interval;
+			char *end;
+
+			if (!av[FIRST_ARG_INDEX + 1])
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+
+			interval = strtod(av[FIRST_ARG_INDEX + 1], &end);
+			if (*end || interval < 0.01 || interval > 86400) {
+				fprintf(stderr, "interval %s is not a number of seconds "
+						"between 0.01 and 86400\n", av[FIRST_ARG_INDEX + 1]);
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+			}
+
+			optsp->interval_ms = (int)(interval * 1000 + 0.5);
+
+			av += 2; ac -= 2;
+			continue;
+		}
+
 		/* -u write-function */
 		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "u")) ) {
 
@@ -966,6 +1225,98 @@ parse_opts(int ac, char *av[], struct opts *optsp)
 			continue;
 		}
 
+		/* -D digest: verify the transfer with a trailer digest */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "D")) ) {
+			int type;
+
+			if (!av[FIRST_ARG_INDEX + 1])
+				print_usage(NULL, HELP_STR_DIGEST, 1);
+
+			type = hash_str_to_type(av[FIRST_ARG_INDEX + 1]);
+			if (type <= HASH_NULL)
+				print_usage(NULL, HELP_STR_DIGEST, 1);
+
+			optsp->digest_type = type;
+			optsp->ext_hdr_mask |= HDR_MSK_DIGEST;
+
+			av += 2; ac -= 2;
+			continue;
+		}
+
+		/* -z compression: compress blocks of the rw engine */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "z")) ) {
+
+			if (!av[FIRST_ARG_INDEX + 1])
+				print_usage(NULL, HELP_STR_COMPRESS, 1);
+
+			if (!strcmp(av[FIRST_ARG_INDEX + 1], "auto"))
+				optsp->compress_mode = COMPRESS_AUTO;
+			else if (!strcmp(av[FIRST_ARG_INDEX + 1], "always"))
+				optsp->compress_mode = COMPRESS_ALWAYS;
+			else
+				print_usage(NULL, HELP_STR_COMPRESS, 1);
+
+			optsp->ext_hdr_mask |= HDR_MSK_COMPRESS;
+
+			av += 2; ac -= 2;
+			continue;
+		}
+
+		/* -R resume: transmitter requests, receiver allows resuming */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "R")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_RESUME;
+			av++; ac--;
+			continue;
+		}
+
+		/* -S sparse: don't transmit the holes of the input file */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "S")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_SPARSE;
+			av++; ac--;
+			continue;
+		}
+
+		/* -Z zero blocks: rw and mmap send zero blocks as holes */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "Z")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_ZERO;
+			av++; ac--;
+			continue;
+		}
+
+		/* -B size the socket buffers from the bandwidth delay product */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "B")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_BDP;
+			av++; ac--;
+			continue;
+		}
+
+		/* -x exchange the statistics with the receiver after the data */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "x")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_STATS;
+			av++; ac--;
+			continue;
+		}
+
+		/* -X delta: send only the differences to the receivers copy */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "X")) ) {
+			optsp->ext_hdr_mask |= HDR_MSK_DELTA;
+			av++; ac--;
+			continue;
+		}
+
+		/* -c packet pair and train probes */
+		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "c")) ) {
+			if (!av[FIRST_ARG_INDEX + 1]) {
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+			}
+
+			if (parse_pprobe_string(av[FIRST_ARG_INDEX + 1]) != SUCCESS)
+				print_usage(NULL, HELP_STR_GLOBAL, 1);
+
+			av += 2; ac -= 2;
+			continue;
+		}
+
 		/* -r rtt probe */
 		if ((!strcmp(&av[FIRST_ARG_INDEX][1], "r")) ) {
 			if (!av[FIRST_ARG_INDEX + 1]) {
@@ -1157,6 +1508,7 @@ parse_opts(int ac, char *av[], struct opts *optsp)
 			if (!strncasecmp(av[FIRST_ARG_INDEX + 1], "transmit", strlen(av[2]))) {
 				optsp->workmode = MODE_TRANSMIT;
 				ret = protocol_map[i].parse_proto(ac - 3, av + 3, optsp);
+				check_ext_hdr_opts(optsp);
 				if (dump_defaults) {
 					dump_opts(optsp);
 					protocol_map[i].dump_proto(optsp);
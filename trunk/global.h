@@ -26,6 +26,7 @@
 #include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <netdb.h>
 
 #include <sys/time.h>
@@ -34,11 +35,15 @@
 #include "config.h"
 #include "error.h"
 #ifdef HAVE_RDTSCLL
-# include <linux/timex.h>
-
+/* "=A" is edx:eax only on i386, on x86_64 it is one of rax or rdx.
+** linux/timex.h no longer exports rdtscll and clashes with the
+** libc struct timeval, so we bring our own. */
 # ifndef rdtscll
-#define rdtscll(val) \
-     __asm__ __volatile__("rdtsc" : "=A" (val))
+#define rdtscll(val) do { \
+	unsigned int __lo, __hi; \
+	__asm__ __volatile__("rdtsc" : "=a" (__lo), "=d" (__hi)); \
+	(val) = ((unsigned long long) __hi << 32) | __lo; \
+} while (0)
 # endif
 #endif /* HAVE_RDTSCLL */
 
@@ -70,6 +75,14 @@
 # define TCP_CONGESTION  13
 #endif
 
+#ifndef TCP_FASTOPEN
+# define TCP_FASTOPEN 23
+#endif
+
+#ifndef TCP_FASTOPEN_CONNECT
+# define TCP_FASTOPEN_CONNECT 30
+#endif
+
 #ifndef SOL_SCTP
 # define SOL_SCTP 132
 #endif
@@ -140,6 +153,7 @@
 #define	EXIT_FAILNET    4
 #define	EXIT_FAILHEADER 6
 #define	EXIT_FAILINT    7 /* INTernal error */
+#define	EXIT_FAILDIGEST 8 /* data digest mismatch */
 
 #define SUCCESS 0
 #define FAILURE -1
@@ -205,13 +219,23 @@ enum io_call {
 /* Centralize our statistic data */
 
 struct use_stat {
-	struct timeval time;
+	struct timeval time; /* CLOCK_MONOTONIC */
 	struct rusage  ru;
 #ifdef HAVE_RDTSCLL
 	long long      tsc;
 #endif
 };
 
+/* the counters of -E, see perf.c */
+enum perf_counter {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_CONTEXT_SWITCHES,
+	PERF_PAGE_FAULTS
+};
+#define	PERF_MAX (PERF_PAGE_FAULTS + 1)
+
 struct sock_stat {
 	/* tcp attributes */
 	uint16_t mss;
@@ -219,11 +243,84 @@ struct sock_stat {
 	/* ip attributes */
 };
 
+/* TCP_INFO as the reports use it, see interval.c */
+struct tcp_sample {
+	unsigned int cwnd, ssthresh; /* segments */
+	unsigned int srtt_us, rttvar_us, rto_us;
+	unsigned int snd_mss, rcv_mss, unacked;
+	unsigned int retransmits, total_retrans;
+	unsigned long long delivery_rate, pacing_rate; /* bytes/s */
+	/* since the connection started, in the interval samples
+	** the time of the interval */
+	unsigned long long busy_us, rwnd_limited_us, sndbuf_limited_us;
+	unsigned int notsent; /* bytes */
+};
+
+/* What the whole machine spent between two samples of
+** /proc/stat and /proc/softirqs (-K), see cpustat.c. Network
+** processing in softirq context - on other CPUs too - is not
+** part of our rusage. */
+#define	CPU_NET_MAX 8
+struct cpu_delta {
+	bool ok;
+	double softirq_sec, irq_sec, system_sec; /* all cpus */
+	unsigned long long net_rx, net_tx; /* softirqs raised */
+	/* the cpus which did network work, most softirq time first */
+	unsigned int cpus_no; /* all of them, at most CPU_NET_MAX listed */
+	struct cpu_net {
+		int cpu;
+		double softirq_sec, system_sec;
+		unsigned long long net_rx, net_tx;
+	} cpus[CPU_NET_MAX];
+};
+
+/* one interval of -i */
+struct interval_sample {
+	double from, to; /* seconds since the transfer started */
+	unsigned long long bytes, calls;
+	double utime, stime;
+	bool tcp_ok;
+	struct tcp_sample tcp;
+	struct cpu_delta cpu; /* -K */
+};
+
+/* the steps up to the data, see phase_mark() */
+enum phase {
+	PHASE_START = 0, /* options parsed */
+	PHASE_RESOLVED, /* name resolved (tx), socket bound and listening (rx) */
+	PHASE_CONNECTED, /* connect() (tx) or accept() (rx) returned */
+	PHASE_HEADERS, /* header and extension headers exchanged */
+	PHASE_PROBED, /* rtt, bdp and pair probes done (tx, if any) */
+	PHASE_FIRST_BYTE, /* first data byte written (tx) or read (rx) */
+	PHASE_LAST_BYTE, /* the engine returned */
+	PHASE_MAX
+};
+
 struct net_stat {
 	struct rtt_probe {
 		double usec;
 		double variance;
+		/* per probe in microseconds: CLOCK_MONOTONIC_RAW around
+		** the syscalls and kernel software timestamps (0 if the
+		** kernel gave us none) */
+		double app_avg_us, app_min_us, app_p50_us, app_p99_us, app_max_us;
+		double kernel_avg_us, kernel_min_us, kernel_p50_us, kernel_p99_us, kernel_max_us;
+		unsigned int sent, lost;
+#define	RTT_HIST_BUCKETS 24
+		unsigned int hist[RTT_HIST_BUCKETS]; /* application rtt, [2^n, 2^(n+1)) us */
 	} rtt_probe;
+	/* packet pairs and trains (-c), bits/s */
+	struct pprobe_stat {
+		double capacity;
+		double adr; /* asymptotic dispersion rate of the trains */
+		unsigned int pairs, trains; /* usable ones */
+	} pprobe;
+	/* buffer sizing (-B), 0 if not done */
+	struct bdp_stat {
+		double rate; /* bytes/s */
+		unsigned long long bdp; /* bytes */
+		int sndbuf, rcvbuf, clamp; /* ours and of the peer */
+	} bdp;
 	struct sock_stat sock_stat;
 
 	unsigned int total_rx_calls;
@@ -232,8 +329,44 @@ struct net_stat {
 	unsigned int total_tx_calls;
 	unsigned long long total_tx_bytes;
 
+	/* the connection at the end of the transfer (tcp only) */
+	struct tcp_sample tcp_end;
+	bool tcp_end_ok;
+
+	/* bytes moved by the socket calls so far - the engines fix
+	** up total_tx_bytes after the transfer, the interval sampler
+	** (-i) needs them as they go */
+	unsigned long long io_bytes;
+
 	struct use_stat use_stat_start;
 	struct use_stat use_stat_end;
+
+	/* counted in user and kernel mode from the start to
+	** the end of the transfer (-E) */
+	struct perf_stat {
+		unsigned long long user[PERF_MAX], kernel[PERF_MAX];
+		/* 1 << enum perf_counter, an unprivileged user may
+		** only count its own mode (perf_event_paranoid 2) */
+		unsigned int user_valid, kernel_valid;
+	} perf;
+
+	/* softirq and cpu time of all cpus during the transfer (-K) */
+	struct cpu_delta cpu_stat;
+
+	/* the counters of the other side, exchanged after
+	** the data (tcp), see ns_nxt_stats */
+	struct peer_stat {
+		bool valid;
+		bool transmit; /* the peer sent the data */
+		int io_call; /* enum io_call of a transmitting peer */
+		unsigned long long bytes;
+		unsigned int calls;
+		double real_sec, utime_sec, stime_sec;
+		double rtt_us; /* average of its -r probes, 0 without */
+	} peer;
+
+	/* CLOCK_MONOTONIC (ns) when a phase was reached, 0 if never */
+	unsigned long long phase_ns[PHASE_MAX];
 };
 
 /* this struct collect all information
@@ -242,6 +375,21 @@ struct net_stat {
  * ... */
 struct peer_header_info {
 	unsigned int data_size; /* < the size of the incoming data */
+	int digest_type; /* < enum hash_type, HASH_NULL if no trailer digest */
+	unsigned int digest_len;
+	int compress_algo; /* < enum ns_cmpr_algo, NS_CMPR_NONE if not framed */
+	unsigned int compress_block;
+	int resumed; /* < peer committed a resume offset */
+	unsigned long long resume_have; /* < bytes we offered to resume from */
+	unsigned long long resume_offset;
+	int delta; /* < peer sends delta ops */
+	unsigned int delta_block; /* < block size we offered */
+	unsigned int delta_blocks; /* < number of blocks we offered */
+	unsigned long long delta_old_size;
+	int sparse; /* < data stream is extent framed */
+	int tree; /* < data stream is a directory tree */
+	int stats; /* < peer sends its statistics after the data */
+	unsigned int chunk; /* < peer writes in chunks of this size, 0 if unknown */
 };
 
 /* Command-line options */
@@ -264,6 +412,16 @@ struct sock_callbacks {
 
 #define	HDR_MSK_SOCKOPT (1 << 0)
 #define HDR_MSK_DIGEST  (1 << 1)
+#define HDR_MSK_COMPRESS (1 << 2)
+#define HDR_MSK_RESUME  (1 << 3)
+#define HDR_MSK_DELTA   (1 << 4)
+#define HDR_MSK_SPARSE  (1 << 5)
+#define HDR_MSK_ZERO    (1 << 6)
+#define HDR_MSK_TREE    (1 << 7) /* set for a directory input */
+#define HDR_MSK_BDP     (1 << 8)
+#define HDR_MSK_STATS   (1 << 9) /* statistics exchange after the data (tcp) */
+
+enum compress_mode { COMPRESS_OFF = 0, COMPRESS_AUTO, COMPRESS_ALWAYS };
 
 /* bitmask set for short_opts_mask */
 #define	SOPTS_VERSION      (1 << 1)
@@ -296,12 +454,15 @@ struct opts {
 	int change_mem_advise;
 
 	long ext_hdr_mask;
+	int digest_type; /* enum hash_type, valid if HDR_MSK_DIGEST is set */
+	int compress_mode; /* enum compress_mode, valid if HDR_MSK_COMPRESS is set */
 
 	long threads; /* < number of threads to parallelize transmit stream */
 
 	int  verbose;
 	int  statistics;
 	int  machine_parseable;
+	int  json_report; /* -T json */
 	int  stat_unit;
 	int  stat_prefix;
 	char *me;
@@ -332,8 +493,14 @@ struct opts {
 
 	bool tcp_use_md5sig;
 	const char *tcp_md5sig_peeraddr; /* receive mode: need ip addr of peer allowed to connect */
+	bool tcp_fastopen; /* -F: the first header goes with the syn */
 
+#define	DEFAULT_RTT_ITERATIONS 10
+#define	DEFAULT_RTT_DATA_SIZE 500
 #define	DEFAULT_RTT_FILTER 4
+#define	DEFAULT_RTT_INFLIGHT 1
+#define	DEFAULT_RTT_TIMEOUT_MS 1000
+#define	MAX_RTT_ITERATIONS 100000
 
 	/* this stores option for the rtt probe commandline option '-R' */
 	struct rtt_probe_opt {
@@ -341,8 +508,34 @@ struct opts {
 		int data_size;
 		int deviation_filter;
 		int force_ms;
+		int inflight; /* probes in the wire at a time */
+		int timeout_ms; /* a datagram probe is lost after */
 	} rtt_probe_opt;
 	int perform_rtt_probe;
+
+	int interval_ms; /* -i, 0 if no interval reports */
+	bool latency_hist; /* -L, see latency.h */
+	bool perf_counters; /* -E, see perf.c */
+	bool cpu_stat; /* -K, see cpustat.c */
+	char *metrics_addr; /* -M, see metrics.c */
+	char *trace_file; /* -e, see trace.h */
+	unsigned long long trace_slots;
+
+#define	DEFAULT_PPROBE_PAIRS 20
+#define	DEFAULT_PPROBE_TRAINS 5
+#define	DEFAULT_PPROBE_TRAIN_LEN 16
+#define	DEFAULT_PPROBE_SIZE 1400
+#define	MIN_PPROBE_SIZE 24 /* struct ns_pprobe */
+#define	MAX_PPROBE_GROUPS 4096
+#define	MAX_PPROBE_TRAIN_LEN 256
+
+	/* packet pair and train probes, commandline option '-c' */
+	struct pprobe_opt {
+		int pairs;
+		int trains;
+		int train_len;
+		int size; /* datagram, octets */
+	} pprobe_opt;
 };
 
 /*** Interface ***/
@@ -353,6 +546,63 @@ enum where_send {
 };
 
 
+/* Counters of the io loops which the interval sampler reads
+** while they change. There is one writer, so a relaxed load and
+** store is enough: no locked instruction in the hot path. */
+#define	STAT_ADD(var, val) \
+	__atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (val), \
+			__ATOMIC_RELAXED)
+#define	STAT_READ(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* analyze.c */
+void phase_mark(enum phase);
+
+/* the callers see net_stat, after the first byte a predicted branch */
+#define	PHASE_FIRST_BYTE_MARK(done) \
+	do { if (unlikely(!net_stat.phase_ns[PHASE_FIRST_BYTE]) && (done) > 0) \
+		phase_mark(PHASE_FIRST_BYTE); } while (0)
+
+/* interval.c */
+void interval_tcp_fd(int);
+void interval_start(void);
+void interval_stop(void);
+const struct interval_sample *interval_samples(unsigned int *);
+bool interval_last(struct interval_sample *);
+bool interval_tcp_now(struct tcp_sample *);
+
+/* metrics.c */
+void metrics_start(void);
+void metrics_stop(void);
+void metrics_transfer(enum where_send);
+
+/* perf.c */
+void perf_start(void);
+void perf_stop(void);
+const char *perf_counter_name(enum perf_counter);
+
+/* cpustat.c */
+struct cpu_snap;
+struct cpu_snap *cpu_snap_new(void);
+void cpu_snap_free(struct cpu_snap *);
+bool cpu_snap_take(struct cpu_snap *);
+void cpu_snap_diff(const struct cpu_snap *, const struct cpu_snap *, struct cpu_delta *);
+void cpu_stat_start(void);
+void cpu_stat_stop(void);
+
+
+/* gettimeofday() jumps with the wall clock (ntp, date -s) */
+static inline void
+use_stat_time(struct timeval *tv)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err_sys("Failure in clock_gettime()");
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+
 /* Gcc is smart enough to realize that argument 'where' is static
 ** at compile time and reorder the branch - this is tested!
 ** Through this optimization our rdtscll call is closer
@@ -364,21 +614,28 @@ touch_use_stat(enum where_send where, struct use_stat *use_stat)
 {
 
 	if (where == TOUCH_BEFORE_OP) {
+		cpu_stat_start();
 		if (getrusage(RUSAGE_SELF, &use_stat->ru) < 0)
 			err_sys("Failure in getrusage()");
-		if (gettimeofday(&use_stat->time, NULL) < 0)
-			err_sys("Failure in gettimeofday()");
+		use_stat_time(&use_stat->time);
 #ifdef HAVE_RDTSCLL
 		rdtscll(use_stat->tsc);
 #endif
+		metrics_transfer(where);
+		interval_start();
+		perf_start();
 	} else { /* TOUCH_AFTER_OP */
+		perf_stop();
+		interval_stop();
+		metrics_transfer(where);
 #ifdef HAVE_RDTSCLL
 		rdtscll(use_stat->tsc);
 #endif
-		if (gettimeofday(&use_stat->time, NULL) < 0)
-			err_sys("Failure in gettimeofday()");
+		use_stat_time(&use_stat->time);
+		phase_mark(PHASE_LAST_BYTE);
 		if (getrusage(RUSAGE_SELF, &use_stat->ru) < 0)
 			err_sys("Failure in getrusage()");
+		cpu_stat_stop();
 	}
 	return;
 };
@@ -388,6 +645,7 @@ touch_use_stat(enum where_send where, struct use_stat *use_stat)
 /* file.c */
 int open_input_file(void);
 int open_output_file(void);
+void truncate_output_file(int, off_t);
 
 /* getopt.c */
 void usage(void);
@@ -397,10 +655,20 @@ int parse_opts(int, char **, struct opts *);
 int get_sock_opts(int, struct net_stat *);
 int set_nodelay(int, int);
 void set_socketopts(int fd);
+int connect_candidates(const struct addrinfo *);
+int connect_race(const struct addrinfo *, void (*)(int, const struct addrinfo *));
+void tcp_fastopen_check(bool);
+void tcp_fastopen_report(int);
 
 /* ns_hdr.c */
 int meta_exchange_snd(int, int);
-int meta_exchange_rcv(int, struct peer_header_info **);
+int meta_exchange_rcv(int, int, struct peer_header_info **);
+size_t meta_trailer_len(const struct peer_header_info *);
+void meta_digest_snd(int);
+int meta_trailer_check(const struct peer_header_info *, const void *, size_t);
+void meta_trailer_verify(const struct peer_header_info *, const void *, size_t);
+void meta_stats_snd(int);
+void meta_stats_reply(int);
 
 /* receive.c */
 void receive_mode(void);
@@ -0,0 +1,483 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+
+#if defined(HAVE_SSE42_CRC32C) || defined(HAVE_SHA_NI)
+# include <cpuid.h>
+# include <immintrin.h>
+#endif
+
+#include "global.h"
+#include "hash.h"
+
+/* CPU feature probing. Both hardware paths are compiled
+** in when the compiler supports them (see configure) but
+** only used if the CPU we run on has the instructions.
+*/
+#define	CPU_UNKNOWN 0
+#define	CPU_HAVE    1
+#define	CPU_MISSING 2
+
+#ifdef HAVE_SSE42_CRC32C
+static int cpu_sse42 = CPU_UNKNOWN;
+
+static bool have_sse42(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (likely(cpu_sse42 != CPU_UNKNOWN))
+		return cpu_sse42 == CPU_HAVE;
+
+	cpu_sse42 = CPU_MISSING;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2))
+		cpu_sse42 = CPU_HAVE;
+
+	return cpu_sse42 == CPU_HAVE;
+}
+#endif
+
+#ifdef HAVE_SHA_NI
+static int cpu_sha = CPU_UNKNOWN;
+
+static bool have_sha_ni(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (likely(cpu_sha != CPU_UNKNOWN))
+		return cpu_sha == CPU_HAVE;
+
+	cpu_sha = CPU_MISSING;
+	/* SHA extensions: CPUID.(EAX=07H, ECX=0):EBX.SHA[bit 29],
+	** SSE4.1 is needed for the blend/shuffle helpers */
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 29)) &&
+		__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1))
+		cpu_sha = CPU_HAVE;
+
+	return cpu_sha == CPU_HAVE;
+}
+#endif
+
+
+/*** CRC32C (Castagnoli) ***/
+
+#define	CRC32C_POLY 0x82f63b78 /* reversed 0x1EDC6F41 */
+
+static uint32_t crc32c_table[8][256];
+static bool crc32c_table_ready;
+
+static void crc32c_init_table(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+	crc32c_table_ready = true;
+}
+
+/* slicing-by-8, used if there is no SSE4.2 */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	if (unlikely(!crc32c_table_ready))
+		crc32c_init_table();
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef HAVE_SSE42_CRC32C
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+
+	return (uint32_t)crc64;
+}
+#endif
+
+/* crc is the value returned by a former call (or 0 for the
+** first chunk) - pre and post inversion is done here
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc = ~crc;
+#ifdef HAVE_SSE42_CRC32C
+	if (have_sse42())
+		return ~crc32c_hw(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+
+/*** SHA-256 (FIPS 180-4) ***/
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define	ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_sw(uint32_t state[8], const unsigned char *p, size_t blocks)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+				(uint32_t)p[i * 4 + 2] << 8 | (uint32_t)p[i * 4 + 3];
+		for (i = 16; i < 64; i++) {
+			uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+				((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+				((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+
+		p += 64;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+/* Intel SHA extensions: two rounds per sha256rnds2, message
+** schedule via sha256msg1/sha256msg2. The state is kept in
+** the ABEF/CDGH register layout the instructions expect.
+*/
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(uint32_t state[8], const unsigned char *p, size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg, abef_save, cdgh_save;
+	__m128i w[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);            /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);      /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);      /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);   /* CDGH */
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				msg = _mm_loadu_si128((const __m128i *)(p + i * 16));
+				w[i] = _mm_shuffle_epi8(msg, mask);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *)&sha256_k[i * 4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+
+		p += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);         /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);      /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);   /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);      /* ABEF */
+
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static void sha256_blocks(uint32_t state[8], const unsigned char *p, size_t blocks)
+{
+#ifdef HAVE_SHA_NI
+	if (have_sha_ni()) {
+		sha256_blocks_ni(state, p, blocks);
+		return;
+	}
+#endif
+	sha256_blocks_sw(state, p, blocks);
+}
+
+static void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->count = 0;
+	ctx->buf_len = 0;
+}
+
+static void sha256_update(struct sha256_ctx *ctx, const unsigned char *p, size_t len)
+{
+	ctx->count += len;
+
+	if (ctx->buf_len) {
+		size_t fill = min(sizeof(ctx->buf) - ctx->buf_len, len);
+
+		memcpy(ctx->buf + ctx->buf_len, p, fill);
+		ctx->buf_len += fill;
+		p += fill;
+		len -= fill;
+		if (ctx->buf_len < sizeof(ctx->buf))
+			return;
+		sha256_blocks(ctx->state, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+	if (len >= 64) {
+		sha256_blocks(ctx->state, p, len / 64);
+		p += len & ~((size_t)63);
+		len &= 63;
+	}
+	if (len) {
+		memcpy(ctx->buf, p, len);
+		ctx->buf_len = len;
+	}
+}
+
+static void sha256_final(struct sha256_ctx *ctx, unsigned char *out)
+{
+	uint64_t bits = ctx->count * 8;
+	int i;
+
+	ctx->buf[ctx->buf_len++] = 0x80;
+	if (ctx->buf_len > 56) {
+		memset(ctx->buf + ctx->buf_len, 0, 64 - ctx->buf_len);
+		sha256_blocks(ctx->state, ctx->buf, 1);
+		ctx->buf_len = 0;
+	}
+	memset(ctx->buf + ctx->buf_len, 0, 56 - ctx->buf_len);
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+	sha256_blocks(ctx->state, ctx->buf, 1);
+
+	for (i = 0; i < 8; i++) {
+		out[i * 4]     = (unsigned char)(ctx->state[i] >> 24);
+		out[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+		out[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+		out[i * 4 + 3] = (unsigned char)(ctx->state[i]);
+	}
+}
+
+
+/*** generic interface ***/
+
+static const struct {
+	enum hash_type type;
+	const char *name;
+	size_t len;
+} hash_map[] = {
+	{ HASH_NULL,   "null",   0 },
+	{ HASH_SHA256, "sha256", 32 },
+	{ HASH_CRC32C, "crc32c", 4 },
+};
+
+
+size_t hash_len(enum hash_type type)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(hash_map); i++)
+		if (hash_map[i].type == type)
+			return hash_map[i].len;
+	return 0;
+}
+
+
+const char *hash_type_to_str(enum hash_type type)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(hash_map); i++)
+		if (hash_map[i].type == type)
+			return hash_map[i].name;
+	return "unknown";
+}
+
+
+/* return -1 for unknown or not implemented algorithms */
+int hash_str_to_type(const char *str)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(hash_map); i++)
+		if (!strcasecmp(hash_map[i].name, str))
+			return hash_map[i].type;
+	return -1;
+}
+
+
+/* which implementation does the work on this box */
+const char *hash_impl_str(enum hash_type type)
+{
+	switch (type) {
+	case HASH_CRC32C:
+#ifdef HAVE_SSE42_CRC32C
+		if (have_sse42())
+			return "sse4.2";
+#endif
+		return "generic";
+	case HASH_SHA256:
+#ifdef HAVE_SHA_NI
+		if (have_sha_ni())
+			return "sha-ni";
+#endif
+		return "generic";
+	default:
+		return "none";
+	}
+}
+
+
+void hash_init(struct hash_ctx *ctx, enum hash_type type)
+{
+	ctx->type = type;
+
+	switch (type) {
+	case HASH_CRC32C:
+		ctx->crc = 0;
+		break;
+	case HASH_SHA256:
+		sha256_init(&ctx->sha256);
+		break;
+	default:
+		break;
+	}
+}
+
+
+void hash_update(struct hash_ctx *ctx, const void *buf, size_t len)
+{
+	switch (ctx->type) {
+	case HASH_CRC32C:
+		ctx->crc = crc32c(ctx->crc, buf, len);
+		break;
+	case HASH_SHA256:
+		sha256_update(&ctx->sha256, buf, len);
+		break;
+	default:
+		break;
+	}
+}
+
+
+/* out must hold at least hash_len(ctx->type) bytes,
+** values are stored in network byte order */
+void hash_final(struct hash_ctx *ctx, unsigned char *out)
+{
+	switch (ctx->type) {
+	case HASH_CRC32C:
+		out[0] = (unsigned char)(ctx->crc >> 24);
+		out[1] = (unsigned char)(ctx->crc >> 16);
+		out[2] = (unsigned char)(ctx->crc >> 8);
+		out[3] = (unsigned char)(ctx->crc);
+		break;
+	case HASH_SHA256:
+		sha256_final(&ctx->sha256, out);
+		break;
+	default:
+		break;
+	}
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
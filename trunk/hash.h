@@ -0,0 +1,46 @@
+#ifndef NETSEND_HASH_H_INCLUDE_
+#define NETSEND_HASH_H_INCLUDE_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* digest algorithms - the numeric values are used on the
+** wire (see struct ns_nxt_digest in ns_hdr.h), so don't reorder
+*/
+enum hash_type {
+	HASH_NULL = 0,
+	HASH_SHA1,    /* not implemented */
+	HASH_SHA256,
+	HASH_SHA512,  /* not implemented */
+	HASH_CRC32C
+};
+
+#define	HASH_MAX_LEN 32
+
+struct sha256_ctx {
+	uint32_t state[8];
+	uint64_t count; /* bytes processed */
+	unsigned char buf[64];
+	unsigned int buf_len;
+};
+
+struct hash_ctx {
+	enum hash_type type;
+	union {
+		uint32_t crc;
+		struct sha256_ctx sha256;
+	};
+};
+
+size_t hash_len(enum hash_type);
+const char *hash_type_to_str(enum hash_type);
+int hash_str_to_type(const char *);
+const char *hash_impl_str(enum hash_type);
+
+void hash_init(struct hash_ctx *, enum hash_type);
+void hash_update(struct hash_ctx *, const void *, size_t);
+void hash_final(struct hash_ctx *, unsigned char *);
+
+uint32_t crc32c(uint32_t crc, const void *, size_t);
+
+#endif /* NETSEND_HASH_H_INCLUDE_ */
@@ -0,0 +1,434 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "global.h"
+#include "xfuncs.h"
+
+/* the kernel struct tcp_info, the one of glibc ends before
+** the rates and limits */
+#ifdef HAVE_TCP_INFO_RATES
+# include <linux/tcp.h>
+#else
+# define __USE_MISC 1
+# include <netinet/tcp.h>
+#endif
+
+extern struct opts opts;
+extern struct net_stat net_stat;
+
+/* The sampler thread wakes up every opts.interval_ms and
+** prints what happened since its last wake up. The engines
+** know nothing about it: they count their socket calls and
+** bytes with STAT_ADD() (no locked instruction, no syscall)
+** and the sampler reads the counters with STAT_READ().
+** A tcp connection gets a TCP_INFO sample every interval too,
+** with -K the softirq time of all cpus.
+** With -T json the samples are kept for the report instead.
+*/
+struct interval_point {
+	struct timespec time;
+	struct rusage ru;
+	unsigned long long bytes;
+	unsigned long long calls;
+	bool tcp_ok;
+	struct tcp_sample tcp;
+	struct cpu_snap *cpu; /* NULL without -K */
+};
+
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup; /* interval_stop() -> sampler */
+	bool running;
+	bool stop;
+	int tcp_fd; /* -1 if not tcp */
+	struct interval_point first; /* taken before the engine starts */
+	struct interval_sample *samples; /* -T json */
+	unsigned int samples_no, samples_max;
+	struct interval_sample last; /* for the metrics (-M) */
+	bool last_ok;
+} sampler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.tcp_fd = -1,
+};
+
+
+static double
+tv_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+
+static double
+ts_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
+}
+
+
+/* an older kernel fills less of struct tcp_info, the rest stays zero */
+static bool
+tcp_sample_take(int fd, struct tcp_sample *ts)
+{
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0)
+		return false;
+
+	memset(ts, 0, sizeof(*ts));
+	ts->cwnd = ti.tcpi_snd_cwnd;
+	ts->ssthresh = ti.tcpi_snd_ssthresh;
+	ts->srtt_us = ti.tcpi_rtt;
+	ts->rttvar_us = ti.tcpi_rttvar;
+	ts->rto_us = ti.tcpi_rto;
+	ts->snd_mss = ti.tcpi_snd_mss;
+	ts->rcv_mss = ti.tcpi_rcv_mss;
+	ts->unacked = ti.tcpi_unacked;
+	ts->retransmits = ti.tcpi_retransmits;
+	ts->total_retrans = ti.tcpi_total_retrans;
+#ifdef HAVE_TCP_INFO_RATES
+	ts->delivery_rate = ti.tcpi_delivery_rate;
+	ts->pacing_rate = ti.tcpi_pacing_rate;
+	ts->busy_us = ti.tcpi_busy_time;
+	ts->rwnd_limited_us = ti.tcpi_rwnd_limited;
+	ts->sndbuf_limited_us = ti.tcpi_sndbuf_limited;
+	ts->notsent = ti.tcpi_notsent_bytes;
+#endif
+
+	return true;
+}
+
+
+static void
+interval_point_take(struct interval_point *p)
+{
+	clock_gettime(CLOCK_MONOTONIC, &p->time);
+	if (getrusage(RUSAGE_SELF, &p->ru) < 0)
+		err_sys("Failure in getrusage()");
+
+	p->bytes = STAT_READ(net_stat.io_bytes);
+	p->calls = opts.workmode == MODE_TRANSMIT ?
+		STAT_READ(net_stat.total_tx_calls) : STAT_READ(net_stat.total_rx_calls);
+
+	p->tcp_ok = sampler.tcp_fd >= 0 && tcp_sample_take(sampler.tcp_fd, &p->tcp);
+
+	if (p->cpu)
+		cpu_snap_take(p->cpu);
+}
+
+
+/* The window state at the end of the interval and how it was
+** spent: busy is the time with data in flight, limited by the
+** receive window (rwnd) or our send buffer (sndbuf) - a share of
+** the busy time. A cwnd problem is busy but neither limited.
+**
+** human:   tcp cwnd 10 ssthresh 7 srtt 52 rttvar 12 us delivery 1.20 pacing 2.40 Gbit/s
+**              retrans 0 (+0) busy 98.1% rwnd 0.0% sndbuf 2.0% notsent 1234
+** machine: <version> <tx|rx> tcpinfo <to> <cwnd> <ssthresh> <srtt us> <rttvar us>
+**          <delivery bytes/s> <pacing bytes/s> <total_retrans> <busy us> <rwnd us>
+**          <sndbuf us> <notsent bytes>
+** The us of busy, rwnd and sndbuf are those of the interval.
+*/
+static void
+interval_tcp_print(const struct interval_sample *is, unsigned int retrans)
+{
+	const struct tcp_sample *t = &is->tcp;
+	double span = is->to - is->from;
+
+	if (opts.machine_parseable) {
+		fprintf(stderr, "%s %s tcpinfo %.4f %u %u %u %u %llu %llu %u %llu %llu %llu %u\n",
+				VERSIONSTRING, opts.workmode == MODE_TRANSMIT ? "tx" : "rx",
+				is->to, t->cwnd, t->ssthresh, t->srtt_us, t->rttvar_us,
+				t->delivery_rate, t->pacing_rate, t->total_retrans,
+				t->busy_us, t->rwnd_limited_us, t->sndbuf_limited_us, t->notsent);
+		return;
+	}
+
+	fprintf(stderr, "    tcp cwnd %u ssthresh %u srtt %u rttvar %u us delivery %.2f "
+			"pacing %.2f Gbit/s retrans %u (+%u) busy %.1f%% rwnd %.1f%% sndbuf %.1f%% "
+			"notsent %u\n", t->cwnd, t->ssthresh, t->srtt_us, t->rttvar_us,
+			t->delivery_rate * 8 / 1e9, t->pacing_rate * 8 / 1e9,
+			t->total_retrans, retrans, t->busy_us / (span * 1e4),
+			t->busy_us ? t->rwnd_limited_us * 100.0 / t->busy_us : 0.0,
+			t->busy_us ? t->sndbuf_limited_us * 100.0 / t->busy_us : 0.0, t->notsent);
+}
+
+
+/* human:   softirq 0.020 s irq 0.000 s NET_RX 1234 NET_TX 5 on cpu2 cpu0
+** machine: <version> <tx|rx> softirq <to> <softirq s> <irq s> <NET_RX> <NET_TX> <cpu,cpu|->
+** The softirq and irq time is that of all cpus.
+*/
+static void
+interval_cpu_print(const struct interval_sample *is)
+{
+	const struct cpu_delta *cd = &is->cpu;
+	unsigned int i;
+
+	if (opts.machine_parseable) {
+		fprintf(stderr, "%s %s softirq %.4f %.3f %.3f %llu %llu ",
+				VERSIONSTRING, opts.workmode == MODE_TRANSMIT ? "tx" : "rx",
+				is->to, cd->softirq_sec, cd->irq_sec, cd->net_rx, cd->net_tx);
+		for (i = 0; i < min(cd->cpus_no, (unsigned int) CPU_NET_MAX); i++)
+			fprintf(stderr, "%s%d", i ? "," : "", cd->cpus[i].cpu);
+		fputs(cd->cpus_no ? "\n" : "-\n", stderr);
+		return;
+	}
+
+	fprintf(stderr, "    softirq %.3f s irq %.3f s NET_RX %llu NET_TX %llu",
+			cd->softirq_sec, cd->irq_sec, cd->net_rx, cd->net_tx);
+	for (i = 0; i < min(cd->cpus_no, (unsigned int) CPU_NET_MAX); i++)
+		fprintf(stderr, "%s cpu%d", i ? "" : " on", cd->cpus[i].cpu);
+	fputc('\n', stderr);
+}
+
+
+static void
+interval_keep(const struct interval_sample *is)
+{
+	if (sampler.samples_no == sampler.samples_max) {
+		sampler.samples_max = sampler.samples_max ? sampler.samples_max * 2 : 64;
+		sampler.samples = xrealloc(sampler.samples,
+				sampler.samples_max * sizeof(*sampler.samples));
+	}
+
+	sampler.samples[sampler.samples_no++] = *is;
+}
+
+
+/* human:   [  2.00 -   3.00 s]  117.19 MiB  1500 calls  983.04 Mbit/s  cpu 42.1%
+** machine: <version> <tx|rx> interval <from> <to> <bytes> <calls> <bytes/s> <utime> <stime>
+*/
+static void
+interval_print(const struct interval_point *prev, const struct interval_point *now)
+{
+	struct interval_sample is;
+	double span, rate;
+
+	memset(&is, 0, sizeof(is));
+	is.from = ts_sec(&prev->time) - ts_sec(&sampler.first.time);
+	is.to = ts_sec(&now->time) - ts_sec(&sampler.first.time);
+	is.utime = tv_sec(&now->ru.ru_utime) - tv_sec(&prev->ru.ru_utime);
+	is.stime = tv_sec(&now->ru.ru_stime) - tv_sec(&prev->ru.ru_stime);
+	is.bytes = now->bytes - prev->bytes;
+	is.calls = now->calls - prev->calls;
+
+	span = is.to - is.from;
+	if (span <= 0.0)
+		return;
+	rate = is.bytes / span;
+
+	/* the busy and limited times of this interval */
+	is.tcp_ok = prev->tcp_ok && now->tcp_ok;
+	if (is.tcp_ok) {
+		is.tcp = now->tcp;
+		is.tcp.busy_us -= prev->tcp.busy_us;
+		is.tcp.rwnd_limited_us -= prev->tcp.rwnd_limited_us;
+		is.tcp.sndbuf_limited_us -= prev->tcp.sndbuf_limited_us;
+	}
+
+	if (prev->cpu && now->cpu)
+		cpu_snap_diff(prev->cpu, now->cpu, &is.cpu);
+
+	/* the sampler thread holds sampler.lock */
+	sampler.last = is;
+	sampler.last_ok = true;
+
+	if (opts.json_report) {
+		interval_keep(&is);
+		return;
+	}
+
+	if (opts.machine_parseable)
+		fprintf(stderr, "%s %s interval %.4f %.4f %llu %llu %.0f %.4f %.4f\n",
+				VERSIONSTRING, opts.workmode == MODE_TRANSMIT ? "tx" : "rx",
+				is.from, is.to, is.bytes, is.calls, rate, is.utime, is.stime);
+	else
+		fprintf(stderr, "[%7.2f - %7.2f s] %10.2f MiB %8llu calls %10.2f Mbit/s  cpu %5.1f%%\n",
+				is.from, is.to, is.bytes / 1048576.0, is.calls, rate * 8 / 1000000,
+				(is.utime + is.stime) / span * 100);
+
+	if (is.tcp_ok)
+		interval_tcp_print(&is, now->tcp.total_retrans - prev->tcp.total_retrans);
+	if (is.cpu.ok)
+		interval_cpu_print(&is);
+	fflush(stderr);
+}
+
+
+static void *
+interval_thread(void *arg __attribute__((unused)))
+{
+	struct interval_point prev = sampler.first, now;
+	struct cpu_snap *cpu_spare;
+	struct timespec next;
+	int ret;
+
+	/* prev and now swap their /proc snapshots */
+	now.cpu = prev.cpu ? cpu_snap_new() : NULL;
+
+	/* CLOCK_REALTIME for pthread_cond_timedwait(), the intervals
+	** themselves are measured with CLOCK_MONOTONIC */
+	clock_gettime(CLOCK_REALTIME, &next);
+
+	pthread_mutex_lock(&sampler.lock);
+	for (;;) {
+		next.tv_nsec += (opts.interval_ms % 1000) * 1000000L;
+		next.tv_sec += opts.interval_ms / 1000 + next.tv_nsec / 1000000000L;
+		next.tv_nsec %= 1000000000L;
+
+		do {
+			ret = pthread_cond_timedwait(&sampler.wakeup, &sampler.lock, &next);
+		} while (!sampler.stop && ret != ETIMEDOUT);
+
+		/* after a stop the last, usually shorter, interval */
+		interval_point_take(&now);
+		interval_print(&prev, &now);
+		cpu_spare = prev.cpu;
+		prev = now;
+		now.cpu = cpu_spare;
+
+		if (sampler.stop)
+			break;
+	}
+	pthread_mutex_unlock(&sampler.lock);
+
+	cpu_snap_free(prev.cpu);
+	cpu_snap_free(now.cpu);
+	sampler.first.cpu = NULL;
+
+	return NULL;
+}
+
+
+/* the connection to sample TCP_INFO from */
+void
+interval_tcp_fd(int fd)
+{
+	__atomic_store_n(&sampler.tcp_fd, fd, __ATOMIC_RELAXED);
+}
+
+
+/* called from touch_use_stat() around the transfer */
+void
+interval_start(void)
+{
+	int ret;
+
+	if (!opts.interval_ms || sampler.running)
+		return;
+
+	pthread_cond_init(&sampler.wakeup, NULL);
+	sampler.stop = false;
+	sampler.first.cpu = opts.cpu_stat ? cpu_snap_new() : NULL;
+	interval_point_take(&sampler.first);
+
+	ret = pthread_create(&sampler.thread, NULL, interval_thread, NULL);
+	if (ret) {
+		errno = ret;
+		err_sys("Can't start interval sampler thread");
+		cpu_snap_free(sampler.first.cpu);
+		sampler.first.cpu = NULL;
+		return;
+	}
+
+	sampler.running = true;
+}
+
+
+void
+interval_stop(void)
+{
+	/* the end state of the connection for the reports */
+	if (sampler.tcp_fd >= 0)
+		net_stat.tcp_end_ok = tcp_sample_take(sampler.tcp_fd, &net_stat.tcp_end);
+
+	if (sampler.running) {
+		pthread_mutex_lock(&sampler.lock);
+		sampler.stop = true;
+		pthread_cond_signal(&sampler.wakeup);
+		pthread_mutex_unlock(&sampler.lock);
+
+		pthread_join(sampler.thread, NULL);
+		pthread_cond_destroy(&sampler.wakeup);
+		sampler.running = false;
+	}
+
+	/* after the last interval, the engine closes the socket next:
+	** a scrape in interval_tcp_now() is done or sees -1 */
+	pthread_mutex_lock(&sampler.lock);
+	__atomic_store_n(&sampler.tcp_fd, -1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&sampler.lock);
+}
+
+
+/* the latest interval, for the metrics thread (-M) */
+bool
+interval_last(struct interval_sample *is)
+{
+	bool ok;
+
+	pthread_mutex_lock(&sampler.lock);
+	ok = sampler.last_ok;
+	if (ok)
+		*is = sampler.last;
+	pthread_mutex_unlock(&sampler.lock);
+
+	return ok;
+}
+
+
+/* TCP_INFO now, for the metrics thread (-M). Under sampler.lock:
+** interval_stop() can't drop the fd for the engine to close it
+** between the load and the getsockopt(). */
+bool
+interval_tcp_now(struct tcp_sample *ts)
+{
+	bool ok;
+	int fd;
+
+	pthread_mutex_lock(&sampler.lock);
+	fd = __atomic_load_n(&sampler.tcp_fd, __ATOMIC_RELAXED);
+	ok = fd >= 0 && tcp_sample_take(fd, ts);
+	pthread_mutex_unlock(&sampler.lock);
+
+	return ok;
+}
+
+
+/* the intervals kept for -T json */
+const struct interval_sample *
+interval_samples(unsigned int *no)
+{
+	*no = sampler.samples_no;
+	return sampler.samples;
+}
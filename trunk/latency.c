@@ -0,0 +1,164 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "xfuncs.h"
+#include "latency.h"
+#include "trace.h"
+
+extern struct opts opts;
+
+struct lat_hist {
+	unsigned long long count;
+	unsigned long long min, max;
+	unsigned long long buckets[LAT_BUCKETS];
+};
+
+/* untouched histograms stay zero pages */
+static struct {
+	struct lat_hist ns, bytes;
+	unsigned long long errors;
+	unsigned long long short_calls; /* moved less than asked for */
+} lat_stat[LAT_MAX];
+
+static const char *lat_call_name[LAT_MAX] = {
+	[LAT_WRITE] = "write",
+	[LAT_SENDFILE] = "sendfile",
+	[LAT_SPLICE] = "splice",
+	[LAT_READ] = "read",
+	[LAT_FILE_WRITE] = "file write",
+};
+
+
+static unsigned int
+lat_bucket(unsigned long long v)
+{
+	unsigned int e;
+
+	if (v < (1ULL << LAT_SUB_BITS))
+		return v;
+
+	e = 63 - __builtin_clzll(v); /* >= LAT_SUB_BITS */
+	return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		(unsigned int)((v >> (e - LAT_SUB_BITS)) - (1ULL << LAT_SUB_BITS));
+}
+
+
+/* highest value of a bucket */
+static unsigned long long
+lat_bucket_top(unsigned int idx)
+{
+	unsigned int e;
+	unsigned long long top;
+
+	if (idx < (1U << LAT_SUB_BITS))
+		return idx;
+
+	e = (idx >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+	top = (1ULL << LAT_SUB_BITS) + (idx & ((1U << LAT_SUB_BITS) - 1));
+	return ((top + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+
+static void
+lat_hist_add(struct lat_hist *h, unsigned long long v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->buckets[lat_bucket(v)]++;
+}
+
+
+void
+lat_record(enum lat_call call, uint64_t start, size_t want, ssize_t done)
+{
+	int err = errno;
+	uint64_t now = lat_now();
+
+	if (opts.trace_file)
+		trace_event(call, start, now, want, done, err);
+	if (!opts.latency_hist)
+		return;
+
+	if (done < 0) {
+		lat_stat[call].errors++;
+		return;
+	}
+
+	lat_hist_add(&lat_stat[call].ns, now - start);
+	lat_hist_add(&lat_stat[call].bytes, done);
+	if ((size_t)done < want)
+		lat_stat[call].short_calls++;
+}
+
+
+/* per mille p of the values are at most this (nearest rank) */
+static unsigned long long
+lat_percentile(const struct lat_hist *h, unsigned int permille)
+{
+	unsigned long long rank = (h->count * permille + 999) / 1000, seen = 0;
+	unsigned int i;
+
+	if (rank == 0)
+		rank = 1;
+
+	for (i = 0; i < LAT_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return min(lat_bucket_top(i), h->max);
+	}
+
+	return h->max;
+}
+
+
+int
+lat_report(char *buf, size_t max_buf_len)
+{
+	const struct lat_hist *ns, *bytes;
+	unsigned int i;
+	int len = 0;
+
+	for (i = 0; i < LAT_MAX; i++) {
+		ns = &lat_stat[i].ns;
+		bytes = &lat_stat[i].bytes;
+		if (ns->count == 0)
+			continue;
+
+		len += xsnprintf(buf + len, max_buf_len - len,
+				"%-11s %llu calls, latency p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n"
+				"%-11s bytes min %llu p50 %llu max %llu, %llu short, %llu failed\n",
+				lat_call_name[i], ns->count,
+				lat_percentile(ns, 500) / 1000.0, lat_percentile(ns, 900) / 1000.0,
+				lat_percentile(ns, 990) / 1000.0, lat_percentile(ns, 999) / 1000.0,
+				ns->max / 1000.0, "", bytes->min,
+				lat_percentile(bytes, 500), bytes->max,
+				lat_stat[i].short_calls, lat_stat[i].errors);
+	}
+
+	return len;
+}
@@ -0,0 +1,50 @@
+#ifndef NETSEND_LATENCY_H_INCLUDE_
+#define NETSEND_LATENCY_H_INCLUDE_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* latency.c - per call latency and size histograms (-L)
+**
+** The inner calls of the engines are timed with the vDSO
+** clock (no syscall) and their latency in nanoseconds and
+** their byte count go into log-linear histograms: values
+** below 2^LAT_SUB_BITS are exact, above every power of two is
+** split into 2^LAT_SUB_BITS buckets - an error of at most
+** 1/32 from 1 ns to 2^63.
+*/
+
+enum lat_call {
+	LAT_WRITE = 0, /* socket write (rw, mmap) */
+	LAT_SENDFILE,
+	LAT_SPLICE,
+	LAT_READ, /* socket read */
+	LAT_FILE_WRITE, /* receiver output */
+	LAT_MAX
+};
+
+#define	LAT_SUB_BITS 5
+#define	LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+static inline uint64_t
+lat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* start is the LAT_START() before the call, want the bytes asked
+** for and done the bytes the call moved (-1 on error) */
+void lat_record(enum lat_call, uint64_t start, size_t want, ssize_t done);
+int lat_report(char *, size_t);
+
+/* the callers see opts, without -L or -e the calls cost a branch */
+#define	LAT_START() (opts.latency_hist || opts.trace_file ? lat_now() : 0)
+#define	LAT_END(call, start, want, done) \
+	do { if (start) lat_record(call, start, want, done); } while (0)
+
+#endif /* NETSEND_LATENCY_H_INCLUDE_ */
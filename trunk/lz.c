@@ -0,0 +1,226 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* A compressed block is a sequence of
+**
+**   token | [literal length] | literals | offset | [match length]
+**
+** The token holds the literal length in the high and the match
+** length (minus LZ_MINMATCH) in the low nibble, 15 means that
+** more length bytes (each adds up to 255) follow. The offset is
+** 16 bit little endian. The last sequence consists of literals
+** only. This is the LZ4 block format.
+*/
+
+#define	LZ_MINMATCH     4
+#define	LZ_LASTLITERALS 5
+#define	LZ_MFLIMIT      12
+#define	LZ_MAX_OFFSET   65535
+#define	LZ_HASH_LOG     13
+#define	LZ_SKIP_TRIGGER 6
+
+static inline uint32_t lz_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+static inline unsigned char *lz_put_len(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/* compress src into dst, returns the compressed size or 0 if
+** the result does not fit into dst_len bytes (incompressible) */
+size_t lz_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t dst_len)
+{
+	uint32_t table[1 << LZ_HASH_LOG];
+	const unsigned char *ip = src, *anchor = src;
+	const unsigned char *iend = src + src_len;
+	const unsigned char *mflimit = iend - LZ_MFLIMIT;
+	const unsigned char *matchlimit = iend - LZ_LASTLITERALS;
+	unsigned char *op = dst, *oend = dst + dst_len;
+	size_t lit;
+
+	if (src_len < LZ_MFLIMIT + 1)
+		goto last_literals;
+
+	memset(table, 0, sizeof(table));
+	table[lz_hash(lz_read32(ip))] = 0;
+	ip++;
+
+	while (ip < mflimit) {
+		const unsigned char *ref;
+		unsigned int searches = 1 << LZ_SKIP_TRIGGER;
+		size_t mlen;
+		unsigned char *token;
+
+		/* find a match, speed up on incompressible data */
+		for (;;) {
+			unsigned int h = lz_hash(lz_read32(ip));
+
+			ref = src + table[h];
+			table[h] = (uint32_t)(ip - src);
+			if (ip - ref <= LZ_MAX_OFFSET && ref < ip &&
+				lz_read32(ref) == lz_read32(ip))
+				break;
+			ip += searches++ >> LZ_SKIP_TRIGGER;
+			if (ip >= mflimit)
+				goto last_literals;
+		}
+
+		/* catch up */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+			mlen++;
+
+		lit = ip - anchor;
+		if (op + 1 + lit / 255 + 1 + lit + 2 + (mlen - LZ_MINMATCH) / 255 + 1 > oend)
+			return 0;
+
+		token = op++;
+		if (lit >= 15) {
+			*token = 15 << 4;
+			op = lz_put_len(op, lit - 15);
+		} else {
+			*token = (unsigned char)(lit << 4);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		*op++ = (unsigned char)((ip - ref) & 0xff);
+		*op++ = (unsigned char)((ip - ref) >> 8);
+
+		if (mlen - LZ_MINMATCH >= 15) {
+			*token |= 15;
+			op = lz_put_len(op, mlen - LZ_MINMATCH - 15);
+		} else {
+			*token |= (unsigned char)(mlen - LZ_MINMATCH);
+		}
+
+		ip += mlen;
+		anchor = ip;
+
+		if (ip < mflimit)
+			table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+	}
+
+last_literals:
+	lit = iend - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > oend)
+		return 0;
+	if (lit >= 15) {
+		*op++ = 15 << 4;
+		op = lz_put_len(op, lit - 15);
+	} else {
+		*op++ = (unsigned char)(lit << 4);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+
+/* returns the decompressed size or -1 if src is corrupted
+** or would overflow dst. Never reads or writes out of bounds */
+long lz_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t dst_len)
+{
+	const unsigned char *ip = src, *iend = src + src_len;
+	unsigned char *op = dst, *oend = dst + dst_len;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit = token >> 4, mlen, off;
+		unsigned char b;
+
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+
+		if (ip == iend) /* last sequence */
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t)(op - dst))
+			return -1;
+
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MINMATCH;
+		if (mlen > (size_t)(oend - op))
+			return -1;
+
+		if (off >= mlen) {
+			memcpy(op, op - off, mlen);
+			op += mlen;
+		} else { /* overlapping copy, e.g. runs */
+			const unsigned char *ref = op - off;
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
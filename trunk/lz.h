@@ -0,0 +1,17 @@
+#ifndef NETSEND_LZ_H_INCLUDE_
+#define NETSEND_LZ_H_INCLUDE_
+
+#include <stddef.h>
+
+/* lz.c - small LZ77 block codec (LZ4 block format)
+**
+** Byte oriented, no entropy stage: trades ratio for
+** speed so it can keep up with a network link.
+*/
+
+#define	lz_compress_bound(n) ((n) + (n) / 255 + 16)
+
+size_t lz_compress(const unsigned char *, size_t, unsigned char *, size_t);
+long lz_decompress(const unsigned char *, size_t, unsigned char *, size_t);
+
+#endif /* NETSEND_LZ_H_INCLUDE_ */
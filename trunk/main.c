@@ -37,6 +37,7 @@
 #include "proto_tcp.h"
 #include "proto_tipc.h"
 #include "proto_udp_recv.h"
+#include "trace.h"
 
 struct conf_map_t memadvice_map[] = {
 	{ MEMADV_NORMAL,	"normal" },
@@ -104,6 +105,7 @@ main(int argc, char *argv[])
 
 	/* parse_opts will exit if an error occurr */
 	parse_opts(argc, argv, &opts);
+	phase_mark(PHASE_START);
 
 	msg(GENTLE, PROGRAMNAME " - " VERSIONSTRING);
 
@@ -126,6 +128,12 @@ main(int argc, char *argv[])
 
 	ignore_sigpipe();
 
+	/* before connect or accept, a scrape shows the waiting too */
+	metrics_start();
+
+	if (opts.trace_file)
+		trace_open(opts.trace_file, opts.trace_slots);
+
 	/* Branch to final workmode ... */
 	switch (opts.workmode) {
 
@@ -176,7 +184,10 @@ main(int argc, char *argv[])
 		err_msg_die(EXIT_FAILMISC, "Programmed Failure");
 	}
 
-	if (opts.statistics || opts.machine_parseable) {
+	if (opts.json_report) {
+		gen_json_analyse(stderr);
+		fflush(stderr);
+	} else if (opts.statistics || opts.machine_parseable) {
 		char buf[MAX_STATLEN];
 
 		if (opts.machine_parseable)
@@ -188,6 +199,8 @@ main(int argc, char *argv[])
 		fflush(stderr);
 	}
 
+	trace_close();
+
 	return ret;
 }
 
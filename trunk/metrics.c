@@ -0,0 +1,459 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "analyze.h"
+#include "global.h"
+#include "xfuncs.h"
+
+extern struct opts opts;
+extern struct net_stat net_stat;
+
+/* Live metrics (-M) in the Prometheus text format, served over
+** http from a tcp or unix socket by a thread of its own. Like the
+** interval sampler it only reads what the engines count anyway
+** (STAT_READ() of net_stat.io_bytes and the call counters) and
+** takes a fresh TCP_INFO per scrape: the io loops do not know
+** about it. One connection at a time, a scrape is a few KiB.
+*/
+
+#define	METRICS_BACKLOG 8
+#define	METRICS_REQ_MAX 4096
+#define	METRICS_IO_TIMEOUT_MS 1000
+
+enum metrics_transfer_state {
+	TRANSFER_WAITING = 0,
+	TRANSFER_RUNNING,
+	TRANSFER_DONE
+};
+
+static struct {
+	pthread_t thread;
+	bool running;
+	int listen_fd;
+	int stop_pipe[2]; /* metrics_stop() -> server thread */
+	char *unix_path; /* unlinked at the end */
+	int state; /* enum metrics_transfer_state, __atomic */
+	struct timespec start, end;
+} metrics = {
+	.listen_fd = -1,
+	.stop_pipe = { -1, -1 },
+};
+
+
+static double
+ts_diff_sec(const struct timespec *end, const struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+/* the type and help line only once per metric, the caller prints the samples */
+static void
+metric_head(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP netsend_%s %s\n# TYPE netsend_%s %s\n", name, help, name, type);
+}
+
+
+static void
+metric(FILE *out, const char *name, const char *type, const char *help, double val)
+{
+	metric_head(out, name, type, help);
+	/* counters exact, up to 2^53 a double holds every integer */
+	if (val == (double) (unsigned long long) val && val < 9007199254740992.0)
+		fprintf(out, "netsend_%s %.0f\n", name, val);
+	else
+		fprintf(out, "netsend_%s %.9g\n", name, val);
+}
+
+
+static void
+metrics_tcp(FILE *out, const struct tcp_sample *t)
+{
+	metric(out, "tcp_cwnd_segments", "gauge", "Congestion window.", t->cwnd);
+	metric(out, "tcp_ssthresh_segments", "gauge", "Slow start threshold.", t->ssthresh);
+	metric(out, "tcp_srtt_seconds", "gauge", "Smoothed round trip time.", t->srtt_us / 1e6);
+	metric(out, "tcp_rttvar_seconds", "gauge", "Round trip time variance.", t->rttvar_us / 1e6);
+	metric(out, "tcp_unacked_segments", "gauge", "Segments in flight.", t->unacked);
+	metric(out, "tcp_retransmits_total", "counter", "Retransmitted segments.",
+			t->total_retrans);
+	metric(out, "tcp_delivery_rate_bytes_per_second", "gauge",
+			"Delivery rate of the last acknowledged data.", t->delivery_rate);
+	metric(out, "tcp_pacing_rate_bytes_per_second", "gauge", "Pacing rate.", t->pacing_rate);
+	metric(out, "tcp_busy_seconds_total", "counter", "Time with data in flight.",
+			t->busy_us / 1e6);
+	metric(out, "tcp_rwnd_limited_seconds_total", "counter",
+			"Busy time limited by the receive window.", t->rwnd_limited_us / 1e6);
+	metric(out, "tcp_sndbuf_limited_seconds_total", "counter",
+			"Busy time limited by the send buffer.", t->sndbuf_limited_us / 1e6);
+	metric(out, "tcp_notsent_bytes", "gauge", "Bytes in the send buffer not yet sent.",
+			t->notsent);
+}
+
+
+static void
+metrics_write(FILE *out)
+{
+	int state = __atomic_load_n(&metrics.state, __ATOMIC_ACQUIRE);
+	struct interval_sample is;
+	struct tcp_sample ts;
+	struct timespec now;
+	struct rusage ru;
+
+	metric_head(out, "info", "gauge", "Version and setup of this process.");
+	fprintf(out, "netsend_info{version=\"%s\",mode=\"%s\",io_call=\"%s\"} 1\n",
+			VERSIONSTRING, opts.workmode == MODE_TRANSMIT ? "tx" : "rx", engine_str());
+
+	metric(out, "transfer_running", "gauge", "1 while the data transfer runs.",
+			state == TRANSFER_RUNNING);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (state == TRANSFER_RUNNING)
+		metric(out, "transfer_seconds", "gauge", "Time since the transfer started.",
+				ts_diff_sec(&now, &metrics.start));
+	else if (state == TRANSFER_DONE)
+		metric(out, "transfer_seconds", "gauge", "Time since the transfer started.",
+				ts_diff_sec(&metrics.end, &metrics.start));
+
+	metric(out, "bytes_total", "counter", "Bytes moved by the socket calls.",
+			STAT_READ(net_stat.io_bytes));
+	metric(out, "io_calls_total", "counter", "Socket calls of the io engine.",
+			opts.workmode == MODE_TRANSMIT ? STAT_READ(net_stat.total_tx_calls) :
+			STAT_READ(net_stat.total_rx_calls));
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		metric_head(out, "cpu_seconds_total", "counter", "Cpu time of the process.");
+		fprintf(out, "netsend_cpu_seconds_total{mode=\"user\"} %.6f\n",
+				ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6);
+		fprintf(out, "netsend_cpu_seconds_total{mode=\"system\"} %.6f\n",
+				ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+	}
+
+	/* the last interval of -i */
+	if (interval_last(&is) && is.to > is.from) {
+		metric(out, "interval_bytes_per_second", "gauge",
+				"Throughput of the last interval (-i).", is.bytes / (is.to - is.from));
+		metric(out, "interval_end_seconds", "gauge",
+				"End of the last interval since the transfer started.", is.to);
+	}
+
+	if (state == TRANSFER_DONE && net_stat.tcp_end_ok)
+		metrics_tcp(out, &net_stat.tcp_end);
+	else if (state == TRANSFER_RUNNING && interval_tcp_now(&ts))
+		metrics_tcp(out, &ts);
+
+	/* the probes ran before the transfer */
+	if (state != TRANSFER_WAITING) {
+		if (net_stat.rtt_probe.app_avg_us > 0)
+			metric(out, "rtt_probe_seconds", "gauge", "Average round trip time of -r.",
+					net_stat.rtt_probe.app_avg_us / 1e6);
+		if (net_stat.pprobe.capacity > 0)
+			metric(out, "capacity_bits_per_second", "gauge",
+					"Bottleneck capacity of -c.", net_stat.pprobe.capacity);
+	}
+}
+
+
+static bool
+metrics_wait(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	return poll(&pfd, 1, METRICS_IO_TIMEOUT_MS) == 1 && (pfd.revents & events);
+}
+
+
+/* the empty line after the header, or a request line without
+** version (HTTP/0.9, "echo GET /metrics | nc") */
+static bool
+metrics_req_complete(const char *req)
+{
+	const char *eol = strchr(req, '\n');
+
+	if (!eol)
+		return false;
+	if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+		return true;
+
+	return !memmem(req, eol - req, "HTTP/", 5);
+}
+
+
+/* HTTP/1.0: read up to the end of the header, answer, close */
+static void
+metrics_serve(int fd)
+{
+	char req[METRICS_REQ_MAX], head[256];
+	char *path, *body = NULL;
+	size_t body_len = 0, req_len = 0;
+	const char *status = "200 OK";
+	FILE *out;
+	ssize_t ret;
+	int head_len;
+
+	req[0] = '\0';
+	while (req_len < sizeof(req) - 1 && !metrics_req_complete(req)) {
+		if (!metrics_wait(fd, POLLIN))
+			return;
+		ret = recv(fd, req + req_len, sizeof(req) - 1 - req_len, 0);
+		if (ret <= 0)
+			return;
+		req_len += ret;
+		req[req_len] = '\0';
+	}
+
+	if (strncmp(req, "GET ", 4)) {
+		status = "405 Method Not Allowed";
+	} else {
+		path = req + 4;
+		path[strcspn(path, " \r\n")] = '\0';
+		if (strcmp(path, "/metrics") && strcmp(path, "/"))
+			status = "404 Not Found";
+	}
+
+	if (status[0] == '2') {
+		if ((out = open_memstream(&body, &body_len)) == NULL) {
+			err_sys("Can't build metrics");
+			return;
+		}
+		metrics_write(out);
+		fclose(out);
+	}
+
+	head_len = xsnprintf(head, sizeof(head), "HTTP/1.0 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+
+	if (metrics_wait(fd, POLLOUT) && send(fd, head, head_len, MSG_NOSIGNAL) == head_len) {
+		size_t done = 0;
+
+		while (done < body_len && metrics_wait(fd, POLLOUT)) {
+			ret = send(fd, body + done, body_len - done, MSG_NOSIGNAL);
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+	}
+
+	free(body);
+}
+
+
+static void *
+metrics_thread(void *arg __attribute__((unused)))
+{
+	struct pollfd pfd[2];
+	int fd;
+
+	pfd[0].fd = metrics.listen_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = metrics.stop_pipe[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys("poll() on the metrics socket");
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		fd = accept(metrics.listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+				err_sys("accept() on the metrics socket");
+			continue;
+		}
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+
+/* unix:PATH, PORT (loopback), HOST:PORT or [HOST]:PORT, * for any address */
+static int
+metrics_listen(const char *addr)
+{
+	struct addrinfo hosthints, *hostres, *addrtmp;
+	const char *host;
+	char *port, *str;
+	int fd = -1, ret, on = 1;
+
+	if (!strncmp(addr, "unix:", 5)) {
+		struct sockaddr_un sun;
+		struct stat st;
+
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr + 5) == 0 || strlen(addr + 5) >= sizeof(sun.sun_path))
+			err_msg_die(EXIT_FAILOPT, "-M: unix socket path empty or too long");
+		strcpy(sun.sun_path, addr + 5);
+
+		/* a stale socket of an earlier run, but never a regular file */
+		if (lstat(sun.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(sun.sun_path);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			err_sys_die(EXIT_FAILNET, "socket() for the metrics");
+		if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+			err_sys_die(EXIT_FAILNET, "Can't bind metrics socket %s", sun.sun_path);
+		metrics.unix_path = xstrdup(sun.sun_path);
+	} else {
+		str = xstrdup(addr);
+		port = strrchr(str, ':');
+		if (port) {
+			*port++ = '\0';
+			host = str;
+			if (str[0] == '[' && str[strlen(str) - 1] == ']') {
+				str[strlen(str) - 1] = '\0';
+				host = str + 1;
+			}
+			if (!strcmp(host, "*"))
+				host = NULL;
+		} else {
+			port = str;
+			host = "localhost";
+		}
+
+		memset(&hosthints, 0, sizeof(struct addrinfo));
+		hosthints.ai_family = AF_UNSPEC;
+		hosthints.ai_socktype = SOCK_STREAM;
+		hosthints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+
+		ret = getaddrinfo(host, port, &hosthints, &hostres);
+		if (ret != 0)
+			err_msg_die(EXIT_FAILOPT, "-M %s: %s", addr,
+					ret == EAI_SYSTEM ? strerror(errno) : gai_strerror(ret));
+
+		for (addrtmp = hostres; addrtmp != NULL; addrtmp = addrtmp->ai_next) {
+			fd = socket(addrtmp->ai_family, addrtmp->ai_socktype | SOCK_CLOEXEC,
+					addrtmp->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+				err_sys("setsockopt(SO_REUSEADDR) on the metrics socket");
+			if (bind(fd, addrtmp->ai_addr, addrtmp->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(hostres);
+		free(str);
+
+		if (fd < 0)
+			err_sys_die(EXIT_FAILNET, "Can't bind metrics socket %s", addr);
+	}
+
+	if (listen(fd, METRICS_BACKLOG) < 0)
+		err_sys_die(EXIT_FAILNET, "listen() on the metrics socket");
+
+	return fd;
+}
+
+
+void
+metrics_start(void)
+{
+	int ret;
+
+	if (!opts.metrics_addr || metrics.running)
+		return;
+
+	metrics.listen_fd = metrics_listen(opts.metrics_addr);
+	if (pipe(metrics.stop_pipe) < 0)
+		err_sys_die(EXIT_FAILMISC, "pipe() for the metrics thread");
+
+	ret = pthread_create(&metrics.thread, NULL, metrics_thread, NULL);
+	if (ret) {
+		errno = ret;
+		err_sys_die(EXIT_FAILMISC, "Can't start metrics thread");
+	}
+
+	metrics.running = true;
+	atexit(metrics_stop);
+	msg(GENTLE, "serve metrics on %s", opts.metrics_addr);
+}
+
+
+void
+metrics_stop(void)
+{
+	if (!metrics.running)
+		return;
+
+	if (write(metrics.stop_pipe[1], "", 1) != 1)
+		err_sys("Can't stop metrics thread");
+	else
+		pthread_join(metrics.thread, NULL);
+	metrics.running = false;
+
+	close(metrics.listen_fd);
+	close(metrics.stop_pipe[0]);
+	close(metrics.stop_pipe[1]);
+	if (metrics.unix_path) {
+		unlink(metrics.unix_path);
+		free(metrics.unix_path);
+		metrics.unix_path = NULL;
+	}
+}
+
+
+/* called from touch_use_stat() around the transfer */
+void
+metrics_transfer(enum where_send where)
+{
+	if (!metrics.running)
+		return;
+
+	if (where == TOUCH_BEFORE_OP) {
+		clock_gettime(CLOCK_MONOTONIC, &metrics.start);
+		__atomic_store_n(&metrics.state, TRANSFER_RUNNING, __ATOMIC_RELEASE);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &metrics.end);
+		__atomic_store_n(&metrics.state, TRANSFER_DONE, __ATOMIC_RELEASE);
+	}
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
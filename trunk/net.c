@@ -22,15 +22,20 @@
 */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include "proto_tcp.h"
 #include "proto_tipc.h"
 #include "global.h"
+#include "xfuncs.h"
 
 extern struct opts opts;
 extern struct socket_options socket_options[];
@@ -193,3 +198,233 @@ void set_socketopts(int fd)
 
 
 
+
+
+/* Connection Attempt Delay of RFC 8305: the time an attempt
+** has before the next address is tried next to it */
+#define	CONNECT_ATTEMPT_DELAY_MS 250
+
+/* RFC 8305 section 4: the resolver sorted the addresses (RFC
+** 6724), the families take turns - the preferred one first */
+static const struct addrinfo **
+connect_order(const struct addrinfo *res, int *order_no)
+{
+	const struct addrinfo *ai, **order, **pref, **other;
+	int n = 0, pref_no = 0, other_no = 0, i;
+
+	for (ai = res; ai; ai = ai->ai_next)
+		n++;
+	order = xmalloc(n * sizeof(*order));
+	pref = xmalloc(n * sizeof(*pref));
+	other = xmalloc(n * sizeof(*other));
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (opts.family != AF_UNSPEC && ai->ai_family != opts.family)
+			continue; /* user fixed family! */
+		if (!pref_no || ai->ai_family == pref[0]->ai_family)
+			pref[pref_no++] = ai;
+		else
+			other[other_no++] = ai;
+	}
+
+	for (n = 0, i = 0; i < pref_no || i < other_no; i++) {
+		if (i < pref_no)
+			order[n++] = pref[i];
+		if (i < other_no)
+			order[n++] = other[i];
+	}
+
+	free(pref);
+	free(other);
+	*order_no = n;
+	return order;
+}
+
+
+/* the number of addresses connect_race() tries */
+int
+connect_candidates(const struct addrinfo *res)
+{
+	int n = 0;
+
+	for (; res; res = res->ai_next)
+		if (opts.family == AF_UNSPEC || res->ai_family == opts.family)
+			n++;
+	return n;
+}
+
+
+static const char *
+connect_addr_str(const struct addrinfo *ai, char *buf, size_t len)
+{
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen, buf, len, NULL, 0, NI_NUMERICHOST))
+		snprintf(buf, len, "%s", opts.hostname);
+	return buf;
+}
+
+
+/* a non-blocking socket with the connect under way,
+** -1 if the address failed already */
+static int
+connect_start(const struct addrinfo *ai, void (*setup)(int, const struct addrinfo *),
+		bool *connected)
+{
+	struct protoent *protoent;
+	char addr[NI_MAXHOST];
+	int fd;
+
+	fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (fd < 0) {
+		err_sys("socket");
+		return -1;
+	}
+
+	protoent = getprotobynumber(ai->ai_protocol);
+	if (protoent)
+		msg(LOUDISH, "socket created - protocol %s(%d)",
+			protoent->p_name, protoent->p_proto);
+
+	/* the options before the connect - the syn carries some */
+	setup(fd, ai);
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+		err_sys_die(EXIT_FAILNET, "fcntl(O_NONBLOCK)");
+
+	msg(STRESSFUL, "connect to %s", connect_addr_str(ai, addr, sizeof(addr)));
+
+	/* datagram sockets connect at once */
+	*connected = connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+	if (!*connected && errno != EINPROGRESS) {
+		err_sys("Can't connect to %s", connect_addr_str(ai, addr, sizeof(addr)));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Happy eyeballs (RFC 8305) over the resolved addresses: an
+** attempt starts every CONNECT_ATTEMPT_DELAY_MS or as soon as the
+** one before failed, the first connection wins and the others are
+** closed. A family which blackholes costs the delay, not the
+** connect timeout. setup() sets the options of each socket. */
+int
+connect_race(const struct addrinfo *res, void (*setup)(int, const struct addrinfo *))
+{
+	const struct addrinfo **order, **pending_ai;
+	struct pollfd *pfd;
+	char addr[NI_MAXHOST];
+	int n, next = 0, pending = 0, fd = -1, i, rc, err;
+	socklen_t err_len;
+	bool connected;
+
+	order = connect_order(res, &n);
+	if (!n)
+		err_msg_die(EXIT_FAILNET, "No suitable socket found");
+	pfd = xmalloc(n * sizeof(*pfd));
+	pending_ai = xmalloc(n * sizeof(*pending_ai));
+
+	while (fd < 0) {
+		/* the next address, after a failure or the delay */
+		if (next < n) {
+			rc = connect_start(order[next], setup, &connected);
+			if (rc >= 0 && connected) {
+				fd = rc;
+				pending_ai[pending] = order[next];
+				i = pending;
+				break;
+			}
+			if (rc >= 0) {
+				pfd[pending].fd = rc;
+				pfd[pending].events = POLLOUT;
+				pending_ai[pending++] = order[next];
+			}
+			next++;
+			if (rc < 0)
+				continue;
+		}
+
+		if (!pending)
+			err_msg_die(EXIT_FAILNET, "Can't connect to %s", opts.hostname);
+
+		do {
+			rc = poll(pfd, pending, next < n ? CONNECT_ATTEMPT_DELAY_MS : -1);
+		} while (rc < 0 && errno == EINTR);
+		if (rc < 0)
+			err_sys_die(EXIT_FAILNET, "poll");
+
+		for (i = 0; i < pending && fd < 0; i++) {
+			if (!pfd[i].revents)
+				continue;
+
+			err_len = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+				err = errno;
+			if (!err) {
+				fd = pfd[i].fd;
+				break;
+			}
+
+			err_msg("Can't connect to %s: %s",
+					connect_addr_str(pending_ai[i], addr, sizeof(addr)), strerror(err));
+			close(pfd[i].fd);
+			pfd[i] = pfd[--pending];
+			pending_ai[i--] = pending_ai[pending];
+		}
+	}
+
+	/* the winner is i, the losers are still in the handshake */
+	msg(LOUDISH, "socket connected to %s (%s) via port %s", opts.hostname,
+			connect_addr_str(pending_ai[i], addr, sizeof(addr)), opts.port);
+	while (pending--)
+		if (pfd[pending].fd != fd)
+			close(pfd[pending].fd);
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) < 0)
+		err_sys_die(EXIT_FAILNET, "fcntl(~O_NONBLOCK)");
+
+	free(order);
+	free(pfd);
+	free(pending_ai);
+	return fd;
+}
+
+
+#define	PROC_TCP_FASTOPEN "/proc/sys/net/ipv4/tcp_fastopen"
+#define	TFO_CLIENT_ENABLE 1
+#define	TFO_SERVER_ENABLE 2
+
+/* net.ipv4.tcp_fastopen: bit 1 lets a client send data with
+** its syn, bit 2 lets a listener take it. Without, the kernel
+** quietly falls back to the handshake. */
+void
+tcp_fastopen_check(bool server)
+{
+	int val, need = server ? TFO_SERVER_ENABLE : TFO_CLIENT_ENABLE;
+	FILE *fp;
+
+	if ((fp = fopen(PROC_TCP_FASTOPEN, "r")) == NULL)
+		return;
+	if (fscanf(fp, "%i", &val) == 1 && !(val & need))
+		err_msg("%s is %d, -F needs %d set - the header waits for the handshake",
+				PROC_TCP_FASTOPEN, val, need);
+	fclose(fp);
+}
+
+
+/* after the header exchange: did the syn carry the header? The
+** first connect to a peer only fetches the cookie. */
+void
+tcp_fastopen_report(int fd)
+{
+	struct tcp_info tcp_info;
+
+	if (!tcp_get_info(fd, &tcp_info))
+		return;
+
+	if (tcp_info.tcpi_options & TCPI_OPT_SYN_DATA)
+		msg(GENTLE, "fast open: the syn carried the header");
+	else
+		msg(GENTLE, "fast open: no data in the syn (no cookie yet or the peer refused it)");
+}
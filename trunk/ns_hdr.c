@@ -20,20 +20,23 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <time.h>
-#include <signal.h>
 #include <math.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
 
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -45,6 +48,16 @@
 #include "ns_hdr.h"
 #include "debug.h"
 #include "xfuncs.h"
+#include "hash.h"
+#include "digest.h"
+#include "resume.h"
+#include "delta.h"
+#include "probes.h"
+
+#ifdef HAVE_SO_TIMESTAMPING
+# include <linux/net_tstamp.h>
+# include <linux/errqueue.h>
+#endif
 
 extern struct opts opts;
 extern struct net_stat net_stat;
@@ -85,304 +98,2440 @@ static ssize_t readn(int fd, void *buf, size_t buflen)
 		case 0: goto out;
 		}
 
-		total += ret;
-		bufptr += ret;
-		buflen -= ret;
-	} while (buflen > 0);
-out:
-	return total > 0 ? total : -1;
+		total += ret;
+		bufptr += ret;
+		buflen -= ret;
+	} while (buflen > 0);
+out:
+	return total > 0 ? total : -1;
+}
+
+static double
+ts_diff_us(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000.0 +
+		(end->tv_nsec - start->tv_nsec) / 1000.0;
+}
+
+
+enum rtt_state { RTT_PENDING = 0, RTT_ANSWERED, RTT_LOST };
+
+struct rtt_sample {
+	struct timespec app_tx;
+	struct timespec kernel_tx, kernel_rx;
+	double app_us;
+	unsigned char state;
+	bool kernel_tx_ok, kernel_rx_ok;
+};
+
+struct rtt_ctx {
+	int fd;
+	bool dgram;
+	int next_hdr; /* of the last probe */
+	unsigned int total; /* probes including the warm up */
+	struct ns_rtt_probe *probe;
+	ssize_t probe_len;
+	struct rtt_sample *samples;
+	bool tstamp;
+	unsigned int tstamp_first; /* first probe sent with timestamps on */
+};
+
+#define	TIMEOUT_SEC 10
+#define	RTT_END_RETRIES 3
+
+#ifdef HAVE_SO_TIMESTAMPING
+
+#define	RTT_TSTAMP_FLAGS (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | \
+		SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY | \
+		SOF_TIMESTAMPING_OPT_ID)
+
+static bool
+rtt_tstamp_set(int fd, int flags)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0)
+		return true;
+
+	msg(GENTLE, "no kernel timestamps for the rtt probes (%s)", strerror(errno));
+	return false;
+}
+
+#endif /* HAVE_SO_TIMESTAMPING */
+
+
+/* software timestamp out of a SCM_TIMESTAMPING control message */
+static bool
+rtt_tstamp_cmsg(struct msghdr *msgh, struct timespec *ts)
+{
+#ifdef HAVE_SO_TIMESTAMPING
+	struct cmsghdr *cmsg;
+	struct scm_timestamping tss;
+
+	for (cmsg = CMSG_FIRSTHDR(msgh); cmsg; cmsg = CMSG_NXTHDR(msgh, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+		memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+		if (tss.ts[0].tv_sec == 0 && tss.ts[0].tv_nsec == 0)
+			return false;
+		*ts = tss.ts[0];
+		return true;
+	}
+#else
+	(void) msgh; (void) ts;
+#endif
+
+	return false;
+}
+
+
+/* The transmit timestamps wait on the error queue, keyed
+** (SOF_TIMESTAMPING_OPT_ID) by datagram or by the offset of the
+** last byte of a write. Timestamping is switched on after the
+** warm up probe is answered - nothing is unacknowledged then
+** and the key of probe n is (n + 1) * probe_len - 1 */
+static void
+rtt_tstamp_tx(struct rtt_ctx *ctx)
+{
+#ifdef HAVE_SO_TIMESTAMPING
+	char control[256];
+	struct msghdr msgh;
+	struct cmsghdr *cmsg;
+	struct sock_extended_err serr;
+	struct timespec ts;
+	unsigned int idx;
+	bool have_key;
+
+	for (;;) {
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_control = control;
+		msgh.msg_controllen = sizeof(control);
+		if (recvmsg(ctx->fd, &msgh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		if (!ctx->tstamp || !rtt_tstamp_cmsg(&msgh, &ts))
+			continue;
+
+		have_key = false;
+		for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+			if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+				(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+				memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+				have_key = serr.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+			}
+		}
+		if (!have_key)
+			continue;
+
+		if (ctx->dgram) {
+			idx = ctx->tstamp_first + serr.ee_data;
+		} else {
+			if ((serr.ee_data + 1) % ctx->probe_len)
+				continue;
+			idx = ctx->tstamp_first + (serr.ee_data + 1) / ctx->probe_len - 1;
+		}
+
+		if (idx < ctx->total) {
+			ctx->samples[idx].kernel_tx = ts;
+			ctx->samples[idx].kernel_tx_ok = true;
+		}
+	}
+#else
+	(void) ctx;
+#endif
+}
+
+
+static void
+rtt_send(struct rtt_ctx *ctx, unsigned int idx)
+{
+	struct rtt_sample *sample = &ctx->samples[idx];
+
+	ctx->probe->nse_nxt_hdr = htons(idx == ctx->total - 1 ?
+			ctx->next_hdr : NSE_NXT_RTT_PROBE);
+	ctx->probe->type = htons((uint16_t)RTT_REQUEST_TYPE);
+	ctx->probe->seq_no = htons(idx & 0xffff);
+
+	/* the peer echos the time, we only use our own */
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &sample->app_tx) != 0)
+		err_sys("Can't call clock_gettime");
+
+	ctx->probe->sec = htonl(sample->app_tx.tv_sec);
+	ctx->probe->usec = htonl(sample->app_tx.tv_nsec / 1000);
+
+	if (writen(ctx->fd, ctx->probe, ctx->probe_len) != ctx->probe_len)
+		err_msg_die(EXIT_FAILHEADER, "Can't send rtt extension header!\n");
+
+	NS_PROBE2(rtt_send, idx, ctx->probe_len);
+}
+
+
+/* Read one reply - a datagram or probe_len octets of the stream -
+** and match it by seq_no against the probes in flight. Returns
+** the answered probe or -1 */
+static int
+rtt_recv(struct rtt_ctx *ctx, unsigned int sent)
+{
+	char reply_buf[ctx->probe_len], control[256];
+	struct ns_rtt_probe *reply = (struct ns_rtt_probe *) reply_buf;
+	struct timespec now, kernel_rx;
+	struct rtt_sample *sample;
+	struct msghdr msgh;
+	struct iovec iov;
+	ssize_t total = 0, ret;
+	bool kernel_ok = false;
+	unsigned int idx;
+
+	do {
+		iov.iov_base = reply_buf + total;
+		iov.iov_len = ctx->probe_len - total;
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_iov = &iov;
+		msgh.msg_iovlen = 1;
+		msgh.msg_control = control;
+		msgh.msg_controllen = sizeof(control);
+
+		ret = recvmsg(ctx->fd, &msgh, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && ctx->dgram)
+			return -1; /* e.g. ECONNREFUSED, the probe counts as lost */
+		if (ret <= 0)
+			err_msg_die(EXIT_FAILHEADER, "Can't read rtt probe reply!\n");
+
+		/* the segment completing the reply */
+		kernel_ok = rtt_tstamp_cmsg(&msgh, &kernel_rx);
+		total += ret;
+	} while (!ctx->dgram && total < ctx->probe_len);
+
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) != 0)
+		err_sys("Can't call clock_gettime");
+
+	if (total != ctx->probe_len || ntohs(reply->type) != RTT_REPLY_TYPE ||
+		ntohs(reply->ident) != (getpid() & 0xffff)) {
+		err_msg("received a unknown rtt probe reply (ident  should: %d is: %d)",
+				ntohs(reply->ident),  (getpid() & 0xffff));
+		return -1;
+	}
+
+	/* the latest probe sent with these 16 bits of sequence */
+	idx = sent - 1 - (uint16_t)(((sent - 1) & 0xffff) - ntohs(reply->seq_no));
+	if (idx >= sent)
+		return -1;
+
+	sample = &ctx->samples[idx];
+	if (sample->state != RTT_PENDING)
+		return -1;
+
+	sample->state = RTT_ANSWERED;
+	sample->app_us = ts_diff_us(&sample->app_tx, &now);
+	sample->kernel_rx = kernel_rx;
+	sample->kernel_rx_ok = kernel_ok;
+
+	NS_PROBE2(rtt_recv, idx, (unsigned long long) (sample->app_us * 1000));
+
+	msg(STRESSFUL, "receive rtt reply probe (sequence: %d, len %d, rtt: %.3fus)",
+			ntohs(reply->seq_no), total, sample->app_us);
+
+	return idx;
+}
+
+
+/* Keep up to inflight probes of [first, last) in the wire. A
+** stream peer answers every probe, a datagram not answered within
+** timeout_ms is lost. */
+static void
+rtt_run(struct rtt_ctx *ctx, unsigned int first, unsigned int last,
+		unsigned int inflight, int timeout_ms)
+{
+	unsigned int next = first, oldest = first, outstanding = 0;
+	struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+	struct timespec now;
+	double wait_ms;
+	int ret;
+
+	while (next < last || outstanding > 0) {
+
+		while (next < last && outstanding < inflight) {
+			rtt_send(ctx, next++);
+			outstanding++;
+		}
+
+		while (oldest < next && ctx->samples[oldest].state != RTT_PENDING)
+			oldest++;
+
+		if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) != 0)
+			err_sys("Can't call clock_gettime");
+
+		wait_ms = timeout_ms - ts_diff_us(&ctx->samples[oldest].app_tx, &now) / 1000;
+		if (wait_ms <= 0) {
+			if (!ctx->dgram)
+				err_msg_die(EXIT_FAILNET, "peer doesn't answer rtt probe %u within %d ms",
+						oldest, timeout_ms);
+			msg(STRESSFUL, "rtt probe %u lost", oldest);
+			ctx->samples[oldest].state = RTT_LOST;
+			outstanding--;
+			continue;
+		}
+
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, (int)ceil(wait_ms));
+		if (ret < 0 && errno != EINTR)
+			err_sys_die(EXIT_FAILNET, "poll");
+		if (ret <= 0)
+			continue;
+
+		/* transmit timestamps on the error queue */
+		if (pfd.revents & POLLERR)
+			rtt_tstamp_tx(ctx);
+
+		if (pfd.revents & POLLIN && rtt_recv(ctx, next) >= 0)
+			outstanding--;
+	}
+}
+
+
+/* The last probe ends the reflector loop of a datagram peer,
+** send it again if the reply got lost. It may arrive twice -
+** the peer takes the copy for data then, datagram transfers
+** aren't reliable anyway. */
+static void
+rtt_end_dgram(struct rtt_ctx *ctx, int timeout_ms)
+{
+	struct rtt_sample *end = &ctx->samples[ctx->total - 1];
+	int i;
+
+	for (i = 0; i < RTT_END_RETRIES && end->state != RTT_ANSWERED; i++) {
+		end->state = RTT_PENDING;
+		rtt_run(ctx, ctx->total - 1, ctx->total, 1, timeout_ms);
+	}
+
+	/* a late answer doesn't count */
+	if (i > 0)
+		end->state = RTT_LOST;
+}
+
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+/* nearest rank of a sorted array */
+static double
+percentile(const double *sorted, unsigned int n, unsigned int p)
+{
+	unsigned int rank = (n * p + 99) / 100;
+
+	return sorted[rank ? rank - 1 : 0];
+}
+
+
+static void
+rtt_stats(struct rtt_ctx *ctx, int probe_no)
+{
+	struct rtt_probe *rp = &net_stat.rtt_probe;
+	double *app, *kernel, deviation, covariance = 0, d_tmp = 0, sum = 0;
+	unsigned int i, n = 0, kernel_no = 0, filtered = 0, bucket, max_count = 0;
+
+	app = xmalloc(probe_no * sizeof(double));
+	kernel = xmalloc(probe_no * sizeof(double));
+
+	/* the warm up probe doesn't count */
+	for (i = 1; i < ctx->total; i++) {
+		struct rtt_sample *sample = &ctx->samples[i];
+
+		rp->sent++;
+		if (sample->state != RTT_ANSWERED) {
+			rp->lost++;
+			continue;
+		}
+		app[n++] = sample->app_us;
+
+		if (sample->kernel_tx_ok && sample->kernel_rx_ok) {
+			double us = ts_diff_us(&sample->kernel_tx, &sample->kernel_rx);
+			if (us > 0 && us <= sample->app_us)
+				kernel[kernel_no++] = us;
+		}
+	}
+
+	if (n == 0) {
+		err_msg("no rtt probe answered (%u sent)", rp->sent);
+		goto out;
+	}
+
+	qsort(app, n, sizeof(double), cmp_double);
+	for (i = 0; i < n; i++) {
+		sum += app[i];
+		bucket = app[i] < 2 ? 0 : min((unsigned int)log2(app[i]), (unsigned int)RTT_HIST_BUCKETS - 1);
+		rp->hist[bucket]++;
+	}
+	rp->app_avg_us = sum / n;
+	rp->app_min_us = app[0];
+	rp->app_p50_us = percentile(app, n, 50);
+	rp->app_p99_us = percentile(app, n, 99);
+	rp->app_max_us = app[n - 1];
+
+	if (kernel_no) {
+		qsort(kernel, kernel_no, sizeof(double), cmp_double);
+		for (i = 0, sum = 0; i < kernel_no; i++)
+			sum += kernel[i];
+		rp->kernel_avg_us = sum / kernel_no;
+		rp->kernel_min_us = kernel[0];
+		rp->kernel_p50_us = percentile(kernel, kernel_no, 50);
+		rp->kernel_p99_us = percentile(kernel, kernel_no, 99);
+		rp->kernel_max_us = kernel[kernel_no - 1];
+	}
+
+	/* average in ms, covariance and standard deviation ... */
+	rp->usec = rp->app_avg_us / 1000;
+	for (i = 0; i < n; i++)
+		covariance += pow(app[i] / 1000 - rp->usec, 2);
+	if (n > 1)
+		covariance /= n - 1;
+	deviation = sqrt(covariance);
+
+	/* ... low and high pass deviation based filter, calculates new rtt average */
+	for (i = 0; i < n; i++) {
+		if (fabs(app[i] / 1000 - rp->usec) <= deviation * opts.rtt_probe_opt.deviation_filter) {
+			d_tmp += app[i] / 1000;
+			++filtered;
+		}
+	}
+	if (filtered)
+		rp->usec = d_tmp / filtered;
+	rp->variance = covariance;
+
+	msg(LOUDISH, "average rtt: %.3fms (after filter), covariance: %.3fms^2, standard deviation %.3fms",
+			rp->usec, covariance, deviation);
+
+	msg(LOUDISH, "rtt application: min %.3fus p50 %.3fus p99 %.3fus max %.3fus (%u of %u probes)",
+			rp->app_min_us, rp->app_p50_us, rp->app_p99_us, rp->app_max_us, n, rp->sent);
+	msg(LOUDISH, "rtt kernel:      min %.3fus p50 %.3fus p99 %.3fus max %.3fus (%u of %u probes)",
+			rp->kernel_min_us, rp->kernel_p50_us, rp->kernel_p99_us, rp->kernel_max_us,
+			kernel_no, rp->sent);
+
+	for (i = 0; i < RTT_HIST_BUCKETS; i++)
+		max_count = max(max_count, rp->hist[i]);
+	for (i = 0; i < RTT_HIST_BUCKETS; i++) {
+		char bar[41];
+		unsigned int len;
+
+		if (!rp->hist[i])
+			continue;
+		len = (rp->hist[i] * 40 + max_count - 1) / max_count;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		msg(LOUDISH, "rtt %8u - %8u us: %6u %s", i ? 1U << i : 0, 2U << i,
+				rp->hist[i], bar);
+	}
+out:
+	free(app);
+	free(kernel);
+}
+
+
+/* This is the plan:
+** send n rtt packets into the wire - up to inflight at a time,
+** matched back by seq_no - and wait until all n reply packets
+** arrived. Over datagram sockets a probe without reply within
+** timeout_ms counts as lost.
+**
+** Every probe is timed twice: with CLOCK_MONOTONIC_RAW around the
+** write and read calls (application rtt) and - if the kernel
+** supports SO_TIMESTAMPING - with the software timestamps the
+** kernel took when the probe left and the reply arrived (kernel
+** rtt, without our syscall and wakeup latency).
+*/
+static int
+probe_rtt(int peer_fd, int next_hdr, int probe_no, uint16_t backing_data_size)
+{
+	struct rtt_ctx ctx;
+	uint16_t packet_len;
+	char rtt_buf[backing_data_size + sizeof(struct ns_rtt_probe)];
+	char *data_ptr = rtt_buf + sizeof(struct ns_rtt_probe);
+	int timeout_ms;
+	unsigned int inflight = opts.rtt_probe_opt.inflight;
+
+	if (probe_no <= 0)
+		err_msg_die(EXIT_FAILINT, "Programmed Failure");
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.fd = peer_fd;
+	ctx.dgram = opts.socktype != SOCK_STREAM;
+	ctx.next_hdr = next_hdr;
+	ctx.total = probe_no + 1;
+	ctx.samples = xzalloc(ctx.total * sizeof(struct rtt_sample));
+	ctx.probe = (struct ns_rtt_probe *) rtt_buf;
+
+	memset(ctx.probe, 0, sizeof(struct ns_rtt_probe));
+	memset(data_ptr, 'A', backing_data_size);
+
+	/* packet backing data MUST a multiple of four */
+	packet_len = ((uint16_t)(backing_data_size / 4)) * 4;
+	ctx.probe_len = packet_len + sizeof(struct ns_rtt_probe);
+
+	/* we announce packetsize in 4 byte slices (32bit)
+	** minus nse_nxt_hdr and nse_len header (4 byte)
+	*/
+	ctx.probe->nse_len = htons((ctx.probe_len - 4) / 4);
+
+	ctx.probe->ident = htons(getpid() & 0xffff);
+
+	timeout_ms = ctx.dgram ? opts.rtt_probe_opt.timeout_ms : TIMEOUT_SEC * 1000;
+
+	/* The first probe is a warm up and not counted: it pays for
+	** cold code paths (page faults, cache misses) in both
+	** processes. The 200ms extra it once showed were replies
+	** held back by Nagle at the peer, see process_rtt_probe().
+	*/
+	rtt_run(&ctx, 0, 1, 1, timeout_ms);
+
+#ifdef HAVE_SO_TIMESTAMPING
+	{
+		int outq = 0;
+
+		/* the reply acknowledged everything we sent, see rtt_tstamp_tx() */
+		if (ctx.dgram || (ioctl(peer_fd, TIOCOUTQ, &outq) == 0 && outq == 0))
+			ctx.tstamp = rtt_tstamp_set(peer_fd, RTT_TSTAMP_FLAGS);
+		ctx.tstamp_first = 1;
+	}
+#endif
+
+	rtt_run(&ctx, 1, ctx.total, inflight, timeout_ms);
+	if (ctx.dgram)
+		rtt_end_dgram(&ctx, timeout_ms);
+
+	/* the last transmit timestamps */
+	rtt_tstamp_tx(&ctx);
+
+#ifdef HAVE_SO_TIMESTAMPING
+	if (ctx.tstamp) {
+		rtt_tstamp_set(peer_fd, 0);
+		ctx.tstamp = false;
+		rtt_tstamp_tx(&ctx);
+	}
+#endif
+
+	rtt_stats(&ctx, probe_no);
+
+	free(ctx.samples);
+
+	return 0;
+}
+
+
+/* Datagram peers get the probes one per datagram and from an
+** unknown address: reflect them with sendto() until the last
+** probe, return its next header */
+static uint16_t
+rtt_reflect_dgram(int peer_fd)
+{
+	unsigned char *buf = xmalloc(UINT16_MAX);
+	struct ns_rtt_probe *probe = (struct ns_rtt_probe *) buf;
+	struct sockaddr_storage ss;
+	socklen_t ss_len;
+	ssize_t len;
+	uint16_t next_hdr;
+
+	for (;;) {
+		ss_len = sizeof(ss);
+		len = recvfrom(peer_fd, buf, UINT16_MAX, 0, (struct sockaddr *) &ss, &ss_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys_die(EXIT_FAILNET, "Can't read rtt probe");
+		}
+
+		if ((size_t)len < sizeof(*probe) || ntohs(probe->type) != RTT_REQUEST_TYPE ||
+			(size_t)ntohs(probe->nse_len) * 4 + 4 != (size_t)len) {
+			err_msg("received an corrupted rtt probe (%zd bytes), ignored", len);
+			continue;
+		}
+
+		next_hdr = ntohs(probe->nse_nxt_hdr);
+
+		msg(STRESSFUL, "process rtt probe (sequence: %d, packet_size: %zd)",
+				ntohs(probe->seq_no), len);
+
+		NS_PROBE2(rtt_reflect, ntohs(probe->seq_no), len);
+
+		probe->nse_nxt_hdr = 0;
+		probe->type = htons(RTT_REPLY_TYPE);
+		if (sendto(peer_fd, buf, len, 0, (struct sockaddr *) &ss, ss_len) != len)
+			err_sys("Can't reply to rtt probe");
+
+		if (next_hdr != NSE_NXT_RTT_PROBE)
+			break;
+	}
+
+	free(buf);
+	return next_hdr;
+}
+
+
+
+#define	RTT_PAYLOAD_SIZE 500
+#define	RTT_NO_PROBES 5
+
+
+#define	NSE_QUEUE_MAX 8
+
+/* Extension headers with a static content are queued and
+** chained by meta_exchange_snd() ahead of the rtt probes.
+** The first 4 octets of every queued header are filled in
+** at flush time (nse_nxt_hdr) or queue time (nse_len).
+*/
+static struct nse_queue_entry {
+	uint16_t type;
+	size_t len;
+	void *hdr;
+} nse_queue[NSE_QUEUE_MAX];
+static unsigned int nse_queue_len;
+
+static void
+nse_queue_add(uint16_t type, void *hdr, size_t len)
+{
+	uint16_t *common_ext_head = hdr;
+
+	if (nse_queue_len >= NSE_QUEUE_MAX || len < 4 || len % 4)
+		err_msg_die(EXIT_FAILINT, "Programmed Failure");
+
+	common_ext_head[1] = htons((len - 4) / 4);
+
+	nse_queue[nse_queue_len].type = type;
+	nse_queue[nse_queue_len].len = len;
+	nse_queue[nse_queue_len].hdr = hdr;
+	nse_queue_len++;
+}
+
+/* type of the first header in the chain */
+static uint16_t
+nse_queue_first(uint16_t last)
+{
+	return nse_queue_len ? nse_queue[0].type : last;
+}
+
+static void
+nse_queue_flush(int fd, uint16_t last)
+{
+	unsigned int i;
+
+	for (i = 0; i < nse_queue_len; i++) {
+		uint16_t *common_ext_head = nse_queue[i].hdr;
+		ssize_t len = nse_queue[i].len;
+
+		common_ext_head[0] = htons(i + 1 < nse_queue_len ?
+				nse_queue[i + 1].type : last);
+
+		if (writen(fd, nse_queue[i].hdr, len) != len)
+			err_msg_die(EXIT_FAILHEADER, "Can't send extension header %d!\n",
+					nse_queue[i].type);
+		free(nse_queue[i].hdr);
+	}
+	nse_queue_len = 0;
+}
+
+
+static void
+digest_to_str(const unsigned char *dgst, size_t len, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(buf + i * 2, "%02x", dgst[i]);
+	buf[len * 2] = 0;
+}
+
+
+/* announce the trailer digest, the digest itself is sent
+** by meta_digest_snd() after the last data byte */
+static void
+nse_queue_digest(void)
+{
+	struct ns_nxt_digest *dgst_hdr = xzalloc(sizeof(*dgst_hdr));
+
+	dgst_hdr->nse_dgst_type = opts.digest_type;
+	dgst_hdr->nse_dgst_len = hash_len(opts.digest_type);
+
+	nse_queue_add(NSE_NXT_DIGEST, dgst_hdr, sizeof(*dgst_hdr));
+}
+
+
+/* announce the block framing of the data stream (see
+** compress.c), the receiver decompresses transparently */
+static void
+nse_queue_compress(void)
+{
+	struct ns_nxt_compress *cmpr_hdr = xzalloc(sizeof(*cmpr_hdr));
+
+	cmpr_hdr->nse_cmpr_algo = NS_CMPR_LZ;
+	cmpr_hdr->nse_cmpr_block = htonl(opts.buffer_size ?
+			opts.buffer_size : DEFAULT_BUFSIZE);
+
+	nse_queue_add(NSE_NXT_COMPRESS, cmpr_hdr, sizeof(*cmpr_hdr));
+}
+
+
+/* announce the extent framing of the data stream (holes are
+** not transmitted), see trans_sparse() */
+static void
+nse_queue_sparse(void)
+{
+	struct ns_nxt_sparse *sprs_hdr = xzalloc(sizeof(*sprs_hdr));
+
+	nse_queue_add(NSE_NXT_SPARSE, sprs_hdr, sizeof(*sprs_hdr));
+}
+
+
+#define	CAPS_TIMEOUT_MS 5000
+#define	CAPS_CHUNK_MAX  (256 * 1024) /* largest chunk we pick ourself */
+#define	CAPS_CHUNK_LIMIT (64 * 1024 * 1024)
+
+static void
+caps_hdr_init(struct ns_nxt_caps *caps_hdr, uint8_t type, uint16_t next_hdr)
+{
+	memset(caps_hdr, 0, sizeof(*caps_hdr));
+	caps_hdr->nse_nxt_hdr = htons(next_hdr);
+	caps_hdr->nse_len = htons((sizeof(*caps_hdr) - 4) / 4);
+	caps_hdr->nse_caps_type = type;
+}
+
+
+/* the features our options ask for */
+static uint32_t
+caps_features(long mask)
+{
+	uint32_t features = 0;
+
+	if (mask & HDR_MSK_DIGEST)
+		features |= NS_CAP_DIGEST;
+	if (mask & HDR_MSK_COMPRESS)
+		features |= NS_CAP_COMPRESS;
+	if (mask & HDR_MSK_RESUME)
+		features |= NS_CAP_RESUME;
+	if (mask & HDR_MSK_DELTA)
+		features |= NS_CAP_DELTA;
+	if (mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO))
+		features |= NS_CAP_SPARSE;
+	if (mask & HDR_MSK_TREE)
+		features |= NS_CAP_TREE;
+	if (mask & HDR_MSK_BDP)
+		features |= NS_CAP_BDP;
+	if (mask & HDR_MSK_STATS)
+		features |= NS_CAP_STATS;
+
+	return features;
+}
+
+
+/* drop what the peer can't take - a directory is fatal */
+static void
+caps_features_apply(uint32_t features)
+{
+	if (opts.ext_hdr_mask & HDR_MSK_TREE && !(features & NS_CAP_TREE))
+		err_msg_die(EXIT_FAILOPT, "peer can't take a directory tree "
+				"(its output is not a directory)");
+
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST && !(features & NS_CAP_DIGEST)) {
+		err_msg("peer can't verify a digest, -D disabled");
+		opts.ext_hdr_mask &= ~HDR_MSK_DIGEST;
+	}
+	if (opts.ext_hdr_mask & HDR_MSK_COMPRESS && !(features & NS_CAP_COMPRESS)) {
+		err_msg("peer can't decompress, -z disabled");
+		opts.ext_hdr_mask &= ~HDR_MSK_COMPRESS;
+	}
+	if (opts.ext_hdr_mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO) && !(features & NS_CAP_SPARSE)) {
+		err_msg("peer can't take extents, -S and -Z disabled");
+		opts.ext_hdr_mask &= ~(HDR_MSK_SPARSE | HDR_MSK_ZERO);
+	}
+	/* no -R or -X at the peer: skip the round trip for nothing */
+	if (opts.ext_hdr_mask & HDR_MSK_RESUME && !(features & NS_CAP_RESUME)) {
+		msg(GENTLE, "peer doesn't resume into its output, send the whole file");
+		opts.ext_hdr_mask &= ~HDR_MSK_RESUME;
+	}
+	if (opts.ext_hdr_mask & HDR_MSK_DELTA && !(features & NS_CAP_DELTA)) {
+		msg(GENTLE, "peer has no old file to offer, send the whole file");
+		opts.ext_hdr_mask &= ~HDR_MSK_DELTA;
+	}
+	if (opts.ext_hdr_mask & HDR_MSK_BDP && !(features & NS_CAP_BDP)) {
+		err_msg("peer can't size its buffers, -B disabled");
+		opts.ext_hdr_mask &= ~HDR_MSK_BDP;
+	}
+	if (opts.ext_hdr_mask & HDR_MSK_STATS && !(features & NS_CAP_STATS)) {
+		msg(GENTLE, "peer doesn't exchange statistics, report our side only");
+		opts.ext_hdr_mask &= ~HDR_MSK_STATS;
+	}
+}
+
+
+/* our -b wins, then the one of the peer - otherwise a quarter
+** of its receive buffer, in whole blocks of its output */
+static uint32_t
+caps_chunk(const struct ns_nxt_caps *reply)
+{
+	uint32_t rcvbuf = ntohl(reply->nse_caps_rcvbuf);
+	uint32_t chunk = ntohl(reply->nse_caps_chunk);
+	uint32_t align = ntohl(reply->nse_caps_align);
+	bool fixed = reply->nse_caps_flags & CAPS_F_CHUNK_FIXED;
+
+	if (opts.buffer_size) {
+		if (fixed && chunk != (uint32_t)opts.buffer_size)
+			msg(GENTLE, "peer reads in chunks of %u bytes, we write %d bytes (-b)",
+					chunk, opts.buffer_size);
+		return opts.buffer_size;
+	}
+
+	if (fixed)
+		return chunk;
+
+	chunk = max(rcvbuf / 4, (uint32_t)DEFAULT_BUFSIZE);
+	chunk = min(chunk, (uint32_t)CAPS_CHUNK_MAX);
+	if (align && !(align & (align - 1)) && align <= chunk)
+		chunk &= ~(align - 1);
+
+	return chunk;
+}
+
+
+/* wait for the first octet of an answer */
+static bool
+wait_readable(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret == -1 && errno == EINTR);
+
+	return ret > 0;
+}
+
+
+#define	PPROBE_GAP_MS 10 /* between two groups, lets the bottleneck queue drain */
+#define	PPROBE_TIMEOUT_MS 1000
+#define	PPROBE_END_RETRIES 3
+
+static void
+pprobe_hdr_init(struct ns_pprobe *pp, uint8_t type, size_t len)
+{
+	memset(pp, 0, sizeof(*pp));
+	pp->nse_len = htons((len - 4) / 4);
+	pp->nse_pp_type = type;
+}
+
+/* one group back to back: a single sendmmsg() for all datagrams,
+** they share the filler */
+static void
+pprobe_send_group(int fd, uint8_t type, uint16_t group, unsigned int count,
+		struct ns_pprobe *hdrs, char *filler)
+{
+	struct mmsghdr msgs[MAX_PPROBE_TRAIN_LEN];
+	struct iovec iov[MAX_PPROBE_TRAIN_LEN][2];
+	size_t len = opts.pprobe_opt.size;
+	unsigned int i, sent = 0;
+	int ret;
+
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (i = 0; i < count; i++) {
+		pprobe_hdr_init(&hdrs[i], type, len);
+		hdrs[i].nse_nxt_hdr = htons(NSE_NXT_PPROBE);
+		hdrs[i].nse_pp_group = htons(group);
+		hdrs[i].nse_pp_index = htons(i);
+		hdrs[i].nse_pp_count = htons(count);
+		iov[i][0].iov_base = &hdrs[i];
+		iov[i][0].iov_len = sizeof(struct ns_pprobe);
+		iov[i][1].iov_base = filler;
+		iov[i][1].iov_len = len - sizeof(struct ns_pprobe);
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 2;
+	}
+
+	while (sent < count) {
+		ret = sendmmsg(fd, msgs + sent, count - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* e.g. ECONNREFUSED of an earlier group, the peer sees a gap */
+			err_sys("Can't send pair probe group %u", group);
+			return;
+		}
+		sent += ret;
+	}
+}
+
+/* Send the pairs and trains of -c, then PPROBE_END with the
+** next header until the PPROBE_REPORT arrives */
+static void
+probe_capacity(int fd, uint16_t next_hdr)
+{
+	unsigned int pairs = opts.pprobe_opt.pairs, trains = opts.pprobe_opt.trains;
+	unsigned int train_len = opts.pprobe_opt.train_len, group, i;
+	struct ns_pprobe hdrs[MAX_PPROBE_TRAIN_LEN], end, report;
+	struct timespec gap = { 0, PPROBE_GAP_MS * 1000000L };
+	char *filler;
+	ssize_t ret;
+
+	filler = xzalloc(opts.pprobe_opt.size);
+
+	msg(LOUDISH, "send %u packet pairs and %u trains of %u datagrams (%d bytes)",
+			pairs, trains, train_len, opts.pprobe_opt.size);
+
+	for (group = 0; group < pairs + trains; group++) {
+		if (group < pairs)
+			pprobe_send_group(fd, PPROBE_PAIR, group, 2, hdrs, filler);
+		else
+			pprobe_send_group(fd, PPROBE_TRAIN, group, train_len, hdrs, filler);
+		nanosleep(&gap, NULL);
+	}
+
+	free(filler);
+
+	pprobe_hdr_init(&end, PPROBE_END, sizeof(end));
+	end.nse_nxt_hdr = htons(next_hdr);
+	end.nse_pp_group = htons(pairs + trains);
+
+	for (i = 0; i < PPROBE_END_RETRIES; i++) {
+		if (writen(fd, &end, sizeof(end)) != sizeof(end))
+			err_sys("Can't send pair probe end");
+
+		while (wait_readable(fd, PPROBE_TIMEOUT_MS)) {
+			ret = read(fd, &report, sizeof(report));
+			if (ret == sizeof(report) && report.nse_pp_type == PPROBE_REPORT)
+				goto report;
+			if (ret < 0 && errno != EINTR)
+				break;
+		}
+	}
+
+	err_msg("receiver doesn't answer the pair probes, no capacity estimate");
+	return;
+
+report:
+	net_stat.pprobe.capacity = ntohl(report.nse_pp_capacity) * 1000.0;
+	net_stat.pprobe.adr = ntohl(report.nse_pp_adr) * 1000.0;
+	net_stat.pprobe.pairs = ntohs(report.nse_pp_pairs);
+	net_stat.pprobe.trains = ntohs(report.nse_pp_trains);
+
+	msg(GENTLE, "capacity %.1f Mbit/s (%u of %u pairs), dispersion rate %.1f Mbit/s "
+			"(%u of %u trains)", net_stat.pprobe.capacity / 1000000,
+			net_stat.pprobe.pairs, pairs, net_stat.pprobe.adr / 1000000,
+			net_stat.pprobe.trains, trains);
+}
+
+
+/* receive side of a pair or train */
+struct pprobe_group {
+	uint8_t type;
+	uint16_t count, next; /* next index expected */
+	bool broken; /* lost or reordered datagram */
+	bool kernel; /* all arrival times from the kernel */
+	struct timespec first, last;
+	struct timespec first_app, last_app;
+	size_t wire_len; /* datagram plus udp and ip header */
+};
+
+/* the median rate of the usable groups of one type in kbit/s */
+static uint32_t
+pprobe_median(struct pprobe_group *groups, unsigned int no, uint8_t type,
+		uint16_t *usable)
+{
+	double *rates = xmalloc(no * sizeof(double)), dt, median;
+	unsigned int i, n = 0;
+
+	for (i = 0; i < no; i++) {
+		struct pprobe_group *g = &groups[i];
+
+		if (g->type != type || g->count < 2 || g->broken || g->next != g->count)
+			continue;
+
+		dt = g->kernel ? ts_diff_us(&g->first, &g->last) :
+			ts_diff_us(&g->first_app, &g->last_app);
+		if (dt <= 0)
+			continue;
+
+		/* bits per microsecond is Mbit/s */
+		rates[n++] = (g->count - 1) * g->wire_len * 8.0 / dt;
+	}
+
+	*usable = n;
+	if (n == 0) {
+		free(rates);
+		return 0;
+	}
+
+	qsort(rates, n, sizeof(double), cmp_double);
+	median = percentile(rates, n, 50);
+	free(rates);
+
+	return (uint32_t) min(median * 1000.0, (double)UINT32_MAX);
+}
+
+/* Datagram peers measure the pairs and trains of probe_capacity()
+** as they arrive: kernel receive timestamps where available, a
+** clock_gettime() after the read otherwise. Returns the next
+** header of PPROBE_END */
+static uint16_t
+pprobe_measure_dgram(int peer_fd)
+{
+	unsigned char *buf = xmalloc(UINT16_MAX);
+	struct ns_pprobe *pp = (struct ns_pprobe *) buf, report;
+	struct pprobe_group *groups = xzalloc(MAX_PPROBE_GROUPS * sizeof(*groups));
+	struct sockaddr_storage ss;
+	struct timespec app, kernel;
+	struct msghdr msgh;
+	struct iovec iov;
+	char control[256];
+	uint16_t group_no, index, next_hdr, groups_seen = 0, pairs, trains;
+	uint32_t capacity, adr;
+	struct pprobe_group *g;
+	bool kernel_ok;
+	ssize_t len;
+
+#ifdef HAVE_SO_TIMESTAMPING
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+	/* datagrams already queued come without */
+	if (setsockopt(peer_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+		msg(GENTLE, "no kernel timestamps for the pair probes (%s)", strerror(errno));
+#endif
+
+	for (;;) {
+		iov.iov_base = buf;
+		iov.iov_len = UINT16_MAX;
+		memset(&msgh, 0, sizeof(msgh));
+		msgh.msg_name = &ss;
+		msgh.msg_namelen = sizeof(ss);
+		msgh.msg_iov = &iov;
+		msgh.msg_iovlen = 1;
+		msgh.msg_control = control;
+		msgh.msg_controllen = sizeof(control);
+
+		len = recvmsg(peer_fd, &msgh, 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys_die(EXIT_FAILNET, "Can't read pair probe");
+		}
+
+		if (clock_gettime(CLOCK_REALTIME, &app) != 0)
+			err_sys("Can't call clock_gettime");
+		kernel_ok = rtt_tstamp_cmsg(&msgh, &kernel);
+
+		if ((size_t)len < sizeof(*pp) || (size_t)ntohs(pp->nse_len) * 4 + 4 != (size_t)len) {
+			err_msg("received an corrupted pair probe (%zd bytes), ignored", len);
+			continue;
+		}
+
+		if (pp->nse_pp_type == PPROBE_END)
+			break;
+
+		group_no = ntohs(pp->nse_pp_group);
+		index = ntohs(pp->nse_pp_index);
+		if (group_no >= MAX_PPROBE_GROUPS || pp->nse_pp_type > PPROBE_TRAIN)
+			continue;
+
+		g = &groups[group_no];
+		if (group_no >= groups_seen)
+			groups_seen = group_no + 1;
+
+		if (index == 0 && g->count == 0) {
+			g->type = pp->nse_pp_type;
+			g->count = ntohs(pp->nse_pp_count);
+			g->kernel = kernel_ok;
+			g->first = kernel;
+			g->first_app = app;
+			g->wire_len = len + 8 + (ss.ss_family == AF_INET6 &&
+					!IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)&ss)->sin6_addr) ? 40 : 20);
+		} else if (index != g->next || g->count == 0) {
+			g->broken = true;
+			continue;
+		}
+
+		g->kernel = g->kernel && kernel_ok;
+		g->last = kernel;
+		g->last_app = app;
+		g->next = index + 1;
+
+		msg(STRESSFUL, "pair probe (group: %u, index: %u, size: %zd)", group_no, index, len);
+	}
+
+#ifdef HAVE_SO_TIMESTAMPING
+	flags = 0;
+	setsockopt(peer_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+#endif
+
+	next_hdr = ntohs(pp->nse_nxt_hdr);
+
+	pprobe_hdr_init(&report, PPROBE_REPORT, sizeof(report));
+	capacity = pprobe_median(groups, groups_seen, PPROBE_PAIR, &pairs);
+	adr = pprobe_median(groups, groups_seen, PPROBE_TRAIN, &trains);
+
+	msg(GENTLE, "capacity %u kbit/s (%u pairs), dispersion rate %u kbit/s (%u trains)",
+			capacity, pairs, adr, trains);
+
+	report.nse_pp_capacity = htonl(capacity);
+	report.nse_pp_adr = htonl(adr);
+	report.nse_pp_pairs = htons(pairs);
+	report.nse_pp_trains = htons(trains);
+
+	if (sendto(peer_fd, &report, sizeof(report), 0, (struct sockaddr *) &ss,
+				msgh.msg_namelen) != sizeof(report))
+		err_sys("Can't send pair probe report");
+
+	free(groups);
+	free(buf);
+
+	return next_hdr;
+}
+
+
+/* the CAPS_COMMIT goes first in the chain */
+static void
+caps_commit_queue(uint32_t chunk)
+{
+	struct ns_nxt_caps *commit = xzalloc(sizeof(*commit));
+
+	commit->nse_caps_type = CAPS_COMMIT;
+	commit->nse_caps_features = htonl(caps_features(opts.ext_hdr_mask));
+	commit->nse_caps_chunk = htonl(chunk);
+
+	nse_queue_add(NSE_NXT_CAPS, commit, sizeof(*commit));
+}
+
+
+/* The reply costs a round trip before anything else goes out:
+** ask only if it decides something - the write chunk of the rw
+** engine without our own -b, -R and -X which the receiver needs
+** as well. */
+static bool
+caps_wanted(void)
+{
+	return (!opts.buffer_size && opts.io_call == IO_RW) ||
+		opts.ext_hdr_mask & (HDR_MSK_RESUME | HDR_MSK_DELTA);
+}
+
+
+/* send the netsend header and the CAPS_REQUEST, adapt our settings
+** to the CAPS_REPLY and queue the CAPS_COMMIT as the first header
+** of the chain. An old receiver refuses the header (NS_MAGIC_CAPS)
+** and closes, one which doesn't answer within CAPS_TIMEOUT_MS gets
+** our own settings. */
+static void
+meta_caps_snd(int fd, const struct ns_hdr *ns_hdr)
+{
+	struct ns_nxt_caps caps_hdr;
+	ssize_t len = sizeof(caps_hdr);
+	uint32_t chunk = opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE;
+	unsigned char first[sizeof(*ns_hdr) + sizeof(caps_hdr)];
+
+	caps_hdr_init(&caps_hdr, CAPS_REQUEST, NSE_NXT_CAPS);
+	caps_hdr.nse_caps_features = htonl(caps_features(opts.ext_hdr_mask));
+	caps_hdr.nse_caps_chunk = htonl(chunk);
+
+	/* one segment - with tcp fast open (-F) the syn carries it */
+	memcpy(first, ns_hdr, sizeof(*ns_hdr));
+	memcpy(first + sizeof(*ns_hdr), &caps_hdr, len);
+	if (writen(fd, first, sizeof(first)) != sizeof(first))
+		err_msg_die(EXIT_FAILHEADER, "Can't send netsend header and capability request!\n");
+
+	if (wait_readable(fd, CAPS_TIMEOUT_MS)) {
+		if (readn(fd, &caps_hdr, len) != len)
+			err_msg_die(EXIT_FAILHEADER, "Can't read capability reply!\n");
+
+		if (caps_hdr.nse_caps_type != CAPS_REPLY ||
+			(size_t)ntohs(caps_hdr.nse_len) * 4 + 4 != sizeof(caps_hdr) ||
+			ntohl(caps_hdr.nse_caps_chunk) == 0 ||
+			ntohl(caps_hdr.nse_caps_chunk) > CAPS_CHUNK_LIMIT)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted capability reply");
+
+		caps_features_apply(ntohl(caps_hdr.nse_caps_features));
+		chunk = caps_chunk(&caps_hdr);
+
+		msg(GENTLE, "peer: receive buffer %u bytes, reads in %u byte chunks%s, "
+				"output block size %u, features 0x%x - we write in %u byte chunks",
+				ntohl(caps_hdr.nse_caps_rcvbuf), ntohl(caps_hdr.nse_caps_chunk),
+				caps_hdr.nse_caps_flags & CAPS_F_CHUNK_FIXED ? " (-b)" : "",
+				ntohl(caps_hdr.nse_caps_align), ntohl(caps_hdr.nse_caps_features), chunk);
+
+		/* the other engines write whole mappings or files */
+		if (!opts.buffer_size && opts.io_call == IO_RW)
+			opts.buffer_size = chunk;
+	} else {
+		err_msg("peer doesn't answer the capability request, keep our settings");
+		opts.ext_hdr_mask &= ~HDR_MSK_STATS;
+	}
+
+	caps_commit_queue(chunk);
+}
+
+
+/* announce a directory tree, see trans_tree() */
+static void
+nse_queue_tree(void)
+{
+	struct ns_nxt_tree *tree_hdr = xzalloc(sizeof(*tree_hdr));
+
+	nse_queue_add(NSE_NXT_TREE, tree_hdr, sizeof(*tree_hdr));
+}
+
+
+/* ask the receiver which data it already has - must be the
+** last queued header, meta_resume_snd() continues the chain */
+static void
+nse_queue_resume(void)
+{
+	struct ns_nxt_resume *rsm_hdr = xzalloc(sizeof(*rsm_hdr));
+
+	rsm_hdr->nse_rsm_type = RESUME_REQUEST;
+	rsm_hdr->nse_rsm_hash = RESUME_HASH;
+	rsm_hdr->nse_rsm_chunk_log = RESUME_CHUNK_LOG_DEF;
+
+	nse_queue_add(NSE_NXT_RESUME, rsm_hdr, sizeof(*rsm_hdr));
+}
+
+
+static void
+resume_hdr_offset(struct ns_nxt_resume *rsm_hdr, unsigned long long offset)
+{
+	rsm_hdr->nse_rsm_offset_hi = htonl((uint32_t)(offset >> 32));
+	rsm_hdr->nse_rsm_offset_lo = htonl((uint32_t)offset);
+}
+
+
+static unsigned long long
+resume_hdr_get_offset(const struct ns_nxt_resume *rsm_hdr)
+{
+	return (unsigned long long)ntohl(rsm_hdr->nse_rsm_offset_hi) << 32 |
+		ntohl(rsm_hdr->nse_rsm_offset_lo);
+}
+
+
+/* read the RESUME_REPLY, compare the hash tree with our file,
+** commit the offset and position file_fd there - the engines
+** start at the current file position */
+static void
+meta_resume_snd(int fd, int file_fd, uint16_t next_hdr)
+{
+	struct ns_nxt_resume rsm_hdr;
+	unsigned char root[RESUME_HASH_LEN], *tree;
+	unsigned int leaves, matched, chunk_log;
+	unsigned long long have, offset;
+	ssize_t len = sizeof(rsm_hdr);
+
+	if (readn(fd, &rsm_hdr, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't read resume reply!\n");
+
+	leaves = ntohl(rsm_hdr.nse_rsm_leaves);
+	chunk_log = rsm_hdr.nse_rsm_chunk_log;
+	have = resume_hdr_get_offset(&rsm_hdr);
+
+	if (rsm_hdr.nse_rsm_type != RESUME_REPLY ||
+		rsm_hdr.nse_rsm_hash != RESUME_HASH ||
+		leaves > RESUME_MAX_LEAVES ||
+		chunk_log < RESUME_CHUNK_LOG_MIN || chunk_log > RESUME_CHUNK_LOG_MAX ||
+		(size_t)ntohs(rsm_hdr.nse_len) * 4 + 4 !=
+				sizeof(rsm_hdr) + (leaves + 1) * RESUME_HASH_LEN)
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted resume reply");
+
+	len = (leaves + 1) * RESUME_HASH_LEN;
+	tree = xmalloc(len);
+	if (readn(fd, tree, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't read resume hash tree!\n");
+
+	resume_tree_root(tree + RESUME_HASH_LEN, leaves, root);
+	if (memcmp(root, tree, RESUME_HASH_LEN))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted resume hash tree");
+
+	matched = resume_leaves_match(file_fd, tree + RESUME_HASH_LEN, leaves, chunk_log);
+	offset = (unsigned long long)matched << chunk_log;
+	free(tree);
+
+	memset(&rsm_hdr, 0, sizeof(rsm_hdr));
+	rsm_hdr.nse_nxt_hdr = htons(next_hdr);
+	rsm_hdr.nse_len = htons((sizeof(rsm_hdr) - 4) / 4);
+	rsm_hdr.nse_rsm_type = RESUME_COMMIT;
+	rsm_hdr.nse_rsm_hash = RESUME_HASH;
+	rsm_hdr.nse_rsm_chunk_log = chunk_log;
+	resume_hdr_offset(&rsm_hdr, offset);
+
+	len = sizeof(rsm_hdr);
+	if (writen(fd, &rsm_hdr, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't send resume commit!\n");
+
+	if (lseek(file_fd, offset, SEEK_SET) == -1)
+		err_sys_die(EXIT_FAILMISC, "Can't seek to resume offset %llu", offset);
+
+	msg(GENTLE, "resume at offset %llu (peer has %llu bytes, %u of %u chunks match)",
+			offset, have, matched, leaves);
+}
+
+
+/* ask the receiver for the block signatures of its copy,
+** meta_delta_snd() reads the reply */
+static void
+nse_queue_delta(unsigned long long size)
+{
+	struct ns_nxt_delta *dlt_hdr = xzalloc(sizeof(*dlt_hdr));
+
+	dlt_hdr->nse_dlt_type = DELTA_REQUEST;
+	dlt_hdr->nse_dlt_strong_len = DELTA_STRONG_LEN;
+	dlt_hdr->nse_dlt_size_hi = htonl((uint32_t)(size >> 32));
+	dlt_hdr->nse_dlt_size_lo = htonl((uint32_t)size);
+
+	nse_queue_add(NSE_NXT_DELTA, dlt_hdr, sizeof(*dlt_hdr));
+}
+
+
+#define	DELTA_SIG_BATCH 4096
+
+/* read the DELTA_REPLY and index the signatures for delta_scan() */
+static void
+meta_delta_snd(int fd)
+{
+	struct ns_nxt_delta dlt_hdr;
+	struct ns_delta_sig *wire;
+	struct delta_sig *sigs;
+	unsigned long long old_size;
+	uint32_t i, j, n, block;
+	ssize_t len = sizeof(dlt_hdr);
+
+	if (readn(fd, &dlt_hdr, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't read delta reply!\n");
+
+	n = ntohl(dlt_hdr.nse_dlt_blocks);
+	block = ntohl(dlt_hdr.nse_dlt_block);
+	old_size = (unsigned long long)ntohl(dlt_hdr.nse_dlt_size_hi) << 32 |
+		ntohl(dlt_hdr.nse_dlt_size_lo);
+
+	if (dlt_hdr.nse_dlt_type != DELTA_REPLY ||
+		dlt_hdr.nse_dlt_strong_len != DELTA_STRONG_LEN ||
+		(size_t)ntohs(dlt_hdr.nse_len) * 4 + 4 != sizeof(dlt_hdr) ||
+		(n && (block < DELTA_BLOCK_MIN || block > DELTA_BLOCK_MAX ||
+			   old_size <= (unsigned long long)(n - 1) * block ||
+			   old_size > (unsigned long long)n * block)))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted delta reply");
+
+	sigs = xmalloc(sizeof(*sigs) * (n + 1));
+	wire = xmalloc(sizeof(*wire) * DELTA_SIG_BATCH);
+
+	for (i = 0; i < n; i += j) {
+		uint32_t batch = min(n - i, (uint32_t)DELTA_SIG_BATCH);
+
+		len = batch * sizeof(*wire);
+		if (readn(fd, wire, len) != len)
+			err_msg_die(EXIT_FAILHEADER, "Can't read delta signatures!\n");
+
+		for (j = 0; j < batch; j++) {
+			sigs[i + j].weak = ntohl(wire[j].weak);
+			memcpy(sigs[i + j].strong, wire[j].strong, DELTA_STRONG_LEN);
+		}
+	}
+	free(wire);
+
+	delta_index_build(sigs, n, n ? block : DELTA_BLOCK_MIN, old_size);
+
+	msg(GENTLE, "delta: peer has %llu bytes (%u blocks of %u bytes)",
+			old_size, n, block);
+}
+
+
+static size_t
+meta_digest_len(const struct peer_header_info *phi)
+{
+	if (phi->digest_type == HASH_NULL)
+		return 0;
+
+	return sizeof(struct ns_nxt_digest) + phi->digest_len;
+}
+
+
+/* number of octets the transmitter sends after the data:
+** the digest trailer first, then the statistics */
+size_t
+meta_trailer_len(const struct peer_header_info *phi)
+{
+	return meta_digest_len(phi) + (phi->stats ? sizeof(struct ns_nxt_stats) : 0);
+}
+
+
+void
+meta_digest_snd(int fd)
+{
+	char str[HASH_MAX_LEN * 2 + 1];
+	unsigned char buf[sizeof(struct ns_nxt_digest) + HASH_MAX_LEN];
+	struct ns_nxt_digest *dgst_hdr = (struct ns_nxt_digest *) buf;
+	unsigned char *dgst = buf + sizeof(struct ns_nxt_digest);
+	ssize_t len;
+
+	memset(dgst_hdr, 0, sizeof(*dgst_hdr));
+
+	len = digest_finish(dgst);
+
+	dgst_hdr->nse_nxt_hdr = htons(opts.ext_hdr_mask & HDR_MSK_STATS ?
+			NSE_NXT_STATS : NSE_NXT_NONXT);
+	dgst_hdr->nse_len = htons((sizeof(*dgst_hdr) - 4 + len) / 4);
+	dgst_hdr->nse_dgst_type = opts.digest_type;
+	dgst_hdr->nse_dgst_len = len;
+
+	len += sizeof(*dgst_hdr);
+	if (writen(fd, buf, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't send digest trailer!\n");
+
+	digest_to_str(dgst, dgst_hdr->nse_dgst_len, str);
+	msg(GENTLE, "%s digest: %s", hash_type_to_str(opts.digest_type), str);
+}
+
+
+static void stats_take(const struct ns_nxt_stats *);
+
+/* compare the trailer held back by the receive loop with our
+** own digest and take the statistics of the peer, returns -1
+** on a digest mismatch */
+int
+meta_trailer_check(const struct peer_header_info *phi, const void *trailer, size_t len)
+{
+	char str[HASH_MAX_LEN * 2 + 1];
+	unsigned char local[HASH_MAX_LEN];
+	const unsigned char *remote = (const unsigned char *) trailer + sizeof(struct ns_nxt_digest);
+	const struct ns_nxt_digest *dgst_hdr = trailer;
+	size_t digest_len = meta_digest_len(phi);
+
+	if (len != meta_trailer_len(phi)) {
+		err_msg("Trailer truncated (%zu of %zu bytes)", len, meta_trailer_len(phi));
+		if (phi->digest_type != HASH_NULL)
+			digest_finish(local);
+		return phi->digest_type == HASH_NULL ? 0 : -1;
+	}
+
+	if (phi->stats)
+		stats_take((const struct ns_nxt_stats *) ((const unsigned char *) trailer + digest_len));
+
+	if (phi->digest_type == HASH_NULL)
+		return 0;
+
+	digest_finish(local);
+
+	if (dgst_hdr->nse_dgst_type != phi->digest_type ||
+		dgst_hdr->nse_dgst_len != phi->digest_len) {
+		err_msg("Corrupted digest trailer (type %d, len %d)",
+				dgst_hdr->nse_dgst_type, dgst_hdr->nse_dgst_len);
+		return -1;
+	}
+
+	if (memcmp(local, remote, phi->digest_len)) {
+		digest_to_str(remote, phi->digest_len, str);
+		err_msg("%s digest mismatch, peer: %s", hash_type_to_str(phi->digest_type), str);
+		digest_to_str(local, phi->digest_len, str);
+		err_msg("%s digest mismatch, local: %s", hash_type_to_str(phi->digest_type), str);
+		return -1;
+	}
+
+	digest_to_str(local, phi->digest_len, str);
+	msg(GENTLE, "%s digest verified: %s", hash_type_to_str(phi->digest_type), str);
+	return 0;
+}
+
+
+/* a mismatch is fatal (EXIT_FAILDIGEST) */
+void
+meta_trailer_verify(const struct peer_header_info *phi, const void *trailer, size_t len)
+{
+	if (meta_trailer_check(phi, trailer, len))
+		exit(EXIT_FAILDIGEST);
+}
+
+
+static void
+stats_u64_set(uint32_t *hi, uint32_t *lo, unsigned long long val)
+{
+	*hi = htonl(val >> 32);
+	*lo = htonl(val & 0xffffffff);
+}
+
+
+static unsigned long long
+stats_u64_get(uint32_t hi, uint32_t lo)
+{
+	return (unsigned long long) ntohl(hi) << 32 | ntohl(lo);
+}
+
+
+static unsigned long long
+tv_diff_usec(struct timeval *end, struct timeval *start)
+{
+	struct timeval tv;
+
+	if (subtime(end, start, &tv))
+		return 0;
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+
+/* our counters of the transfer, touch_use_stat() took the times */
+static void
+stats_hdr_init(struct ns_nxt_stats *st_hdr, uint8_t type, uint16_t next_hdr)
+{
+	struct use_stat *start = &net_stat.use_stat_start, *end = &net_stat.use_stat_end;
+	bool tx = type == STATS_TX;
+	uint32_t hi, lo;
+	double rtt_ns = net_stat.rtt_probe.app_avg_us * 1000;
+
+	memset(st_hdr, 0, sizeof(*st_hdr));
+	st_hdr->nse_nxt_hdr = htons(next_hdr);
+	st_hdr->nse_len = htons((sizeof(*st_hdr) - 4) / 4);
+	st_hdr->nse_st_type = type;
+	st_hdr->nse_st_io_call = tx ? opts.io_call : 0;
+	st_hdr->nse_st_calls = htonl(tx ? net_stat.total_tx_calls : net_stat.total_rx_calls);
+	st_hdr->nse_st_rtt_ns = htonl(rtt_ns > UINT32_MAX ? UINT32_MAX : (uint32_t) rtt_ns);
+
+	/* the members are packed: go through locals rather than their addresses */
+	stats_u64_set(&hi, &lo, tx ? net_stat.total_tx_bytes : net_stat.total_rx_bytes);
+	st_hdr->nse_st_bytes_hi = hi;
+	st_hdr->nse_st_bytes_lo = lo;
+	stats_u64_set(&hi, &lo, tv_diff_usec(&end->time, &start->time));
+	st_hdr->nse_st_real_us_hi = hi;
+	st_hdr->nse_st_real_us_lo = lo;
+	stats_u64_set(&hi, &lo, tv_diff_usec(&end->ru.ru_utime, &start->ru.ru_utime));
+	st_hdr->nse_st_utime_us_hi = hi;
+	st_hdr->nse_st_utime_us_lo = lo;
+	stats_u64_set(&hi, &lo, tv_diff_usec(&end->ru.ru_stime, &start->ru.ru_stime));
+	st_hdr->nse_st_stime_us_hi = hi;
+	st_hdr->nse_st_stime_us_lo = lo;
+}
+
+
+static void
+stats_take(const struct ns_nxt_stats *st_hdr)
+{
+	struct peer_stat *ps = &net_stat.peer;
+
+	if (st_hdr->nse_st_type > STATS_RX || st_hdr->nse_st_io_call > IO_MAX ||
+		(size_t)ntohs(st_hdr->nse_len) * 4 + 4 != sizeof(*st_hdr)) {
+		err_msg("received corrupted statistics of the peer (type %d)",
+				st_hdr->nse_st_type);
+		return;
+	}
+
+	ps->transmit = st_hdr->nse_st_type == STATS_TX;
+	ps->io_call = st_hdr->nse_st_io_call;
+	ps->calls = ntohl(st_hdr->nse_st_calls);
+	ps->bytes = stats_u64_get(st_hdr->nse_st_bytes_hi, st_hdr->nse_st_bytes_lo);
+	ps->real_sec = stats_u64_get(st_hdr->nse_st_real_us_hi, st_hdr->nse_st_real_us_lo) / 1E6;
+	ps->utime_sec = stats_u64_get(st_hdr->nse_st_utime_us_hi, st_hdr->nse_st_utime_us_lo) / 1E6;
+	ps->stime_sec = stats_u64_get(st_hdr->nse_st_stime_us_hi, st_hdr->nse_st_stime_us_lo) / 1E6;
+	ps->rtt_us = ntohl(st_hdr->nse_st_rtt_ns) / 1E3;
+	ps->valid = true;
+
+	msg(LOUDISH, "peer %s %llu bytes in %u calls, real %.4f sec, cpu %.4f sec",
+			ps->transmit ? "sent" : "received", ps->bytes, ps->calls,
+			ps->real_sec, ps->utime_sec + ps->stime_sec);
+}
+
+
+#define	STATS_TIMEOUT_MS 10000
+
+/* After the data (and the digest trailer): our counters as
+** the last trailer, then the half close tells a receiver
+** without a size the end of the stream. The peer answers
+** with its counters or just closes - one which is stuck (in
+** a stalled output) gets STATS_TIMEOUT_MS. */
+void
+meta_stats_snd(int fd)
+{
+	struct ns_nxt_stats st_hdr;
+	ssize_t len = sizeof(st_hdr);
+
+	stats_hdr_init(&st_hdr, STATS_TX, NSE_NXT_NONXT);
+
+	if (writen(fd, &st_hdr, len) != len) {
+		err_sys("Can't send statistics trailer");
+		return;
+	}
+
+	if (shutdown(fd, SHUT_WR))
+		err_sys("Can't shut down the connection for writing");
+
+	if (!wait_readable(fd, STATS_TIMEOUT_MS)) {
+		err_msg("peer didn't answer within %d ms, report our side only",
+				STATS_TIMEOUT_MS);
+		return;
+	}
+
+	if (readn(fd, &st_hdr, len) != len || st_hdr.nse_st_type != STATS_RX) {
+		err_msg("peer sent no statistics, report our side only");
+		return;
+	}
+
+	stats_take(&st_hdr);
+}
+
+
+/* the receiver, once the data is written */
+void
+meta_stats_reply(int fd)
+{
+	struct ns_nxt_stats st_hdr;
+	ssize_t len = sizeof(st_hdr);
+
+	stats_hdr_init(&st_hdr, STATS_RX, 0);
+
+	if (writen(fd, &st_hdr, len) != len)
+		err_sys("Can't reply with our statistics");
+}
+
+
+#define	BDP_PROBE_MS 200 /* the second half is measured */
+#define	BDP_CHUNK    (64 * 1024)
+#define	BDP_BUF_MIN  (64 * 1024)
+#define	BDP_BUF_MAX  (1 << 30)
+
+/* third value of tcp_rmem or tcp_wmem: autotuning grows the
+** buffer up to it as long as nobody sets SO_RCVBUF/SO_SNDBUF */
+static int
+bdp_autotune_max(const char *path)
+{
+	FILE *fp;
+	int min_val, def_val, max_val = 0;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%d %d %d", &min_val, &def_val, &max_val) != 3)
+		max_val = 0;
+	fclose(fp);
+
+	return max_val;
+}
+
+
+/* Give the socket a buffer of want octets (as the kernel counts
+** them, it doubles the setsockopt() value). Setting the buffer
+** ends autotuning, so leave it alone if autotuning reaches want.
+** SO_*BUFFORCE passes net.core.*mem_max with CAP_NET_ADMIN. */
+static int
+bdp_size_buf(int fd, int optname, int force_optname, const char *autotune, int want)
+{
+	const char *name = optname == SO_SNDBUF ? "SO_SNDBUF" : "SO_RCVBUF";
+	int max = bdp_autotune_max(autotune), val = want / 2, cur = 0;
+	socklen_t optlen = sizeof(cur);
+
+	if (max >= want) {
+		msg(LOUDISH, "%s: autotuning reaches %d bytes (%s), %d needed",
+				name, max, autotune, want);
+		return max;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, force_optname, &val, sizeof(val)) &&
+		setsockopt(fd, SOL_SOCKET, optname, &val, sizeof(val)))
+		err_sys("Can't set %s to %d", name, val);
+
+	if (getsockopt(fd, SOL_SOCKET, optname, &cur, &optlen))
+		err_sys("Can't get %s", name);
+
+	if (cur < want)
+		err_msg("%s capped at %d bytes, %d needed (raise net.core.%s_max)",
+				name, cur, want, optname == SO_SNDBUF ? "wmem" : "rmem");
+
+	return cur;
+}
+
+
+/* The probe of the receive side: set the buffer, clamp the window
+** if autotuning left a buffer far beyond the path (a standing
+** queue otherwise builds up in front of the bottleneck) */
+static void
+bdp_apply_rcv(int fd, int want, int clamp, int *rcvbuf, int *clamped)
+{
+	int window;
+
+	*rcvbuf = bdp_size_buf(fd, SO_RCVBUF, SO_RCVBUFFORCE, "/proc/sys/net/ipv4/tcp_rmem", want);
+	*clamped = 0;
+
+	/* about half of the buffer is window */
+	window = *rcvbuf / 2;
+	if (clamp > 0 && window >= 2 * clamp) {
+		if (setsockopt(fd, IPPROTO_TCP, TCP_WINDOW_CLAMP, &clamp, sizeof(clamp)))
+			err_sys("Can't set TCP_WINDOW_CLAMP to %d", clamp);
+		else
+			*clamped = clamp;
+	}
+}
+
+
+/* bandwidth probe, see ns_nxt_bdp */
+static void
+meta_bdp_snd(int fd)
+{
+	struct ns_nxt_bdp *bdp_hdr, reply;
+	size_t len = sizeof(*bdp_hdr) + BDP_CHUNK;
+	unsigned char *buf = xzalloc(len);
+	struct timespec start, now;
+	double elapsed_ms = 0, rtt_us, usec;
+	unsigned long long bytes, sent = 0, want;
+	ssize_t rlen = sizeof(reply);
+	struct bdp_stat *bs = &net_stat.bdp;
+
+	bdp_hdr = (struct ns_nxt_bdp *) buf;
+	bdp_hdr->nse_nxt_hdr = htons(NSE_NXT_BDP);
+	bdp_hdr->nse_len = htons((len - 4) / 4);
+	bdp_hdr->nse_bdp_type = BDP_PROBE;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+		err_sys("Can't call clock_gettime");
+
+	do {
+		if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+			err_sys("Can't call clock_gettime");
+		elapsed_ms = ts_diff_us(&start, &now) / 1000;
+
+		bdp_hdr->nse_bdp_flags = elapsed_ms >= BDP_PROBE_MS / 2 ? BDP_F_MEASURE : 0;
+		if (elapsed_ms >= BDP_PROBE_MS)
+			bdp_hdr->nse_bdp_flags |= BDP_F_LAST;
+
+		if (writen(fd, buf, len) != (ssize_t)len)
+			err_msg_die(EXIT_FAILHEADER, "Can't send bandwidth probe!\n");
+		sent += len;
+	} while (!(bdp_hdr->nse_bdp_flags & BDP_F_LAST));
+
+	if (readn(fd, &reply, rlen) != rlen)
+		err_msg_die(EXIT_FAILHEADER, "Can't read bandwidth probe reply!\n");
+	if (reply.nse_bdp_type != BDP_REPLY ||
+		(size_t)ntohs(reply.nse_len) * 4 + 4 != sizeof(reply))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted bandwidth probe reply");
+
+	bytes = (unsigned long long)ntohl(reply.nse_bdp_bytes_hi) << 32 |
+		ntohl(reply.nse_bdp_bytes_lo);
+	usec = ntohl(reply.nse_bdp_usec);
+
+	/* a single measured chunk: take the whole probe from our side */
+	if (bytes == 0 || usec == 0) {
+		if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+			err_sys("Can't call clock_gettime");
+		bytes = sent;
+		usec = ts_diff_us(&start, &now);
+	}
+
+	/* the path without queues (pipelined probes wait behind each
+	** other), kernel timestamps are closest to it */
+	rtt_us = net_stat.rtt_probe.kernel_min_us ? : net_stat.rtt_probe.app_min_us;
+
+	bs->rate = bytes / (usec / 1000000);
+	bs->bdp = bs->rate * rtt_us / 1000000;
+
+	/* twice the bdp as window, the kernel keeps half the buffer
+	** for its overhead */
+	want = max(4 * bs->bdp, (unsigned long long)BDP_BUF_MIN);
+	want = min(want, (unsigned long long)BDP_BUF_MAX);
+
+	bs->sndbuf = bdp_size_buf(fd, SO_SNDBUF, SO_SNDBUFFORCE,
+			"/proc/sys/net/ipv4/tcp_wmem", (int)want);
+
+	memset(buf, 0, sizeof(*bdp_hdr));
+	bdp_hdr->nse_nxt_hdr = htons(NSE_NXT_DATA);
+	bdp_hdr->nse_len = htons((sizeof(*bdp_hdr) - 4) / 4);
+	bdp_hdr->nse_bdp_type = BDP_SET;
+	bdp_hdr->nse_bdp_rcvbuf = htonl((uint32_t)want);
+	bdp_hdr->nse_bdp_clamp = htonl((uint32_t)max(2 * bs->bdp, (unsigned long long)BDP_BUF_MIN));
+
+	rlen = sizeof(*bdp_hdr);
+	if (writen(fd, bdp_hdr, rlen) != rlen)
+		err_msg_die(EXIT_FAILHEADER, "Can't send buffer sizes!\n");
+
+	rlen = sizeof(reply);
+	if (readn(fd, &reply, rlen) != rlen)
+		err_msg_die(EXIT_FAILHEADER, "Can't read buffer size reply!\n");
+	if (reply.nse_bdp_type != BDP_SET_REPLY ||
+		(size_t)ntohs(reply.nse_len) * 4 + 4 != sizeof(reply))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted buffer size reply");
+
+	bs->rcvbuf = ntohl(reply.nse_bdp_rcvbuf);
+	bs->clamp = ntohl(reply.nse_bdp_clamp);
+
+	msg(GENTLE, "bdp: %.0f bytes/s x %.3fus rtt = %llu bytes - send buffer %d bytes, "
+			"peer receive buffer %d bytes, window clamp %d bytes",
+			bs->rate, rtt_us, bs->bdp, bs->sndbuf, bs->rcvbuf, bs->clamp);
+
+	free(buf);
+}
+
+
+/**
+ * meta_exchange_snd send header(s) information to the
+ * peer node. We definitive send our netsend header and
+ * 0 or more rtt probe packets to gather the current
+ * round trip time. The rtt probe results reach the peer
+ * with our statistics after the data (meta_stats_snd()).
+*/
+
+int
+meta_exchange_snd(int connected_fd, int file_fd)
+{
+	int ret = 0;
+	ssize_t len;
+	ssize_t file_size;
+	struct ns_hdr ns_hdr;
+	struct stat stat_buf;
+	int perform_rtt, perform_pprobe;
+	uint16_t data_hdr, pprobe_hdr;
+	bool caps_sent = false;
+
+	memset(&ns_hdr, 0, sizeof(struct ns_hdr));
+
+	/* fetch file size */
+	xfstat(file_fd, &stat_buf, opts.infile);
+
+	file_size = S_ISREG(stat_buf.st_mode) ? stat_buf.st_size : 0;
+
+
+	ns_hdr.magic = htons(NS_MAGIC);
+	/* FIXME: catch overflow */
+	ns_hdr.version = htons((uint16_t) strtol(VERSIONSTRING, (char **)NULL, 10));
+	ns_hdr.data_size = htonl(file_size);
+
+	perform_rtt = (opts.rtt_probe_opt.iterations > 0) ? 1 : 0;
+	perform_pprobe = (opts.pprobe_opt.pairs + opts.pprobe_opt.trains > 0) ? 1 : 0;
+
+	/* stream sockets negotiate the settings first if the answer
+	** decides something, the chain starts with our capability
+	** request. Else our settings go out at once, with a commit
+	** only for the statistics exchange. */
+	if (opts.socktype == SOCK_STREAM) {
+		if (caps_wanted()) {
+			ns_hdr.magic = htons(NS_MAGIC_CAPS);
+			ns_hdr.nse_nxt_hdr = htons(NSE_NXT_CAPS);
+			NS_PROBE1(hdr_snd, NSE_NXT_CAPS);
+			meta_caps_snd(connected_fd, &ns_hdr);
+			caps_sent = true;
+		} else if (opts.ext_hdr_mask & HDR_MSK_STATS) {
+			ns_hdr.magic = htons(NS_MAGIC_CAPS);
+			caps_commit_queue(opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE);
+		}
+	}
+
+	/* the tree engine frames the data itself */
+	if (opts.ext_hdr_mask & HDR_MSK_TREE) {
+		if (opts.ext_hdr_mask & (HDR_MSK_COMPRESS | HDR_MSK_RESUME |
+					HDR_MSK_DELTA | HDR_MSK_SPARSE | HDR_MSK_ZERO))
+			err_msg_die(EXIT_FAILOPT, "A directory can't be sent with -z, -R, -X, -S or -Z");
+		if (opts.socktype != SOCK_STREAM)
+			err_msg_die(EXIT_FAILOPT, "A directory requires a stream protocol (tcp, sctp "
+					"or tipc with SOCK_STREAM)");
+		nse_queue_tree();
+	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		nse_queue_digest();
+
+	if (opts.ext_hdr_mask & HDR_MSK_COMPRESS)
+		nse_queue_compress();
+
+	if (opts.ext_hdr_mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO)) {
+		if (!S_ISREG(stat_buf.st_mode))
+			err_msg_die(EXIT_FAILOPT, "-S and -Z require a regular input file");
+		nse_queue_sparse();
+	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_RESUME) {
+		if (!S_ISREG(stat_buf.st_mode))
+			err_msg_die(EXIT_FAILOPT, "-R requires a regular input file");
+		nse_queue_resume();
+	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_DELTA) {
+		if (!S_ISREG(stat_buf.st_mode))
+			err_msg_die(EXIT_FAILOPT, "-X requires a regular input file");
+		nse_queue_delta(stat_buf.st_size);
+	}
+
+	/* the queued extension headers are followed by the rtt probes
+	** and the pair probes (if any) */
+	pprobe_hdr = perform_pprobe ? NSE_NXT_PPROBE : NSE_NXT_DATA;
+	data_hdr = perform_rtt ? NSE_NXT_RTT_PROBE : pprobe_hdr;
+
+	if (!caps_sent) {
+		ns_hdr.nse_nxt_hdr = htons(nse_queue_first(data_hdr));
+
+		len = sizeof(struct ns_hdr);
+		if (writen(connected_fd, &ns_hdr, len) != len)
+			err_msg_die(EXIT_FAILHEADER, "Can't send netsend header!\n");
+		NS_PROBE1(hdr_snd, ntohs(ns_hdr.nse_nxt_hdr));
+	}
+
+	/* the resume request waits for the receivers reply,
+	** the chain continues with our commit */
+	if (opts.ext_hdr_mask & HDR_MSK_RESUME) {
+		nse_queue_flush(connected_fd, NSE_NXT_RESUME);
+		meta_resume_snd(connected_fd, file_fd, data_hdr);
+	} else {
+		nse_queue_flush(connected_fd, data_hdr);
+	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_DELTA)
+		meta_delta_snd(connected_fd);
+
+	phase_mark(PHASE_HEADERS);
+
+	/* probe for effective round trip time */
+	if (opts.rtt_probe_opt.iterations > 0) {
+		NS_PROBE1(hdr_snd, NSE_NXT_RTT_PROBE);
+
+		int flag_old = -1;
+
+		/* set TCP_NODELAY so tcp writes dont get buffered */
+		if (opts.protocol == IPPROTO_TCP) {
+			if ((flag_old = set_nodelay(connected_fd, 1)) < 0) {
+				err_sys("Can't set TCP_NODELAY for socket (ret: %d)",
+						flag_old);
+			}
+		}
+
+		probe_rtt(connected_fd, opts.ext_hdr_mask & HDR_MSK_BDP ? NSE_NXT_BDP : pprobe_hdr,
+				opts.rtt_probe_opt.iterations, opts.rtt_probe_opt.data_size);
+
+		/* and restore TCP_NOPUSH */
+		if (flag_old >= 0) {
+			if ((set_nodelay(connected_fd, flag_old)) < 0) {
+				err_sys("Can't set TCP_NODELAY for socket");
+			}
+		}
+
+		/* size the buffers from the rtt and a bandwidth probe */
+		if (opts.ext_hdr_mask & HDR_MSK_BDP) {
+			NS_PROBE1(hdr_snd, NSE_NXT_BDP);
+			meta_bdp_snd(connected_fd);
+		}
+	}
+
+	/* bottleneck capacity from packet pairs and trains */
+	if (perform_pprobe) {
+		NS_PROBE1(hdr_snd, NSE_NXT_PPROBE);
+		probe_capacity(connected_fd, NSE_NXT_DATA);
+	}
+
+	if (perform_rtt || perform_pprobe)
+		phase_mark(PHASE_PROBED);
+
+	NS_PROBE1(hdr_snd, NSE_NXT_DATA);
+
+	return ret;
+}
+
+/* receiver side of the bandwidth probe, see ns_nxt_bdp */
+static struct {
+	struct timespec start;
+	unsigned long long bytes;
+	bool started;
+} bdp_rcv;
+
+static int
+process_bdp(int peer_fd, uint16_t nse_len)
+{
+	struct ns_nxt_bdp bdp_hdr;
+	ssize_t to_read = sizeof(bdp_hdr) - 4;
+	size_t total = nse_len * 4 + 4, rest;
+	char sink[16 * 1024];
+	struct timespec now;
+	int rcvbuf, clamp;
+
+	if (total < sizeof(bdp_hdr))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted bdp header");
+
+	if (readn(peer_fd, (char *)&bdp_hdr + 4, to_read) != to_read)
+		return -1;
+
+	/* the filler of a probe */
+	for (rest = total - sizeof(bdp_hdr); rest > 0; rest -= to_read) {
+		to_read = min(rest, sizeof(sink));
+		if (readn(peer_fd, sink, to_read) != to_read)
+			return -1;
+	}
+
+	memset(&bdp_hdr, 0, 4);
+	bdp_hdr.nse_len = htons((sizeof(bdp_hdr) - 4) / 4);
+
+	switch (bdp_hdr.nse_bdp_type) {
+	case BDP_PROBE:
+		if (!(bdp_hdr.nse_bdp_flags & BDP_F_MEASURE))
+			return 0;
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+			err_sys("Can't call clock_gettime");
+
+		if (!bdp_rcv.started) {
+			bdp_rcv.started = true;
+			bdp_rcv.start = now;
+		} else {
+			bdp_rcv.bytes += total;
+		}
+
+		if (!(bdp_hdr.nse_bdp_flags & BDP_F_LAST))
+			return 0;
+
+		bdp_hdr.nse_bdp_type = BDP_REPLY;
+		bdp_hdr.nse_bdp_bytes_hi = htonl(bdp_rcv.bytes >> 32);
+		bdp_hdr.nse_bdp_bytes_lo = htonl(bdp_rcv.bytes & 0xffffffff);
+		bdp_hdr.nse_bdp_usec = htonl(bdp_rcv.bytes ? ts_diff_us(&bdp_rcv.start, &now) : 0);
+
+		msg(LOUDISH, "bandwidth probe: %llu bytes in %u us", bdp_rcv.bytes,
+				ntohl(bdp_hdr.nse_bdp_usec));
+		break;
+	case BDP_SET:
+		if (ntohl(bdp_hdr.nse_bdp_rcvbuf) > BDP_BUF_MAX ||
+			ntohl(bdp_hdr.nse_bdp_clamp) > BDP_BUF_MAX)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted bdp header");
+
+		bdp_apply_rcv(peer_fd, ntohl(bdp_hdr.nse_bdp_rcvbuf),
+				ntohl(bdp_hdr.nse_bdp_clamp), &rcvbuf, &clamp);
+
+		msg(GENTLE, "bdp: receive buffer %d bytes, window clamp %d bytes", rcvbuf, clamp);
+
+		bdp_hdr.nse_bdp_type = BDP_SET_REPLY;
+		bdp_hdr.nse_bdp_rcvbuf = htonl(rcvbuf);
+		bdp_hdr.nse_bdp_clamp = htonl(clamp);
+		break;
+	default:
+		err_msg_die(EXIT_FAILHEADER, "received an unknown bdp header (type %d)",
+				bdp_hdr.nse_bdp_type);
+	}
+
+	to_read = sizeof(bdp_hdr);
+	if (writen(peer_fd, &bdp_hdr, to_read) != to_read)
+		err_msg_die(EXIT_FAILHEADER, "Can't reply to bdp header!\n");
+
+	return 0;
 }
 
-/* This is the plan:
-** send n rtt packets into the wire and wait until all n reply packets
-** arrived. If a timeout occur we count this packet as lost
+
+/* probe_rtt read a rtt probe packet, set nse_nxt_hdr to zero,
+** nse_len to the current packet size and send it back to origin
 */
 static int
-probe_rtt(int peer_fd, int next_hdr, int probe_no, uint16_t backing_data_size)
+process_rtt_probe(int peer_fd, uint16_t nse_len)
 {
-	int i, j, current_next_hdr;
-	double rtt_ms[probe_no + 1], deviation = 0, covariance = 0;
-	double d_tmp = 0;
-	uint16_t packet_len; ssize_t to_write;
-	char rtt_buf[backing_data_size + sizeof(struct ns_rtt_probe)];
-	struct ns_rtt_probe *ns_rtt_probe = (struct ns_rtt_probe *) rtt_buf;
-	char *data_ptr = rtt_buf + sizeof(struct ns_rtt_probe);
+	int ret = 0;
+	static bool nodelay;
+	struct ns_rtt_probe *ns_rtt_probe_ptr;
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
 
-	if (probe_no <= 0)
-		err_msg_die(EXIT_FAILINT, "Programmed Failure");
+	if ((size_t)to_read + 4 < sizeof(*ns_rtt_probe_ptr))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted rtt probe");
 
-	memset(ns_rtt_probe, 0, sizeof(struct ns_rtt_probe));
-	memset(data_ptr, 'A', backing_data_size);
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
 
-	/* packet backing data MUST a multiple of four */
-	packet_len = ((uint16_t)(backing_data_size / 4)) * 4;
-	to_write = packet_len + sizeof(struct ns_rtt_probe);
+	/* an unacknowledged reply would hold back the next one
+	** until the delayed ACK of the peer (Nagle) */
+	if (!nodelay && opts.protocol == IPPROTO_TCP) {
+		if (set_nodelay(peer_fd, 1) < 0)
+			err_sys("Can't set TCP_NODELAY for socket");
+		nodelay = true;
+	}
 
-	/* we announce packetsize in 4 byte slices (32bit)
-	** minus nse_nxt_hdr and nse_len header (4 byte)
-	*/
-	ns_rtt_probe->nse_len = htons((to_write - 4) / 4);
+	ns_rtt_probe_ptr = (struct ns_rtt_probe *) buf;
 
-	ns_rtt_probe->ident = htons(getpid() & 0xffff);
+	msg(STRESSFUL, "process rtt probe (sequence: %d, type: %d packet_size: %d)",
+			ntohs(ns_rtt_probe_ptr->seq_no), ntohs(ns_rtt_probe_ptr->type), to_read);
 
-	current_next_hdr = NSE_NXT_RTT_PROBE;
+	NS_PROBE2(rtt_reflect, ntohs(ns_rtt_probe_ptr->seq_no), to_read + 4);
 
-	/* FIXME:
-	** The first rtt probe packet had nearly a rtt of additional
-	** 200ms. So we ignore the first packet silently and calculate
-	** rtt and variation. I think this increased measurement is caused
-	** by "cold code paths"[TM], but these is to validate.
-	*/
-	for (i = 0; i <= probe_no; ) {
+	ns_rtt_probe_ptr->type = htons(RTT_REPLY_TYPE);
+	ns_rtt_probe_ptr->nse_nxt_hdr = 0;
+	ns_rtt_probe_ptr->nse_len = htons(nse_len);
 
-		char reply_buf[to_write];
-		struct ns_rtt_probe *ns_rtt_reply;
-		ssize_t to_read = to_write;
-		struct timeval tv, tv_tmp, tv_res;
+	if (writen(peer_fd, buf, to_read + 4) != to_read + 4)
+		err_msg_die(EXIT_FAILHEADER, "Can't reply to rtt probe!\n");
 
-		if (i++ >= probe_no)
-			current_next_hdr = next_hdr;
+	return ret;
+}
 
-		ns_rtt_probe->nse_nxt_hdr = htons(current_next_hdr);
-		ns_rtt_probe->type = (htons((uint16_t)RTT_REQUEST_TYPE));
-		ns_rtt_probe->seq_no = htons(i);
 
-		/* set timeval for packet */
-		if (gettimeofday(&tv, NULL) != 0)
-			err_sys("Can't call gettimeofday");
+static int
+process_rtt_info(int peer_fd, uint16_t nse_len)
+{
+	char buf[nse_len * 4 + sizeof(uint16_t) * 2];
+	ssize_t to_read = nse_len * 4;
+	struct ns_rtt_info *ns_rtt_info;
 
-		ns_rtt_probe->sec = htonl(tv.tv_sec);
-		ns_rtt_probe->usec = htonl(tv.tv_usec);
+	if (readn(peer_fd, buf + sizeof(uint16_t) * 2, to_read) != to_read)
+		return -1;
 
-		/* transmitt rtt probe ... */
-		if (writen(peer_fd, ns_rtt_probe, to_write) != to_write)
-			err_msg_die(EXIT_FAILHEADER, "Can't send rtt extension header!\n");
+	ns_rtt_info = (struct ns_rtt_info *)buf;
 
-		/* ... and receive probe */
-		if (readn(peer_fd, reply_buf, to_read) != to_read)
-			return -1;
 
-		if (gettimeofday(&tv, NULL) != 0)
-			err_sys("Can't call gettimeofday");
+	return 0;
+}
 
-		ns_rtt_reply = (struct ns_rtt_probe *) reply_buf;
 
-		tv_tmp.tv_sec = ntohl(ns_rtt_reply->sec);
-		tv_tmp.tv_usec = ntohl(ns_rtt_reply->usec);
+static int
+process_digest(int peer_fd, uint16_t nse_len, struct peer_header_info *phi)
+{
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
+	struct ns_nxt_digest *dgst_hdr = (struct ns_nxt_digest *) buf;
 
-		subtime(&tv_tmp, &tv, &tv_res);
+	if (nse_len < 1)
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted digest header");
 
-		/* sanity check (ident) */
-		if (ntohs(ns_rtt_reply->ident) != (getpid() & 0xffff))
-			err_msg("received a unknown rtt probe reply (ident  should: %d is: %d)",
-					ntohs(ns_rtt_reply->ident),  (getpid() & 0xffff));
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
 
-		/* XXX: if you change something here, then check all counter
-		** variables, etc
-		*/
-		if (i == 1)
-			continue;
+	if (hash_len(dgst_hdr->nse_dgst_type) == 0 ||
+		hash_len(dgst_hdr->nse_dgst_type) != dgst_hdr->nse_dgst_len)
+		err_msg_die(EXIT_FAILHEADER, "peer requested an unsupported digest "
+				"(type: %d, len: %d)", dgst_hdr->nse_dgst_type, dgst_hdr->nse_dgst_len);
 
-		rtt_ms[i - 2] = (tv_res.tv_sec * 1000) + ((double)tv_res.tv_usec / 1000);
+	phi->digest_type = dgst_hdr->nse_dgst_type;
+	phi->digest_len = dgst_hdr->nse_dgst_len;
 
-		msg(STRESSFUL, "receive rtt reply probe (sequence: %d, len %d, rtt: %.3fms)",
-				ntohs(ns_rtt_reply->seq_no), to_read, rtt_ms[i - 2]);
+	msg(LOUDISH, "peer announced %s trailer digest", hash_type_to_str(phi->digest_type));
 
-	}
+	return 0;
+}
 
-	/* average */
-	for (j = 0; j < probe_no; j++)
-		net_stat.rtt_probe.usec += rtt_ms[j];
 
-	net_stat.rtt_probe.usec /= --j;
+/* the largest block a peer may announce - protects
+** the receiver from allocating absurd buffers */
+#define	MAX_CMPR_BLOCK (64 * 1024 * 1024)
 
-	/* ... covariance and standard deviation */
-	for (j = 0; j < probe_no; j++)
-		covariance += pow(rtt_ms[j] - net_stat.rtt_probe.usec, 2);
+static int
+process_compress(int peer_fd, uint16_t nse_len, struct peer_header_info *phi)
+{
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
+	struct ns_nxt_compress *cmpr_hdr = (struct ns_nxt_compress *) buf;
+	uint32_t block;
 
-	covariance /= --j;
-	deviation = sqrt(covariance);
+	if (nse_len < 2)
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted compression header");
 
-	d_tmp = 0;
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
 
-	/* low and high pass deviation based filter, calculates new rtt average */
-	for (j = 0, i = 0; j < probe_no; j++) {
+	block = ntohl(cmpr_hdr->nse_cmpr_block);
+	if (cmpr_hdr->nse_cmpr_algo != NS_CMPR_LZ || block == 0 || block > MAX_CMPR_BLOCK)
+		err_msg_die(EXIT_FAILHEADER, "peer requested an unsupported compression "
+				"(algorithm: %d, block size: %u)", cmpr_hdr->nse_cmpr_algo, block);
 
-		if (((rtt_ms[j] > net_stat.rtt_probe.usec) &&
-			(rtt_ms[j] < (net_stat.rtt_probe.usec +
-				(deviation * opts.rtt_probe_opt.deviation_filter)))) ||
-		   ((rtt_ms[j] < net_stat.rtt_probe.usec) &&
-			(rtt_ms[j] > (net_stat.rtt_probe.usec -
-				(deviation * opts.rtt_probe_opt.deviation_filter))))) {
-			d_tmp += rtt_ms[j];
-			++i;
-		}
-	}
-	net_stat.rtt_probe.usec = d_tmp / i;
+	phi->compress_algo = cmpr_hdr->nse_cmpr_algo;
+	phi->compress_block = block;
 
-	msg(LOUDISH, "average rtt: %.3fms (after filter), covariance: %.3fms^2, standard deviation %.3fms",
-			net_stat.rtt_probe.usec, covariance, deviation);
+	msg(LOUDISH, "peer announced compressed data stream (block size %u)", block);
 
 	return 0;
 }
 
 
-#define	TIMEOUT_SEC 10
-
-static void
-timout_handler(int sig_no)
+static int
+process_sparse(int peer_fd, uint16_t nse_len, struct peer_header_info *phi)
 {
-	if (sig_no != SIGALRM)
-		err_msg_die(EXIT_FAILINT, "Programmed error (received an unknow signal)");
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
 
-	alarm(TIMEOUT_SEC);
+	if ((size_t)to_read + 4 < sizeof(struct ns_nxt_sparse))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted sparse header");
 
-	msg(STRESSFUL, "timout occure while wait for rtt probe response");
-}
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
 
-#define	RTT_PAYLOAD_SIZE 500
-#define	RTT_NO_PROBES 5
+	phi->sparse = 1;
+
+	msg(LOUDISH, "peer announced extent framed data stream");
+
+	return 0;
+}
 
 
 static int
-send_rtt_info(int fd, int next_hdr, struct rtt_probe *rtt_probe)
+process_tree(int peer_fd, uint16_t nse_len, struct peer_header_info *phi)
 {
-	(void) fd;
-	(void) next_hdr;
-	(void) rtt_probe;
-	return -1;
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
+
+	if ((size_t)to_read + 4 < sizeof(struct ns_nxt_tree))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted tree header");
+
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
+
+	phi->tree = 1;
+
+	msg(LOUDISH, "peer announced a directory tree");
+
+	return 0;
 }
 
-/**
- * meta_exchange_snd send header(s) information to the
- * peer node. We definitive send our netsend header and
- * 0 or more rtt probe packets to gather the current
- * round trip time. If we send rtt probes we transmit the
- * results also to the peer node.
-*/
 
-int
-meta_exchange_snd(int connected_fd, int file_fd)
+/* resume and delta need an existing regular output file which
+** we may read (see open_output_file()) */
+static bool
+output_reusable(int file_fd)
 {
-	int ret = 0;
-	ssize_t len;
-	ssize_t file_size;
-	struct ns_hdr ns_hdr;
 	struct stat stat_buf;
-	int perform_rtt;
 
-	memset(&ns_hdr, 0, sizeof(struct ns_hdr));
+	return fstat(file_fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode) &&
+		(fcntl(file_fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+}
 
-	/* fetch file size */
-	xfstat(file_fd, &stat_buf, opts.infile);
 
-	file_size = S_ISREG(stat_buf.st_mode) ? stat_buf.st_size : 0;
+/* answer a CAPS_REQUEST with what we take and how we read */
+static void
+caps_reply(int peer_fd, int file_fd)
+{
+	struct ns_nxt_caps caps_hdr;
+	struct stat stat_buf;
+	uint32_t features = NS_CAP_DIGEST | NS_CAP_COMPRESS | NS_CAP_SPARSE | NS_CAP_BDP;
+	int rcvbuf = 0;
+	socklen_t optlen = sizeof(rcvbuf);
+	ssize_t len = sizeof(caps_hdr);
+	bool dir = false;
+
+	caps_hdr_init(&caps_hdr, CAPS_REPLY, 0);
+
+	if (fstat(file_fd, &stat_buf) == 0) {
+		dir = S_ISDIR(stat_buf.st_mode);
+		if (S_ISREG(stat_buf.st_mode) || dir)
+			caps_hdr.nse_caps_align = htonl(stat_buf.st_blksize);
+	}
 
+	if (dir)
+		features |= NS_CAP_TREE;
+	if (opts.ext_hdr_mask & HDR_MSK_RESUME && output_reusable(file_fd))
+		features |= NS_CAP_RESUME;
+	if (opts.ext_hdr_mask & HDR_MSK_DELTA && opts.outfile && output_reusable(file_fd))
+		features |= NS_CAP_DELTA;
+	/* needs the half close of the transmitter */
+	if (opts.protocol == IPPROTO_TCP)
+		features |= NS_CAP_STATS;
 
-	ns_hdr.magic = htons(NS_MAGIC);
-	/* FIXME: catch overflow */
-	ns_hdr.version = htons((uint16_t) strtol(VERSIONSTRING, (char **)NULL, 10));
-	ns_hdr.data_size = htonl(file_size);
+	if (getsockopt(peer_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen))
+		rcvbuf = 0;
 
-	perform_rtt = (opts.rtt_probe_opt.iterations > 0) ? 1 : 0;
+	caps_hdr.nse_caps_flags = opts.buffer_size ? CAPS_F_CHUNK_FIXED : 0;
+	caps_hdr.nse_caps_features = htonl(features);
+	caps_hdr.nse_caps_rcvbuf = htonl(rcvbuf);
+	caps_hdr.nse_caps_chunk = htonl(opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE);
 
+	if (writen(peer_fd, &caps_hdr, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't reply to capability request!\n");
 
-	ns_hdr.nse_nxt_hdr = perform_rtt ? htons(NSE_NXT_RTT_PROBE) : htons(NSE_NXT_DATA);
+	msg(LOUDISH, "capabilities: receive buffer %d bytes, features 0x%x", rcvbuf, features);
+}
 
-	len = sizeof(struct ns_hdr);
-	if (writen(connected_fd, &ns_hdr, len) != len)
-		err_msg_die(EXIT_FAILHEADER, "Can't send netsend header!\n");
 
-	/* probe for effective round trip time */
-	if (opts.rtt_probe_opt.iterations > 0) {
+static int
+process_caps(int peer_fd, int file_fd, uint16_t nse_len,
+		struct peer_header_info *phi)
+{
+	char buf[nse_len * 4 + 4];
+	ssize_t to_read = nse_len * 4;
+	struct ns_nxt_caps *caps_hdr = (struct ns_nxt_caps *) buf;
+	uint32_t chunk;
 
-		int flag_old;
-		struct sigaction sa;
+	if ((size_t)to_read + 4 < sizeof(*caps_hdr))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted capability header");
 
-		/* initialize signalhandler for timeout handling */
-		sigemptyset(&sa.sa_mask);
-		sa.sa_flags = SA_INTERRUPT;	/* don't restart system calls */
-		sa.sa_handler = timout_handler;
-		if (sigaction(SIGALRM, &sa, NULL) != 0)
-			err_sys("Can't add signal handler");
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
+		return -1;
 
-		/* set TCP_NODELAY so tcp writes dont get buffered */
-		if (opts.protocol == IPPROTO_TCP) {
-			if ((flag_old = set_nodelay(connected_fd, 1)) < 0) {
-				err_sys("Can't set TCP_NODELAY for socket (ret: %d)",
-						flag_old);
-			}
-		}
+	switch (caps_hdr->nse_caps_type) {
+	case CAPS_REQUEST:
+		caps_reply(peer_fd, file_fd);
+		break;
+	case CAPS_COMMIT:
+		chunk = ntohl(caps_hdr->nse_caps_chunk);
+		if (chunk == 0 || chunk > CAPS_CHUNK_LIMIT)
+			err_msg_die(EXIT_FAILHEADER, "peer commits to an invalid chunk size (%u)", chunk);
+		phi->chunk = chunk;
+		phi->stats = !!(ntohl(caps_hdr->nse_caps_features) & NS_CAP_STATS);
+		msg(LOUDISH, "peer writes in %u byte chunks (features 0x%x)",
+				chunk, ntohl(caps_hdr->nse_caps_features));
+		break;
+	default:
+		err_msg_die(EXIT_FAILHEADER, "received an unknown capability header (type %d)",
+				caps_hdr->nse_caps_type);
+	}
 
-		alarm(TIMEOUT_SEC);
-		probe_rtt(connected_fd, NSE_NXT_DATA,
-				opts.rtt_probe_opt.iterations, opts.rtt_probe_opt.data_size);
-		alarm(0);
+	return 0;
+}
 
-		/* and restore TCP_NOPUSH */
-		if (opts.protocol == IPPROTO_TCP) {
-			if ((set_nodelay(connected_fd, flag_old)) < 0) {
-				err_sys("Can't set TCP_NODELAY for socket");
-			}
-		}
 
-		/* transmitt our rtt probe results to our peer */
-		send_rtt_info(connected_fd, NSE_NXT_DATA, &net_stat.rtt_probe);
+/* answer a RESUME_REQUEST with the hash tree over the data we
+** have - only if the user allowed to resume into the file */
+static void
+resume_reply(int peer_fd, int file_fd, unsigned int chunk_log,
+		struct peer_header_info *phi)
+{
+	struct stat stat_buf;
+	struct ns_nxt_resume *rsm_hdr;
+	unsigned long long have = 0;
+	unsigned char *buf, *root;
+	unsigned int leaves;
+	ssize_t len;
 
-	}
+	if (opts.ext_hdr_mask & HDR_MSK_RESUME && output_reusable(file_fd) &&
+		fstat(file_fd, &stat_buf) == 0)
+		have = stat_buf.st_size;
 
-	/* XXX: add shasum next header if opts.sha, modify nse_nxt_hdr processing */
+	chunk_log = resume_chunk_log(have, chunk_log);
 
-	return ret;
+	buf = xzalloc(sizeof(*rsm_hdr) + (RESUME_MAX_LEAVES + 1) * RESUME_HASH_LEN);
+	rsm_hdr = (struct ns_nxt_resume *) buf;
+	root = buf + sizeof(*rsm_hdr);
+
+	leaves = resume_leaves_build(file_fd, have, chunk_log, root + RESUME_HASH_LEN);
+	resume_tree_root(root + RESUME_HASH_LEN, leaves, root);
+
+	phi->resume_have = (unsigned long long)leaves << chunk_log;
+
+	len = sizeof(*rsm_hdr) + (leaves + 1) * RESUME_HASH_LEN;
+	rsm_hdr->nse_nxt_hdr = 0;
+	rsm_hdr->nse_len = htons((len - 4) / 4);
+	rsm_hdr->nse_rsm_type = RESUME_REPLY;
+	rsm_hdr->nse_rsm_hash = RESUME_HASH;
+	rsm_hdr->nse_rsm_chunk_log = chunk_log;
+	rsm_hdr->nse_rsm_leaves = htonl(leaves);
+	resume_hdr_offset(rsm_hdr, phi->resume_have);
+
+	if (writen(peer_fd, buf, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't reply to resume request!\n");
+	free(buf);
+
+	msg(GENTLE, "resume: offer %llu of %llu bytes (%u chunks of %llu bytes)",
+			phi->resume_have, have, leaves, 1ULL << chunk_log);
 }
 
-/* probe_rtt read a rtt probe packet, set nse_nxt_hdr to zero,
-** nse_len to the current packet size and send it back to origin
-*/
+
 static int
-process_rtt_probe(int peer_fd, uint16_t nse_len)
+process_resume(int peer_fd, int file_fd, uint16_t nse_len,
+		struct peer_header_info *phi)
 {
-	int ret = 0; uint16_t *intptr;
-	struct ns_rtt_probe *ns_rtt_probe_ptr;
 	char buf[nse_len * 4 + 4];
 	ssize_t to_read = nse_len * 4;
+	struct ns_nxt_resume *rsm_hdr = (struct ns_nxt_resume *) buf;
+	unsigned long long offset;
 
+	if ((size_t)to_read + 4 < sizeof(*rsm_hdr))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted resume header");
 
 	if (readn(peer_fd, buf + 4, to_read) != to_read)
 		return -1;
 
-	ns_rtt_probe_ptr = (struct ns_rtt_probe *) buf;
+	switch (rsm_hdr->nse_rsm_type) {
+	case RESUME_REQUEST:
+		resume_reply(peer_fd, file_fd, rsm_hdr->nse_rsm_chunk_log, phi);
+		break;
+	case RESUME_COMMIT:
+		offset = resume_hdr_get_offset(rsm_hdr);
+		if (offset > phi->resume_have)
+			err_msg_die(EXIT_FAILHEADER, "peer resumes at offset %llu, "
+					"but we offered %llu bytes only", offset, phi->resume_have);
+		if (opts.ext_hdr_mask & HDR_MSK_RESUME)
+			truncate_output_file(file_fd, offset);
+		phi->resume_offset = offset;
+		phi->resumed = 1;
+		msg(GENTLE, "resume at offset %llu", offset);
+		break;
+	default:
+		err_msg_die(EXIT_FAILHEADER, "received an unknown resume header (type %d)",
+				rsm_hdr->nse_rsm_type);
+	}
 
-	msg(STRESSFUL, "process rtt probe (sequence: %d, type: %d packet_size: %d)",
-			ntohs(ns_rtt_probe_ptr->seq_no), ntohs(ns_rtt_probe_ptr->type), to_read);
+	return 0;
+}
 
-	ns_rtt_probe_ptr->type = htons(RTT_REPLY_TYPE);
 
-	intptr = (uint16_t *)buf;
-	*intptr = 0;
+/* answer a DELTA_REQUEST with the block signatures of our file -
+** only if the user allowed it and we can rename over the file */
+static void
+delta_reply(int peer_fd, int file_fd, struct peer_header_info *phi)
+{
+	struct stat stat_buf;
+	struct ns_nxt_delta dlt_hdr;
+	struct ns_delta_sig *wire;
+	unsigned char *buf;
+	unsigned long long have = 0, off;
+	uint32_t i, j, n = 0, block;
+	ssize_t len;
 
-	intptr = (uint16_t *)buf + sizeof(uint16_t);
-	*intptr = htons(nse_len);
+	if (opts.ext_hdr_mask & HDR_MSK_DELTA && opts.outfile &&
+		output_reusable(file_fd) && fstat(file_fd, &stat_buf) == 0)
+		have = stat_buf.st_size;
 
-	if (writen(peer_fd, buf, to_read + 4) != to_read + 4)
-		err_msg_die(EXIT_FAILHEADER, "Can't reply to rtt probe!\n");
+	block = delta_block_size(have);
+	n = (have + block - 1) / block;
 
-	return ret;
+	memset(&dlt_hdr, 0, sizeof(dlt_hdr));
+	dlt_hdr.nse_len = htons((sizeof(dlt_hdr) - 4) / 4);
+	dlt_hdr.nse_dlt_type = DELTA_REPLY;
+	dlt_hdr.nse_dlt_strong_len = DELTA_STRONG_LEN;
+	dlt_hdr.nse_dlt_block = htonl(block);
+	dlt_hdr.nse_dlt_blocks = htonl(n);
+	dlt_hdr.nse_dlt_size_hi = htonl((uint32_t)(have >> 32));
+	dlt_hdr.nse_dlt_size_lo = htonl((uint32_t)have);
+
+	len = sizeof(dlt_hdr);
+	if (writen(peer_fd, &dlt_hdr, len) != len)
+		err_msg_die(EXIT_FAILHEADER, "Can't reply to delta request!\n");
+
+	buf = xmalloc(block);
+	wire = xmalloc(sizeof(*wire) * DELTA_SIG_BATCH);
+
+	for (i = 0, off = 0; i < n; i += j) {
+		uint32_t batch = min(n - i, (uint32_t)DELTA_SIG_BATCH);
+
+		for (j = 0; j < batch; j++, off += block) {
+			size_t blen = min((unsigned long long)block, have - off);
+
+			if (pread(file_fd, buf, blen, off) != (ssize_t)blen)
+				err_sys_die(EXIT_FAILMISC, "delta: pread at offset %llu failed", off);
+
+			wire[j].weak = htonl(delta_weak(buf, blen));
+			delta_strong(buf, blen, wire[j].strong);
+		}
+
+		len = batch * sizeof(*wire);
+		if (writen(peer_fd, wire, len) != len)
+			err_msg_die(EXIT_FAILHEADER, "Can't send delta signatures!\n");
+	}
+
+	free(wire);
+	free(buf);
+
+	phi->delta_block = block;
+	phi->delta_blocks = n;
+	phi->delta_old_size = have;
+
+	msg(GENTLE, "delta: offer %llu bytes (%u blocks of %u bytes)", have, n, block);
 }
 
 
 static int
-process_rtt_info(int peer_fd, uint16_t nse_len)
+process_delta(int peer_fd, int file_fd, uint16_t nse_len,
+		struct peer_header_info *phi)
 {
-	char buf[nse_len * 4 + sizeof(uint16_t) * 2];
+	char buf[nse_len * 4 + 4];
 	ssize_t to_read = nse_len * 4;
-	struct ns_rtt_info *ns_rtt_info;
+	struct ns_nxt_delta *dlt_hdr = (struct ns_nxt_delta *) buf;
 
-	if (readn(peer_fd, buf + sizeof(uint16_t) * 2, to_read) != to_read)
+	if ((size_t)to_read + 4 < sizeof(*dlt_hdr))
+		err_msg_die(EXIT_FAILHEADER, "received an corrupted delta header");
+
+	if (readn(peer_fd, buf + 4, to_read) != to_read)
 		return -1;
 
-	ns_rtt_info = (struct ns_rtt_info *)buf;
+	if (dlt_hdr->nse_dlt_type != DELTA_REQUEST ||
+		dlt_hdr->nse_dlt_strong_len != DELTA_STRONG_LEN)
+		err_msg_die(EXIT_FAILHEADER, "received an unknown delta header (type %d)",
+				dlt_hdr->nse_dlt_type);
 
+	delta_reply(peer_fd, file_fd, phi);
+	phi->delta = 1;
 
 	return 0;
 }
@@ -391,8 +2540,11 @@ process_rtt_info(int peer_fd, uint16_t nse_len)
 static int
 process_nonxt(int peer_fd, uint16_t nse_len)
 {
-	char buf[nse_len];
-	ssize_t to_read = nse_len;
+	char buf[nse_len * 4 + 1];
+	ssize_t to_read = nse_len * 4;
+
+	if (to_read == 0)
+		return 0;
 
 	if (readn(peer_fd, buf, to_read) != to_read)
 		return -1;
@@ -404,7 +2556,7 @@ process_nonxt(int peer_fd, uint16_t nse_len)
 
 /* return -1 if a failure occure, zero apart from that */
 int
-meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
+meta_exchange_rcv(int peer_fd, int file_fd, struct peer_header_info **hi)
 {
 	int ret;
 	int invalid_ext_seen = 0;
@@ -429,7 +2581,7 @@ meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
 		return -1;
 
 	/* ns header is in -> sanity checks and look if peer specified extension header */
-	if (ntohs(ns_hdr.magic) != NS_MAGIC) {
+	if (ntohs(ns_hdr.magic) != NS_MAGIC && ntohs(ns_hdr.magic) != NS_MAGIC_CAPS) {
 		err_msg_die(EXIT_FAILHEADER, "received an corrupted header"
 				"(should %d but is %d)!\n", NS_MAGIC, ntohs(ns_hdr.magic));
 	}
@@ -441,6 +2593,7 @@ meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
 
 
 	extension_type = ntohs(ns_hdr.nse_nxt_hdr);
+	NS_PROBE2(hdr_rcv, extension_type, sizeof(struct ns_hdr));
 
 	if (extension_type == NSE_NXT_DATA) {
 		msg(STRESSFUL, "end of extension header processing (NSE_NXT_DATA, no extension header)");
@@ -453,6 +2606,26 @@ meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
 		uint16_t common_ext_head[2];
 		to_read = sizeof(uint16_t) * 2;
 
+		/* a datagram carries a whole probe, see rtt_reflect_dgram() */
+		if (extension_type == NSE_NXT_RTT_PROBE && opts.socktype != SOCK_STREAM) {
+			extension_type = rtt_reflect_dgram(peer_fd);
+			if (extension_type == NSE_NXT_DATA) {
+				msg(STRESSFUL, "end of extension header processing (NSE_NXT_DATA)");
+				return 0;
+			}
+			continue;
+		}
+
+		/* the pair probes too, see pprobe_measure_dgram() */
+		if (extension_type == NSE_NXT_PPROBE && opts.socktype != SOCK_STREAM) {
+			extension_type = pprobe_measure_dgram(peer_fd);
+			if (extension_type == NSE_NXT_DATA) {
+				msg(STRESSFUL, "end of extension header processing (NSE_NXT_DATA)");
+				return 0;
+			}
+			continue;
+		}
+
 		/* read first 4 octets of extension header, because we now
 		** there IS a extension header and a extension header is always
 		** 4 byte
@@ -461,6 +2634,7 @@ meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
 			return -1;
 
 		extension_size = ntohs(common_ext_head[1]);
+		NS_PROBE2(hdr_rcv, extension_type, extension_size * 4 + 4);
 
 		switch (extension_type) {
 			case NSE_NXT_DATA:
@@ -474,7 +2648,58 @@ meta_exchange_rcv(int peer_fd, struct peer_header_info **hi)
 
 			case NSE_NXT_DIGEST:
 				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_DIGEST");
-				err_msg("Not implementet yet: NSE_NXT_DIGEST\n");
+				ret = process_digest(peer_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_COMPRESS:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_COMPRESS");
+				ret = process_compress(peer_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_SPARSE:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_SPARSE");
+				ret = process_sparse(peer_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_CAPS:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_CAPS");
+				ret = process_caps(peer_fd, file_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_BDP:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_BDP");
+				ret = process_bdp(peer_fd, extension_size);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_TREE:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_TREE");
+				ret = process_tree(peer_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_RESUME:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_RESUME");
+				ret = process_resume(peer_fd, file_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
+				break;
+
+			case NSE_NXT_DELTA:
+				msg(STRESSFUL, "next extension header: %s", "NSE_NXT_DELTA");
+				ret = process_delta(peer_fd, file_fd, extension_size, phi);
+				if (ret == -1)
+					return -1;
 				break;
 
 			case NSE_NXT_RTT_PROBE:
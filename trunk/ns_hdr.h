@@ -23,9 +23,15 @@
 /* all values in network byte order */
 
 #define	NS_MAGIC 0x67
+/* a chain with capability headers (ns_nxt_caps): a receiver
+** which knows only NS_MAGIC refuses it instead of skipping the
+** headers it doesn't know and taking the rest as data */
+#define	NS_MAGIC_CAPS 0x68
 
 enum ns_nse_nxt { NSE_NXT_DATA, NSE_NXT_DIGEST, NSE_NXT_RTT_PROBE,
-		NSE_NXT_NONXT, NSE_NXT_RTT_INFO
+		NSE_NXT_NONXT, NSE_NXT_RTT_INFO, NSE_NXT_COMPRESS, NSE_NXT_RESUME,
+		NSE_NXT_DELTA, NSE_NXT_SPARSE, NSE_NXT_TREE,
+		NSE_NXT_CAPS, NSE_NXT_BDP, NSE_NXT_PPROBE, NSE_NXT_STATS
 };
 
 struct ns_hdr {
@@ -47,12 +53,91 @@ struct ns_hdr {
 */
 
 
+/* ns_nxt_caps lets the receiver take part in the choice of the
+** transfer settings. On stream sockets the transmitter starts the
+** chain with a CAPS_REQUEST (nse_nxt_hdr is NSE_NXT_CAPS) if the
+** answer decides one of its settings, else it may send a CAPS_COMMIT
+** right away (for the statistics exchange). The receiver answers a
+** request on the same connection with a CAPS_REPLY: its SO_RCVBUF, the chunk it reads in (CAPS_F_CHUNK_FIXED if the user
+** chose it), the block size of its output and the features it
+** accepts. The transmitter adapts its settings and continues the
+** chain with a CAPS_COMMIT which carries the chunk it writes in
+** and the features it will use. nse_nxt_hdr of the reply is 0.
+** The netsend header of such a chain carries NS_MAGIC_CAPS.
+*/
+
+enum ns_caps_type { CAPS_REQUEST = 0, CAPS_REPLY, CAPS_COMMIT };
+
+#define	CAPS_F_CHUNK_FIXED 0x01
+
+#define	NS_CAP_DIGEST   (1 << 0)
+#define	NS_CAP_COMPRESS (1 << 1)
+#define	NS_CAP_RESUME   (1 << 2) /* receiver resumes into its output (-R) */
+#define	NS_CAP_DELTA    (1 << 3) /* receiver offers its output (-X) */
+#define	NS_CAP_SPARSE   (1 << 4)
+#define	NS_CAP_TREE     (1 << 5) /* output is a directory */
+#define	NS_CAP_BDP      (1 << 6)
+#define	NS_CAP_STATS    (1 << 7) /* statistics exchange, see ns_nxt_stats */
+
+struct ns_nxt_caps {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_caps_type; /* one of ns_caps_type */
+	uint8_t   nse_caps_flags;
+	uint16_t  unused;
+	uint32_t  nse_caps_features; /* NS_CAP_* */
+	uint32_t  nse_caps_rcvbuf;
+	uint32_t  nse_caps_chunk; /* read or write size in octets */
+	uint32_t  nse_caps_align; /* block size of the output, 0 if unknown */
+} __attribute__((packed));
+
+
+/* ns_nxt_bdp sizes the socket buffers after the rtt probes (-B,
+** the last probe points to NSE_NXT_BDP). The transmitter sends
+** BDP_PROBE headers, each followed by BDP_CHUNK octets of filler
+** (counted in nse_len), for BDP_PROBE_MS. The receiver times the
+** chunks flagged BDP_F_MEASURE - the first one starts the clock -
+** and answers the BDP_F_LAST chunk with a BDP_REPLY (octets and
+** microseconds). The transmitter computes the bandwidth delay
+** product and ends the chain with BDP_SET: the receive buffer and
+** the window clamp it suggests. The receiver applies them and
+** answers with a BDP_SET_REPLY carrying what it got. Replies have
+** nse_nxt_hdr 0.
+*/
+enum ns_bdp_type { BDP_PROBE = 0, BDP_REPLY, BDP_SET, BDP_SET_REPLY };
+
+#define	BDP_F_MEASURE 0x01
+#define	BDP_F_LAST    0x02
+
+struct ns_nxt_bdp {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_bdp_type; /* one of ns_bdp_type */
+	uint8_t   nse_bdp_flags;
+	uint16_t  unused;
+	uint32_t  nse_bdp_bytes_hi; /* BDP_REPLY: measured octets */
+	uint32_t  nse_bdp_bytes_lo;
+	uint32_t  nse_bdp_usec; /* BDP_REPLY: ... in this time */
+	uint32_t  nse_bdp_rcvbuf; /* BDP_SET(_REPLY): SO_RCVBUF value */
+	uint32_t  nse_bdp_clamp; /* BDP_SET(_REPLY): TCP_WINDOW_CLAMP, 0 for none */
+} __attribute__((packed));
+
+
 /* ns_nxt_digest is the digest header extension
-** Currently netsend support following digest algorithms:
+** nse_dgst_type is one of enum hash_type (hash.h), the
+** digest length in octets is noted in brackets:
 **  o NULL   (0)
-**  o SHA    (20)
+**  o SHA    (20) - not implemented
 **  o SHA256 (32)
-**  o SHA512 (64)
+**  o SHA512 (64) - not implemented
+**  o CRC32C (4)
+**
+** The digest is a trailer: the header chain only announces
+** type and length (no digest data, nse_len is 1). After the
+** last data byte the transmitter sends the same header again,
+** this time followed by the digest, with nse_nxt_hdr set to
+** NSE_NXT_NONXT. Nothing follows the trailer, the receiver
+** holds back the last (8 + nse_dgst_len) octets of the stream.
 */
 
 struct ns_nxt_digest {
@@ -60,10 +145,198 @@ struct ns_nxt_digest {
 	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
 	uint8_t  nse_dgst_type;
 	uint8_t  nse_dgst_len;
+	uint16_t  unused;
 	/* followed by digest data */
 } __attribute__((packed));
 
 
+/* ns_nxt_stats carries the counters of one side at the end of a
+** tcp transfer (NS_CAP_STATS in the CAPS_COMMIT). The transmitter
+** sends a STATS_TX trailer after the data and the digest trailer
+** (whose nse_nxt_hdr is NSE_NXT_STATS then), with nse_nxt_hdr set
+** to NSE_NXT_NONXT, and shuts down its side of the connection.
+** The receiver holds it back like the digest and answers on the
+** same connection with STATS_RX (nse_nxt_hdr 0) once the data is
+** written. Times in microseconds, nse_st_rtt_ns is the average
+** application rtt of the rtt probes (0 if none were sent).
+*/
+enum ns_stats_type { STATS_TX = 0, STATS_RX };
+
+struct ns_nxt_stats {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_st_type; /* one of ns_stats_type */
+	uint8_t   nse_st_io_call; /* STATS_TX: enum io_call */
+	uint16_t  unused;
+	uint32_t  nse_st_bytes_hi;
+	uint32_t  nse_st_bytes_lo;
+	uint32_t  nse_st_calls;
+	uint32_t  nse_st_real_us_hi;
+	uint32_t  nse_st_real_us_lo;
+	uint32_t  nse_st_utime_us_hi;
+	uint32_t  nse_st_utime_us_lo;
+	uint32_t  nse_st_stime_us_hi;
+	uint32_t  nse_st_stime_us_lo;
+	uint32_t  nse_st_rtt_ns;
+} __attribute__((packed));
+
+
+/* ns_nxt_compress announces a block compressed data stream.
+** The data is split into blocks of at most nse_cmpr_block
+** octets, each preceded by a struct ns_blk_hdr. A block is
+** either sent as it is or, if NS_BLK_COMPRESSED is set in
+** wire_len, compressed with nse_cmpr_algo. A header with
+** both lengths zero terminates the data (a trailer digest
+** follows this end marker and covers the uncompressed data).
+*/
+
+enum ns_cmpr_algo { NS_CMPR_NONE = 0, NS_CMPR_LZ };
+
+struct ns_nxt_compress {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_cmpr_algo; /* one of ns_cmpr_algo */
+	uint8_t   unused[3];
+	uint32_t  nse_cmpr_block; /* largest uncompressed block */
+} __attribute__((packed));
+
+#define	NS_BLK_COMPRESSED 0x80000000U
+
+struct ns_blk_hdr {
+	uint32_t  wire_len; /* octets following, NS_BLK_COMPRESSED flag */
+	uint32_t  raw_len; /* octets after decompression */
+} __attribute__((packed));
+
+
+/* ns_nxt_resume negotiates the offset a transfer restarts at.
+** The transmitter ends the header chain with a RESUME_REQUEST
+** (nse_rsm_chunk_log is the smallest chunk it wants). The
+** receiver answers on the same connection with a RESUME_REPLY:
+** nse_rsm_offset is the number of bytes covered by the leaves,
+** followed by the root and nse_rsm_leaves leaf hashes of the
+** chunk hash tree (resume.h) - nse_nxt_hdr of the reply is 0.
+** The transmitter verifies the leaves against its file and
+** continues the chain with a RESUME_COMMIT, nse_rsm_offset set
+** to the first differing byte. The receiver truncates its file
+** there and data starts at this offset.
+*/
+
+enum ns_resume_type { RESUME_REQUEST = 0, RESUME_REPLY, RESUME_COMMIT };
+
+struct ns_nxt_resume {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_rsm_type; /* one of ns_resume_type */
+	uint8_t   nse_rsm_hash; /* enum hash_type of the tree */
+	uint8_t   nse_rsm_chunk_log; /* chunk size is 1 << nse_rsm_chunk_log */
+	uint8_t   unused;
+	uint32_t  nse_rsm_offset_hi;
+	uint32_t  nse_rsm_offset_lo;
+	uint32_t  nse_rsm_leaves;
+	/* RESUME_REPLY: followed by root and leaf hashes */
+} __attribute__((packed));
+
+
+/* ns_nxt_delta asks for an rsync like delta transfer. The
+** transmitter sends a DELTA_REQUEST (nse_dlt_size is the size
+** of its file), the receiver answers on the same connection
+** with a DELTA_REPLY: block size, size of its old file and
+** nse_dlt_blocks struct ns_delta_sig (not counted in nse_len,
+** nse_nxt_hdr of the reply is 0). The last block may be short.
+** The chain continues with the next header of the request.
+**
+** The data stream is a sequence of struct ns_delta_op: literal
+** data follows its op, a block reference copies nse_dlt_op &
+** ~NS_DELTA_REF blocks of the old file starting at block
+** nse_dlt_block. An op of zero ends the data, a trailer digest
+** follows and covers the rebuilt file.
+*/
+
+enum ns_delta_type { DELTA_REQUEST = 0, DELTA_REPLY };
+
+struct ns_nxt_delta {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_dlt_type; /* one of ns_delta_type */
+	uint8_t   nse_dlt_strong_len; /* octets of the strong checksum */
+	uint16_t  unused;
+	uint32_t  nse_dlt_block; /* block size */
+	uint32_t  nse_dlt_blocks;
+	uint32_t  nse_dlt_size_hi;
+	uint32_t  nse_dlt_size_lo;
+	/* DELTA_REPLY: followed by the block signatures */
+} __attribute__((packed));
+
+struct ns_delta_sig {
+	uint32_t  weak; /* rolling checksum */
+	uint8_t   strong[16]; /* leading octets of the sha256 */
+} __attribute__((packed));
+
+#define	NS_DELTA_REF 0x80000000U
+
+struct ns_delta_op {
+	uint32_t  nse_dlt_op; /* literal length or NS_DELTA_REF | block count */
+	uint32_t  nse_dlt_block; /* first referenced block */
+} __attribute__((packed));
+
+
+/* ns_nxt_sparse announces an extent framed data stream: each
+** extent starts with a struct ns_ext_hdr. NS_EXT_DATA is followed
+** by nse_ext_len data octets, NS_EXT_HOLE stands for nse_ext_len
+** zero octets which are not transmitted - the receiver seeks over
+** them (or punches a hole). NS_EXT_END terminates the data, a
+** trailer digest follows and covers the data extents only.
+*/
+
+enum ns_ext_type { NS_EXT_END = 0, NS_EXT_DATA, NS_EXT_HOLE };
+
+struct ns_nxt_sparse {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint32_t  unused;
+} __attribute__((packed));
+
+struct ns_ext_hdr {
+	uint32_t  nse_ext_type; /* one of ns_ext_type */
+	uint32_t  nse_ext_len_hi;
+	uint32_t  nse_ext_len_lo;
+} __attribute__((packed));
+
+
+/* ns_nxt_tree announces a directory tree: the data stream is a
+** sequence of batches. A batch starts with a struct ns_tree_batch,
+** followed by nse_tb_entries struct ns_tree_ent, their names
+** (nse_tb_names octets, relative to the tree root, not terminated)
+** and the content of the regular files and symlinks of the batch
+** in entry order (nse_tb_data octets). Small files share a batch,
+** a large file comes in a batch of its own. A directory appears
+** in an earlier batch than its content. A batch without entries
+** ends the data, a trailer digest covers the whole batch stream.
+*/
+
+struct ns_nxt_tree {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint32_t  unused;
+} __attribute__((packed));
+
+struct ns_tree_batch {
+	uint32_t  nse_tb_entries;
+	uint32_t  nse_tb_names; /* octets of all names */
+	uint32_t  nse_tb_data_hi;
+	uint32_t  nse_tb_data_lo;
+} __attribute__((packed));
+
+struct ns_tree_ent {
+	uint32_t  nse_te_mode; /* file type and permissions (st_mode) */
+	uint32_t  nse_te_size_hi; /* file size or length of the symlink target */
+	uint32_t  nse_te_size_lo;
+	uint32_t  nse_te_mtime; /* seconds since the epoch */
+	uint16_t  nse_te_name_len;
+	uint16_t  unused;
+} __attribute__((packed));
+
+
 /* this is a dummy extension header. it indicates that this
 ** is the last extension header AND no more data is comming!
 */
@@ -91,6 +364,35 @@ struct ns_rtt_probe {
 	/* variable data */
 } __attribute__((packed));
 
+/* ns_pprobe - packet pairs and trains for a capacity estimate
+** (-c, datagram protocols only). After the rtt probes (or the
+** netsend header) the transmitter sends groups of back-to-back
+** datagrams, each one a ns_pprobe plus filler (counted in
+** nse_len). The receiver notes their kernel receive timestamps:
+** a pair leaves the bottleneck spread by the time the link needs
+** for one packet (capacity), a train by the rate the path gives
+** it for longer (asymptotic dispersion rate, between the available
+** bandwidth and the capacity). PPROBE_END, which carries the next
+** header of the chain, asks for the PPROBE_REPORT with the medians
+** of both.
+*/
+enum ns_pprobe_type { PPROBE_PAIR = 0, PPROBE_TRAIN, PPROBE_END, PPROBE_REPORT };
+
+struct ns_pprobe {
+	uint16_t  nse_nxt_hdr; /* next header */
+	uint16_t  nse_len; /* length in units of 4 octets (not including the first 4 octets) */
+	uint8_t   nse_pp_type; /* one of ns_pprobe_type */
+	uint8_t   unused;
+	uint16_t  nse_pp_group; /* number of the pair or train */
+	uint16_t  nse_pp_index; /* position in the group */
+	uint16_t  nse_pp_count; /* datagrams in the group */
+	uint32_t  nse_pp_capacity; /* PPROBE_REPORT: kbit/s, 0 if unknown */
+	uint32_t  nse_pp_adr; /* PPROBE_REPORT: kbit/s, 0 if unknown */
+	uint16_t  nse_pp_pairs; /* PPROBE_REPORT: pairs and trains which */
+	uint16_t  nse_pp_trains; /* arrived complete and in order */
+	/* filler */
+} __attribute__((packed));
+
 struct ns_rtt_info {
 	uint16_t  nse_nxt_hdr; /* next header */
 	uint16_t  nse_len; /* ... you know */
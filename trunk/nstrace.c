@@ -0,0 +1,113 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* nstrace - print a netsend -e trace file as csv
+**
+** usage: nstrace TRACEFILE > trace.csv
+**
+** One line per io call, oldest first. A ring that wrapped holds
+** the last slots events, seq tells how many came before.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static const char *op_name[] = TRACE_OP_NAMES;
+
+
+static void __attribute__((noreturn))
+die(const char *path, const char *what)
+{
+	fprintf(stderr, "nstrace: %s: %s\n", path, what);
+	exit(1);
+}
+
+
+int
+main(int ac, char **av)
+{
+	const struct trace_hdr *hdr;
+	const struct trace_record *ring, *r;
+	struct stat st;
+	uint64_t head, n, i;
+	char op_buf[16];
+	const char *op;
+	void *map;
+	int fd;
+
+	if (ac != 2) {
+		fputs("usage: nstrace TRACEFILE > trace.csv\n", stderr);
+		return 1;
+	}
+
+	if ((fd = open(av[1], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		die(av[1], strerror(errno));
+	if ((size_t) st.st_size < sizeof(*hdr))
+		die(av[1], "too short for a trace file");
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die(av[1], strerror(errno));
+	close(fd);
+
+	hdr = map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)))
+		die(av[1], "not a netsend trace file");
+	if (hdr->version != TRACE_VERSION || hdr->record_size != sizeof(*r))
+		die(av[1], "trace version or byte order not supported");
+	if (hdr->slots == 0 ||
+		(uint64_t) st.st_size < sizeof(*hdr) + hdr->slots * sizeof(*r))
+		die(av[1], "trace file truncated");
+
+	ring = (const struct trace_record *) (hdr + 1);
+	head = hdr->head;
+	n = head < hdr->slots ? head : hdr->slots;
+
+	printf("seq,time_ns,realtime_ns,mode,op,want,done,latency_ns,errno,strerror\n");
+	for (i = head - n; i < head; i++) {
+		r = &ring[i % hdr->slots];
+
+		if (r->op < sizeof(op_name) / sizeof(op_name[0])) {
+			op = op_name[r->op];
+		} else {
+			snprintf(op_buf, sizeof(op_buf), "op%u", r->op);
+			op = op_buf;
+		}
+
+		printf("%llu,%llu,%llu,%s,%s,%u,%u,%u,%u,\"%s\"\n", (unsigned long long) i,
+				(unsigned long long) r->time_ns,
+				(unsigned long long) (hdr->start_realtime_ns + r->time_ns),
+				hdr->mode ? "rx" : "tx", op, r->want, r->done, r->latency_ns, r->err,
+				r->err ? strerror(r->err) : "");
+	}
+
+	return 0;
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,208 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "global.h"
+
+#ifdef HAVE_PERF_EVENT
+# include <sys/syscall.h>
+# include <sys/prctl.h>
+# include <linux/perf_event.h>
+#endif
+
+extern struct opts opts;
+extern struct net_stat net_stat;
+
+/* Hardware and software counters of the transfer (-E). Every
+** counter is opened twice, once for the user and once for the
+** kernel part, so that a sendfile() or splice() engine shows
+** where its cycles go. The counters follow the calling thread
+** only: the interval sampler does not count. They are opened
+** disabled and switched on and off together with one prctl(),
+** close to the engine like rdtscll in touch_use_stat().
+** A counter the machine lacks (a guest without a PMU, a
+** perf_event_paranoid of 3) is left out of the report.
+*/
+
+static const char *perf_counter_str[PERF_MAX] = {
+	[PERF_CYCLES]           = "cycles",
+	[PERF_INSTRUCTIONS]     = "instructions",
+	[PERF_CACHE_MISSES]     = "cache-misses",
+	[PERF_CONTEXT_SWITCHES] = "context-switches",
+	[PERF_PAGE_FAULTS]      = "page-faults",
+};
+
+
+const char *
+perf_counter_name(enum perf_counter counter)
+{
+	return perf_counter_str[counter];
+}
+
+
+#ifdef HAVE_PERF_EVENT
+
+#define	PERF_USER   0
+#define	PERF_KERNEL 1
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_event_map[PERF_MAX] = {
+	[PERF_CYCLES]           = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[PERF_INSTRUCTIONS]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[PERF_CACHE_MISSES]     = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[PERF_CONTEXT_SWITCHES] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[PERF_PAGE_FAULTS]      = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+static int perf_fd[PERF_MAX][2];
+static bool perf_running;
+
+
+static int
+perf_open(enum perf_counter counter, int mode)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_event_map[counter].type;
+	attr.config = perf_event_map[counter].config;
+	attr.disabled = 1;
+	attr.exclude_hv = 1;
+	attr.exclude_kernel = mode == PERF_USER;
+	attr.exclude_user = mode == PERF_KERNEL;
+	/* more counters than the PMU has are multiplexed */
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+/* the count extrapolated to the whole time the counter was enabled */
+static bool
+perf_read(int fd, unsigned long long *res)
+{
+	struct {
+		uint64_t value, time_enabled, time_running;
+	} rf;
+
+	if (read(fd, &rf, sizeof(rf)) != sizeof(rf))
+		return false;
+
+	if (rf.time_running == 0) {
+		*res = 0;
+		return rf.time_enabled == 0;
+	}
+
+	if (rf.time_running < rf.time_enabled)
+		*res = (double) rf.value * rf.time_enabled / rf.time_running;
+	else
+		*res = rf.value;
+
+	return true;
+}
+
+
+void
+perf_start(void)
+{
+	int i, mode, opened = 0, last_errno = 0;
+
+	if (!opts.perf_counters || perf_running)
+		return;
+
+	for (i = 0; i < PERF_MAX; i++) {
+		for (mode = PERF_USER; mode <= PERF_KERNEL; mode++) {
+			perf_fd[i][mode] = perf_open(i, mode);
+			if (perf_fd[i][mode] < 0) {
+				last_errno = errno;
+				msg(GENTLE, "perf counter %s (%s) not available: %s",
+						perf_counter_str[i], mode == PERF_USER ? "user" : "kernel",
+						strerror(errno));
+				continue;
+			}
+			opened++;
+		}
+	}
+
+	if (!opened) {
+		errno = last_errno;
+		err_sys("No perf counter available (see /proc/sys/kernel/perf_event_paranoid)");
+		return;
+	}
+
+	perf_running = true;
+	if (prctl(PR_TASK_PERF_EVENTS_ENABLE) < 0)
+		err_sys("Failure in prctl(PR_TASK_PERF_EVENTS_ENABLE)");
+}
+
+
+void
+perf_stop(void)
+{
+	struct perf_stat *ps = &net_stat.perf;
+	int i;
+
+	if (!perf_running)
+		return;
+
+	if (prctl(PR_TASK_PERF_EVENTS_DISABLE) < 0)
+		err_sys("Failure in prctl(PR_TASK_PERF_EVENTS_DISABLE)");
+	perf_running = false;
+
+	memset(ps, 0, sizeof(*ps));
+	for (i = 0; i < PERF_MAX; i++) {
+		if (perf_fd[i][PERF_USER] >= 0) {
+			if (perf_read(perf_fd[i][PERF_USER], &ps->user[i]))
+				ps->user_valid |= 1 << i;
+			close(perf_fd[i][PERF_USER]);
+		}
+		if (perf_fd[i][PERF_KERNEL] >= 0) {
+			if (perf_read(perf_fd[i][PERF_KERNEL], &ps->kernel[i]))
+				ps->kernel_valid |= 1 << i;
+			close(perf_fd[i][PERF_KERNEL]);
+		}
+	}
+}
+
+#else /* HAVE_PERF_EVENT */
+
+void
+perf_start(void)
+{
+	if (opts.perf_counters)
+		err_msg("perf counters (-E) not supported by this build");
+}
+
+
+void
+perf_stop(void)
+{
+}
+
+#endif /* HAVE_PERF_EVENT */
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
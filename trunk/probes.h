@@ -0,0 +1,28 @@
+#ifndef NETSEND_PROBES_H_INCLUDE_
+#define NETSEND_PROBES_H_INCLUDE_
+
+#include "config.h"
+
+/* USDT probes for bpftrace, perf probe and systemtap
+**
+** With <sys/sdt.h> (systemtap-sdt-dev) every probe is a single
+** nop in the text and a note in .note.stapsdt naming it and the
+** location of its arguments - a tracer patches the nop when it
+** attaches. The arguments must be cheap: they are computed into
+** registers whether or not anything is attached. Without the
+** header the probes compile to nothing. The provider is
+** "netsend", see PROBES in netsend.pod for the list.
+*/
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define	NS_PROBE1(name, a)          DTRACE_PROBE1(netsend, name, a)
+# define	NS_PROBE2(name, a, b)       DTRACE_PROBE2(netsend, name, a, b)
+# define	NS_PROBE3(name, a, b, c)    DTRACE_PROBE3(netsend, name, a, b, c)
+#else
+# define	NS_PROBE1(name, a)          do { } while (0)
+# define	NS_PROBE2(name, a, b)       do { } while (0)
+# define	NS_PROBE3(name, a, b, c)    do { } while (0)
+#endif
+
+#endif /* NETSEND_PROBES_H_INCLUDE_ */
@@ -64,15 +64,37 @@ static void tcp_set_socketopts(int fd, const struct sockaddr *sa)
 }
 
 
+/* -F and a single address, see init_tcp_trans() */
+static bool tfo_connect;
+
+
+/* the options of a socket for the address ai, before its connect */
+static void
+tcp_connect_setup(int fd, const struct addrinfo *ai)
+{
+	assert(ai->ai_protocol == IPPROTO_TCP);
+
+	tcp_set_socketopts(fd, ai->ai_addr);
+
+	/* With a cookie of the peer connect() returns at once and the
+	** first write sends the syn with the data. Without one it is a
+	** normal connect which fetches the cookie for the next time. */
+	if (tfo_connect) {
+		int on = 1;
+
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0)
+			err_sys("setsockopt(TCP_FASTOPEN_CONNECT), no fast open");
+	}
+}
+
+
 /* Creates our server socket and initialize
 ** options
 */
 static int init_tcp_trans(void)
 {
-	bool use_multicast = false;
-	int fd = -1, ret;
-	struct addrinfo  hosthints, *hostres, *addrtmp;
-	struct protoent *protoent;
+	int fd;
+	struct addrinfo  hosthints, *hostres;
 
 	memset(&hosthints, 0, sizeof(struct addrinfo));
 
@@ -83,73 +105,30 @@ static int init_tcp_trans(void)
 	hosthints.ai_flags    = AI_ADDRCONFIG;
 
 	xgetaddrinfo(opts.hostname, opts.port, &hosthints, &hostres);
-
-	addrtmp = hostres;
-
-	for (addrtmp = hostres; addrtmp != NULL ; addrtmp = addrtmp->ai_next) {
-
-		if (opts.family != AF_UNSPEC &&
-			addrtmp->ai_family != opts.family) { /* user fixed family! */
-			continue;
-		}
-
-		fd = socket(addrtmp->ai_family, addrtmp->ai_socktype,
-				addrtmp->ai_protocol);
-		if (fd < 0) {
-			err_sys("socket");
-			continue;
-		}
-
-		protoent = getprotobynumber(addrtmp->ai_protocol);
-		if (protoent)
-			msg(LOUDISH, "socket created - protocol %s(%d)",
-				protoent->p_name, protoent->p_proto);
-
-		assert(addrtmp->ai_protocol == IPPROTO_TCP);
-
-		if (use_multicast) {
-			int hops_ttl = 30;
-				int on = 1;
-			switch (addrtmp->ai_family) {
-				case AF_INET6:
-					xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&hops_ttl,
-								sizeof(hops_ttl), "IPV6_MULTICAST_HOPS");
-					xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
-							&on, sizeof(int), "IPV6_MULTICAST_LOOP");
-					break;
-				case AF_INET:
-					xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,
-					         (char *)&hops_ttl, sizeof(hops_ttl), "IP_MULTICAST_TTL");
-
-					xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP,
-							&on, sizeof(int), "IP_MULTICAST_LOOP");
-					msg(STRESSFUL, "set IP_MULTICAST_LOOP option");
-					break;
-				default:
-					err_msg_die(EXIT_FAILINT, "Programmed Failure");
-			}
-		}
-
-		tcp_set_socketopts(fd, addrtmp->ai_addr);
-
-		/* Connect to peer
-		** There are three advantages to call connect for all types
-		** of our socket protocols (especially udp)
-		**
-		** 1. We don't need to specify a destination address (only call write)
-		** 2. Performance advantages (kernel level)
-		** 3. Error detection (e.g. destination port unreachable at udp)
-		*/
-		ret = connect(fd, addrtmp->ai_addr, addrtmp->ai_addrlen);
-		if (ret == -1)
-			err_sys_die(EXIT_FAILNET, "Can't connect to %s", opts.hostname);
-
-		msg(LOUDISH, "socket connected to %s via port %s",
-			opts.hostname, opts.port);
+	phase_mark(PHASE_RESOLVED);
+
+	/* A deferred connect "succeeds" before any packet left, it
+	** would win the race even for an address which never answers
+	** and the first write hangs. Several addresses race with the
+	** handshake, fast open needs a single one. */
+	if (opts.tcp_fastopen) {
+		int n = connect_candidates(hostres);
+
+		tfo_connect = n == 1;
+		if (n > 1)
+			err_msg("%s has %d addresses, the connects race without fast open "
+					"(give an address or -4/-6)", opts.hostname, n);
 	}
 
-	if (fd < 0)
-		err_msg_die(EXIT_FAILNET, "No suitable socket found");
+	/* Connect to peer
+	** There are three advantages to call connect for all types
+	** of our socket protocols (especially udp)
+	**
+	** 1. We don't need to specify a destination address (only call write)
+	** 2. Performance advantages (kernel level)
+	** 3. Error detection (e.g. destination port unreachable at udp)
+	*/
+	fd = connect_race(hostres, tcp_connect_setup);
 
 	freeaddrinfo(hostres);
 	return fd;
@@ -172,13 +151,21 @@ void tcp_trans_mode(void)
 
 	/* check if the transmitted file is present and readable */
 	file_fd = open_input_file();
+	if (opts.tcp_fastopen)
+		tcp_fastopen_check(false);
 	connected_fd = init_tcp_trans();
+	phase_mark(PHASE_CONNECTED);
 
 	/* fetch sockopt before the first byte  */
 	get_sock_opts(connected_fd, &net_stat);
 
 	/* construct and send netsend header to peer */
 	meta_exchange_snd(connected_fd, file_fd);
+	if (tfo_connect)
+		tcp_fastopen_report(connected_fd);
+
+	/* TCP_INFO next to the interval reports (-i) */
+	interval_tcp_fd(connected_fd);
 
 	/* take the transmit start time for diff */
 	gettimeofday(&opts.starttime, NULL);
@@ -187,6 +174,10 @@ void tcp_trans_mode(void)
 
 	gettimeofday(&opts.endtime, NULL);
 
+	/* our counters to the receiver, its counters back */
+	if (opts.ext_hdr_mask & HDR_MSK_STATS)
+		meta_stats_snd(connected_fd);
+
 	if (VL_LOUDISH(opts.verbose)) {
 		struct tcp_info tcp_info;
 
@@ -76,6 +76,7 @@ void tipc_trans_mode(void)
 	/* check if the transmitted file is present and readable */
 	file_fd = open_input_file();
 	connected_fd = init_tipc_trans();
+	phase_mark(PHASE_CONNECTED);
 
 	/* fetch sockopt before the first byte  */
 	get_sock_opts(connected_fd, &net_stat);
@@ -43,15 +43,65 @@ extern struct net_stat net_stat;
 extern struct conf_map_t io_call_map[];
 extern struct sock_callbacks sock_callbacks;
 
+/* the options of a socket for the address ai, before its connect */
+static void
+udp_connect_setup(int fd, const struct addrinfo *ai)
+{
+	bool use_multicast = false;
+
+	/* mulicast checks */
+	assert(ai->ai_protocol == IPPROTO_UDP);
+	switch (ai->ai_family) {
+	case AF_INET6:
+		if (IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)
+						ai->ai_addr)->sin6_addr)) {
+			use_multicast = true;
+		}
+		break;
+	case AF_INET:
+		if (IN_MULTICAST(ntohl(((struct sockaddr_in *)
+			ai->ai_addr)->sin_addr.s_addr))) {
+			use_multicast = true;
+		}
+		break;
+	default:
+		err_msg_die(EXIT_FAILINT, "Programmed Failure");
+	}
+
+	if (use_multicast) {
+		int hops_ttl = 30;
+			int on = 1;
+		switch (ai->ai_family) {
+			case AF_INET6:
+				xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&hops_ttl,
+							sizeof(hops_ttl), "IPV6_MULTICAST_HOPS");
+				xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+						&on, sizeof(int), "IPV6_MULTICAST_LOOP");
+				break;
+			case AF_INET:
+				xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,
+				         (char *)&hops_ttl, sizeof(hops_ttl), "IP_MULTICAST_TTL");
+
+				xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+						&on, sizeof(int), "IP_MULTICAST_LOOP");
+				msg(STRESSFUL, "set IP_MULTICAST_LOOP option");
+				break;
+			default:
+				err_msg_die(EXIT_FAILINT, "Programmed Failure");
+		}
+	}
+
+	set_socketopts(fd);
+}
+
+
 /* Creates our server socket and initialize
 ** options
 */
 static int init_udp_trans(void)
 {
-	bool use_multicast = false;
-	int fd = -1, ret;
-	struct addrinfo  hosthints, *hostres, *addrtmp;
-	struct protoent *protoent;
+	int fd;
+	struct addrinfo  hosthints, *hostres;
 
 	memset(&hosthints, 0, sizeof(struct addrinfo));
 
@@ -62,90 +112,17 @@ static int init_udp_trans(void)
 	hosthints.ai_flags    = AI_ADDRCONFIG;
 
 	xgetaddrinfo(opts.hostname, opts.port, &hosthints, &hostres);
-
-	addrtmp = hostres;
-
-	for (addrtmp = hostres; addrtmp != NULL ; addrtmp = addrtmp->ai_next) {
-
-		if (opts.family != AF_UNSPEC &&
-			addrtmp->ai_family != opts.family) { /* user fixed family! */
-			continue;
-		}
-
-		fd = socket(addrtmp->ai_family, addrtmp->ai_socktype,
-				addrtmp->ai_protocol);
-		if (fd < 0) {
-			err_sys("socket");
-			continue;
-		}
-
-		protoent = getprotobynumber(addrtmp->ai_protocol);
-		if (protoent)
-			msg(LOUDISH, "socket created - protocol %s(%d)",
-				protoent->p_name, protoent->p_proto);
-
-		/* mulicast checks */
-		assert(addrtmp->ai_protocol == IPPROTO_UDP);
-		switch (addrtmp->ai_family) {
-		case AF_INET6:
-			if (IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)
-							addrtmp->ai_addr)->sin6_addr)) {
-				use_multicast = true;
-			}
-			break;
-		case AF_INET:
-			if (IN_MULTICAST(ntohl(((struct sockaddr_in *)
-				addrtmp->ai_addr)->sin_addr.s_addr))) {
-				use_multicast = true;
-			}
-			break;
-		default:
-			err_msg_die(EXIT_FAILINT, "Programmed Failure");
-		}
-
-		if (use_multicast) {
-			int hops_ttl = 30;
-				int on = 1;
-			switch (addrtmp->ai_family) {
-				case AF_INET6:
-					xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&hops_ttl,
-								sizeof(hops_ttl), "IPV6_MULTICAST_HOPS");
-					xsetsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
-							&on, sizeof(int), "IPV6_MULTICAST_LOOP");
-					break;
-				case AF_INET:
-					xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,
-					         (char *)&hops_ttl, sizeof(hops_ttl), "IP_MULTICAST_TTL");
-
-					xsetsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP,
-							&on, sizeof(int), "IP_MULTICAST_LOOP");
-					msg(STRESSFUL, "set IP_MULTICAST_LOOP option");
-					break;
-				default:
-					err_msg_die(EXIT_FAILINT, "Programmed Failure");
-			}
-		}
-
-		set_socketopts(fd);
-
-		/* Connect to peer
-		** There are three advantages to call connect for all types
-		** of our socket protocols (especially udp)
-		**
-		** 1. We don't need to specify a destination address (only call write)
-		** 2. Performance advantages (kernel level)
-		** 3. Error detection (e.g. destination port unreachable at udp)
-		*/
-		ret = connect(fd, addrtmp->ai_addr, addrtmp->ai_addrlen);
-		if (ret == -1)
-			err_sys_die(EXIT_FAILNET, "Can't connect to %s", opts.hostname);
-
-		msg(LOUDISH, "socket connected to %s via port %s",
-			opts.hostname, opts.port);
-	}
-
-	if (fd < 0)
-		err_msg_die(EXIT_FAILNET, "No suitable socket found");
+	phase_mark(PHASE_RESOLVED);
+
+	/* Connect to peer
+	** There are three advantages to call connect for all types
+	** of our socket protocols (especially udp)
+	**
+	** 1. We don't need to specify a destination address (only call write)
+	** 2. Performance advantages (kernel level)
+	** 3. Error detection (e.g. destination port unreachable at udp)
+	*/
+	fd = connect_race(hostres, udp_connect_setup);
 
 	freeaddrinfo(hostres);
 	return fd;
@@ -170,6 +147,7 @@ udp_trans_mode(void)
 	/* check if the transmitted file is present and readable */
 	file_fd = open_input_file();
 	connected_fd = init_udp_trans();
+	phase_mark(PHASE_CONNECTED);
 
 	/* fetch sockopt before the first byte  */
 	get_sock_opts(connected_fd, &net_stat);
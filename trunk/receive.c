@@ -20,6 +20,14 @@
 ** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#ifdef HAVE_PUNCH_HOLE
+# include <linux/falloc.h>
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -27,16 +35,25 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
 #include "global.h"
+#include "ns_hdr.h"
 #include "tcp_md5sig.h"
 #include "xfuncs.h"
 #include "proto_tcp.h"
 #include "proto_tipc.h"
+#include "digest.h"
+#include "lz.h"
+#include "delta.h"
+#include "tree.h"
+#include "latency.h"
+#include "probes.h"
 
 extern struct opts opts;
 extern struct net_stat net_stat;
@@ -44,39 +61,889 @@ extern struct conf_map_t io_call_map[];
 extern struct socket_options socket_options[];
 extern struct sock_callbacks sock_callbacks;
 
+/* the socket reads of the engines, timed for -L */
+static ssize_t
+cs_sock_read(int fd, void *buf, size_t len)
+{
+	uint64_t start = LAT_START();
+	ssize_t rc = read(fd, buf, len);
+
+	LAT_END(LAT_READ, start, len, rc);
+	PHASE_FIRST_BYTE_MARK(rc);
+	return rc;
+}
+
+
+/* make sure at least need bytes are buffered at rbuf + *rpos,
+** returns false if the stream ended before */
+static bool
+cs_fill(int connected_fd, unsigned char *rbuf, size_t rsize,
+		size_t *rpos, size_t *rend, size_t need)
+{
+	if (*rend - *rpos >= need)
+		return true;
+
+	if (*rpos + need > rsize) {
+		memmove(rbuf, rbuf + *rpos, *rend - *rpos);
+		*rend -= *rpos;
+		*rpos = 0;
+	}
+
+	while (*rend - *rpos < need) {
+		ssize_t rc = cs_sock_read(connected_fd, rbuf + *rend, rsize - *rend);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc < 0)
+				err_sys("read failed");
+			return false;
+		}
+		STAT_ADD(net_stat.total_rx_calls, 1);
+		net_stat.total_rx_bytes += rc;
+		STAT_ADD(net_stat.io_bytes, rc);
+		*rend += rc;
+	}
+
+	return true;
+}
+
+
+/* our -b, else the chunk size the peer committed to */
+static size_t
+cs_buflen(const struct peer_header_info *phi)
+{
+	if (opts.buffer_size)
+		return opts.buffer_size;
+
+	return phi->chunk ? phi->chunk : DEFAULT_BUFSIZE;
+}
+
+
+/* Receive function for a block compressed stream (see
+** ns_nxt_compress in ns_hdr.h): parse the block headers,
+** decompress and write the data. Reads go into a buffer
+** twice the largest frame so one read() usually delivers
+** several frames.
+*/
+static ssize_t
+cs_read_compressed(int file_fd, int connected_fd, struct peer_header_info *phi)
+{
+	size_t block = phi->compress_block;
+	size_t frame_max = sizeof(struct ns_blk_hdr) + lz_compress_bound(block);
+	size_t rsize = 2 * frame_max, rpos = 0, rend = 0, trailer_len;
+	unsigned char *rbuf, *out = NULL;
+	unsigned long long raw_total = 0;
+	bool digest = phi->digest_type != HASH_NULL, eos = false;
+
+	trailer_len = meta_trailer_len(phi);
+
+	rbuf = xmalloc(rsize);
+	if (digest)
+		digest_start(phi->digest_type, block);
+	else
+		out = xmalloc(block);
+
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while (cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, sizeof(struct ns_blk_hdr))) {
+		struct ns_blk_hdr *blk_hdr = (struct ns_blk_hdr *) (rbuf + rpos);
+		uint32_t wire_len = ntohl(blk_hdr->wire_len);
+		uint32_t raw_len = ntohl(blk_hdr->raw_len);
+		bool compressed = wire_len & NS_BLK_COMPRESSED;
+		const unsigned char *data;
+		ssize_t ret;
+
+		wire_len &= ~NS_BLK_COMPRESSED;
+
+		if (wire_len == 0 && raw_len == 0) {
+			rpos += sizeof(struct ns_blk_hdr);
+			eos = true;
+			break;
+		}
+
+		if (raw_len == 0 || raw_len > block ||
+			(compressed ? wire_len > lz_compress_bound(block) : wire_len != raw_len))
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted block header "
+					"(wire: %u, raw: %u)", wire_len, raw_len);
+
+		if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend,
+					sizeof(struct ns_blk_hdr) + wire_len))
+			break;
+
+		data = rbuf + rpos + sizeof(struct ns_blk_hdr);
+
+		if (digest)
+			out = digest_slot_get();
+
+		if (compressed) {
+			if (lz_decompress(data, wire_len, out, raw_len) != (long)raw_len)
+				err_msg_die(EXIT_FAILHEADER, "received an corrupted compressed block");
+			data = out;
+		} else if (digest) {
+			memcpy(out, data, raw_len);
+			data = out;
+		}
+
+		do {
+			uint64_t start = LAT_START();
+
+			ret = write(file_fd, data, raw_len);
+			LAT_END(LAT_FILE_WRITE, start, raw_len, ret);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret != (ssize_t)raw_len) {
+			err_sys("write failed");
+			break;
+		}
+
+		if (digest)
+			digest_slot_put(out, raw_len);
+
+		rpos += sizeof(struct ns_blk_hdr) + wire_len;
+		raw_total += raw_len;
+	}
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	if (!eos)
+		err_msg("compressed stream ended without end of data marker");
+
+	msg(LOUDISH, "received %llu bytes of data in %llu bytes",
+			raw_total, net_stat.total_rx_bytes);
+
+	if (trailer_len) {
+		if (eos)
+			cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, trailer_len);
+		meta_trailer_verify(phi, rbuf + rpos, min(rend - rpos, trailer_len));
+	}
+	if (!digest)
+		free(out);
+	free(rbuf);
+
+	return eos ? 0 : -1;
+}
+
+
+static bool
+cs_write(int fd, const unsigned char *buf, size_t len)
+{
+	while (len > 0) {
+		uint64_t start = LAT_START();
+		ssize_t ret = write(fd, buf, len);
+
+		LAT_END(LAT_FILE_WRITE, start, len, ret);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			err_sys("write failed");
+			return false;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+
+/* zeros for holes the output can't seek over (pipes) or which
+** must replace old data - returns false on write errors */
+static bool
+cs_skip_hole(int file_fd, off_t *pos, off_t old_size, unsigned long long len)
+{
+	static const unsigned char zero[65536];
+
+	if (*pos >= 0) {
+#ifdef HAVE_PUNCH_HOLE
+		if (*pos < old_size && fallocate(file_fd, FALLOC_FL_PUNCH_HOLE |
+					FALLOC_FL_KEEP_SIZE, *pos, min((off_t)len, old_size - *pos)))
+			err_sys("Can't punch hole at offset %lld", (long long)*pos);
+#else
+		(void) old_size;
+#endif
+		if (lseek(file_fd, len, SEEK_CUR) != -1) {
+			*pos += len;
+			return true;
+		}
+		*pos = -1;
+	}
+
+	while (len > 0) {
+		size_t chunk = min(len, (unsigned long long)sizeof(zero));
+
+		if (!cs_write(file_fd, zero, chunk))
+			return false;
+		len -= chunk;
+	}
+	return true;
+}
+
+
+/* Receive function for an extent framed stream (see
+** ns_nxt_sparse in ns_hdr.h): data extents are written,
+** holes are skipped and the file is extended to its full
+** size at the end.
+*/
+static ssize_t
+cs_read_sparse(int file_fd, int connected_fd, struct peer_header_info *phi)
+{
+	size_t buflen = cs_buflen(phi);
+	size_t rsize = 2 * buflen, rpos = 0, rend = 0, trailer_len;
+	unsigned char *rbuf;
+	unsigned long long data_bytes = 0, hole_bytes = 0;
+	bool digest = phi->digest_type != HASH_NULL, eos = false, ok = true, regular = false;
+	struct stat stat_buf;
+	off_t pos, old_size = 0;
+
+	trailer_len = meta_trailer_len(phi);
+
+	/* pos is -1 if the output can't seek */
+	pos = lseek(file_fd, 0, SEEK_CUR);
+	if (pos != -1 && fstat(file_fd, &stat_buf) == 0 && S_ISREG(stat_buf.st_mode)) {
+		old_size = stat_buf.st_size;
+		regular = true;
+	}
+
+	rbuf = xmalloc(rsize);
+	if (digest)
+		digest_start(phi->digest_type, buflen);
+
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while (ok && cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, sizeof(struct ns_ext_hdr))) {
+		struct ns_ext_hdr *ext_hdr = (struct ns_ext_hdr *) (rbuf + rpos);
+		uint32_t type = ntohl(ext_hdr->nse_ext_type);
+		unsigned long long len = (unsigned long long)ntohl(ext_hdr->nse_ext_len_hi) << 32 |
+			ntohl(ext_hdr->nse_ext_len_lo);
+
+		if (digest)
+			digest_feed_copy(ext_hdr, sizeof(struct ns_ext_hdr));
+		rpos += sizeof(struct ns_ext_hdr);
+
+		if (type == NS_EXT_END) {
+			eos = true;
+			break;
+		}
+
+		if (type == NS_EXT_HOLE) {
+			ok = cs_skip_hole(file_fd, &pos, old_size, len);
+			hole_bytes += len;
+			continue;
+		}
+
+		if (type != NS_EXT_DATA)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted extent header (type %u)", type);
+
+		data_bytes += len;
+
+		while (ok && len > 0) {
+			size_t chunk;
+			unsigned char *data;
+
+			if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, 1)) {
+				ok = false;
+				break;
+			}
+			chunk = min(rend - rpos, buflen);
+			chunk = min(len, (unsigned long long)chunk);
+			data = rbuf + rpos;
+			if (digest) {
+				data = digest_slot_get();
+				memcpy(data, rbuf + rpos, chunk);
+			}
+			ok = cs_write(file_fd, data, chunk);
+			if (digest)
+				digest_slot_put(data, chunk);
+			rpos += chunk;
+			len -= chunk;
+			if (pos != -1)
+				pos += chunk;
+		}
+	}
+
+	/* a trailing hole: extend the file */
+	if (eos && regular && pos != -1 && ftruncate(file_fd, pos))
+		err_sys("Can't extend outputfile to %lld bytes", (long long)pos);
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	if (!eos)
+		err_msg("sparse stream ended without end of data marker");
+
+	msg(LOUDISH, "sparse: received %llu bytes of data, %llu bytes of holes",
+			data_bytes, hole_bytes);
+
+	if (trailer_len) {
+		if (eos)
+			cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, trailer_len);
+		meta_trailer_verify(phi, rbuf + rpos, min(rend - rpos, trailer_len));
+	}
+	free(rbuf);
+
+	return eos ? 0 : -1;
+}
+
+
+/* Receive function for a delta stream (see ns_nxt_delta in
+** ns_hdr.h). If we offered blocks of our old file the new
+** one is rebuilt next to it and renamed over it only after
+** the stream (and the digest) is complete - a broken
+** transfer leaves the old file untouched.
+*/
+static ssize_t
+cs_read_delta(int file_fd, int connected_fd, struct peer_header_info *phi)
+{
+	size_t rsize = 2 * DELTA_LITERAL_MAX, rpos = 0, rend = 0, trailer_len;
+	size_t chunk_size = DELTA_LITERAL_MAX;
+	unsigned char *rbuf, *chunk = NULL;
+	unsigned long long literal = 0, copied = 0;
+	bool digest = phi->digest_type != HASH_NULL, eos = false, ok = true;
+	char *tmp_name = NULL;
+	int out_fd = file_fd;
+
+	trailer_len = meta_trailer_len(phi);
+
+	if (phi->delta_blocks) {
+		struct stat stat_buf;
+
+		tmp_name = xmalloc(strlen(opts.outfile) + sizeof(".XXXXXX"));
+		sprintf(tmp_name, "%s.XXXXXX", opts.outfile);
+		out_fd = mkstemp(tmp_name);
+		if (out_fd == -1)
+			err_sys_die(EXIT_FAILMISC, "Can't create temporary file %s", tmp_name);
+		xfstat(file_fd, &stat_buf, opts.outfile);
+		if (fchmod(out_fd, stat_buf.st_mode & 07777))
+			err_sys("Can't set mode of %s", tmp_name);
+	}
+
+	rbuf = xmalloc(rsize);
+	if (digest)
+		digest_start(phi->digest_type, chunk_size);
+	else
+		chunk = xmalloc(chunk_size);
+
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while (ok && cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, sizeof(struct ns_delta_op))) {
+		struct ns_delta_op *op = (struct ns_delta_op *) (rbuf + rpos);
+		uint32_t op_len = ntohl(op->nse_dlt_op);
+		uint32_t block = ntohl(op->nse_dlt_block);
+
+		rpos += sizeof(struct ns_delta_op);
+
+		if (op_len == 0) {
+			eos = true;
+			break;
+		}
+
+		if (op_len & NS_DELTA_REF) {
+			uint32_t count = op_len & ~NS_DELTA_REF;
+			unsigned long long off = (unsigned long long)block * phi->delta_block;
+			unsigned long long left;
+
+			if (count == 0 || block >= phi->delta_blocks ||
+				count > phi->delta_blocks - block)
+				err_msg_die(EXIT_FAILHEADER, "received an corrupted block reference "
+						"(block %u, count %u)", block, count);
+
+			left = min((unsigned long long)count * phi->delta_block,
+					phi->delta_old_size - off);
+			copied += left;
+
+			while (ok && left > 0) {
+				size_t len = min(left, (unsigned long long)chunk_size);
+				unsigned char *buf = digest ? digest_slot_get() : chunk;
+
+				if (pread(file_fd, buf, len, off) != (ssize_t)len)
+					err_sys_die(EXIT_FAILMISC, "delta: pread at offset %llu failed", off);
+				ok = cs_write(out_fd, buf, len);
+				if (digest)
+					digest_slot_put(buf, len);
+				off += len;
+				left -= len;
+			}
+			continue;
+		}
+
+		if (op_len > DELTA_LITERAL_MAX)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted literal (%u bytes)", op_len);
+
+		literal += op_len;
+
+		while (ok && op_len > 0) {
+			size_t len;
+			unsigned char *data;
+
+			if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, 1)) {
+				ok = false;
+				break;
+			}
+			len = min((size_t)op_len, rend - rpos);
+			data = rbuf + rpos;
+			if (digest) {
+				data = digest_slot_get();
+				memcpy(data, rbuf + rpos, len);
+			}
+			ok = cs_write(out_fd, data, len);
+			if (digest)
+				digest_slot_put(data, len);
+			rpos += len;
+			op_len -= len;
+		}
+	}
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	msg(LOUDISH, "delta: %llu literal bytes, %llu bytes copied from the old file",
+			literal, copied);
+
+	if (!eos) {
+		err_msg("delta stream ended without end of data marker");
+		ok = false;
+	}
+
+	if (trailer_len) {
+		if (eos)
+			cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, trailer_len);
+		if (meta_trailer_check(phi, rbuf + rpos, min(rend - rpos, trailer_len)))
+			ok = false;
+	}
+	if (!digest)
+		free(chunk);
+	free(rbuf);
+
+	if (tmp_name) {
+		if (ok && (fsync(out_fd) || rename(tmp_name, opts.outfile))) {
+			err_sys("Can't replace %s", opts.outfile);
+			ok = false;
+		}
+		if (!ok)
+			unlink(tmp_name);
+		close(out_fd);
+		free(tmp_name);
+	}
+
+	if (!ok)
+		err_msg_die(digest && eos ? EXIT_FAILDIGEST : EXIT_FAILNET,
+				"delta transfer failed%s", phi->delta_blocks ?
+				", output file left unchanged" : "");
+
+	return 0;
+}
+
+
+/* symlinks are created and directory modes applied after the
+** last batch: a symlink from the stream can't redirect later
+** entries and read-only directories still take their content */
+struct tree_fixup {
+	struct tree_fixup *next;
+	char *name;
+	char *target; /* symlink, NULL for a directory */
+	mode_t mode;
+	time_t mtime;
+};
+
+
+/* names are relative and must stay below the output directory */
+static bool
+tree_name_ok(const char *name, size_t len)
+{
+	const char *p = name, *end = name + len;
+
+	if (len == 0 || name[0] == '/' || name[len - 1] == '/' || memchr(name, 0, len))
+		return false;
+
+	while (p < end) {
+		const char *slash = memchr(p, '/', end - p);
+		size_t comp = (slash ? slash : end) - p;
+
+		if (comp == 0 || (comp == 1 && p[0] == '.') ||
+			(comp == 2 && p[0] == '.' && p[1] == '.'))
+			return false;
+		p += comp + 1;
+	}
+	return true;
+}
+
+
+/* walk to the directory of the last component of name one component
+** at a time: O_NOFOLLOW on the final open only guards the last one,
+** a symlink in between would lead out of the output directory.
+** Returns dir_fd itself for a name without slash, else a descriptor
+** to close, and -1 (ELOOP or ENOTDIR for a symlink) on failure */
+static int
+tree_parent_open(int dir_fd, char *name, const char **base)
+{
+	int fd = dir_fd, next, save_errno;
+	char *p = name, *slash;
+
+	while ((slash = strchr(p, '/'))) {
+		*slash = 0;
+		next = openat(fd, p, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		*slash = '/';
+		save_errno = errno;
+		if (fd != dir_fd)
+			close(fd);
+		if (next == -1) {
+			errno = save_errno;
+			return -1;
+		}
+		fd = next;
+		p = slash + 1;
+	}
+
+	*base = p;
+	return fd;
+}
+
+
+static void
+tree_parent_close(int dir_fd, int fd)
+{
+	if (fd != dir_fd && fd != -1)
+		close(fd);
+}
+
+
+/* the tree digest covers the whole batch stream */
+static void
+tree_digest(const unsigned char *p, size_t len, size_t slot_size)
+{
+	while (len > 0) {
+		size_t chunk = min(len, slot_size);
+		unsigned char *slot = digest_slot_get();
+
+		memcpy(slot, p, chunk);
+		digest_slot_put(slot, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+
+static void
+tree_fixup_apply(int dir_fd, struct tree_fixup *fixups, unsigned int *failed)
+{
+	while (fixups) {
+		struct tree_fixup *f = fixups;
+		struct timespec times[2] = { { 0, UTIME_OMIT }, { f->mtime, 0 } };
+		const char *base;
+		int pfd = tree_parent_open(dir_fd, f->name, &base), fd;
+
+		if (pfd == -1) {
+			err_sys("Can't reach %s", f->name);
+			(*failed)++;
+		} else if (f->target) {
+			if (symlinkat(f->target, pfd, base) && (errno != EEXIST ||
+					unlinkat(pfd, base, 0) ||
+					symlinkat(f->target, pfd, base))) {
+				err_sys("Can't create symlink %s", f->name);
+				(*failed)++;
+			}
+			utimensat(pfd, base, times, AT_SYMLINK_NOFOLLOW);
+		} else if ((fd = openat(pfd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1) {
+			err_sys("Can't set mode of %s", f->name);
+			(*failed)++;
+		} else {
+			if (fchmod(fd, f->mode & 07777))
+				err_sys("Can't set mode of %s", f->name);
+			futimens(fd, times);
+			close(fd);
+		}
+		tree_parent_close(dir_fd, pfd);
+
+		fixups = f->next;
+		free(f->name);
+		free(f->target);
+		free(f);
+	}
+}
+
+
+/* Receive function for a directory tree (see ns_nxt_tree in
+** ns_hdr.h): create directories, write the files of each batch
+** straight from the receive buffer and collect symlinks and
+** directory modes for the end.
+*/
+static ssize_t
+cs_read_tree(int dir_fd, int connected_fd, struct peer_header_info *phi)
+{
+	size_t rsize = 2 * TREE_META_MAX, rpos = 0, rend = 0, trailer_len;
+	unsigned char *rbuf, *meta;
+	unsigned long long files = 0, dirs = 0, links = 0, bytes = 0;
+	unsigned int failed = 0;
+	bool digest = phi->digest_type != HASH_NULL, eos = false, ok = true;
+	struct tree_fixup *fixups = NULL;
+	struct stat stat_buf;
+
+	xfstat(dir_fd, &stat_buf, opts.outfile ? opts.outfile : "stdout");
+	if (!S_ISDIR(stat_buf.st_mode))
+		err_msg_die(EXIT_FAILOPT, "peer sends a directory tree, the output "
+				"must be an existing directory");
+
+	trailer_len = meta_trailer_len(phi);
+
+	rbuf = xmalloc(rsize);
+	meta = xmalloc(TREE_META_MAX);
+	if (digest)
+		digest_start(phi->digest_type, rsize);
+
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while (ok && cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, sizeof(struct ns_tree_batch))) {
+		struct ns_tree_batch *hdr = (struct ns_tree_batch *) (rbuf + rpos);
+		uint32_t entries = ntohl(hdr->nse_tb_entries);
+		uint32_t names_len = ntohl(hdr->nse_tb_names);
+		unsigned long long data = (unsigned long long)ntohl(hdr->nse_tb_data_hi) << 32 |
+			ntohl(hdr->nse_tb_data_lo), sum = 0;
+		size_t meta_len;
+		const char *name;
+		uint32_t i;
+
+		if (entries == 0) {
+			if (digest)
+				tree_digest(rbuf + rpos, sizeof(*hdr), rsize);
+			rpos += sizeof(*hdr);
+			eos = true;
+			break;
+		}
+
+		if (entries > TREE_BATCH_ENTRIES || names_len > TREE_BATCH_NAMES)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted tree batch "
+					"(%u entries, %u octets of names)", entries, names_len);
+
+		meta_len = sizeof(*hdr) + entries * sizeof(struct ns_tree_ent) + names_len;
+		if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, meta_len))
+			break;
+		memcpy(meta, rbuf + rpos, meta_len);
+		if (digest)
+			tree_digest(rbuf + rpos, meta_len, rsize);
+		rpos += meta_len;
+
+		name = (const char *) meta + meta_len - names_len;
+
+		/* check the batch as a whole before anything is created */
+		for (i = 0; i < entries; i++) {
+			struct ns_tree_ent *ent = (struct ns_tree_ent *) (meta + sizeof(*hdr)) + i;
+			uint16_t name_len = ntohs(ent->nse_te_name_len);
+			mode_t mode = ntohl(ent->nse_te_mode);
+			unsigned long long size = (unsigned long long)ntohl(ent->nse_te_size_hi) << 32 |
+				ntohl(ent->nse_te_size_lo);
+
+			if (name + name_len > (const char *) meta + meta_len ||
+				!tree_name_ok(name, name_len) ||
+				!(S_ISREG(mode) || S_ISDIR(mode) || S_ISLNK(mode)) ||
+				(S_ISDIR(mode) && size) ||
+				(S_ISLNK(mode) && (size == 0 || size >= PATH_MAX)))
+				err_msg_die(EXIT_FAILHEADER, "received an corrupted tree entry");
+			sum += size;
+			name += name_len;
+		}
+		if (sum != data || name != (const char *) meta + meta_len)
+			err_msg_die(EXIT_FAILHEADER, "received an corrupted tree batch");
+
+		name = (const char *) meta + meta_len - names_len;
+
+		for (i = 0; ok && i < entries; i++) {
+			struct ns_tree_ent *ent = (struct ns_tree_ent *) (meta + sizeof(*hdr)) + i;
+			uint16_t name_len = ntohs(ent->nse_te_name_len);
+			mode_t mode = ntohl(ent->nse_te_mode);
+			unsigned long long left = (unsigned long long)ntohl(ent->nse_te_size_hi) << 32 |
+				ntohl(ent->nse_te_size_lo);
+			time_t mtime = ntohl(ent->nse_te_mtime);
+			char path[name_len + 1];
+			const char *base;
+			int fd = -1, pfd;
+
+			memcpy(path, name, name_len);
+			path[name_len] = 0;
+			name += name_len;
+
+			if (S_ISDIR(mode) || S_ISLNK(mode)) {
+				struct tree_fixup *f = xzalloc(sizeof(*f));
+
+				if (S_ISDIR(mode)) {
+					pfd = tree_parent_open(dir_fd, path, &base);
+					if (pfd == -1 || (mkdirat(pfd, base, S_IRWXU) && errno != EEXIST)) {
+						err_sys("Can't create directory %s", path);
+						failed++;
+					}
+					tree_parent_close(dir_fd, pfd);
+					dirs++;
+				} else {
+					if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, left)) {
+						ok = false;
+						free(f);
+						break;
+					}
+					f->target = xmalloc(left + 1);
+					memcpy(f->target, rbuf + rpos, left);
+					f->target[left] = 0;
+					if (digest)
+						tree_digest(rbuf + rpos, left, rsize);
+					rpos += left;
+					links++;
+				}
+				f->name = xstrdup(path);
+				f->mode = mode;
+				f->mtime = mtime;
+				f->next = fixups;
+				fixups = f;
+				continue;
+			}
+
+			pfd = tree_parent_open(dir_fd, path, &base);
+			if (pfd != -1)
+				fd = openat(pfd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,
+						S_IRUSR | S_IWUSR);
+			tree_parent_close(dir_fd, pfd);
+			if (fd == -1) {
+				err_sys("Can't create %s, data discarded", path);
+				failed++;
+			}
+			files++;
+			bytes += left;
+
+			while (left > 0) {
+				size_t len;
+
+				if (!cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, 1)) {
+					ok = false;
+					break;
+				}
+				len = min(rend - rpos, rsize);
+				len = min(left, (unsigned long long)len);
+				if (fd != -1 && !cs_write(fd, rbuf + rpos, len)) {
+					close(fd);
+					fd = -1;
+					failed++;
+				}
+				if (digest)
+					tree_digest(rbuf + rpos, len, rsize);
+				rpos += len;
+				left -= len;
+			}
+
+			if (fd != -1) {
+				struct timespec times[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+
+				if (fchmod(fd, mode & 07777))
+					err_sys("Can't set mode of %s", path);
+				futimens(fd, times);
+				close(fd);
+			}
+		}
+	}
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	tree_fixup_apply(dir_fd, fixups, &failed);
+
+	if (!eos)
+		err_msg("tree stream ended without end of data marker");
+
+	msg(LOUDISH, "tree: received %llu files (%llu bytes), %llu directories, %llu symlinks",
+			files, bytes, dirs, links);
+
+	if (trailer_len) {
+		if (eos)
+			cs_fill(connected_fd, rbuf, rsize, &rpos, &rend, trailer_len);
+		meta_trailer_verify(phi, rbuf + rpos, min(rend - rpos, trailer_len));
+	}
+	free(meta);
+	free(rbuf);
+
+	if (failed)
+		err_msg_die(EXIT_FAILMISC, "%u entries of the tree could not be created", failed);
+
+	return eos ? 0 : -1;
+}
+
+
 /* This is our inner receive function.
 ** It reads from a connected socket descriptor
 ** and write to the file descriptor
+**
+** If the peer announced a trailer (digest, statistics) the last
+** trailer_len bytes of the stream are never written
+** to the file: they are held back at the start of the
+** buffer until the next read proves that they are data.
 */
 static ssize_t
 cs_read(int file_fd, int connected_fd, struct peer_header_info *phi)
 {
 	int buflen;
 	ssize_t rc;
-	char *buf;
+	unsigned char *buf;
+	size_t trailer_len, held = 0;
+	unsigned long long data_size;
+	bool digest = phi->digest_type != HASH_NULL;
+
+	if (phi->tree)
+		return cs_read_tree(file_fd, connected_fd, phi);
+
+	if (phi->compress_algo != NS_CMPR_NONE)
+		return cs_read_compressed(file_fd, connected_fd, phi);
 
-	/* user option or default(DEFAULT_BUFSIZE) */
-	buflen = (opts.buffer_size == 0) ? DEFAULT_BUFSIZE : opts.buffer_size;
+	if (phi->delta)
+		return cs_read_delta(file_fd, connected_fd, phi);
 
-	buf = xmalloc(buflen);
+	if (phi->sparse)
+		return cs_read_sparse(file_fd, connected_fd, phi);
+
+	/* user option, the chunk of the peer or default(DEFAULT_BUFSIZE) */
+	buflen = cs_buflen(phi);
+
+	trailer_len = meta_trailer_len(phi);
+	data_size = phi->data_size ? phi->data_size + trailer_len : 0;
+
+	if (digest) {
+		digest_start(phi->digest_type, buflen + trailer_len);
+		buf = digest_slot_get();
+	} else {
+		buf = xmalloc(buflen + trailer_len);
+	}
 
 	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
 
 	/* main client loop */
-	while ((rc = read(connected_fd, buf, buflen)) > 0) {
-		ssize_t ret;
-		net_stat.total_rx_calls++;
+	while ((rc = cs_sock_read(connected_fd, buf + held, buflen)) > 0) {
+		ssize_t ret = 0;
+		size_t out;
+
+		STAT_ADD(net_stat.total_rx_calls, 1);
 		net_stat.total_rx_bytes += rc;
-		do {
-			ret = write(file_fd, buf, rc);
-		} while (ret == -1 && errno == EINTR);
+		STAT_ADD(net_stat.io_bytes, rc);
+		NS_PROBE2(rx_chunk, rc, net_stat.total_rx_bytes);
+
+		out = held + rc;
+		held = min(out, trailer_len);
+		out -= held;
+
+		if (out > 0) {
+			do {
+				uint64_t start = LAT_START();
+
+				ret = write(file_fd, buf, out);
+				LAT_END(LAT_FILE_WRITE, start, out, ret);
+			} while (ret == -1 && errno == EINTR);
+		}
 
-		if (ret != rc) {
+		if (ret != (ssize_t)out) {
 			err_sys("write failed");
 			break;
 		}
 
-		if (net_stat.total_rx_bytes >= phi->data_size && phi->data_size != 0) {
+		if (digest) {
+			unsigned char *next = digest_slot_get();
+
+			memcpy(next, buf + out, held);
+			digest_slot_put(buf, out);
+			buf = next;
+		} else if (held && out) {
+			memmove(buf, buf + out, held);
+		}
+
+		if (net_stat.total_rx_bytes >= data_size && data_size != 0) {
 
 			/* we are at the end of the
 			 * announced data amount. Protocols like
@@ -90,7 +957,21 @@ cs_read(int file_fd, int connected_fd, struct peer_header_info *phi)
 	}
 
 	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
-	free(buf);
+
+	/* the trailers are no data */
+	net_stat.total_rx_bytes -= held;
+
+	if (digest) {
+		unsigned char trailer[trailer_len];
+
+		memcpy(trailer, buf, held);
+		digest_slot_put(buf, 0);
+		meta_trailer_verify(phi, trailer, held);
+	} else {
+		if (trailer_len)
+			meta_trailer_verify(phi, buf, held);
+		free(buf);
+	}
 	return rc;
 }
 
@@ -255,6 +1136,16 @@ instigate_cs(void)
 		err_msg_die(EXIT_FAILNET, "Don't found a suitable address for binding, giving up "
 				"(TIP: start program with strace(2) to find the problen\n");
 
+	/* the first header comes with the syn, accept() returns
+	** before the handshake is done */
+	if (opts.tcp_fastopen && opts.protocol == IPPROTO_TCP) {
+		int qlen = BACKLOG;
+
+		tcp_fastopen_check(true);
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+			err_sys("setsockopt(TCP_FASTOPEN), no fast open");
+	}
+
 	ret = sock_callbacks.cb_listen(fd, BACKLOG);
 	if (ret < 0)
 		err_sys_die(EXIT_FAILNET, "listen(fd: %d, backlog: %d) failed", fd, BACKLOG);
@@ -305,6 +1196,7 @@ receive_mode(void)
 	file_fd = open_output_file();
 
 	connected_fd = server_fd = instigate_cs();
+	phase_mark(PHASE_RESOLVED);
 
 #ifdef HAVE_AF_TIPC
 	if (opts.family == AF_TIPC) {
@@ -342,11 +1234,39 @@ receive_mode(void)
 		break;
 	}
 
+	/* datagram sockets have no accept, the wait is in the headers */
+	if (connected_fd != server_fd)
+		phase_mark(PHASE_CONNECTED);
+
 	/* read netsend header */
-	meta_exchange_rcv(connected_fd, &phi);
+	meta_exchange_rcv(connected_fd, file_fd, &phi);
+	phase_mark(PHASE_HEADERS);
+	if (opts.tcp_fastopen && opts.protocol == IPPROTO_TCP)
+		tcp_fastopen_report(connected_fd);
+
+	/* a directory is the target of a tree only */
+	if (!phi->tree && opts.outfile && strcmp(opts.outfile, "-")) {
+		struct stat stat_buf;
+
+		xfstat(file_fd, &stat_buf, opts.outfile);
+		if (S_ISDIR(stat_buf.st_mode))
+			err_msg_die(EXIT_FAILOPT, "peer sends a single file, but %s is a directory",
+					opts.outfile);
+	}
+
+	/* we kept the old content for a resume or delta which didn't happen */
+	if (opts.ext_hdr_mask & (HDR_MSK_RESUME | HDR_MSK_DELTA) &&
+		!phi->resumed && !phi->delta_blocks) {
+		msg(GENTLE, "old content of the output file not used, overwrite it");
+		truncate_output_file(file_fd, 0);
+	}
 
 	msg(LOUDISH, "block in read");
 
+	/* TCP_INFO next to the interval reports (-i) */
+	if (opts.protocol == IPPROTO_TCP)
+		interval_tcp_fd(connected_fd);
+
 	/* take the transmit start time for diff */
 	gettimeofday(&opts.starttime, NULL);
 
@@ -354,6 +1274,10 @@ receive_mode(void)
 
 	gettimeofday(&opts.endtime, NULL);
 
+	/* the transmitter waits for our counters (ns_nxt_stats) */
+	if (phi->stats)
+		meta_stats_reply(connected_fd);
+
 	msg(LOUDISH, "done");
 
 	if (opts.protocol == IPPROTO_TCP && VL_LOUDISH(opts.verbose)) {
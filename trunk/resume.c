@@ -0,0 +1,152 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "xfuncs.h"
+#include "resume.h"
+
+#define	RESUME_READ_BUF (256 * 1024)
+
+
+/* smallest chunk size >= 1 << chunk_log which covers have
+** bytes with at most RESUME_MAX_LEAVES leaves */
+unsigned int resume_chunk_log(unsigned long long have, unsigned int chunk_log)
+{
+	if (chunk_log < RESUME_CHUNK_LOG_MIN)
+		chunk_log = RESUME_CHUNK_LOG_MIN;
+	if (chunk_log > RESUME_CHUNK_LOG_MAX)
+		chunk_log = RESUME_CHUNK_LOG_MAX;
+
+	while (chunk_log < RESUME_CHUNK_LOG_MAX &&
+			(have >> chunk_log) > RESUME_MAX_LEAVES)
+		chunk_log++;
+
+	return chunk_log;
+}
+
+
+/* returns false if the file ends before off + len */
+static bool hash_chunk(int fd, unsigned char *buf, off_t off, size_t len,
+		unsigned char *out)
+{
+	struct hash_ctx ctx;
+
+	hash_init(&ctx, RESUME_HASH);
+
+	while (len > 0) {
+		ssize_t rc = pread(fd, buf, min(len, (size_t)RESUME_READ_BUF), off);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			err_sys_die(EXIT_FAILMISC, "resume: pread at offset %lld failed",
+					(long long)off);
+		}
+		if (rc == 0)
+			return false;
+
+		hash_update(&ctx, buf, rc);
+		off += rc;
+		len -= rc;
+	}
+
+	hash_final(&ctx, out);
+	return true;
+}
+
+
+/* hash all complete chunks of the first have bytes of fd into
+** leaves (RESUME_MAX_LEAVES * RESUME_HASH_LEN), returns the count */
+unsigned int resume_leaves_build(int fd, unsigned long long have,
+		unsigned int chunk_log, unsigned char *leaves)
+{
+	unsigned int i, n = min(have >> chunk_log, (unsigned long long)RESUME_MAX_LEAVES);
+	unsigned char *buf = xmalloc(RESUME_READ_BUF);
+
+	for (i = 0; i < n; i++) {
+		if (!hash_chunk(fd, buf, (off_t)i << chunk_log, (size_t)1 << chunk_log,
+					leaves + i * RESUME_HASH_LEN))
+			break;
+	}
+
+	free(buf);
+	return i;
+}
+
+
+void resume_tree_root(const unsigned char *leaves, unsigned int n, unsigned char *root)
+{
+	unsigned char *level;
+	unsigned int i;
+
+	if (n == 0) {
+		memset(root, 0, RESUME_HASH_LEN);
+		return;
+	}
+
+	level = xmalloc(n * RESUME_HASH_LEN);
+	memcpy(level, leaves, n * RESUME_HASH_LEN);
+
+	while (n > 1) {
+		for (i = 0; i < n / 2; i++) {
+			struct hash_ctx ctx;
+
+			hash_init(&ctx, RESUME_HASH);
+			hash_update(&ctx, level + 2 * i * RESUME_HASH_LEN, 2 * RESUME_HASH_LEN);
+			hash_final(&ctx, level + i * RESUME_HASH_LEN);
+		}
+		if (n % 2)
+			memmove(level + i * RESUME_HASH_LEN,
+					level + (n - 1) * RESUME_HASH_LEN, RESUME_HASH_LEN);
+		n = (n + 1) / 2;
+	}
+
+	memcpy(root, level, RESUME_HASH_LEN);
+	free(level);
+}
+
+
+/* number of leading leaves which match the chunks of fd */
+unsigned int resume_leaves_match(int fd, const unsigned char *leaves,
+		unsigned int n, unsigned int chunk_log)
+{
+	unsigned int i;
+	unsigned char md[RESUME_HASH_LEN];
+	unsigned char *buf = xmalloc(RESUME_READ_BUF);
+
+	for (i = 0; i < n; i++) {
+		if (!hash_chunk(fd, buf, (off_t)i << chunk_log, (size_t)1 << chunk_log, md))
+			break;
+		if (memcmp(md, leaves + i * RESUME_HASH_LEN, RESUME_HASH_LEN))
+			break;
+	}
+
+	free(buf);
+	return i;
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,30 @@
+#ifndef NETSEND_RESUME_H_INCLUDE_
+#define NETSEND_RESUME_H_INCLUDE_
+
+#include <stddef.h>
+
+#include "hash.h"
+
+/* resume.c - chunk hash tree over the data a receiver already has
+**
+** The file prefix is cut into chunks of 1 << chunk_log bytes,
+** the sha256 of each chunk is a leaf. Interior nodes hash the
+** concatenation of their two children, an odd node is promoted
+** unchanged. The receiver sends root and leaves, the transmitter
+** checks the root and compares the leaves with its own file
+** until the first mismatch.
+*/
+
+#define	RESUME_HASH          HASH_SHA256
+#define	RESUME_HASH_LEN      32
+#define	RESUME_CHUNK_LOG_MIN 16
+#define	RESUME_CHUNK_LOG_DEF 20 /* 1 MiB */
+#define	RESUME_CHUNK_LOG_MAX 40
+#define	RESUME_MAX_LEAVES    4096 /* keeps the reply below 64k * 4 octets */
+
+unsigned int resume_chunk_log(unsigned long long, unsigned int);
+unsigned int resume_leaves_build(int, unsigned long long, unsigned int, unsigned char *);
+void resume_tree_root(const unsigned char *, unsigned int, unsigned char *);
+unsigned int resume_leaves_match(int, const unsigned char *, unsigned int, unsigned int);
+
+#endif /* NETSEND_RESUME_H_INCLUDE_ */
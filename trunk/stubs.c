@@ -0,0 +1,2 @@
+#include <stdlib.h>
+void *xmalloc(size_t s){return malloc(s);} 
@@ -0,0 +1,123 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "trace.h"
+
+extern struct opts opts;
+
+static struct {
+	struct trace_hdr *hdr; /* NULL if not tracing */
+	struct trace_record *ring;
+	size_t map_len;
+	uint64_t slots;
+} trace;
+
+
+/* before the transfer: create the file, map and touch all of it,
+** the io loops must not page fault on a fresh record */
+void
+trace_open(const char *path, uint64_t slots)
+{
+	struct timespec ts;
+	void *map;
+	int fd;
+
+	trace.map_len = sizeof(struct trace_hdr) + slots * sizeof(struct trace_record);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		err_sys_die(EXIT_FAILMISC, "Can't open trace file %s", path);
+	if (ftruncate(fd, trace.map_len) < 0)
+		err_sys_die(EXIT_FAILMISC, "Can't size trace file %s", path);
+
+	map = mmap(NULL, trace.map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED)
+		err_sys_die(EXIT_FAILMEM, "Can't map trace file %s", path);
+	close(fd);
+
+	trace.hdr = map;
+	trace.ring = (struct trace_record *) (trace.hdr + 1);
+	trace.slots = slots;
+
+	memset(trace.hdr, 0, sizeof(*trace.hdr));
+	memcpy(trace.hdr->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	trace.hdr->version = TRACE_VERSION;
+	trace.hdr->record_size = sizeof(struct trace_record);
+	trace.hdr->slots = slots;
+	trace.hdr->mode = opts.workmode == MODE_TRANSMIT ? 0 : 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	trace.hdr->start_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	trace.hdr->start_realtime_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	msg(GENTLE, "trace %llu events to %s", (unsigned long long) slots, path);
+}
+
+
+/* the page cache has it all, the kernel writes it back in its time */
+void
+trace_close(void)
+{
+	if (!trace.hdr)
+		return;
+
+	if (msync(trace.hdr, trace.map_len, MS_ASYNC) < 0)
+		err_sys("msync() of the trace file");
+	munmap(trace.hdr, trace.map_len);
+	trace.hdr = NULL;
+}
+
+
+/* from lat_record(), single writer: the record first, then head */
+void
+trace_event(unsigned int op, uint64_t start, uint64_t end, size_t want, ssize_t done, int err)
+{
+	struct trace_record *r;
+	uint64_t head, lat = end - start;
+
+	if (!trace.hdr)
+		return;
+
+	head = trace.hdr->head;
+	r = &trace.ring[head % trace.slots];
+	r->time_ns = end - trace.hdr->start_ns;
+	r->latency_ns = lat > UINT32_MAX ? UINT32_MAX : lat;
+	r->want = want > UINT32_MAX ? UINT32_MAX : want;
+	r->done = done > 0 ? (uint32_t) min((size_t) done, (size_t) UINT32_MAX) : 0;
+	r->err = done < 0 ? err : 0;
+	r->op = op;
+	r->reserved = 0;
+
+	__atomic_store_n(&trace.hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,53 @@
+#ifndef NETSEND_TRACE_H_INCLUDE_
+#define NETSEND_TRACE_H_INCLUDE_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* trace.c - one binary record per io call (-e)
+**
+** The trace file is a header followed by a ring of fixed size
+** records, mapped shared into memory: recording an event is a
+** store into the page cache, the kernel writes it back. The
+** header counts the records ever written, the oldest one is at
+** head % slots once the ring wrapped. Host byte order - decode
+** on the same architecture (nstrace FILE > trace.csv).
+*/
+
+#define	TRACE_MAGIC "nstrace"
+#define	TRACE_VERSION 1
+#define	DEFAULT_TRACE_SLOTS (1 << 20) /* 24 MiB */
+#define	MIN_TRACE_SLOTS 16
+
+struct trace_hdr {
+	char magic[8]; /* TRACE_MAGIC, NUL terminated */
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t slots; /* records in the ring */
+	uint64_t head; /* records written so far */
+	uint64_t start_ns; /* CLOCK_MONOTONIC of the start */
+	uint64_t start_realtime_ns; /* CLOCK_REALTIME at the same time */
+	uint32_t mode; /* 0 transmit, 1 receive */
+	uint32_t reserved[3];
+};
+
+/* op is an enum lat_call of latency.h */
+struct trace_record {
+	uint64_t time_ns; /* end of the call since start_ns */
+	uint32_t latency_ns; /* saturated at UINT32_MAX */
+	uint32_t want; /* bytes asked for */
+	uint32_t done; /* bytes moved, 0 on error */
+	uint16_t err; /* errno, 0 on success */
+	uint8_t op;
+	uint8_t reserved;
+};
+
+#define	TRACE_OP_NAMES { "write", "sendfile", "splice", "read", "file-write" }
+
+/* trace.c */
+void trace_open(const char *, uint64_t);
+void trace_close(void);
+void trace_event(unsigned int, uint64_t, uint64_t, size_t, ssize_t, int);
+
+#endif /* NETSEND_TRACE_H_INCLUDE_ */
@@ -45,6 +45,14 @@
 #include "global.h"
 #include "xfuncs.h"
 #include "proto_tipc.h"
+#include "digest.h"
+#include "compress.h"
+#include "ns_hdr.h"
+#include "delta.h"
+#include "zero.h"
+#include "tree.h"
+#include "latency.h"
+#include "probes.h"
 
 extern struct opts opts;
 extern struct net_stat net_stat;
@@ -84,13 +92,26 @@ static int get_mem_adv_f(int adv)
 }
 
 
+/* engines start at the file position - it is not zero if
+** meta_exchange_snd() resumed a transfer */
+static off_t start_offset(int file_fd)
+{
+	off_t offset = lseek(file_fd, 0, SEEK_CUR);
+
+	return offset < 0 ? 0 : offset;
+}
+
+
 static ssize_t write_len(int fd, const void *buf, size_t len)
 {
 	const char *bufptr = buf;
 	ssize_t total = 0;
 	do {
+		uint64_t start = LAT_START();
 		ssize_t written = sock_callbacks.cb_write(fd, bufptr, len);
-		net_stat.total_tx_calls += 1;
+		LAT_END(LAT_WRITE, start, len, written);
+		PHASE_FIRST_BYTE_MARK(written);
+		STAT_ADD(net_stat.total_tx_calls, 1);
 		if (written < 0) {
 			int real_errno;
 
@@ -109,6 +130,7 @@ static ssize_t write_len(int fd, const void *buf, size_t len)
 			errno = real_errno;
 			break;
 		}
+		STAT_ADD(net_stat.io_bytes, written);
 		total += written;
 		bufptr += written;
 		len -= written;
@@ -123,13 +145,15 @@ static ssize_t trans_rw(int file_fd, int connected_fd)
 	int buflen;
 	ssize_t cnt, cnt_coll = 0;
 	unsigned char *buf;
+	bool digest = opts.ext_hdr_mask & HDR_MSK_DIGEST;
 
 	msg(STRESSFUL, "send via read/write io operation");
 
 	/* user option or default */
 	buflen = opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE;
 
-	buf = xmalloc(buflen);
+	/* with a digest the buffers rotate through the digest thread */
+	buf = digest ? digest_slot_get() : xmalloc(buflen);
 	if (opts.change_mem_advise &&
 		posix_fadvise(file_fd, 0, 0, get_mem_adv_f(opts.mem_advice))) {
 		err_sys("posix_fadvise");	/* do not exit */
@@ -143,6 +167,12 @@ static ssize_t trans_rw(int file_fd, int connected_fd)
 			break;
 		/* correct statistics */
 		net_stat.total_tx_bytes += cnt_coll;
+		NS_PROBE2(tx_chunk, IO_RW, cnt_coll);
+
+		if (digest) {
+			digest_slot_put(buf, cnt_coll);
+			buf = digest_slot_get();
+		}
 
 		/* if we reached a user transfer limit? */
 		if (opts.multiple_barrier) {
@@ -154,16 +184,109 @@ static ssize_t trans_rw(int file_fd, int connected_fd)
 
 	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
 
-	free(buf);
+	if (digest)
+		digest_slot_put(buf, 0);
+	else
+		free(buf);
 
 	return cnt_coll;
 }
 
 
+/* rw engine with the compression stage in between: every
+** buffer carries COMPRESS_BLK_HDR_LEN bytes of headroom for
+** the block header so raw blocks need no extra copy */
+static ssize_t trans_rw_compress(int file_fd, int connected_fd)
+{
+	int buflen;
+	ssize_t cnt, cnt_coll = 0;
+	size_t frame_len;
+	unsigned char *buf, *frame;
+	bool digest = opts.ext_hdr_mask & HDR_MSK_DIGEST;
+
+	msg(STRESSFUL, "send via read/write io operation (compressed)");
+
+	buflen = opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE;
+
+	buf = digest ? digest_slot_get() : xmalloc(COMPRESS_BLK_HDR_LEN + buflen);
+	if (opts.change_mem_advise &&
+		posix_fadvise(file_fd, 0, 0, get_mem_adv_f(opts.mem_advice))) {
+		err_sys("posix_fadvise");	/* do not exit */
+	}
+
+	compress_start(opts.compress_mode, buflen);
+
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while ((cnt = read(file_fd, buf + COMPRESS_BLK_HDR_LEN, buflen)) > 0) {
+		frame_len = compress_block(buf, cnt, &frame);
+
+		cnt_coll = write_len(connected_fd, frame, frame_len);
+		if (cnt_coll == -1)
+			break;
+		compress_sent(cnt_coll);
+
+		net_stat.total_tx_bytes += cnt_coll;
+		NS_PROBE2(tx_chunk, IO_RW, cnt_coll);
+
+		if (digest) {
+			digest_slot_put_off(buf, COMPRESS_BLK_HDR_LEN, cnt);
+			buf = digest_slot_get();
+		}
+
+		/* the transfer limit counts data, not wire bytes */
+		if (opts.multiple_barrier &&
+			compress_raw_bytes() >= (unsigned long long)buflen * opts.multiple_barrier)
+			break;
+	}
+
+	if (cnt_coll != -1) {
+		frame_len = compress_end_marker(buf);
+		cnt_coll = write_len(connected_fd, buf, frame_len);
+		if (cnt_coll != -1)
+			net_stat.total_tx_bytes += cnt_coll;
+	}
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	compress_finish();
+
+	if (digest)
+		digest_slot_put(buf, 0);
+	else
+		free(buf);
+
+	return cnt_coll;
+}
+
+
+/* the *_range() helpers send [*offset, end) of the file and
+** advance *offset - shared by the engines and trans_sparse() */
+static ssize_t mmap_range(int connected_fd, const char *map, off_t *offset, off_t end)
+{
+	ssize_t rc = 0;
+	/* full or partial write */
+	off_t write_cnt = opts.buffer_size ? opts.buffer_size : end - *offset;
+
+	while (*offset < end) {
+		rc = write_len(connected_fd, map + *offset, min(write_cnt, end - *offset));
+		if (rc == -1)
+			return -1;
+		NS_PROBE2(tx_chunk, IO_MMAP, rc);
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			digest_feed_ref(map + *offset, rc);
+		*offset += rc;
+	}
+
+	return rc;
+}
+
+
 static ssize_t trans_mmap(int file_fd, int connected_fd)
 {
 	int ret = 0;
-	ssize_t rc, written = 0, write_cnt;
+	ssize_t rc = 0;
+	off_t start = start_offset(file_fd), written = start;
 	struct stat stat_buf;
 	void *mmap_buf;
 
@@ -183,38 +306,18 @@ static ssize_t trans_mmap(int file_fd, int connected_fd)
 		posix_madvise(mmap_buf, stat_buf.st_size, get_mem_adv_m(opts.mem_advice)))
 		err_sys("posix_madvise");	/* do not exit */
 
-	/* full or partial write */
-	write_cnt = opts.buffer_size ?
-		opts.buffer_size : stat_buf.st_size;
-
-	/* write chunked sized frames */
-	while (stat_buf.st_size - written >= write_cnt) {
-		char *tmpbuf = mmap_buf;
-		rc = write_len(connected_fd, tmpbuf + written, write_cnt);
-		if (rc == -1)
-			goto write_fail;
-		written += rc;
-	}
-	/* and write remaining bytes, if any */
-	write_cnt = stat_buf.st_size - written;
-	if (write_cnt > 0) {
-		char *tmpbuf = mmap_buf;
-		rc = write_len(connected_fd, tmpbuf + written, write_cnt);
-		if (rc == -1) {
- write_fail:
-			touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
-			net_stat.total_tx_bytes = written;
-			return munmap(mmap_buf, stat_buf.st_size);
-		}
-		written += rc;
-	}
+	rc = mmap_range(connected_fd, mmap_buf, &written, stat_buf.st_size);
 
 	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
 
+	/* the digest thread reads from our mapping */
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		digest_drain();
+
 	if (stat_buf.st_size != written) {
 		fprintf(stderr, "ERROR: Can't flush buffer within write call: %s!\n",
 				strerror(errno));
-		fprintf(stderr, " size: %ld written %zd\n", (long)stat_buf.st_size, written);
+		fprintf(stderr, " size: %ld written %ld\n", (long)stat_buf.st_size, (long)written);
 	}
 
 	ret = munmap(mmap_buf, stat_buf.st_size);
@@ -222,7 +325,7 @@ static ssize_t trans_mmap(int file_fd, int connected_fd)
 		err_sys("Can't munmap buffer");
 
 	/* correct statistics */
-	net_stat.total_tx_bytes = stat_buf.st_size;
+	net_stat.total_tx_bytes = written - start;
 
 	return rc;
 }
@@ -233,13 +336,18 @@ static long splice_chunk(int pipe_fd, int fd_out, size_t len, int flags)
 	long written, total = 0;
 
 	do {
+		uint64_t start = LAT_START();
+
 		written = splice(pipe_fd, NULL, fd_out, NULL, len, flags);
+		LAT_END(LAT_SPLICE, start, len, written);
+		PHASE_FIRST_BYTE_MARK(written);
 		if (written < 0) {
 			err_sys("Failure in splice from pipe");
 			break;
 		}
 
-		net_stat.total_tx_calls++;
+		STAT_ADD(net_stat.total_tx_calls, 1);
+		STAT_ADD(net_stat.io_bytes, written);
 		total += written;
 		len -= written;
         } while (len > 0);
@@ -258,12 +366,18 @@ ss_splice_frompipe(int pipe_fd, int connected_fd, ssize_t write_cnt)
 	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
 
 	do {
+		uint64_t start = LAT_START();
+
 		written = splice(pipe_fd, NULL, connected_fd, NULL, write_cnt, SPLICE_F_MOVE|SPLICE_F_MORE);
+		LAT_END(LAT_SPLICE, start, write_cnt, written);
+		PHASE_FIRST_BYTE_MARK(written);
 		if (written < 0) {
 			err_sys("Failure in splice from pipe");
 			break;
 		}
-		net_stat.total_tx_calls += 1;
+		STAT_ADD(net_stat.total_tx_calls, 1);
+		STAT_ADD(net_stat.io_bytes, written);
+		NS_PROBE2(tx_chunk, IO_SPLICE, written);
 		total += written;
         } while (written > 0);
 
@@ -296,6 +410,30 @@ static ssize_t get_splice_size(int file_fd, struct stat *stat_buf)
 
 	return write_cnt;
 }
+
+
+static ssize_t splice_range(int file_fd, int connected_fd, int pipefds[2],
+		loff_t *offset, loff_t end, ssize_t write_cnt)
+{
+	ssize_t rc = 0;
+
+	while (*offset < end) {
+		rc = splice(file_fd, offset, pipefds[1], NULL,
+				min(write_cnt, end - *offset), SPLICE_F_MOVE);
+		if (rc == -1)
+			err_sys_die(EXIT_FAILMISC, "Failure in splice to pipe");
+		if (rc == 0)
+			break;
+		if (splice_chunk(pipefds[0], connected_fd, rc, SPLICE_F_MOVE |
+					(*offset < end ? SPLICE_F_MORE : 0)) != rc)
+			return -1;
+		NS_PROBE2(tx_chunk, IO_SPLICE, rc);
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			digest_feed_file(file_fd, *offset - rc, rc);
+	}
+
+	return rc;
+}
 #endif
 
 
@@ -304,43 +442,31 @@ static ssize_t trans_splice(int file_fd, int connected_fd)
 #ifdef HAVE_SPLICE
 	int pipefds[2];
 	struct stat stat_buf;
-	ssize_t rc, write_cnt;
-	loff_t offset = 0;
+	ssize_t rc = 0, write_cnt;
+	loff_t offset = start_offset(file_fd);
 
 	msg(STRESSFUL, "send via splice io operation");
 
 	write_cnt = get_splice_size(file_fd, &stat_buf);
 
-	if (S_ISFIFO(stat_buf.st_mode))
+	if (S_ISFIFO(stat_buf.st_mode)) {
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			err_msg_die(EXIT_FAILOPT, "Can't digest data spliced from a pipe "
+					"(data never reach userspace), use -u rw");
 		return ss_splice_frompipe(file_fd, connected_fd, write_cnt);
+	}
 
 	xpipe(pipefds);
 
 	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
 
-	/* write chunked sized frames */
-	while (stat_buf.st_size - offset - 1 >= write_cnt) {
-		rc = splice(file_fd, &offset, pipefds[1], NULL, write_cnt, SPLICE_F_MOVE);
-		if (rc == -1)
-			err_sys_die(EXIT_FAILMISC, "Failure in splice to pipe");
-		if (splice_chunk(pipefds[0], connected_fd, rc, SPLICE_F_MOVE|SPLICE_F_MORE) < 0)
-			goto finish;
-	}
-	/* and write remaining bytes, if any */
-	write_cnt = stat_buf.st_size - offset - 1;
-	if (write_cnt >= 0) {
-		rc = splice(file_fd, &offset, pipefds[1], NULL, write_cnt + 1, 0);
-		if (rc == -1)
-			err_sys_die(EXIT_FAILMISC, "Failure in splice to pipe");
+	rc = splice_range(file_fd, connected_fd, pipefds, &offset, stat_buf.st_size, write_cnt);
 
-		splice_chunk(pipefds[0], connected_fd, rc, SPLICE_F_MOVE);
-	}
- finish:
 	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
 
 	if (offset != stat_buf.st_size)
-		err_msg("Incomplete transfer in splice: %d of %ld bytes",
-						offset , stat_buf.st_size);
+		err_msg("Incomplete transfer in splice: %lld of %ld bytes",
+						(long long)offset, (long)stat_buf.st_size);
 	close(pipefds[0]);
 	close(pipefds[1]);
 	return rc;
@@ -350,11 +476,40 @@ static ssize_t trans_splice(int file_fd, int connected_fd)
 }
 
 
+static ssize_t sendfile_range(int file_fd, int connected_fd, off_t *offset, off_t end)
+{
+	ssize_t rc = 0;
+	/* full or partial write */
+	off_t write_cnt = opts.buffer_size ? opts.buffer_size : end - *offset;
+
+	while (*offset < end) {
+		size_t want = min(write_cnt, end - *offset);
+		uint64_t start = LAT_START();
+
+		rc = sendfile(connected_fd, file_fd, offset, want);
+		LAT_END(LAT_SENDFILE, start, want, rc);
+		PHASE_FIRST_BYTE_MARK(rc);
+		if (rc == -1)
+			err_sys_die(EXIT_FAILNET, "Failure in sendfile routine");
+		if (rc == 0)
+			break;
+		STAT_ADD(net_stat.total_tx_calls, 1);
+		STAT_ADD(net_stat.io_bytes, rc);
+		NS_PROBE2(tx_chunk, IO_SENDFILE, rc);
+		/* pages are hot in the page cache right now */
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			digest_feed_file(file_fd, *offset - rc, rc);
+	}
+
+	return rc;
+}
+
+
 static ssize_t trans_sendfile(int file_fd, int connected_fd)
 {
 	struct stat stat_buf;
-	ssize_t rc, write_cnt;
-	off_t offset = 0;
+	ssize_t rc = 0;
+	off_t start = start_offset(file_fd), offset = start;
 
 	msg(STRESSFUL, "send via sendfile io operation");
 
@@ -363,42 +518,596 @@ static ssize_t trans_sendfile(int file_fd, int connected_fd)
 	if (stat_buf.st_size == 0)
 		err_msg("%s: empty file", opts.infile);
 
-	/* full or partial write */
-	write_cnt = opts.buffer_size ?
-		opts.buffer_size : stat_buf.st_size;
-
 	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
 
-	/* write chunked sized frames */
-	while (stat_buf.st_size - offset - 1 >= write_cnt) {
-		rc = sendfile(connected_fd, file_fd, &offset, write_cnt);
-		if (rc == -1)
-			err_sys_die(EXIT_FAILNET, "Failure in sendfile routine");
-		net_stat.total_tx_calls += 1;
+	rc = sendfile_range(file_fd, connected_fd, &offset, stat_buf.st_size);
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	if (offset != stat_buf.st_size)
+		err_msg_die(EXIT_FAILNET, "Incomplete transfer from sendfile: %ld of %ld bytes",
+				(long)offset, (long)stat_buf.st_size);
+
+	/* correct statistics */
+	net_stat.total_tx_bytes = stat_buf.st_size - start;
+	return rc;
+}
+
+
+static ssize_t rw_range(int file_fd, int connected_fd, unsigned char **buf,
+		size_t buflen, off_t *offset, off_t end)
+{
+	ssize_t cnt = 0;
+
+	while (*offset < end) {
+		cnt = pread(file_fd, *buf, min((off_t)buflen, end - *offset), *offset);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		if (cnt <= 0) {
+			if (cnt < 0)
+				err_sys("read failed");
+			return -1;
+		}
+		if (write_len(connected_fd, *buf, cnt) == -1)
+			return -1;
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST) {
+			digest_slot_put(*buf, cnt);
+			*buf = digest_slot_get();
+		}
+		*offset += cnt;
+	}
+
+	return cnt;
+}
+
+
+#define	SPARSE_HDR_ROOM (2 * sizeof(struct ns_ext_hdr))
+#define	ZERO_SCAN_MAX   (8 * 1024 * 1024)
+
+/* holes are not announced right away: the hole and the header
+** of the following data extent go out with one write */
+struct sparse_out {
+	int fd;
+	unsigned long long hole; /* pending */
+	unsigned long long data_bytes, hole_bytes;
+	unsigned int extents, markers;
+};
+
+
+static void sparse_fill_hdr(struct ns_ext_hdr *ext_hdr, enum ns_ext_type type,
+		unsigned long long len)
+{
+	ext_hdr->nse_ext_type = htonl(type);
+	ext_hdr->nse_ext_len_hi = htonl((uint32_t)(len >> 32));
+	ext_hdr->nse_ext_len_lo = htonl((uint32_t)len);
+}
+
+
+/* store the pending hole and the header of the next extent at
+** the end of dst[SPARSE_HDR_ROOM], returns their length */
+static size_t sparse_hdrs(struct sparse_out *out, unsigned char *dst,
+		enum ns_ext_type type, unsigned long long len)
+{
+	struct ns_ext_hdr ext_hdr[2];
+	size_t n = 0;
+
+	if (out->hole) {
+		sparse_fill_hdr(&ext_hdr[n++], NS_EXT_HOLE, out->hole);
+		out->hole_bytes += out->hole;
+		out->markers++;
+		out->hole = 0;
+	}
+	sparse_fill_hdr(&ext_hdr[n++], type, len);
+	if (type == NS_EXT_DATA) {
+		out->data_bytes += len;
+		out->extents++;
 	}
-	/* and write remaining bytes, if any */
-	write_cnt = stat_buf.st_size - offset - 1;
-	if (write_cnt >= 0) {
-		rc = sendfile(connected_fd, file_fd, &offset, write_cnt + 1);
+
+	n *= sizeof(struct ns_ext_hdr);
+	memcpy(dst + SPARSE_HDR_ROOM - n, ext_hdr, n);
+	/* the digest covers the layout of the file as well */
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		digest_feed_copy(ext_hdr, n);
+	return n;
+}
+
+
+static int sparse_put(struct sparse_out *out, enum ns_ext_type type, unsigned long long len)
+{
+	unsigned char buf[SPARSE_HDR_ROOM];
+	size_t n = sparse_hdrs(out, buf, type, len);
+
+	return write_len(out->fd, buf + SPARSE_HDR_ROOM - n, n) == -1 ? -1 : 0;
+}
+
+
+/* -Z: send the data blocks of [*offset, end), zero blocks become
+** holes. The scan looks at most ZERO_SCAN_MAX bytes ahead. */
+static ssize_t zero_mmap_range(struct sparse_out *out, const char *map,
+		off_t *offset, off_t end)
+{
+	ssize_t rc = 0;
+
+	while (*offset < end) {
+		bool zero;
+		size_t run = zero_run((const unsigned char *) map + *offset,
+				min(end - *offset, (off_t)ZERO_SCAN_MAX), &zero);
+
+		/* the run goes out (and into the digest) as a hole
+		** marker in front of the next header, see sparse_hdrs() */
+		if (zero) {
+			out->hole += run;
+			*offset += run;
+			continue;
+		}
+
+		if (sparse_put(out, NS_EXT_DATA, run))
+			return -1;
+		rc = mmap_range(out->fd, map, offset, *offset + run);
 		if (rc == -1)
-			err_sys_die(EXIT_FAILNET, "Failure in sendfile routine");
-		net_stat.total_tx_calls += 1;
+			return -1;
+	}
+
+	return rc;
+}
+
+
+/* the buffer starts with SPARSE_HDR_ROOM bytes of headroom: the
+** headers of a data run are stored right before it - in the
+** headroom or at the end of the zero run in front of it - so
+** each run costs one write */
+static ssize_t zero_rw_range(struct sparse_out *out, int file_fd, unsigned char **buf,
+		size_t buflen, off_t *offset, off_t end)
+{
+	bool digest = opts.ext_hdr_mask & HDR_MSK_DIGEST;
+	ssize_t cnt = 0;
+
+	while (*offset < end) {
+		unsigned char *data = *buf + SPARSE_HDR_ROOM;
+		size_t pos = 0, run, n;
+		bool zero;
+
+		cnt = pread(file_fd, data, min((off_t)buflen, end - *offset), *offset);
+		if (cnt < 0 && errno == EINTR)
+			continue;
+		if (cnt <= 0) {
+			if (cnt < 0)
+				err_sys("read failed");
+			return -1;
+		}
+
+		while (pos < (size_t)cnt) {
+			run = zero_run(data + pos, cnt - pos, &zero);
+			/* a hole marker like in zero_mmap_range() */
+			if (zero) {
+				out->hole += run;
+				pos += run;
+				continue;
+			}
+
+			n = sparse_hdrs(out, data + pos - SPARSE_HDR_ROOM, NS_EXT_DATA, run);
+			if (write_len(out->fd, data + pos - n, n + run) == -1)
+				return -1;
+			if (digest)
+				digest_feed_ref(data + pos, run);
+			pos += run;
+		}
+
+		*offset += cnt;
+		if (digest) {
+			digest_slot_release(*buf);
+			*buf = digest_slot_get();
+		}
+	}
+
+	return cnt;
+}
+
+
+/* next data extent at or after off: [*data, *hole) - without
+** SEEK_DATA support (or on filesystems which don't track holes)
+** the rest of the file is one data extent */
+static void sparse_next_extent(int file_fd, off_t off, off_t size,
+		off_t *data, off_t *hole)
+{
+	*data = off;
+	*hole = size;
+#ifdef HAVE_SEEK_DATA
+	if (!(opts.ext_hdr_mask & HDR_MSK_SPARSE))
+		return;
+	*data = lseek(file_fd, off, SEEK_DATA);
+	if (*data == -1) {
+		*data = errno == ENXIO ? size : off;
+		return;
+	}
+	*hole = lseek(file_fd, *data, SEEK_HOLE);
+	if (*hole == -1 || *hole > size)
+		*hole = size;
+#else
+	(void) file_fd;
+#endif
+}
+
+
+/* sparse engine: walk the data extents of the file (-S) and send
+** them with the selected send routine, holes become a NS_EXT_HOLE
+** marker (see ns_nxt_sparse in ns_hdr.h). With -Z the rw and mmap
+** routines turn zero blocks within the data into holes as well. */
+static ssize_t trans_sparse(int file_fd, int connected_fd)
+{
+	struct stat stat_buf;
+	struct sparse_out out;
+	off_t off = start_offset(file_fd), data, hole;
+	char *map = NULL;
+	unsigned char *buf = NULL;
+	size_t buflen = opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE;
+	bool digest = opts.ext_hdr_mask & HDR_MSK_DIGEST;
+	bool zero = opts.ext_hdr_mask & HDR_MSK_ZERO;
+	ssize_t rc = 0;
+#ifdef HAVE_SPLICE
+	int pipefds[2];
+	ssize_t splice_cnt = 0;
+#endif
+
+	msg(STRESSFUL, "send via %s io operation (%s)",
+			opts.io_call == IO_MMAP ? "mmap" : opts.io_call == IO_SPLICE ? "splice" :
+			opts.io_call == IO_SENDFILE ? "sendfile" : "read/write",
+			zero ? "zero block elision" : "sparse");
+	if (zero)
+		msg(LOUDISH, "zero block scan: %s implementation", zero_impl_str());
+
+	xfstat(file_fd, &stat_buf, opts.infile);
+
+	memset(&out, 0, sizeof(out));
+	out.fd = connected_fd;
+
+	switch (opts.io_call) {
+	case IO_MMAP:
+		if (stat_buf.st_size == 0)
+			break;
+		map = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+		if (map == MAP_FAILED)
+			err_sys_die(EXIT_FAILMISC, "Can't mmap file %s: %s\n",
+					opts.infile, strerror(errno));
+		break;
+	case IO_SPLICE:
+#ifdef HAVE_SPLICE
+		splice_cnt = get_splice_size(file_fd, &stat_buf);
+		xpipe(pipefds);
+#else
+		err_msg_die(EXIT_FAILMISC, "splice support not compiled in");
+#endif
+		break;
+	case IO_RW:
+		buf = digest ? digest_slot_get() : xmalloc(SPARSE_HDR_ROOM + buflen);
+		break;
+	default:
+		break;
 	}
 
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while (off < stat_buf.st_size) {
+		sparse_next_extent(file_fd, off, stat_buf.st_size, &data, &hole);
+
+		if (data > off) {
+			out.hole += data - off;
+			off = data;
+			continue;
+		}
+
+		if (zero && opts.io_call == IO_MMAP) {
+			rc = zero_mmap_range(&out, map, &off, hole);
+		} else if (zero) {
+			rc = zero_rw_range(&out, file_fd, &buf, buflen, &off, hole);
+		} else {
+			if (sparse_put(&out, NS_EXT_DATA, hole - off))
+				goto out;
+
+			switch (opts.io_call) {
+			case IO_MMAP:
+				rc = mmap_range(connected_fd, map, &off, hole);
+				break;
+#ifdef HAVE_SPLICE
+			case IO_SPLICE:
+				rc = splice_range(file_fd, connected_fd, pipefds, &off, hole, splice_cnt);
+				break;
+#endif
+			case IO_SENDFILE:
+				rc = sendfile_range(file_fd, connected_fd, &off, hole);
+				break;
+			default:
+				rc = rw_range(file_fd, connected_fd, &buf, buflen, &off, hole);
+				break;
+			}
+		}
+
+		if (rc == -1 || off != hole)
+			goto out;
+	}
+
+	sparse_put(&out, NS_EXT_END, 0);
+
+ out:
 	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
 
-	if (offset != stat_buf.st_size)
-		err_msg_die(EXIT_FAILNET, "Incomplete transfer from sendfile: %d of %ld bytes",
-				offset , stat_buf.st_size);
+	if (map) {
+		if (digest)
+			digest_drain();
+		munmap(map, stat_buf.st_size);
+	}
+#ifdef HAVE_SPLICE
+	if (opts.io_call == IO_SPLICE) {
+		close(pipefds[0]);
+		close(pipefds[1]);
+	}
+#endif
+	if (buf) {
+		if (digest)
+			digest_slot_put(buf, 0);
+		else
+			free(buf);
+	}
 
 	/* correct statistics */
-	net_stat.total_tx_bytes = stat_buf.st_size;
+	net_stat.total_tx_bytes = out.data_bytes +
+		(out.extents + out.markers + 1) * sizeof(struct ns_ext_hdr);
+
+	if (off != stat_buf.st_size)
+		err_msg_die(EXIT_FAILNET, "Incomplete sparse transfer: %lld of %lld bytes",
+				(long long)off, (long long)stat_buf.st_size);
+
+	msg(LOUDISH, "sparse: %llu bytes in %u data extents, %llu bytes in %u holes skipped",
+			out.data_bytes, out.extents, out.hole_bytes, out.markers);
+
 	return rc;
 }
 
 
-void trans_start(int file_fd, int connected_fd)
+#define	DELTA_OUT_BUF (64 * 1024)
+
+struct delta_out {
+	int fd;
+	unsigned char *buf;
+	size_t len;
+};
+
+
+static int delta_put(struct delta_out *out, const void *data, size_t len)
 {
+	ssize_t rc;
+
+	if (out->len + len > DELTA_OUT_BUF || (len == 0 && out->len)) {
+		rc = write_len(out->fd, out->buf, out->len);
+		if (rc == -1)
+			return -1;
+		net_stat.total_tx_bytes += rc;
+		out->len = 0;
+	}
+
+	/* large literals bypass the buffer */
+	if (len >= DELTA_OUT_BUF) {
+		rc = write_len(out->fd, data, len);
+		if (rc == -1)
+			return -1;
+		net_stat.total_tx_bytes += rc;
+		return 0;
+	}
+
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+	return 0;
+}
+
+
+static int delta_emit(const struct delta_op *op, void *arg)
+{
+	struct delta_out *out = arg;
+	struct ns_delta_op hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	switch (op->type) {
+	case DELTA_OP_LITERAL:
+		hdr.nse_dlt_op = htonl(op->len);
+		return delta_put(out, &hdr, sizeof(hdr)) ||
+			delta_put(out, op->ptr, op->len) ? -1 : 0;
+	case DELTA_OP_REF:
+		hdr.nse_dlt_op = htonl(NS_DELTA_REF | op->count);
+		hdr.nse_dlt_block = htonl(op->block);
+		return delta_put(out, &hdr, sizeof(hdr));
+	case DELTA_OP_END:
+		/* a zero length put flushes the buffer */
+		return delta_put(out, &hdr, sizeof(hdr)) || delta_put(out, NULL, 0) ? -1 : 0;
+	}
+
+	return -1;
+}
+
+
+/* delta engine: scan the mapped file against the signatures
+** the receiver sent (see meta_delta_snd()) and send literal
+** runs and block references instead of the data */
+static ssize_t trans_delta(int file_fd, int connected_fd)
+{
+	struct stat stat_buf;
+	struct delta_out out;
+	unsigned char *data = NULL;
+	int rc;
+
+	msg(STRESSFUL, "send via delta encoding");
+
+	xfstat(file_fd, &stat_buf, opts.infile);
+
+	if (stat_buf.st_size > 0) {
+		data = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+		if (data == MAP_FAILED)
+			err_sys_die(EXIT_FAILMISC, "Can't mmap file %s: %s\n",
+					opts.infile, strerror(errno));
+		posix_madvise(data, stat_buf.st_size, POSIX_MADV_SEQUENTIAL);
+	}
+
+	out.fd = connected_fd;
+	out.buf = xmalloc(DELTA_OUT_BUF);
+	out.len = 0;
+
+	/* the digest covers the rebuilt file, not the wire data */
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST && stat_buf.st_size > 0)
+		digest_feed_ref(data, stat_buf.st_size);
+
+	net_stat.total_tx_bytes = 0;
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	rc = delta_scan(data, stat_buf.st_size, delta_emit, &out);
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		digest_drain();
+	if (data)
+		munmap(data, stat_buf.st_size);
+	free(out.buf);
+	delta_index_free();
+
+	if (rc)
+		err_msg_die(EXIT_FAILNET, "Incomplete delta transfer");
+
+	return 0;
+}
+
+
+#define	TREE_RETIRE_MAX 8
+
+/* the data of a large file follows its batch - a file which
+** shrunk since the walker opened it is padded with zeros */
+static void tree_send_file(struct tree_batch *batch, int connected_fd)
+{
+	static const unsigned char zero[65536];
+	off_t offset = 0;
+
+	sendfile_range(batch->fd, connected_fd, &offset, batch->size);
+
+	if ((unsigned long long)offset < batch->size)
+		err_msg("file shrunk while sending (%lld of %llu bytes), padded with zeros",
+				(long long)offset, batch->size);
+
+	while ((unsigned long long)offset < batch->size) {
+		size_t len = min(batch->size - offset, (unsigned long long)sizeof(zero));
+
+		if (write_len(connected_fd, zero, len) != (ssize_t)len)
+			err_msg_die(EXIT_FAILNET, "Incomplete tree transfer");
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			digest_feed_ref(zero, len);
+		offset += len;
+	}
+}
+
+
+static void tree_retire(struct tree_batch **retired, unsigned int *n_retired)
+{
+	digest_drain();
+
+	while (*retired) {
+		struct tree_batch *batch = *retired;
+
+		*retired = batch->next;
+		tree_batch_free(batch);
+	}
+	*n_retired = 0;
+}
+
+
+/* directory tree engine: the walker threads (tree.c) read the
+** tree and pack small files into batches, each batch goes out
+** with one write, a large file follows its batch via sendfile.
+** With a digest the batches (and open files) are kept until the
+** digest thread is done with them. */
+static ssize_t trans_tree(int connected_fd)
+{
+	struct tree_batch *batch, *retired = NULL;
+	struct ns_tree_batch end;
+	unsigned int n_retired = 0;
+	bool digest = opts.ext_hdr_mask & HDR_MSK_DIGEST;
+
+	msg(STRESSFUL, "send directory tree");
+
+	tree_walk_start(opts.infile);
+
+	net_stat.total_tx_bytes = 0;
+	touch_use_stat(TOUCH_BEFORE_OP, &net_stat.use_stat_start);
+
+	while ((batch = tree_walk_next())) {
+		if (write_len(connected_fd, batch->wire, batch->len) != (ssize_t)batch->len)
+			err_msg_die(EXIT_FAILNET, "Incomplete tree transfer");
+		net_stat.total_tx_bytes += batch->len;
+
+		if (digest)
+			digest_feed_ref(batch->wire, batch->len);
+
+		if (batch->fd != -1) {
+			tree_send_file(batch, connected_fd);
+			net_stat.total_tx_bytes += batch->size;
+		}
+
+		if (!digest) {
+			tree_batch_free(batch);
+			continue;
+		}
+
+		batch->next = retired;
+		retired = batch;
+		if (++n_retired >= TREE_RETIRE_MAX || batch->fd != -1)
+			tree_retire(&retired, &n_retired);
+	}
+
+	/* a batch without entries ends the tree */
+	memset(&end, 0, sizeof(end));
+	if (write_len(connected_fd, &end, sizeof(end)) != sizeof(end))
+		err_msg_die(EXIT_FAILNET, "Incomplete tree transfer");
+	net_stat.total_tx_bytes += sizeof(end);
+	if (digest) {
+		digest_feed_ref(&end, sizeof(end));
+		tree_retire(&retired, &n_retired);
+	}
+
+	touch_use_stat(TOUCH_AFTER_OP, &net_stat.use_stat_end);
+
+	tree_walk_finish();
+
+	return 0;
+}
+
+
+static void trans_engine(int file_fd, int connected_fd)
+{
+	bool compress = opts.ext_hdr_mask & HDR_MSK_COMPRESS;
+	bool delta = opts.ext_hdr_mask & HDR_MSK_DELTA;
+
+	if (opts.ext_hdr_mask & HDR_MSK_TREE) {
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			digest_start(opts.digest_type, 0);
+		trans_tree(connected_fd);
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			meta_digest_snd(connected_fd);
+		return;
+	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		digest_start(opts.digest_type, opts.io_call != IO_RW || delta ? 0 :
+				(opts.buffer_size ? opts.buffer_size : DEFAULT_BUFSIZE) +
+				(compress ? COMPRESS_BLK_HDR_LEN : 0) +
+				(opts.ext_hdr_mask & HDR_MSK_ZERO ? SPARSE_HDR_ROOM : 0));
+
+	if (delta || opts.ext_hdr_mask & (HDR_MSK_SPARSE | HDR_MSK_ZERO)) {
+		if (delta)
+			trans_delta(file_fd, connected_fd);
+		else
+			trans_sparse(file_fd, connected_fd);
+		if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+			meta_digest_snd(connected_fd);
+		return;
+	}
+
 	switch (opts.io_call) {
 	case IO_SENDFILE:
 		trans_sendfile(file_fd, connected_fd);
@@ -410,11 +1119,27 @@ void trans_start(int file_fd, int connected_fd)
 		trans_mmap(file_fd, connected_fd);
 		break;
 	case IO_RW:
-		trans_rw(file_fd, connected_fd);
+		if (compress)
+			trans_rw_compress(file_fd, connected_fd);
+		else
+			trans_rw(file_fd, connected_fd);
 		break;
 	default:
 		err_msg_die(EXIT_FAILINT, "Programmed Failure");
 	}
+
+	if (opts.ext_hdr_mask & HDR_MSK_DIGEST)
+		meta_digest_snd(connected_fd);
+}
+
+
+void trans_start(int file_fd, int connected_fd)
+{
+	NS_PROBE2(trans_start, opts.io_call, opts.ext_hdr_mask);
+
+	trans_engine(file_fd, connected_fd);
+
+	NS_PROBE1(trans_end, net_stat.total_tx_bytes);
 }
 
 
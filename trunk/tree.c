@@ -0,0 +1,488 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "xfuncs.h"
+#include "ns_hdr.h"
+#include "tree.h"
+
+/* directories wait here until a walker picks them up, the
+** path is relative to the tree root ("" is the root) */
+struct tree_dir {
+	struct tree_dir *next;
+	char *path;
+};
+
+static struct {
+	pthread_t threads[TREE_WALKERS];
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* directory queued or walk finished */
+	pthread_cond_t ready; /* batch published or walk finished */
+	pthread_cond_t room; /* engine took a batch */
+
+	int root_fd;
+	struct tree_dir *dirs;
+	unsigned int busy; /* walkers inside a directory */
+	bool done;
+
+	struct tree_batch *head, *tail;
+	unsigned int queued;
+
+	unsigned long long files, dirs_seen, links, skipped, bytes, batches;
+} tw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.ready = PTHREAD_COND_INITIALIZER,
+	.room = PTHREAD_COND_INITIALIZER,
+};
+
+/* the batch a walker fills: entries are collected behind the
+** batch header, names in a scratch buffer and the data at
+** TREE_META_MAX - tree_publish() moves entries and names down
+** to the data so the batch goes out in one piece */
+struct tree_build {
+	struct tree_batch *batch;
+	unsigned int entries;
+	char *names;
+	size_t names_len;
+	size_t data_len;
+	struct tree_dir *subdirs; /* queued once the batch is out */
+	unsigned long long files, dirs, links, bytes, skipped;
+};
+
+
+static void tree_queue_dir(char *path)
+{
+	struct tree_dir *dir = xmalloc(sizeof(*dir));
+
+	dir->path = path;
+
+	pthread_mutex_lock(&tw.lock);
+	dir->next = tw.dirs;
+	tw.dirs = dir;
+	pthread_cond_signal(&tw.work);
+	pthread_mutex_unlock(&tw.lock);
+}
+
+
+static void tree_queue_batch(struct tree_batch *batch)
+{
+	pthread_mutex_lock(&tw.lock);
+	while (tw.queued >= TREE_QUEUE_MAX)
+		pthread_cond_wait(&tw.room, &tw.lock);
+
+	batch->next = NULL;
+	if (tw.tail)
+		tw.tail->next = batch;
+	else
+		tw.head = batch;
+	tw.tail = batch;
+	tw.queued++;
+	tw.batches++;
+
+	pthread_cond_signal(&tw.ready);
+	pthread_mutex_unlock(&tw.lock);
+}
+
+
+static void tree_batch_hdr(unsigned char *p, unsigned int entries,
+		size_t names, unsigned long long data)
+{
+	struct ns_tree_batch *hdr = (struct ns_tree_batch *) p;
+
+	hdr->nse_tb_entries = htonl(entries);
+	hdr->nse_tb_names = htonl(names);
+	hdr->nse_tb_data_hi = htonl((uint32_t)(data >> 32));
+	hdr->nse_tb_data_lo = htonl((uint32_t)data);
+}
+
+
+static void tree_ent(struct ns_tree_ent *ent, const struct stat *st,
+		unsigned long long size, size_t name_len)
+{
+	memset(ent, 0, sizeof(*ent));
+	ent->nse_te_mode = htonl(st->st_mode);
+	ent->nse_te_size_hi = htonl((uint32_t)(size >> 32));
+	ent->nse_te_size_lo = htonl((uint32_t)size);
+	ent->nse_te_mtime = htonl((uint32_t)st->st_mtime);
+	ent->nse_te_name_len = htons(name_len);
+}
+
+
+static void tree_build_new(struct tree_build *tb)
+{
+	tb->batch = xzalloc(sizeof(*tb->batch));
+	tb->batch->buf = xmalloc(TREE_META_MAX + TREE_BATCH_DATA);
+	tb->batch->fd = -1;
+	tb->entries = 0;
+	tb->names_len = 0;
+	tb->data_len = 0;
+}
+
+
+static void tree_publish(struct tree_build *tb)
+{
+	struct tree_batch *batch = tb->batch;
+	size_t ents_len = tb->entries * sizeof(struct ns_tree_ent);
+	unsigned char *data = batch->buf + TREE_META_MAX;
+	unsigned char *wire = data - tb->names_len - ents_len - sizeof(struct ns_tree_batch);
+
+	if (tb->entries) {
+		memmove(wire + sizeof(struct ns_tree_batch),
+				batch->buf + sizeof(struct ns_tree_batch), ents_len);
+		memcpy(data - tb->names_len, tb->names, tb->names_len);
+		tree_batch_hdr(wire, tb->entries, tb->names_len, tb->data_len);
+
+		batch->wire = wire;
+		batch->len = data + tb->data_len - wire;
+		tree_queue_batch(batch);
+		tree_build_new(tb);
+	}
+
+	/* the batch with their entries is out - the walkers
+	** may hand out the content of these directories */
+	while (tb->subdirs) {
+		struct tree_dir *dir = tb->subdirs;
+
+		tb->subdirs = dir->next;
+		tree_queue_dir(dir->path);
+		free(dir);
+	}
+}
+
+
+/* make room for one more entry with name_len and data_len
+** octets in the current batch */
+static void tree_reserve(struct tree_build *tb, size_t name_len, size_t data_len)
+{
+	if (tb->entries == TREE_BATCH_ENTRIES ||
+		tb->names_len + name_len > TREE_BATCH_NAMES ||
+		tb->data_len + data_len > TREE_BATCH_DATA)
+		tree_publish(tb);
+}
+
+
+static void tree_add(struct tree_build *tb, const struct stat *st,
+		const char *name, size_t name_len, size_t data_len)
+{
+	struct ns_tree_ent *ent = (struct ns_tree_ent *) (tb->batch->buf +
+			sizeof(struct ns_tree_batch)) + tb->entries;
+
+	tree_ent(ent, st, data_len, name_len);
+	memcpy(tb->names + tb->names_len, name, name_len);
+	tb->names_len += name_len;
+	tb->data_len += data_len;
+	tb->entries++;
+}
+
+
+/* read exactly len octets - a file which shrunk since
+** fstat() is padded with zeros */
+static void tree_read_file(int fd, const char *path, unsigned char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rc = read(fd, buf + done, len - done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			if (rc < 0)
+				err_sys("Can't read %s", path);
+			else
+				err_msg("%s shrunk while reading, padded with zeros", path);
+			memset(buf + done, 0, len - done);
+			break;
+		}
+		done += rc;
+	}
+}
+
+
+static int tree_open(int dir_fd, const char *name)
+{
+	int fd;
+
+#ifdef O_NOATIME
+	fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME);
+	/* O_NOATIME is for the owner only */
+	if (fd != -1 || errno != EPERM)
+		return fd;
+#endif
+	fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+	return fd;
+}
+
+
+static void tree_regular(struct tree_build *tb, int dir_fd, const char *name,
+		const char *path, size_t path_len)
+{
+	struct stat st;
+	int fd = tree_open(dir_fd, name);
+
+	if (fd == -1 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		err_sys("Can't open %s, skipped", path);
+		if (fd != -1)
+			close(fd);
+		tb->skipped++;
+		return;
+	}
+
+	tb->files++;
+	tb->bytes += st.st_size;
+
+	if (st.st_size > TREE_SMALL_MAX) {
+		/* a batch of its own, the engine sends the data */
+		struct tree_batch *batch = xzalloc(sizeof(*batch));
+		size_t len = sizeof(struct ns_tree_batch) + sizeof(struct ns_tree_ent) + path_len;
+
+		batch->buf = xmalloc(len);
+		tree_batch_hdr(batch->buf, 1, path_len, st.st_size);
+		tree_ent((struct ns_tree_ent *) (batch->buf + sizeof(struct ns_tree_batch)),
+				&st, st.st_size, path_len);
+		memcpy(batch->buf + len - path_len, path, path_len);
+		batch->wire = batch->buf;
+		batch->len = len;
+		batch->fd = fd;
+		batch->size = st.st_size;
+		tree_queue_batch(batch);
+		return;
+	}
+
+	tree_reserve(tb, path_len, st.st_size);
+	tree_read_file(fd, path, tb->batch->buf + TREE_META_MAX + tb->data_len, st.st_size);
+	close(fd);
+	tree_add(tb, &st, path, path_len, st.st_size);
+}
+
+
+static void tree_walk_dir(struct tree_build *tb, const char *dir_path)
+{
+	DIR *dir;
+	struct dirent *de;
+	int dir_fd;
+	size_t dir_len = strlen(dir_path);
+
+	dir_fd = openat(tw.root_fd, dir_len ? dir_path : ".",
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dir_fd == -1 || !(dir = fdopendir(dir_fd))) {
+		err_sys("Can't open directory %s, skipped", dir_path);
+		if (dir_fd != -1)
+			close(dir_fd);
+		tb->skipped++;
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		char path[PATH_MAX];
+		struct stat st;
+		size_t path_len;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		path_len = snprintf(path, sizeof(path), "%s%s%s", dir_path,
+				dir_len ? "/" : "", de->d_name);
+		if (path_len >= sizeof(path) || path_len > UINT16_MAX) {
+			err_msg("path too long, skipped: %s/%s", dir_path, de->d_name);
+			tb->skipped++;
+			continue;
+		}
+
+		if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			err_sys("Can't stat %s, skipped", path);
+			tb->skipped++;
+			continue;
+		}
+
+		if (S_ISREG(st.st_mode)) {
+			tree_regular(tb, dir_fd, de->d_name, path, path_len);
+		} else if (S_ISDIR(st.st_mode)) {
+			struct tree_dir *sub = xmalloc(sizeof(*sub));
+
+			tree_reserve(tb, path_len, 0);
+			tree_add(tb, &st, path, path_len, 0);
+			sub->path = xstrdup(path);
+			sub->next = tb->subdirs;
+			tb->subdirs = sub;
+			tb->dirs++;
+		} else if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlinkat(dir_fd, de->d_name, target, sizeof(target));
+
+			if (len <= 0 || len == sizeof(target)) {
+				err_sys("Can't read symlink %s, skipped", path);
+				tb->skipped++;
+				continue;
+			}
+			tree_reserve(tb, path_len, len);
+			memcpy(tb->batch->buf + TREE_META_MAX + tb->data_len, target, len);
+			tree_add(tb, &st, path, path_len, len);
+			tb->links++;
+		} else {
+			msg(GENTLE, "special file %s skipped", path);
+			tb->skipped++;
+		}
+	}
+
+	closedir(dir);
+}
+
+
+static void *tree_walker(void *arg __attribute__((unused)))
+{
+	struct tree_build tb;
+
+	memset(&tb, 0, sizeof(tb));
+	tb.names = xmalloc(TREE_BATCH_NAMES);
+	tree_build_new(&tb);
+
+	pthread_mutex_lock(&tw.lock);
+	for (;;) {
+		struct tree_dir *dir;
+
+		while (!tw.dirs && tw.busy)
+			pthread_cond_wait(&tw.work, &tw.lock);
+
+		if (!tw.dirs) {
+			/* nobody is left who could find another directory */
+			tw.done = true;
+			pthread_cond_broadcast(&tw.work);
+			pthread_cond_broadcast(&tw.ready);
+			break;
+		}
+
+		dir = tw.dirs;
+		tw.dirs = dir->next;
+		tw.busy++;
+		pthread_mutex_unlock(&tw.lock);
+
+		tree_walk_dir(&tb, dir->path);
+		tree_publish(&tb);
+		free(dir->path);
+		free(dir);
+
+		pthread_mutex_lock(&tw.lock);
+		tw.busy--;
+		if (!tw.busy)
+			pthread_cond_broadcast(&tw.work);
+	}
+
+	tw.files += tb.files;
+	tw.dirs_seen += tb.dirs;
+	tw.links += tb.links;
+	tw.bytes += tb.bytes;
+	tw.skipped += tb.skipped;
+	pthread_mutex_unlock(&tw.lock);
+
+	free(tb.batch->buf);
+	free(tb.batch);
+	free(tb.names);
+	return NULL;
+}
+
+
+void tree_walk_start(const char *root)
+{
+	unsigned int i;
+	int ret;
+
+	tw.root_fd = open(root, O_RDONLY | O_DIRECTORY);
+	if (tw.root_fd == -1)
+		err_sys_die(EXIT_FAILMISC, "Can't open directory %s", root);
+
+	tree_queue_dir(xstrdup(""));
+
+	for (i = 0; i < TREE_WALKERS; i++) {
+		ret = pthread_create(&tw.threads[i], NULL, tree_walker, NULL);
+		if (ret)
+			err_msg_die(EXIT_FAILMISC, "Can't create walker thread: %s", strerror(ret));
+	}
+
+	msg(LOUDISH, "%d walker threads started for %s", TREE_WALKERS, root);
+}
+
+
+/* the next batch in walk order, NULL if the walk is complete */
+struct tree_batch *tree_walk_next(void)
+{
+	struct tree_batch *batch;
+
+	pthread_mutex_lock(&tw.lock);
+	while (!tw.head && !tw.done)
+		pthread_cond_wait(&tw.ready, &tw.lock);
+
+	batch = tw.head;
+	if (batch) {
+		tw.head = batch->next;
+		if (!tw.head)
+			tw.tail = NULL;
+		tw.queued--;
+		pthread_cond_signal(&tw.room);
+	}
+	pthread_mutex_unlock(&tw.lock);
+
+	return batch;
+}
+
+
+void tree_walk_finish(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < TREE_WALKERS; i++)
+		pthread_join(tw.threads[i], NULL);
+	close(tw.root_fd);
+
+	msg(LOUDISH, "tree: %llu files (%llu bytes), %llu directories, %llu symlinks "
+			"in %llu batches, %llu entries skipped", tw.files, tw.bytes,
+			tw.dirs_seen, tw.links, tw.batches, tw.skipped);
+}
+
+
+void tree_batch_free(struct tree_batch *batch)
+{
+	if (batch->fd != -1)
+		close(batch->fd);
+	free(batch->buf);
+	free(batch);
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,42 @@
+#ifndef NETSEND_TREE_H_INCLUDE_
+#define NETSEND_TREE_H_INCLUDE_
+
+#include <stddef.h>
+
+/* tree.c - parallel directory walker
+**
+** Walker threads read the directories of a tree, stat their
+** entries and pack them into wire ready batches (see
+** ns_tree_batch in ns_hdr.h): small files and symlink targets
+** are read into the batch, a large file gets a batch of its
+** own and stays open for sendfile. A directory is handed out
+** in an earlier batch than its content.
+*/
+
+#define	TREE_WALKERS       4
+#define	TREE_QUEUE_MAX     16 /* batches between walkers and engine */
+#define	TREE_SMALL_MAX     (256 * 1024) /* larger files go with sendfile */
+#define	TREE_BATCH_ENTRIES 1024
+#define	TREE_BATCH_NAMES   (256 * 1024)
+#define	TREE_BATCH_DATA    (1024 * 1024)
+
+/* largest batch header, entries and names - the receiver
+** rejects larger batches */
+#define	TREE_META_MAX (sizeof(struct ns_tree_batch) + \
+		TREE_BATCH_ENTRIES * sizeof(struct ns_tree_ent) + TREE_BATCH_NAMES)
+
+struct tree_batch {
+	struct tree_batch *next;
+	unsigned char *buf;
+	const unsigned char *wire; /* header, entries, names and packed data */
+	size_t len;
+	int fd; /* large file sent after the batch, -1 if none */
+	unsigned long long size; /* octets to send from fd */
+};
+
+void tree_walk_start(const char *);
+struct tree_batch *tree_walk_next(void);
+void tree_walk_finish(void);
+void tree_batch_free(struct tree_batch *);
+
+#endif /* NETSEND_TREE_H_INCLUDE_ */
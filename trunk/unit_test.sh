@@ -379,6 +379,940 @@ case10()
   fi
 }
 
+case11()
+{
+  echo -n "Digest trailer test (crc32c and sha256) ..."
+
+  L_ERR=0
+
+  for DIGEST in crc32c sha256 ; do
+    for CALL in rw mmap sendfile splice ; do
+      ${NETSEND_BIN} tcp receive 1>/dev/null 2>&1 &
+      RPID=$!
+
+      sleep 2
+
+      ${NETSEND_BIN} -D ${DIGEST} -u ${CALL} tcp transmit ${TESTFILE} localhost 1>/dev/null 2>&1
+      if [ $? -ne 0 ] ; then
+        L_ERR=1
+      fi
+
+      # the receiver exits with 8 if the digest doesn't match
+      wait $RPID
+      if [ $? -ne 0 ] ; then
+        L_ERR=1
+      fi
+    done
+  done
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case12()
+{
+  echo -n "Compression test (auto and always, with digest) ..."
+
+  L_ERR=0
+  CFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp /tmp/netsendXXXXXX)
+
+  # compressible and incompressible parts
+  seq 1 200000 > ${CFILE}
+  dd if=/dev/urandom bs=1024 count=512 >> ${CFILE} 2>/dev/null
+
+  for MODE in auto always ; do
+    ${NETSEND_BIN} tcp receive > ${OFILE} 2>/dev/null &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -z ${MODE} -D crc32c tcp transmit ${CFILE} localhost 1>/dev/null 2>&1
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${CFILE} ${OFILE} || L_ERR=1
+  done
+
+  rm -f ${CFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case13()
+{
+  echo -n "Resume test (damaged partial copy) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  for CALL in rw sendfile ; do
+    # first 3 MiB, with a damaged byte in the second MiB
+    head -c 3145728 ${IFILE} > ${OFILE}
+    printf 'X' | dd of=${OFILE} bs=1 seek=1500000 conv=notrunc 2>/dev/null
+
+    ${NETSEND_BIN} -R tcp receive ${OFILE} 1>/dev/null 2>&1 &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -R -u ${CALL} tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+  done
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case14()
+{
+  echo -n "Delta test (modified copy) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  # old copy: a shifted prefix, a damaged byte and a missing tail
+  printf 'prefix' > ${OFILE}
+  head -c 3145728 ${IFILE} >> ${OFILE}
+  printf 'X' | dd of=${OFILE} bs=1 seek=1500000 conv=notrunc 2>/dev/null
+
+  ${NETSEND_BIN} -X tcp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -X -D sha256 tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case15()
+{
+  echo -n "Sparse test (holes are not transmitted) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=/tmp/netsend-sparse-$$
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 2>/dev/null
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 seek=32768 2>/dev/null
+  truncate -s 64M ${IFILE}
+
+  for CALL in sendfile splice mmap rw ; do
+    rm -f ${OFILE}
+
+    ${NETSEND_BIN} tcp receive ${OFILE} 1>/dev/null 2>&1 &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -S -D sha256 -u ${CALL} tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+    # the holes must survive the transfer
+    [ $(du -k ${OFILE} | cut -f1) -lt 1024 ] || L_ERR=1
+  done
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case16()
+{
+  echo -n "Zero block test (written out zeros are not transmitted) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=/tmp/netsend-zero-$$
+
+  # zero runs in front of, between and behind the data: each
+  # marker position goes through the digest
+  dd if=/dev/zero of=${IFILE} bs=1M count=32 2>/dev/null
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 seek=1024 conv=notrunc 2>/dev/null
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 seek=16384 conv=notrunc 2>/dev/null
+
+  for CALL in mmap rw ; do
+    rm -f ${OFILE}
+
+    ${NETSEND_BIN} tcp receive ${OFILE} 1>/dev/null 2>&1 &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -Z -D sha256 -u ${CALL} tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+    # zero runs become holes at the receiver
+    [ $(du -k ${OFILE} | cut -f1) -lt 1024 ] || L_ERR=1
+  done
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case17()
+{
+  echo -n "Directory tree test (many files over one connection) ..."
+
+  L_ERR=0
+  IDIR=$(mktemp -d /tmp/netsendXXXXXX)
+  ODIR=$(mktemp -d /tmp/netsendXXXXXX)
+
+  mkdir -p ${IDIR}/a/b ${IDIR}/empty
+  for i in $(seq 1 500) ; do
+    echo "small file $i" > ${IDIR}/a/f$i
+  done
+  dd if=/dev/urandom of=${IDIR}/a/b/large bs=1024 count=2048 2>/dev/null
+  ln -s a/f1 ${IDIR}/link
+
+  ${NETSEND_BIN} tcp receive ${ODIR} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -D sha256 tcp transmit ${IDIR} localhost 1>/dev/null 2>&1
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  diff -r --no-dereference ${IDIR} ${ODIR} >/dev/null 2>&1 || L_ERR=1
+
+  # a symlink already in the output must not lead the entries out of it
+  rm -rf ${ODIR}
+  ODIR=$(mktemp -d /tmp/netsendXXXXXX)
+  LDIR=$(mktemp -d /tmp/netsendXXXXXX)
+  ln -s ${LDIR} ${ODIR}/a
+
+  ${NETSEND_BIN} tcp receive ${ODIR} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} tcp transmit ${IDIR} localhost 1>/dev/null 2>&1
+  wait $RPID
+
+  [ -z "$(ls -A ${LDIR})" ] || L_ERR=1
+
+  rm -rf ${IDIR} ${ODIR} ${LDIR}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case18()
+{
+  echo -n "Capability negotiation test (-R without peer support, peer -b) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} -b 65536 tcp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -R -D sha256 tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case19()
+{
+  echo -n "RTT probe test (pipelined over tcp and udp) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 2>/dev/null
+
+  for PROTO in tcp udp ; do
+    rm -f ${OFILE}
+
+    ${NETSEND_BIN} ${PROTO} receive ${OFILE} 1>/dev/null 2>&1 &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -r 500n,16k,100d ${PROTO} transmit ${IFILE} localhost 1>/dev/null 2>&1
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+  done
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case20()
+{
+  echo -n "Buffer sizing test (bandwidth delay product) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} tcp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -B -D crc32c tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case21()
+{
+  echo -n "Capacity probe test (packet pairs and trains over udp) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=64 2>/dev/null
+
+  ${NETSEND_BIN} udp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -c 10p,3t,8l -T human -v loudish udp transmit ${IFILE} localhost 2>&1 | \
+    grep -q "^capacity:" || L_ERR=1
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  # a stream sends no back to back datagrams
+  ${NETSEND_BIN} -c 10p tcp transmit ${IFILE} localhost 1>/dev/null 2>&1
+  if [ $? -ne 2 ] ; then
+    L_ERR=1
+  fi
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case22()
+{
+  echo -n "Interval report test (machine format, tcp info) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  LOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=16384 2>/dev/null
+
+  ${NETSEND_BIN} tcp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -i 0.01 -T machine -b 4096 tcp transmit ${IFILE} localhost 2>${LOG} 1>/dev/null
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  # the intervals add up to the whole file
+  BYTES=$(awk '$3 == "interval" { sum += $6 } END { print sum }' ${LOG})
+  if [ "${BYTES}" != "$(stat -c %s ${IFILE})" ] ; then
+    L_ERR=1
+  fi
+
+  # every interval of a tcp connection has its TCP_INFO sample
+  if [ "$(grep -c ' tx interval ' ${LOG})" != "$(grep -c ' tx tcpinfo ' ${LOG})" ] ; then
+    L_ERR=1
+  fi
+
+  rm -f ${IFILE} ${OFILE} ${LOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case23()
+{
+  echo -n "Latency histogram test (-L with rw and sendfile) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  for IO in rw sendfile ; do
+    rm -f ${OFILE}
+
+    ${NETSEND_BIN} -L -T human tcp receive ${OFILE} 2>&1 | grep -q "^file write .* calls, latency p50" &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -L -T human -u ${IO} -b 65536 tcp transmit ${IFILE} localhost 2>&1 | \
+      grep -q " calls, latency p50" || L_ERR=1
+
+    wait $RPID
+    if [ $? -ne 0 ] ; then
+      L_ERR=1
+    fi
+
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+  done
+
+  rm -f ${IFILE} ${OFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case24()
+{
+  echo -n "JSON report test (counters, tcp info, intervals) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  LOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=16384 2>/dev/null
+
+  ${NETSEND_BIN} tcp receive ${OFILE} 1>/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -T json -i 0.01 -b 4096 tcp transmit ${IFILE} localhost 2>${LOG} 1>/dev/null
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  wait $RPID
+  if [ $? -ne 0 ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  grep -q '"schema_version": 1' ${LOG} || L_ERR=1
+  grep -q "\"tx_bytes\": $(stat -c %s ${IFILE})," ${LOG} || L_ERR=1
+
+  if command -v python3 >/dev/null ; then
+    python3 -c 'import json, sys; d = json.load(open(sys.argv[1])); \
+      sys.exit(not (d["tcp_info"] and d["intervals"] and \
+        sum(i["bytes"] for i in d["intervals"]) == d["net_stat"]["tx_bytes"]))' ${LOG} || L_ERR=1
+  fi
+
+  rm -f ${IFILE} ${OFILE} ${LOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case25()
+{
+  echo -n "Perf counter test (-E with splice) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  LOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} tcp receive ${OFILE} >/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -E -T human -u splice tcp transmit ${IFILE} localhost >${LOG} 2>&1 || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  # the software counters exist everywhere perf_event_open(2) does,
+  # cycles and instructions only with a (virtual) PMU
+  if ! grep -q "No perf counter available" ${LOG} ; then
+    grep -q "^perf: *context-switches [0-9]* (user [0-9-]*, kernel [0-9-]*)" ${LOG} || L_ERR=1
+    if grep -q "^perf: *cycles" ${LOG} ; then
+      grep -q "^perf: *cycles .*/byte (splice)" ${LOG} || L_ERR=1
+    fi
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${LOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case26()
+{
+  echo -n "Softirq statistic test (-K with interval) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  LOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} -K -i 0.1 -T machine tcp receive ${OFILE} >${LOG} 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -K -T human tcp transmit ${IFILE} localhost 2>&1 | \
+    grep -q "^softirq: *[0-9.]* sec (irq [0-9.]* sec, NET_RX [0-9]*, NET_TX [0-9]*" || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  # one softirq line per interval line
+  INTERVALS=$(grep -c " rx interval " ${LOG})
+  SOFTIRQS=$(grep -c " rx softirq [0-9.]* [0-9.]* [0-9.]* [0-9]* [0-9]* [0-9,-]*$" ${LOG})
+  if [ ${INTERVALS} -eq 0 -o ${INTERVALS} -ne ${SOFTIRQS} ] ; then
+    L_ERR=1
+  fi
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${LOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+# GET an http://HOST:PORT/PATH url with nc, the server closes after the answer
+nc_scrape()
+{
+  NC_URL=${1#http://}
+  NC_HOST=${NC_URL%%:*}
+  NC_PORT=${NC_URL#*:}
+  NC_PORT=${NC_PORT%%/*}
+  printf "GET /%s HTTP/1.0\r\n\r\n" "${NC_URL#*/}" | nc ${NC_HOST} ${NC_PORT}
+}
+
+case27()
+{
+  echo -n "Metrics endpoint test (-M, prometheus text over http) ..."
+
+  # an http client, sh has no /dev/tcp
+  if command -v curl >/dev/null 2>&1 ; then
+    SCRAPE="curl -s -i --http1.0"
+  elif command -v nc >/dev/null 2>&1 ; then
+    SCRAPE=nc_scrape
+  else
+    echo "skipped (neither curl nor nc)"
+    return
+  fi
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  LOG=$(mktemp /tmp/netsendXXXXXX)
+  MPORT=19142
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} -M ${MPORT} tcp receive ${OFILE} >/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  # waits for the transfer, scrape it before
+  ${SCRAPE} http://127.0.0.1:${MPORT}/metrics >${LOG} 2>/dev/null || L_ERR=1
+
+  grep -q "^HTTP/1.0 200 OK" ${LOG} || L_ERR=1
+  grep -q "^# TYPE netsend_bytes_total counter" ${LOG} || L_ERR=1
+  grep -q "^netsend_transfer_running 0" ${LOG} || L_ERR=1
+  grep -q '^netsend_info{version="[^"]*",mode="rx",io_call="read"} 1' ${LOG} || L_ERR=1
+
+  ${NETSEND_BIN} tcp transmit ${IFILE} localhost >/dev/null 2>&1 || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${LOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case28()
+{
+  echo -n "Event trace test (-e and nstrace) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  TFILE=$(mktemp /tmp/netsendXXXXXX)
+  RFILE=$(mktemp /tmp/netsendXXXXXX)
+  NSTRACE_BIN=$(dirname ${NETSEND_BIN})/nstrace
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  # a ring too small for the receiver wraps
+  ${NETSEND_BIN} -e ${RFILE},16 tcp receive ${OFILE} >/dev/null 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -e ${TFILE} -u sendfile -b 65536 tcp transmit ${IFILE} localhost \
+    >/dev/null 2>&1 || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  # the sendfile calls moved the whole file
+  BYTES=$(${NSTRACE_BIN} ${TFILE} | awk -F, '$5 == "sendfile" { sum += $7 } END { print sum }')
+  if [ "${BYTES}" != "$(stat -c %s ${IFILE})" ] ; then
+    L_ERR=1
+  fi
+
+  # the last 16 calls of the receiver, reads and file writes
+  if [ "$(${NSTRACE_BIN} ${RFILE} | grep -c ',rx,\(read\|file-write\),')" != "16" ] ; then
+    L_ERR=1
+  fi
+
+  rm -f ${IFILE} ${OFILE} ${TFILE} ${RFILE}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case29()
+{
+  echo -n "USDT probe test (readelf -n) ..."
+
+  L_ERR=0
+
+  # the probes only exist in a build with sys/sdt.h
+  if ! readelf -n ${NETSEND_BIN} 2>/dev/null | grep -q stapsdt ; then
+    echo "skipped (built without sys/sdt.h)"
+    return
+  fi
+
+  for PROBE in trans_start trans_end tx_chunk rx_chunk hdr_snd hdr_rcv \
+               rtt_send rtt_recv rtt_reflect ; do
+    readelf -n ${NETSEND_BIN} | grep -A2 "Provider: netsend" | \
+      grep -q "Name: ${PROBE}$" || L_ERR=1
+  done
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case30()
+{
+  echo -n "Statistics exchange test (both sides report both ends) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  RLOG=$(mktemp /tmp/netsendXXXXXX)
+  TLOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=4096 2>/dev/null
+
+  ${NETSEND_BIN} -T human tcp receive ${OFILE} >${RLOG} 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  # the statistics follow the digest trailer
+  ${NETSEND_BIN} -T human -x -D crc32c tcp transmit ${IFILE} localhost >${TLOG} 2>&1 || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  grep -q "^rx-amount: *4194304 Byte" ${RLOG} || L_ERR=1
+  grep -q "^peer: *tx 4194304 bytes, [0-9]* calls (write)" ${RLOG} || L_ERR=1
+  grep -q "^peer: *rx 4194304 bytes, [0-9]* calls (read)" ${TLOG} || L_ERR=1
+  for LOG in ${RLOG} ${TLOG} ; do
+    grep -q "^goodput: *[0-9.]* MiB/sec (4194304 bytes end to end)" ${LOG} || L_ERR=1
+    grep -q "^cpu/byte: *tx [0-9.]* ns, rx [0-9.]* ns" ${LOG} || L_ERR=1
+  done
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${RLOG} ${TLOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case31()
+{
+  echo -n "Phase breakdown test (setup and first byte) ..."
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  RLOG=$(mktemp /tmp/netsendXXXXXX)
+  TLOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=1024 2>/dev/null
+
+  ${NETSEND_BIN} -T json tcp receive ${OFILE} >${RLOG} 2>&1 &
+  RPID=$!
+
+  sleep 2
+
+  ${NETSEND_BIN} -T human -r 5n tcp transmit ${IFILE} localhost >${TLOG} 2>&1 || L_ERR=1
+  wait $RPID || L_ERR=1
+
+  grep -q "^phases: *dns [0-9.]* ms, connect [0-9.]* ms, headers [0-9.]* ms, probes [0-9.]* ms, first-byte [0-9.]* ms, transfer [0-9.]* ms (first byte [0-9.]* ms, total [0-9.]* ms)" ${TLOG} || L_ERR=1
+  # the receiver reflects the probes within its headers phase
+  grep -q '"phases_ms": {"start": 0.000000, "resolved": [0-9.]*, "connected": [0-9.]*, "headers": [0-9.]*, "probed": null, "first_byte": [0-9.]*, "last_byte": [0-9.]*}' ${RLOG} || L_ERR=1
+
+  cmp -s ${IFILE} ${OFILE} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${RLOG} ${TLOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+case32()
+{
+  echo -n "TCP fast open test (header in the syn) ..."
+
+  # without client and server bit the kernel falls back to the handshake
+  TFO=$(cat /proc/sys/net/ipv4/tcp_fastopen 2>/dev/null || echo 0)
+  if [ $(( TFO & 3 )) -ne 3 ] ; then
+    echo "skipped (net.ipv4.tcp_fastopen is ${TFO}, needs 3)"
+    return
+  fi
+
+  L_ERR=0
+  IFILE=$(mktemp /tmp/netsendXXXXXX)
+  OFILE=$(mktemp -u /tmp/netsendXXXXXX)
+  TLOG=$(mktemp /tmp/netsendXXXXXX)
+
+  dd if=/dev/urandom of=${IFILE} bs=1024 count=1024 2>/dev/null
+
+  # the first connect fetches the cookie, the second uses it - one
+  # address, with several the connects race without fast open
+  for RUN in 1 2 ; do
+    rm -f ${OFILE}
+    ${NETSEND_BIN} tcp receive -F ${OFILE} 2>/dev/null &
+    RPID=$!
+
+    sleep 2
+
+    ${NETSEND_BIN} -v gentle tcp transmit -F ${IFILE} 127.0.0.1 >${TLOG} 2>&1 || L_ERR=1
+    wait $RPID || L_ERR=1
+    cmp -s ${IFILE} ${OFILE} || L_ERR=1
+  done
+
+  grep -q "fast open: the syn carried the header" ${TLOG} || L_ERR=1
+
+  rm -f ${IFILE} ${OFILE} ${TLOG}
+
+  if [ $L_ERR -ne 0 ] ; then
+    echo failed
+    TEST_FAILED=1
+  else
+    echo passed
+  fi
+}
+
+
 echo -e "\nnetsend unit test script - (C) 2007\n"
 
 pre
@@ -395,6 +1329,28 @@ case7
 case8
 case9
 case10
+case11
+case12
+case13
+case14
+case15
+case16
+case17
+case18
+case19
+case20
+case21
+case22
+case23
+case24
+case25
+case26
+case27
+case28
+case29
+case30
+case31
+case32
 
 post
 
@@ -54,6 +54,17 @@ xmalloc(size_t size)
 }
 
 
+void *
+xrealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+
+	if (!p)
+		err_msg_die(EXIT_FAILMEM, "Out of mem: %s!\n", strerror(errno));
+	return p;
+}
+
+
 void xgetaddrinfo(const char *node, const char *service,
 		struct addrinfo *hints, struct addrinfo **res)
 {
@@ -7,6 +7,7 @@
 
 
 void *xmalloc(size_t len);
+void *xrealloc(void *, size_t);
 
 static inline void *xzalloc(size_t len)
 {
@@ -0,0 +1,180 @@
+/*
+** netsend - a high performance filetransfer and diagnostic tool
+** http://netsend.berlios.de
+**
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation; either version 2 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#ifdef HAVE_AVX2
+# include <cpuid.h>
+#endif
+#if defined(HAVE_AVX2) || defined(__SSE2__)
+# include <immintrin.h>
+#endif
+
+#include "global.h"
+#include "zero.h"
+
+#define	CPU_UNKNOWN 0
+#define	CPU_HAVE    1
+#define	CPU_MISSING 2
+
+#ifdef HAVE_AVX2
+static int cpu_avx2 = CPU_UNKNOWN;
+
+static bool have_avx2(void)
+{
+	unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+	if (likely(cpu_avx2 != CPU_UNKNOWN))
+		return cpu_avx2 == CPU_HAVE;
+
+	cpu_avx2 = CPU_MISSING;
+	/* AVX2: CPUID.(EAX=07H, ECX=0):EBX[bit 5], and the OS must
+	** save the ymm registers (OSXSAVE, XCR0 bits 1 and 2) */
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+		return false;
+	__asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	if ((xcr0_lo & 6) != 6)
+		return false;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1 << 5)))
+		cpu_avx2 = CPU_HAVE;
+
+	return cpu_avx2 == CPU_HAVE;
+}
+
+
+__attribute__((target("avx2")))
+static bool zero_avx2(const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + (len & ~(size_t)127);
+
+	for (; p < end; p += 128) {
+		__m256i v = _mm256_or_si256(
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i *) p),
+					_mm256_loadu_si256((const __m256i *) (p + 32))),
+				_mm256_or_si256(_mm256_loadu_si256((const __m256i *) (p + 64)),
+					_mm256_loadu_si256((const __m256i *) (p + 96))));
+		if (!_mm256_testz_si256(v, v))
+			return false;
+	}
+
+	for (len &= 127; len > 0; len--)
+		if (*p++)
+			return false;
+	return true;
+}
+#endif
+
+
+#ifdef __SSE2__
+static bool zero_sse2(const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + (len & ~(size_t)63);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; p < end; p += 64) {
+		__m128i v = _mm_or_si128(
+				_mm_or_si128(_mm_loadu_si128((const __m128i *) p),
+					_mm_loadu_si128((const __m128i *) (p + 16))),
+				_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 32)),
+					_mm_loadu_si128((const __m128i *) (p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			return false;
+	}
+
+	for (len &= 63; len > 0; len--)
+		if (*p++)
+			return false;
+	return true;
+}
+#endif
+
+
+#ifndef __SSE2__
+static bool zero_generic(const unsigned char *p, size_t len)
+{
+	uint64_t w[4];
+
+	for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+		memcpy(w, p, sizeof(w));
+		if (w[0] | w[1] | w[2] | w[3])
+			return false;
+	}
+
+	for (; len > 0; len--)
+		if (*p++)
+			return false;
+	return true;
+}
+#endif
+
+
+bool zero_block(const unsigned char *p, size_t len)
+{
+#ifdef HAVE_AVX2
+	if (have_avx2())
+		return zero_avx2(p, len);
+#endif
+#ifdef __SSE2__
+	return zero_sse2(p, len);
+#else
+	return zero_generic(p, len);
+#endif
+}
+
+
+/* length of the leading run of ZERO_BLOCK sized blocks (the
+** last one may be short) which are all zero (*zero true) or
+** all contain data (*zero false) */
+size_t zero_run(const unsigned char *p, size_t len, bool *zero)
+{
+	size_t run = min(len, (size_t)ZERO_BLOCK);
+
+	*zero = zero_block(p, run);
+
+	while (run < len) {
+		size_t blk = min(len - run, (size_t)ZERO_BLOCK);
+
+		if (zero_block(p + run, blk) != *zero)
+			break;
+		run += blk;
+	}
+
+	return run;
+}
+
+
+const char *zero_impl_str(void)
+{
+#ifdef HAVE_AVX2
+	if (have_avx2())
+		return "avx2";
+#endif
+#ifdef __SSE2__
+	return "sse2";
+#else
+	return "generic";
+#endif
+}
+
+/* vim:set ts=4 sw=4 tw=78 noet: */
@@ -0,0 +1,21 @@
+#ifndef NETSEND_ZERO_H_INCLUDE_
+#define NETSEND_ZERO_H_INCLUDE_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* zero.c - vectorized all-zero test
+**
+** Splits a buffer into runs of blocks which are all zero and
+** blocks which are not. A block with data is usually rejected
+** after its first 64 or 128 bytes, zero blocks are read at
+** memory bandwidth.
+*/
+
+#define	ZERO_BLOCK 4096
+
+bool zero_block(const unsigned char *, size_t);
+size_t zero_run(const unsigned char *, size_t, bool *);
+const char *zero_impl_str(void);
+
+#endif /* NETSEND_ZERO_H_INCLUDE_ */